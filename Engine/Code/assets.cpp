@@ -0,0 +1,681 @@
+//
+// assets.cpp : Streaming of textures and models. Requests return a texture or mesh index right
+// away, bound to a placeholder (an embedded texture, or the embedded sphere for models), and
+// loader threads decode the files in the background. Every frame the render thread uploads
+// some of the decoded assets, within a byte and a time budget, and swaps them in place of
+// their placeholders. Textures go through a ring of pixel unpack buffers with one segment
+// filled per frame, so uploads never wait for the GPU to finish reading a previous batch.
+//
+
+enum AssetType
+{
+    AssetType_Texture,
+    AssetType_Model,
+};
+
+enum AssetState
+{
+    AssetState_Queued,
+    AssetState_Loading,  // Owned by a loader thread
+    AssetState_Decoded,  // Owned by the render thread
+    AssetState_Uploaded, // Slot freed once all the older requests are uploaded too
+};
+
+enum AssetTextureSlot
+{
+    AssetTextureSlot_Albedo,
+    AssetTextureSlot_Emissive,
+    AssetTextureSlot_Specular,
+    AssetTextureSlot_Normals,
+    AssetTextureSlot_Bump,
+    AssetTextureSlot_Count
+};
+
+CASSERT(ARRAY_COUNT(AssimpTextureTypes) == AssetTextureSlot_Count, "");
+
+// Material of a decoded model, its textures are requested when the model is uploaded
+struct AssetMaterial
+{
+    char name[64];
+    vec3 albedo;
+    vec3 emissive;
+    f32  smoothness;
+    char texturePaths[AssetTextureSlot_Count][256]; // Empty for slots without a texture
+};
+
+struct AssetRequest
+{
+    AssetType   type;
+    AssetState  state;
+    u32         assetIdx; // Texture or mesh handed out to the caller
+    char        filepath[256];
+    TextureRole role;     // Textures
+
+    // Written by the loader thread
+    bool                       hasFailed;
+    char                       error[256];
+    Image                      image;     // Textures, unless they are cooked
+    CookedTexture              cooked;
+    Mesh                       mesh;      // Models, material indices relative to materials
+    std::vector<AssetMaterial> materials;
+    Arena                      vertices;
+    Arena                      indices;
+};
+
+struct AssetLoader
+{
+    std::thread             threads[ASSET_LOADER_THREAD_COUNT];
+    std::mutex              mutex;
+    std::condition_variable condition; // Signals both queued and decoded requests
+    AssetRequest            requests[ASSET_MAX_REQUESTS]; // Ring, in request order
+    u32                     requestHead;  // Oldest request not uploaded yet
+    u32                     requestCount;
+    u32                     queuedCount;
+    u32                     decodedCount;
+    bool                    useCookedTextures;
+    bool                    quit;
+};
+
+static void AssetLoader_Fail(AssetRequest& request, const char* reason)
+{
+    request.hasFailed = true;
+    snprintf(request.error, sizeof(request.error), "%s", reason ? reason : "unknown error");
+}
+
+static void AssetLoader_DecodeTexture(AssetLoader* loader, AssetRequest& request)
+{
+    CPU_PROFILE_SCOPE("Decode texture");
+
+    if (loader->useCookedTextures && TextureCooker_LoadCooked(request.filepath, request.role, request.cooked))
+        return;
+
+    // Gray images are expanded while decoding, uploads only handle RGB(A). Only the header is
+    // read to find out, so every image is decoded once.
+    Image& image = request.image;
+    i32 channelCount = 0;
+    if (stbi_info(request.filepath, &image.size.x, &image.size.y, &image.nchannels) && image.nchannels < 3)
+        channelCount = image.nchannels == 2 ? 4 : 3;
+
+    image.pixels = stbi_load(request.filepath, &image.size.x, &image.size.y, &image.nchannels, channelCount);
+    if (channelCount)
+        image.nchannels = channelCount;
+
+    if (image.pixels)
+        image.stride = image.size.x * image.nchannels;
+    else
+        AssetLoader_Fail(request, stbi_failure_reason());
+}
+
+static void AssetLoader_ReadMaterial(const aiMaterial* material, const char* modelFilepath, AssetMaterial& myMaterial)
+{
+    aiString name;
+    aiColor3D diffuseColor;
+    aiColor3D emissiveColor;
+    ai_real shininess = 0.0f;
+    material->Get(AI_MATKEY_NAME, name);
+    material->Get(AI_MATKEY_COLOR_DIFFUSE, diffuseColor);
+    material->Get(AI_MATKEY_COLOR_EMISSIVE, emissiveColor);
+    material->Get(AI_MATKEY_SHININESS, shininess);
+
+    snprintf(myMaterial.name, sizeof(myMaterial.name), "%s", name.C_Str());
+    myMaterial.albedo = vec3(diffuseColor.r, diffuseColor.g, diffuseColor.b);
+    myMaterial.emissive = vec3(emissiveColor.r, emissiveColor.g, emissiveColor.b);
+    myMaterial.smoothness = shininess / 256.0f;
+
+    for (u32 slot = 0; slot < AssetTextureSlot_Count; ++slot)
+    {
+        aiString aiFilename;
+        if (material->GetTextureCount(AssimpTextureTypes[slot]) > 0 &&
+            material->GetTexture(AssimpTextureTypes[slot], 0, &aiFilename) == aiReturn_SUCCESS)
+        {
+            MakeModelRelativePath(myMaterial.texturePaths[slot], sizeof(myMaterial.texturePaths[slot]), modelFilepath, aiFilename.C_Str());
+        }
+    }
+}
+
+static void AssetLoader_DecodeModel(AssetRequest& request)
+{
+    CPU_PROFILE_SCOPE("Decode model");
+
+    const aiScene* scene = aiImportFile(request.filepath, AssimpImportFlags);
+    if (!scene)
+    {
+        AssetLoader_Fail(request, aiGetErrorString());
+        return;
+    }
+
+    u32 vertexCount = 0;
+    u32 indexCount = 0;
+    CountAssimpGeometry(scene, scene->mRootNode, vertexCount, indexCount);
+    if (vertexCount == 0 || indexCount == 0)
+    {
+        aiReleaseImport(scene);
+        AssetLoader_Fail(request, "no triangles");
+        return;
+    }
+
+    // Position, normal, texture coordinates, tangent and bitangent at most, see ProcessAssimpMesh
+    request.vertices = CreateArena(vertexCount * 14 * sizeof(float));
+    request.indices = CreateArena(indexCount * sizeof(u32));
+    ProcessAssimpNode(scene, scene->mRootNode, &request.mesh, 0, request.mesh.materialIndices, request.vertices, request.indices);
+
+    request.materials.resize(scene->mNumMaterials, AssetMaterial{});
+    for (unsigned int i = 0; i < scene->mNumMaterials; ++i)
+        AssetLoader_ReadMaterial(scene->mMaterials[i], request.filepath, request.materials[i]);
+
+    aiReleaseImport(scene);
+}
+
+static void AssetLoader_Run(AssetLoader* loader)
+{
+#if USE_CPU_PROFILER
+    CpuProfile_SetThreadName("Asset loader");
+#endif
+
+    // Rows bottom-up, as LoadImage returns them
+    stbi_set_flip_vertically_on_load_thread(true);
+
+    for (;;)
+    {
+        AssetRequest* request = NULL;
+        {
+            std::unique_lock<std::mutex> lock(loader->mutex);
+            loader->condition.wait(lock, [loader]() { return loader->queuedCount > 0 || loader->quit; });
+            if (loader->quit)
+                break;
+
+            for (u32 i = 0; i < loader->requestCount && !request; ++i)
+            {
+                AssetRequest& candidate = loader->requests[(loader->requestHead + i) % ASSET_MAX_REQUESTS];
+                if (candidate.state == AssetState_Queued)
+                    request = &candidate;
+            }
+            ASSERT(request, "Queued request not found");
+            request->state = AssetState_Loading;
+            loader->queuedCount--;
+        }
+
+        if (request->type == AssetType_Texture)
+            AssetLoader_DecodeTexture(loader, *request);
+        else
+            AssetLoader_DecodeModel(*request);
+
+        {
+            std::lock_guard<std::mutex> lock(loader->mutex);
+            request->state = AssetState_Decoded;
+            loader->decodedCount++;
+        }
+        loader->condition.notify_all();
+    }
+}
+
+static void AssetLoader_Push(Assets& assets, AssetType type, u32 assetIdx, const char* filepath, TextureRole role)
+{
+    if (!assets.loader)
+    {
+        assets.loader = new AssetLoader();
+        assets.loader->useCookedTextures = assets.useCookedTextures;
+        for (u32 i = 0; i < ASSET_LOADER_THREAD_COUNT; ++i)
+            assets.loader->threads[i] = std::thread(AssetLoader_Run, assets.loader);
+    }
+
+    AssetLoader* loader = assets.loader;
+    {
+        std::lock_guard<std::mutex> lock(loader->mutex);
+        ASSERT(loader->requestCount < ASSET_MAX_REQUESTS, "Max number of asset requests reached");
+
+        AssetRequest& request = loader->requests[(loader->requestHead + loader->requestCount) % ASSET_MAX_REQUESTS];
+        request = AssetRequest{};
+        request.type = type;
+        request.state = AssetState_Queued;
+        request.assetIdx = assetIdx;
+        snprintf(request.filepath, sizeof(request.filepath), "%s", filepath);
+        request.role = role;
+
+        loader->requestCount++;
+        loader->queuedCount++;
+    }
+    loader->condition.notify_all();
+
+    assets.requestCount++;
+}
+
+static bool AssetLoader_IsFull(Assets& assets)
+{
+    if (!assets.loader)
+        return false;
+    std::lock_guard<std::mutex> lock(assets.loader->mutex);
+    return assets.loader->requestCount == ASSET_MAX_REQUESTS;
+}
+
+static void AssetRequest_Free(AssetRequest& request)
+{
+    if (request.image.pixels)
+        FreeImage(request.image);
+    FreeCookedTexture(request.cooked);
+    if (request.vertices.data)
+        DestroyArena(request.vertices);
+    if (request.indices.data)
+        DestroyArena(request.indices);
+    request = AssetRequest{};
+}
+
+u32 LoadTexture2DAsync(Assets& assets, Device& device, const char* filepath, TextureRole role, u32 placeholderTexIdx)
+{
+    for (u32 texIdx = 0; texIdx < device.textureCount; ++texIdx)
+        if (SameString(device.textures[texIdx].filepath, CString(filepath)))
+            return texIdx;
+
+    // A full request ring would overwrite pending requests, load the texture right away instead
+    if (AssetLoader_IsFull(assets))
+    {
+        const u32 texIdx = LoadTexture2D(device, filepath, role);
+        return texIdx != UINT32_MAX ? texIdx : placeholderTexIdx;
+    }
+
+    Texture tex = device.textures[placeholderTexIdx];
+    tex.filepath = InternString(StrArena, filepath);
+    tex.memorySize = 0;
+    tex.isCooked = false;
+
+    ASSERT(device.textureCount < ARRAY_COUNT(device.textures), "Max number of textures reached");
+    u32 texIdx = device.textureCount;
+    device.textures[device.textureCount++] = tex;
+
+    AssetLoader_Push(assets, AssetType_Texture, texIdx, filepath, role);
+    return texIdx;
+}
+
+u32 LoadModelAsync(Assets& assets, Device& device, const Embedded& embedded, const char* filepath)
+{
+    // Same as textures when the request ring is full, a model that fails to load keeps its proxy
+    const bool isLoaderFull = AssetLoader_IsFull(assets);
+    if (isLoaderFull)
+    {
+        const u32 meshIdx = LoadModel(device, filepath);
+        if (meshIdx != UINT32_MAX)
+            return meshIdx;
+    }
+
+    ASSERT(device.meshCount < ARRAY_COUNT(device.meshes), "Max number of meshes reached");
+    u32 meshIdx = device.meshCount++;
+    Mesh& mesh = device.meshes[meshIdx];
+    mesh = Mesh{};
+
+    // The proxy is the embedded sphere, models are expected to be centered around the origin
+    const Mesh& embeddedMesh = device.meshes[embedded.meshIdx];
+    mesh.submeshes.push_back(embeddedMesh.submeshes[embedded.sphereSubmeshIdx]);
+    mesh.materialIndices.push_back(embedded.defaultMaterialIdx);
+    mesh.vertexBufferIdx = embeddedMesh.vertexBufferIdx;
+    mesh.indexBufferIdx = embeddedMesh.indexBufferIdx;
+
+    if (!isLoaderFull)
+        AssetLoader_Push(assets, AssetType_Model, meshIdx, filepath, TextureRole_Albedo);
+    return meshIdx;
+}
+
+#if USE_GFX_API_OPENGL
+static bool Assets_IsSegmentFree(const AssetUploadSegment& segment, bool waitForGpu)
+{
+    if (!segment.fence)
+        return true;
+
+    if (waitForGpu)
+    {
+        glClientWaitSync(segment.fence, GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+        return true;
+    }
+
+    GLint status = GL_UNSIGNALED;
+    glGetSynciv(segment.fence, GL_SYNC_STATUS, sizeof(status), NULL, &status);
+    return status == GL_SIGNALED;
+}
+
+static void Assets_UploadModel(App* app, AssetRequest& request)
+{
+    CPU_PROFILE_FUNCTION();
+
+    Device& device = app->device;
+    Embedded& embedded = app->embedded;
+    Mesh& mesh = request.mesh;
+    mesh.name = InternString(StrArena, request.filepath);
+
+    const u32 placeholderTexIndices[] = {
+        embedded.whiteTexIdx, embedded.blackTexIdx, embedded.blackTexIdx, embedded.normalTexIdx, embedded.blackTexIdx
+    };
+    CASSERT(ARRAY_COUNT(placeholderTexIndices) == AssetTextureSlot_Count, "");
+
+    // Textures stream in after the geometry
+    const u32 baseMaterialIdx = device.materialCount;
+    for (u32 i = 0; i < request.materials.size(); ++i)
+    {
+        const AssetMaterial& assetMaterial = request.materials[i];
+
+        ASSERT(device.materialCount < ARRAY_COUNT(device.materials), "Max number of materials reached");
+        Material& material = device.materials[device.materialCount++];
+        material = Material{};
+        material.name = InternString(StrArena, assetMaterial.name);
+        material.albedo = assetMaterial.albedo;
+        material.emissive = assetMaterial.emissive;
+        material.smoothness = assetMaterial.smoothness;
+
+        u32* textureIndices[] = {
+            &material.albedoTextureIdx, &material.emissiveTextureIdx, &material.specularTextureIdx,
+            &material.normalsTextureIdx, &material.bumpTextureIdx
+        };
+        for (u32 slot = 0; slot < AssetTextureSlot_Count; ++slot)
+            if (assetMaterial.texturePaths[slot][0])
+                *textureIndices[slot] = LoadTexture2DAsync(app->assets, device, assetMaterial.texturePaths[slot], AssimpTextureRoles[slot],
+                                                           placeholderTexIndices[slot]);
+    }
+    for (u32 i = 0; i < mesh.materialIndices.size(); ++i)
+        mesh.materialIndices[i] += baseMaterialIdx;
+
+    // Binding the index buffer would change the VAO bound at this point, if any
+    glBindVertexArray(0);
+
+    const u32 vertexBufferSize = request.vertices.head;
+    const u32 indexBufferSize = request.indices.head;
+
+    mesh.vertexBufferIdx = CreateStaticVertexBuffer(device, vertexBufferSize);
+    mesh.indexBufferIdx = CreateStaticIndexBuffer(device, indexBufferSize);
+
+    Buffer& vertexBuffer = device.vertexBuffers[mesh.vertexBufferIdx];
+    Buffer& indexBuffer = device.indexBuffers[mesh.indexBufferIdx];
+
+    MapBuffer(vertexBuffer, Access_Write);
+    MapBuffer(indexBuffer, Access_Write);
+
+    BufferPushData(vertexBuffer, request.vertices.data, vertexBufferSize);
+    BufferPushData(indexBuffer, request.indices.data, indexBufferSize);
+
+    UnmapBuffer(vertexBuffer);
+    UnmapBuffer(indexBuffer);
+
+    // The VAOs of the proxy point at the embedded buffers
+    for (u32 i = 0; i < device.vaoCount;)
+    {
+        if (device.vaos[i].meshIdx == request.assetIdx)
+        {
+            glDeleteVertexArrays(1, &device.vaos[i].handle);
+            device.vaos[i] = device.vaos[--device.vaoCount];
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    std::swap(device.meshes[request.assetIdx], mesh);
+    MeshOptimizer_LogReport(device.meshes[request.assetIdx]);
+
+    // Shadow casters changed shape
+    app->scene.staticGeometryVersion++;
+}
+
+// Creates the texture of a decoded request from data, its pixels or cooked levels either in
+// client memory or at an offset of the bound pixel unpack buffer
+static void Assets_CreateTexture(Device& device, const AssetRequest& request, u8* data)
+{
+    Texture& texture = device.textures[request.assetIdx];
+    if (request.cooked.data)
+    {
+        CookedTexture cooked = request.cooked;
+        cooked.data = data;
+        texture.handle = CreateTexture2DFromCooked(cooked);
+        texture.size = cooked.size;
+        texture.memorySize = cooked.dataSize;
+        texture.isCooked = true;
+    }
+    else
+    {
+        Image image = request.image;
+        image.pixels = data;
+        texture.handle = CreateTexture2DFromImage(image);
+        texture.size = image.size;
+        texture.memorySize = GetImageMemorySize(image);
+    }
+}
+
+// Uploads decoded requests, oldest first, until either budget runs out (at least one upload
+// always goes through). Returns the number of requests retired.
+static u32 Assets_UploadDecoded(App* app, u64 byteBudget, u64 deadlineNs, bool waitForGpu)
+{
+    CPU_PROFILE_FUNCTION();
+
+    Assets& assets = app->assets;
+    Device& device = app->device;
+    AssetLoader* loader = assets.loader;
+
+    u32 decodedSlots[ASSET_MAX_REQUESTS];
+    u32 decodedSlotCount = 0;
+    {
+        std::lock_guard<std::mutex> lock(loader->mutex);
+        for (u32 i = 0; i < loader->requestCount; ++i)
+        {
+            const u32 slot = (loader->requestHead + i) % ASSET_MAX_REQUESTS;
+            if (loader->requests[slot].state == AssetState_Decoded)
+                decodedSlots[decodedSlotCount++] = slot;
+        }
+    }
+    if (decodedSlotCount == 0)
+        return 0;
+
+    AssetUploadSegment& segment = assets.uploadSegments[assets.uploadSegmentIdx];
+    const bool isSegmentFree = Assets_IsSegmentFree(segment, waitForGpu);
+    if (!isSegmentFree)
+        assets.uploadStallCount++;
+
+    u8* segmentPixels = NULL;
+    u32 segmentHead = 0;
+    AssetRequest* stagedRequests[ASSET_MAX_REQUESTS];
+    u32 stagedOffsets[ASSET_MAX_REQUESTS];
+    u32 stagedCount = 0;
+
+    u32 retiredSlots[ASSET_MAX_REQUESTS];
+    u32 retiredCount = 0;
+    u64 uploadedBytes = 0;
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    for (u32 i = 0; i < decodedSlotCount; ++i)
+    {
+        AssetRequest& request = loader->requests[decodedSlots[i]];
+
+        const bool isFirstUpload = retiredCount == 0;
+        if (!isFirstUpload && GetProfileTimeNs() > deadlineNs)
+            break;
+
+        if (request.hasFailed)
+        {
+            ELOG("Could not load %s: %s", request.filepath, request.error);
+            if (request.type == AssetType_Texture)
+                device.textures[request.assetIdx].handle = device.textures[app->embedded.magentaTexIdx].handle;
+            assets.failedCount++;
+            retiredSlots[retiredCount++] = decodedSlots[i];
+            continue;
+        }
+
+        if (request.type == AssetType_Texture)
+        {
+            const Image& image = request.image;
+            const CookedTexture& cooked = request.cooked;
+            const u32 imageSize = cooked.data ? cooked.dataSize : image.stride * image.size.y;
+            if (!isFirstUpload && uploadedBytes + imageSize > byteBudget)
+                continue;
+
+            if (imageSize > ASSET_UPLOAD_SEGMENT_SIZE)
+            {
+                // Too large for the ring, uploaded from client memory on its own
+                if (!isFirstUpload)
+                    continue;
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                Assets_CreateTexture(device, request, cooked.data ? cooked.data : (u8*)image.pixels);
+                if (request.image.pixels)
+                    FreeImage(request.image);
+                request.image = {};
+                FreeCookedTexture(request.cooked);
+            }
+            else
+            {
+                if (!isSegmentFree || segmentHead + imageSize > ASSET_UPLOAD_SEGMENT_SIZE)
+                    continue;
+
+                if (!segmentPixels)
+                {
+                    if (!segment.pbo)
+                    {
+                        glGenBuffers(1, &segment.pbo);
+                        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, segment.pbo);
+                        glBufferData(GL_PIXEL_UNPACK_BUFFER, ASSET_UPLOAD_SEGMENT_SIZE, NULL, GL_STREAM_DRAW);
+                    }
+                    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, segment.pbo);
+                    segmentPixels = (u8*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, ASSET_UPLOAD_SEGMENT_SIZE,
+                                                          GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+                    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                    if (!segmentPixels)
+                    {
+                        ELOG("Could not map the texture upload buffer");
+                        break;
+                    }
+                }
+
+                MemCopy(segmentPixels + segmentHead, cooked.data ? cooked.data : image.pixels, imageSize);
+                stagedRequests[stagedCount] = &request;
+                stagedOffsets[stagedCount] = segmentHead;
+                stagedCount++;
+                segmentHead = Align(segmentHead + imageSize, 16);
+            }
+
+            uploadedBytes += imageSize;
+        }
+        else
+        {
+            const u32 modelSize = request.vertices.head + request.indices.head;
+            if (!isFirstUpload && uploadedBytes + modelSize > byteBudget)
+                continue;
+
+            Assets_UploadModel(app, request);
+            uploadedBytes += modelSize;
+        }
+
+        assets.loadedCount++;
+        retiredSlots[retiredCount++] = decodedSlots[i];
+    }
+
+    // Staged textures are created once their pixels are all in the unmapped segment
+    if (segmentPixels)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, segment.pbo);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        for (u32 i = 0; i < stagedCount; ++i)
+        {
+            Assets_CreateTexture(device, *stagedRequests[i], (u8*)(uintptr_t)stagedOffsets[i]);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        if (segment.fence)
+            glDeleteSync(segment.fence);
+        segment.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        assets.uploadSegmentIdx = (assets.uploadSegmentIdx + 1) % ASSET_UPLOAD_SEGMENT_COUNT;
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    assets.uploadedBytes += uploadedBytes;
+
+    {
+        std::lock_guard<std::mutex> lock(loader->mutex);
+        for (u32 i = 0; i < retiredCount; ++i)
+        {
+            AssetRequest& request = loader->requests[retiredSlots[i]];
+            AssetRequest_Free(request);
+            request.state = AssetState_Uploaded;
+        }
+        loader->decodedCount -= retiredCount;
+
+        while (loader->requestCount > 0 && loader->requests[loader->requestHead].state == AssetState_Uploaded)
+        {
+            loader->requests[loader->requestHead] = AssetRequest{};
+            loader->requestHead = (loader->requestHead + 1) % ASSET_MAX_REQUESTS;
+            loader->requestCount--;
+        }
+    }
+
+    return retiredCount;
+}
+
+// Uploads the assets decoded so far within the budget of a frame
+void Assets_Update(App* app)
+{
+    if (!app->assets.loader)
+        return;
+
+    const u64 deadlineNs = GetProfileTimeNs() + (u64)(ASSET_UPLOAD_BUDGET_MS * 1000000.0f);
+    Assets_UploadDecoded(app, ASSET_UPLOAD_SEGMENT_SIZE, deadlineNs, false);
+}
+
+// Waits until every request, including the textures of the models requested so far, is uploaded
+void Assets_Flush(App* app)
+{
+    CPU_PROFILE_FUNCTION();
+
+    AssetLoader* loader = app->assets.loader;
+    if (!loader)
+        return;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(loader->mutex);
+            if (loader->requestCount == 0)
+                break;
+            loader->condition.wait(lock, [loader]() { return loader->decodedCount > 0; });
+        }
+        Assets_UploadDecoded(app, UINT64_MAX, UINT64_MAX, true);
+    }
+}
+
+void Assets_Shutdown(App* app)
+{
+    Assets& assets = app->assets;
+
+    AssetLoader* loader = assets.loader;
+    if (loader)
+    {
+        {
+            std::lock_guard<std::mutex> lock(loader->mutex);
+            loader->quit = true;
+        }
+        loader->condition.notify_all();
+        for (u32 i = 0; i < ASSET_LOADER_THREAD_COUNT; ++i)
+            loader->threads[i].join(); // Requests still queued are dropped
+
+        for (u32 i = 0; i < ASSET_MAX_REQUESTS; ++i)
+            AssetRequest_Free(loader->requests[i]);
+
+        delete loader;
+        assets.loader = NULL;
+    }
+
+    for (u32 i = 0; i < ASSET_UPLOAD_SEGMENT_COUNT; ++i)
+    {
+        AssetUploadSegment& segment = assets.uploadSegments[i];
+        if (segment.fence)
+            glDeleteSync(segment.fence);
+        if (segment.pbo)
+            glDeleteBuffers(1, &segment.pbo);
+        segment = {};
+    }
+}
+#endif
+
+void Assets_Gui(App* app)
+{
+    Assets& assets = app->assets;
+
+    const u32 pendingCount = assets.requestCount - assets.loadedCount - assets.failedCount;
+    ImGui::Text("Assets: %u loaded, %u pending, %u failed", assets.loadedCount, pendingCount, assets.failedCount);
+    ImGui::Text("Uploaded: %.2f MB (%u GPU stalls)", (f32)assets.uploadedBytes / (f32)MB(1), assets.uploadStallCount);
+}
@@ -0,0 +1,406 @@
+//
+// benchmark.cpp : Render benchmark mode. It builds a parameterized stress scene, runs
+// every render path over the same scripted camera path for a fixed number of frames,
+// and writes a JSON report with frame time percentiles, per group CPU/GPU times and
+// the frame stats counters. Meant to be run headless (e.g. on Mesa llvmpipe) in CI.
+//
+
+// Project3 assets, relative to the working directory
+#define BENCHMARK_ASSETS_DIR "../../Deprecated/Project3/res/models/"
+
+// The GlobalParams uniform block holds 16 lights, one of them is the directional light
+#define BENCHMARK_MAX_POINT_LIGHTS 15
+
+#define BENCHMARK_MAX_FRAMES 4096
+
+static const char* BenchmarkSceneNames[] = { "grid", "unique_meshes", "canyon", "sibenik" };
+CASSERT(ARRAY_COUNT(BenchmarkSceneNames) == BenchmarkScene_Count, "Number of benchmark scenes do not match");
+
+static const char* BenchmarkRenderPathNames[] = { "test", "forward", "deferred", "visibility_buffer" };
+CASSERT(ARRAY_COUNT(BenchmarkRenderPathNames) == RenderPath_Count, "Number of render paths do not match");
+
+bool BenchmarkSceneFromName(const char* name, BenchmarkScene& scene)
+{
+    for (u32 i = 0; i < BenchmarkScene_Count; ++i)
+    {
+        if (SameString(name, BenchmarkSceneNames[i]))
+        {
+            scene = (BenchmarkScene)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Model the scene is made of, imported on the job threads during startup
+const char* Benchmark_GetModelFilepath(const BenchmarkConfig& config)
+{
+    switch (config.scene)
+    {
+        case BenchmarkScene_Canyon:  return BENCHMARK_ASSETS_DIR "canyon_rocks/mountain_canyon_01.obj";
+        case BenchmarkScene_Sibenik: return BENCHMARK_ASSETS_DIR "sibenik/sibenik.obj";
+        default:                     return "Patrick/Patrick.obj";
+    }
+}
+
+void Benchmark_AddModelGrid(Scene& scene, const u32* modelIndices, u32 modelCount, u32 gridSize, f32 separation)
+{
+    for (u32 i = 0; i < gridSize; ++i)
+    {
+        for (u32 j = 0; j < gridSize; ++j)
+        {
+            const u32 modelIdx = modelIndices[(i * gridSize + j) % modelCount];
+            const f32 x = separation * (f32)i - 0.5f * gridSize * separation;
+            const f32 z = separation * (f32)j - 0.5f * gridSize * separation;
+            AddModelEntity(scene, modelIdx, TransformPositionScale(vec3(x, 1.5f, z), vec3(0.45f)));
+        }
+    }
+}
+
+void Benchmark_InitScene(Device& device, Scene& scene, Embedded& embedded, Benchmark& benchmark)
+{
+    CPU_PROFILE_FUNCTION();
+
+    BenchmarkConfig& config = benchmark.config;
+    const f32 ENTITY_SEPARATION = 3.0f;
+
+    AddMeshEntity(scene, embedded.meshIdx, embedded.floorSubmeshIdx, TransformScale(vec3(100.0f)));
+    AddDirectionalLight(scene, vec3(0.8, 0.8, 0.8), normalize(vec3(1.0, 1.0, 1.0)));
+
+    benchmark.cameraTarget = vec3(0.0f);
+    benchmark.cameraRadius = 30.0f;
+
+    switch (config.scene)
+    {
+        case BenchmarkScene_Grid:
+        {
+            // Every entity of the grid shares the same model, so they get instanced
+            scene.patrickModelIdx = LoadModel(device, Benchmark_GetModelFilepath(config));
+            const u32 maxGridSize = (u32)sqrtf((f32)(MAX_ENTITIES - scene.entityCount));
+            const u32 gridSize = min(config.gridSize, maxGridSize);
+            Benchmark_AddModelGrid(scene, &scene.patrickModelIdx, 1, gridSize, ENTITY_SEPARATION);
+            benchmark.cameraRadius = max(10.0f, 0.75f * gridSize * ENTITY_SEPARATION);
+        } break;
+
+        case BenchmarkScene_UniqueMeshes:
+        {
+            // Loading the model once per entity gives each one its own mesh, buffers and VAOs
+            const u32 maxMeshCount = min((u32)(ARRAY_COUNT(device.meshes) - device.meshCount), (u32)(MAX_ENTITIES - scene.entityCount));
+            const u32 meshCount = min(config.uniqueMeshCount, maxMeshCount);
+            u32* modelIndices = PUSH_ARRAY(GetGlobalFrameArena(), u32, meshCount);
+            u32 loadedMeshCount = 0;
+            for (u32 i = 0; i < meshCount; ++i)
+            {
+                const u32 modelIdx = LoadModel(device, Benchmark_GetModelFilepath(config));
+                if (modelIdx != UINT32_MAX)
+                    modelIndices[loadedMeshCount++] = modelIdx;
+            }
+            if (loadedMeshCount == 0)
+                break;
+            scene.patrickModelIdx = modelIndices[0];
+            const u32 gridSize = (u32)sqrtf((f32)loadedMeshCount);
+            Benchmark_AddModelGrid(scene, modelIndices, loadedMeshCount, gridSize, ENTITY_SEPARATION);
+            benchmark.cameraRadius = max(10.0f, 0.75f * gridSize * ENTITY_SEPARATION);
+        } break;
+
+        case BenchmarkScene_Canyon:
+        case BenchmarkScene_Sibenik:
+        {
+            const char* filepath = Benchmark_GetModelFilepath(config);
+            const u32 modelIdx = LoadModel(device, filepath);
+            if (modelIdx != UINT32_MAX)
+            {
+                AddModelEntity(scene, modelIdx, TransformScale(vec3(1.0f)));
+            }
+            else
+            {
+                ELOG("Benchmark scene %s: could not load %s, only the floor will be rendered\n", BenchmarkSceneNames[config.scene], filepath);
+            }
+        } break;
+
+        default: INVALID_CODE_PATH("Unsupported BenchmarkScene");
+    }
+
+    benchmark.cameraHeight = 0.4f * benchmark.cameraRadius;
+
+    // Point lights on a ring around the scene
+    const u32 pointLightCount = min(config.pointLightCount, (u32)BENCHMARK_MAX_POINT_LIGHTS);
+    for (u32 i = 0; i < pointLightCount; ++i)
+    {
+        const f32 angle = TAU * (f32)i / (f32)pointLightCount;
+        const f32 radius = 0.5f * benchmark.cameraRadius;
+        AddPointLight(scene, vec3(2.0, 1.5, 0.5), vec3(radius * cosf(angle), 0.5f, radius * sinf(angle)));
+    }
+
+    // Every supported render path but the test one, over the same camera path
+    config.frameCount = clamp(config.frameCount, 1u, (u32)BENCHMARK_MAX_FRAMES);
+    benchmark.runCount = 0;
+    for (u32 renderPath = RenderPath_ForwardShading; renderPath < RenderPath_Count; ++renderPath)
+    {
+        if (!IsRenderPathSupported((RenderPath)renderPath))
+            continue;
+        BenchmarkRun& run = benchmark.runs[benchmark.runCount++];
+        run = {};
+        run.renderPath = (RenderPath)renderPath;
+        run.frameStats = new FrameStats[config.frameCount];
+    }
+}
+
+// Orbits the camera target, the same frames for every render path
+void Benchmark_UpdateCamera(Benchmark& benchmark, Camera& camera, u32 measuredFrame)
+{
+    const f32 t = (f32)measuredFrame / (f32)benchmark.config.frameCount;
+    const f32 angle = TAU * t;
+    camera.position = benchmark.cameraTarget + vec3(benchmark.cameraRadius * cosf(angle),
+                                                    benchmark.cameraHeight,
+                                                    benchmark.cameraRadius * sinf(angle));
+    camera.speed = vec3(0.0f);
+
+    const vec3 direction = normalize(benchmark.cameraTarget - camera.position);
+    camera.pitch = asinf(direction.y);
+    camera.yaw = atan2f(direction.x, -direction.z);
+}
+
+void Benchmark_Update(App* app)
+{
+    Benchmark& benchmark = app->benchmark;
+    if (!benchmark.config.isEnabled || benchmark.currentRun >= benchmark.runCount)
+        return;
+
+    BenchmarkRun& run = benchmark.runs[benchmark.currentRun];
+    if (benchmark.runFrame == 0)
+    {
+        run.firstMeasuredFrame = app->frame + benchmark.config.warmupFrames;
+        app->renderPath = run.renderPath;
+    }
+
+    const u32 measuredFrame = benchmark.runFrame > benchmark.config.warmupFrames ? benchmark.runFrame - benchmark.config.warmupFrames : 0;
+    Benchmark_UpdateCamera(benchmark, app->scene.mainCamera, measuredFrame);
+}
+
+BenchmarkRun* Benchmark_FindRun(Benchmark& benchmark, u32 frame)
+{
+    for (u32 i = 0; i < benchmark.runCount; ++i)
+    {
+        BenchmarkRun& run = benchmark.runs[i];
+        const bool isStarted = run.firstMeasuredFrame > 0;
+        if (isStarted && frame >= run.firstMeasuredFrame && frame < run.firstMeasuredFrame + benchmark.config.frameCount)
+            return &run;
+    }
+    return NULL;
+}
+
+void Benchmark_OnGpuGroupTime(App* app, u32 frame, u32 renderGroupIdx, f32 timeMs)
+{
+    Benchmark& benchmark = app->benchmark;
+    if (!benchmark.config.isEnabled)
+        return;
+
+    BenchmarkRun* run = Benchmark_FindRun(benchmark, frame);
+    if (run)
+    {
+        run->gpuGroupTotalMs[renderGroupIdx] += timeMs;
+        run->gpuGroupMaxMs[renderGroupIdx] = max(run->gpuGroupMaxMs[renderGroupIdx], timeMs);
+        run->gpuGroupSamples[renderGroupIdx]++;
+    }
+}
+
+u64* Benchmark_SortedFrameTimesUs(const BenchmarkRun& run, u32 frameCount)
+{
+    u64* frameTimesUs = PUSH_ARRAY(GetGlobalFrameArena(), u64, frameCount);
+    for (u32 i = 0; i < frameCount; ++i)
+        frameTimesUs[i] = (u64)(run.frameStats[i].frameTimeMs * 1000.0f);
+    QSort(frameTimesUs, frameTimesUs + frameCount - 1);
+    return frameTimesUs;
+}
+
+static void Benchmark_WriteMeshStats(FILE* file, const char* name, const MeshStats& stats)
+{
+    fprintf(file, "\"%s\": { \"acmr\": %.4f, \"atvr\": %.4f, \"overfetch\": %.4f, \"overdraw\": %.4f }",
+            name, stats.acmr, stats.atvr, stats.overfetch, stats.overdraw);
+}
+
+// Vertex cache, fetch and overdraw figures of every submesh before and after mesh_optimizer.cpp
+static void Benchmark_WriteMeshes(FILE* file, const Device& device)
+{
+    fprintf(file, "  \"meshes\": [");
+    bool isFirstMesh = true;
+    for (u32 meshIdx = 0; meshIdx < device.meshCount; ++meshIdx)
+    {
+        const Mesh& mesh = device.meshes[meshIdx];
+        if (!mesh.name.str)
+            continue;
+
+        fprintf(file, "%s\n    { \"name\": \"%s\", \"submeshes\": [", isFirstMesh ? "" : ",", mesh.name.str);
+        for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+        {
+            const Submesh& submesh = mesh.submeshes[i];
+            fprintf(file, "%s\n      { \"triangles\": %u, \"vertices\": %u, ", i == 0 ? "" : ",", submesh.indexCount / 3, submesh.vertexCount);
+            Benchmark_WriteMeshStats(file, "source", submesh.sourceStats);
+            fprintf(file, ", ");
+            Benchmark_WriteMeshStats(file, "optimized", submesh.optimizedStats);
+            fprintf(file, " }");
+        }
+        fprintf(file, "\n    ] }");
+        isFirstMesh = false;
+    }
+    fprintf(file, "\n  ],\n");
+}
+
+bool Benchmark_WriteReport(App* app)
+{
+    const Benchmark& benchmark = app->benchmark;
+    const BenchmarkConfig& config = benchmark.config;
+
+    FILE* file = fopen(config.outputFilepath, "wb");
+    if (!file)
+    {
+        ELOG("Could not open %s to write the benchmark report\n", config.outputFilepath);
+        return false;
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"device\": \"%s\",\n", app->device.name);
+    fprintf(file, "  \"glVersion\": \"%s\",\n", app->device.glVersionString);
+    fprintf(file, "  \"displaySize\": [%d, %d],\n", app->displaySize.x, app->displaySize.y);
+    fprintf(file, "  \"programs\": { \"count\": %u, \"loadTimeMs\": %.3f, \"cacheHits\": %u, \"cacheMisses\": %u },\n",
+            app->device.programCount, app->device.programLoadTimeNs / 1000000.0,
+            app->device.programCacheHitCount, app->device.programCacheMissCount);
+    fprintf(file, "  \"scene\": { \"name\": \"%s\", \"gridSize\": %u, \"uniqueMeshCount\": %u, \"pointLightCount\": %u, \"entityCount\": %u, \"lightCount\": %u },\n",
+            BenchmarkSceneNames[config.scene], config.gridSize, config.uniqueMeshCount, config.pointLightCount,
+            app->scene.entityCount, app->scene.lightCount);
+    fprintf(file, "  \"warmupFrames\": %u,\n", config.warmupFrames);
+    fprintf(file, "  \"frameCount\": %u,\n", config.frameCount);
+    Benchmark_WriteMeshes(file, app->device);
+    fprintf(file, "  \"runs\": [\n");
+
+    for (u32 runIdx = 0; runIdx < benchmark.runCount; ++runIdx)
+    {
+        const BenchmarkRun& run = benchmark.runs[runIdx];
+        const u32 frameCount = config.frameCount;
+
+        const u64* sortedFrameTimesUs = Benchmark_SortedFrameTimesUs(run, frameCount);
+        f64 frameTimeTotalMs = 0.0;
+        f64 drawCalls = 0, instances = 0, triangles = 0, programBinds = 0, vaoBinds = 0, textureBinds = 0;
+        f64 bufferBytesMapped = 0, bufferBytesWritten = 0, renderPrimitives = 0, entitiesProcessed = 0, frameArenaBytes = 0;
+        f64 commandLists = 0, commands = 0, recordTimeMs = 0, replayTimeMs = 0;
+        f64 rasterTriangles = 0, rasterPixels = 0, rasterTimeMs = 0;
+        for (u32 i = 0; i < frameCount; ++i)
+        {
+            const FrameStats& stats = run.frameStats[i];
+            frameTimeTotalMs   += stats.frameTimeMs;
+            drawCalls          += stats.drawCalls;
+            instances          += stats.instances;
+            triangles          += (f64)stats.triangles;
+            programBinds       += stats.programBinds;
+            vaoBinds           += stats.vaoBinds;
+            textureBinds       += stats.textureBinds;
+            bufferBytesMapped  += (f64)stats.bufferBytesMapped;
+            bufferBytesWritten += (f64)stats.bufferBytesWritten;
+            renderPrimitives   += stats.renderPrimitives;
+            entitiesProcessed  += stats.entitiesProcessed;
+            frameArenaBytes    += stats.frameArenaBytes;
+            commandLists       += stats.commandLists;
+            commands           += stats.commands;
+            recordTimeMs       += stats.recordTimeMs;
+            replayTimeMs       += stats.replayTimeMs;
+            rasterTriangles    += (f64)stats.rasterTriangles;
+            rasterPixels       += (f64)stats.rasterPixels;
+            rasterTimeMs       += stats.rasterTimeMs;
+        }
+        const f64 n = (f64)frameCount;
+
+        fprintf(file, "    {\n");
+        fprintf(file, "      \"renderPath\": \"%s\",\n", BenchmarkRenderPathNames[run.renderPath]);
+        fprintf(file, "      \"frameTimeMs\": { \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f },\n",
+                frameTimeTotalMs / n,
+                sortedFrameTimesUs[(frameCount - 1) * 50 / 100] / 1000.0,
+                sortedFrameTimesUs[(frameCount - 1) * 95 / 100] / 1000.0,
+                sortedFrameTimesUs[(frameCount - 1) * 99 / 100] / 1000.0,
+                sortedFrameTimesUs[frameCount - 1] / 1000.0);
+        fprintf(file, "      \"counters\": { \"drawCalls\": %.1f, \"instances\": %.1f, \"triangles\": %.1f, \"programBinds\": %.1f, \"vaoBinds\": %.1f, \"textureBinds\": %.1f, "
+                      "\"bufferBytesMapped\": %.1f, \"bufferBytesWritten\": %.1f, \"renderPrimitives\": %.1f, \"entitiesProcessed\": %.1f, \"frameArenaBytes\": %.1f },\n",
+                drawCalls / n, instances / n, triangles / n, programBinds / n, vaoBinds / n, textureBinds / n,
+                bufferBytesMapped / n, bufferBytesWritten / n, renderPrimitives / n, entitiesProcessed / n, frameArenaBytes / n);
+        fprintf(file, "      \"commandLists\": { \"lists\": %.1f, \"commands\": %.1f, \"recordTimeMs\": %.4f, \"replayTimeMs\": %.4f },\n",
+                commandLists / n, commands / n, recordTimeMs / n, replayTimeMs / n);
+        if (rasterTimeMs > 0.0)
+        {
+            // Throughput of the software rasterizer over the whole run
+            const f64 rasterSeconds = rasterTimeMs / 1000.0;
+            fprintf(file, "      \"software\": { \"rasterTimeMs\": %.4f, \"trianglesPerSecond\": %.1f, \"pixelsPerSecond\": %.1f },\n",
+                    rasterTimeMs / n, rasterTriangles / rasterSeconds, rasterPixels / rasterSeconds);
+        }
+        fprintf(file, "      \"groups\": [");
+
+        bool isFirstGroup = true;
+        for (u32 groupIdx = 0; groupIdx < app->renderGroupCount; ++groupIdx)
+        {
+            if (run.cpuGroupSamples[groupIdx] == 0 && run.gpuGroupSamples[groupIdx] == 0)
+                continue;
+
+            const f64 cpuMeanMs = run.cpuGroupSamples[groupIdx] ? run.cpuGroupTotalMs[groupIdx] / run.cpuGroupSamples[groupIdx] : 0.0;
+            const f64 gpuMeanMs = run.gpuGroupSamples[groupIdx] ? run.gpuGroupTotalMs[groupIdx] / run.gpuGroupSamples[groupIdx] : 0.0;
+            fprintf(file, "%s\n        { \"name\": \"%s\", \"cpuMeanMs\": %.4f, \"cpuMaxMs\": %.4f, \"gpuMeanMs\": %.4f, \"gpuMaxMs\": %.4f, \"gpuSamples\": %u }",
+                    isFirstGroup ? "" : ",", app->renderGroups[groupIdx].name,
+                    cpuMeanMs, run.cpuGroupMaxMs[groupIdx], gpuMeanMs, run.gpuGroupMaxMs[groupIdx], run.gpuGroupSamples[groupIdx]);
+            isFirstGroup = false;
+        }
+
+        fprintf(file, "\n      ]\n");
+        fprintf(file, "    }%s\n", runIdx + 1 < benchmark.runCount ? "," : "");
+    }
+
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+    fclose(file);
+
+    ILOG("Benchmark report written to %s\n", config.outputFilepath);
+    return true;
+}
+
+void Benchmark_EndFrame(App* app)
+{
+    Benchmark& benchmark = app->benchmark;
+    if (!benchmark.config.isEnabled)
+        return;
+
+    if (benchmark.currentRun < benchmark.runCount)
+    {
+        BenchmarkRun& run = benchmark.runs[benchmark.currentRun];
+        if (benchmark.runFrame >= benchmark.config.warmupFrames)
+        {
+            run.frameStats[benchmark.runFrame - benchmark.config.warmupFrames] = app->frameStats;
+
+            for (u32 groupIdx = 0; groupIdx < app->renderGroupCount; ++groupIdx)
+            {
+                const f32 cpuTimeMs = app->renderGroups[groupIdx].cpuFrameTimeMs;
+                if (cpuTimeMs > 0.0f)
+                {
+                    run.cpuGroupTotalMs[groupIdx] += cpuTimeMs;
+                    run.cpuGroupMaxMs[groupIdx] = max(run.cpuGroupMaxMs[groupIdx], cpuTimeMs);
+                    run.cpuGroupSamples[groupIdx]++;
+                }
+            }
+        }
+
+        if (++benchmark.runFrame == benchmark.config.warmupFrames + benchmark.config.frameCount)
+        {
+            benchmark.currentRun++;
+            benchmark.runFrame = 0;
+        }
+    }
+    // Wait for the GPU timings of the last frames before writing the report
+    else if (++benchmark.flushFrames > 2 * MAX_GPU_FRAME_DELAY)
+    {
+        Benchmark_WriteReport(app);
+
+        for (u32 i = 0; i < benchmark.runCount; ++i)
+        {
+            delete[] benchmark.runs[i].frameStats;
+            benchmark.runs[i].frameStats = NULL;
+        }
+        benchmark.config.isEnabled = false;
+        app->isRunning = false;
+    }
+}
@@ -17,6 +17,8 @@ static Buffer CreateBufferRaw(Device& device, u32 size, BufferType type, BufferU
     buffer = OpenGL_CreateBuffer(device, size, type, usage);
 #elif USE_GFX_API_METAL
     buffer = Metal_CreateBuffer(device, size, type, usage);
+#elif USE_GFX_API_VULKAN
+    buffer = Vulkan_CreateBuffer(device, size, type, usage);
 #endif
 
     return buffer;
@@ -65,6 +67,8 @@ void BindBuffer(const Buffer& buffer)
     OpenGL_BindBuffer(buffer);
 #elif USE_GFX_API_METAL
     Metal_BindBuffer(buffer);
+#elif USE_GFX_API_VULKAN
+    Vulkan_BindBuffer(buffer);
 #endif
 }
 
@@ -75,17 +79,23 @@ void MapBuffer(Buffer& buffer, Access access)
     OpenGL_MapBuffer(buffer, access);
 #elif USE_GFX_API_METAL
     Metal_MapBuffer(buffer, access);
+#elif USE_GFX_API_VULKAN
+    Vulkan_MapBuffer(buffer, access);
 #endif
     buffer.head = 0;
+    STATS_ADD(bufferBytesMapped, buffer.size);
 }
 
 void UnmapBuffer(Buffer& buffer)
 {
     ASSERT(buffer.data, "The buffer is not mapped");
+    STATS_ADD(bufferBytesWritten, buffer.head);
 #if USE_GFX_API_OPENGL
     OpenGL_UnmapBuffer(buffer);
 #elif USE_GFX_API_METAL
     Metal_UnmapBuffer(buffer);
+#elif USE_GFX_API_VULKAN
+    Vulkan_UnmapBuffer(buffer);
 #endif
     buffer.data = 0;
     buffer.head = 0;
@@ -133,7 +143,7 @@ Buffer& GetCurrentConstantBuffer( Device& device )
 
 void BeginConstantBufferRecording( Device& device )
 {
-    device.currentConstantBufferIdx = 0;
+    device.currentConstantBufferIdx = 1; // The first buffer is the null one
     Buffer& buffer = GetCurrentConstantBuffer(device);
     MapBuffer( buffer, Access_Write );
 }
@@ -0,0 +1,296 @@
+//
+// command_lists.cpp : Compact command lists recorded on worker threads and replayed on the
+// thread that owns the GL context. Recording only reads engine data and writes to the arena
+// of the recording thread, GL is only touched during the replay. Each command is a one-byte
+// type followed by its packed arguments.
+//
+
+enum CommandType : u8
+{
+    Command_BindPipelineState,
+    Command_BindVertexBuffer,
+    Command_BindUniformBuffer,
+    Command_BindVertexArray,
+    Command_BindInstances,
+    Command_BindTexture,
+    Command_SetUniformUInt,
+    Command_DrawIndexed,
+    Command_DrawIndexedIndirect,
+};
+
+struct BindPipelineStateCommand   { u32 pipelineStateIdx; };
+struct BindVertexBufferCommand    { u32 bufferIdx; };
+struct BindUniformBufferCommand   { u32 binding; BufferRange range; };
+struct BindVertexArrayCommand     { u32 vaoHandle; };
+struct BindInstancesCommand       { u32 offset; }; // Instancing stream layout of the bound pipeline state
+struct BindTextureCommand         { u32 unit; u32 target; u32 textureHandle; };
+struct SetUniformUIntCommand      { i32 location; u32 value; };
+struct DrawIndexedCommand         { u32 indexCount; u32 indexOffset; u32 instanceCount; };
+struct DrawIndexedIndirectCommand { u32 bufferHandle; u32 offset; u32 drawCount; };
+
+// The arenas are sized by COMMAND_LIST_PRIMITIVE_SIZE: check the largest render primitive, a
+// non-instanced shaded one, and the binds opening a list
+CASSERT(4 + sizeof(BindTextureCommand) + sizeof(BindVertexArrayCommand) + sizeof(BindUniformBufferCommand) + sizeof(DrawIndexedCommand) <= COMMAND_LIST_PRIMITIVE_SIZE,
+        "Render primitive commands do not fit COMMAND_LIST_PRIMITIVE_SIZE");
+CASSERT(3 + sizeof(BindPipelineStateCommand) + sizeof(BindUniformBufferCommand) + sizeof(BindVertexBufferCommand) <= COMMAND_LIST_PRIMITIVE_SIZE,
+        "List opening commands do not fit COMMAND_LIST_PRIMITIVE_SIZE");
+
+// Redundant binds are dropped while recording
+struct CommandRecorder
+{
+    Arena*       arena;
+    CommandList* list;
+    u32          vaoHandle;
+    u32          textureHandles[16];
+};
+
+void CommandRecorder_Begin(CommandRecorder& recorder, Arena& arena, CommandList& list, u32 sortKey)
+{
+    recorder = {};
+    recorder.arena = &arena;
+    recorder.list = &list;
+
+    list = {};
+    list.sortKey = sortKey;
+    list.commands = arena.data + arena.head;
+}
+
+void CommandRecorder_End(CommandRecorder& recorder)
+{
+    CommandList& list = *recorder.list;
+    list.size = (u32)(recorder.arena->data + recorder.arena->head - list.commands);
+}
+
+template <typename T>
+static void CommandRecorder_Push(CommandRecorder& recorder, CommandType type, const T& command)
+{
+    PushChar(*recorder.arena, type);
+    PushData(*recorder.arena, &command, sizeof(command));
+    recorder.list->commandCount++;
+}
+
+void Cmd_BindPipelineState(CommandRecorder& recorder, u32 pipelineStateIdx)
+{
+    CommandRecorder_Push(recorder, Command_BindPipelineState, BindPipelineStateCommand{ pipelineStateIdx });
+}
+
+void Cmd_BindVertexBuffer(CommandRecorder& recorder, u32 bufferIdx)
+{
+    CommandRecorder_Push(recorder, Command_BindVertexBuffer, BindVertexBufferCommand{ bufferIdx });
+}
+
+void Cmd_BindUniformBuffer(CommandRecorder& recorder, u32 binding, const BufferRange& range)
+{
+    CommandRecorder_Push(recorder, Command_BindUniformBuffer, BindUniformBufferCommand{ binding, range });
+}
+
+void Cmd_BindVertexArray(CommandRecorder& recorder, u32 vaoHandle)
+{
+    if (recorder.vaoHandle == vaoHandle)
+        return;
+    recorder.vaoHandle = vaoHandle;
+    CommandRecorder_Push(recorder, Command_BindVertexArray, BindVertexArrayCommand{ vaoHandle });
+}
+
+void Cmd_BindInstances(CommandRecorder& recorder, u32 offset)
+{
+    CommandRecorder_Push(recorder, Command_BindInstances, BindInstancesCommand{ offset });
+}
+
+void Cmd_BindTexture(CommandRecorder& recorder, u32 unit, u32 target, u32 textureHandle)
+{
+    ASSERT(unit < ARRAY_COUNT(recorder.textureHandles), "Texture unit out of range");
+    if (recorder.textureHandles[unit] == textureHandle)
+        return;
+    recorder.textureHandles[unit] = textureHandle;
+    CommandRecorder_Push(recorder, Command_BindTexture, BindTextureCommand{ unit, target, textureHandle });
+}
+
+void Cmd_SetUniformUInt(CommandRecorder& recorder, i32 location, u32 value)
+{
+    CommandRecorder_Push(recorder, Command_SetUniformUInt, SetUniformUIntCommand{ location, value });
+}
+
+void Cmd_DrawIndexed(CommandRecorder& recorder, u32 indexCount, u32 indexOffset, u32 instanceCount)
+{
+    CommandRecorder_Push(recorder, Command_DrawIndexed, DrawIndexedCommand{ indexCount, indexOffset, instanceCount });
+}
+
+// Draws the drawCount tightly packed DrawElementsIndirectCommand structs at offset in bufferHandle
+void Cmd_DrawIndexedIndirect(CommandRecorder& recorder, u32 bufferHandle, u32 offset, u32 drawCount)
+{
+    CommandRecorder_Push(recorder, Command_DrawIndexedIndirect, DrawIndexedIndirectCommand{ bufferHandle, offset, drawCount });
+}
+
+template <typename T>
+static const u8* ReadCommand(const u8* cursor, T& command)
+{
+    MemCopy(&command, cursor, sizeof(command));
+    return cursor + sizeof(command);
+}
+
+static void CommandList_Replay(Device& device, const CommandList& list)
+{
+    u32 pipelineStateIdx = 0;
+
+    const u8* cursor = list.commands;
+    const u8* end = list.commands + list.size;
+    while (cursor < end)
+    {
+        const CommandType type = (CommandType)*cursor++;
+        switch (type)
+        {
+            case Command_BindPipelineState:
+                {
+                    BindPipelineStateCommand command;
+                    cursor = ReadCommand(cursor, command);
+                    pipelineStateIdx = command.pipelineStateIdx;
+                    ApplyPipelineState(device, pipelineStateIdx);
+                }
+                break;
+
+            case Command_BindVertexBuffer:
+                {
+                    BindVertexBufferCommand command;
+                    cursor = ReadCommand(cursor, command);
+                    BindBuffer(device.vertexBuffers[command.bufferIdx]);
+                }
+                break;
+
+            case Command_BindUniformBuffer:
+                {
+                    BindUniformBufferCommand command;
+                    cursor = ReadCommand(cursor, command);
+                    const BufferRange& range = command.range;
+                    glBindBufferRange(GL_UNIFORM_BUFFER, command.binding, device.constantBuffers[range.bufferIdx].handle, range.offset, range.size);
+                }
+                break;
+
+            case Command_BindVertexArray:
+                {
+                    BindVertexArrayCommand command;
+                    cursor = ReadCommand(cursor, command);
+                    glBindVertexArray(command.vaoHandle);
+                    STATS_INC(vaoBinds);
+                }
+                break;
+
+            case Command_BindInstances:
+                {
+                    BindInstancesCommand command;
+                    cursor = ReadCommand(cursor, command);
+                    BindInstanceAttributes(device, pipelineStateIdx, command.offset);
+                }
+                break;
+
+            case Command_BindTexture:
+                {
+                    BindTextureCommand command;
+                    cursor = ReadCommand(cursor, command);
+                    glActiveTexture(GL_TEXTURE0 + command.unit);
+                    glBindTexture(command.target, command.textureHandle);
+                    STATS_INC(textureBinds);
+                }
+                break;
+
+            case Command_SetUniformUInt:
+                {
+                    SetUniformUIntCommand command;
+                    cursor = ReadCommand(cursor, command);
+                    glUniform1ui(command.location, command.value);
+                }
+                break;
+
+            case Command_DrawIndexed:
+                {
+                    DrawIndexedCommand command;
+                    cursor = ReadCommand(cursor, command);
+                    if (command.instanceCount == 1)
+                        glDrawElements(GL_TRIANGLES, command.indexCount, GL_UNSIGNED_INT, (void*)(u64)command.indexOffset);
+                    else
+                        glDrawElementsInstanced(GL_TRIANGLES, command.indexCount, GL_UNSIGNED_INT, (void*)(u64)command.indexOffset, command.instanceCount);
+                    Stats_CountDraw(command.indexCount, command.instanceCount);
+                }
+                break;
+
+            case Command_DrawIndexedIndirect:
+                {
+                    DrawIndexedIndirectCommand command;
+                    cursor = ReadCommand(cursor, command);
+                    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command.bufferHandle);
+                    if (device.glVersion >= MAKE_GLVERSION(4, 3))
+                    {
+                        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(u64)command.offset, command.drawCount, 0);
+                        STATS_INC(drawCalls);
+                    }
+                    else
+                    {
+                        const u32 indirectCommandSize = 5 * sizeof(u32); // DrawElementsIndirectCommand
+                        for (u32 i = 0; i < command.drawCount; ++i)
+                            glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(u64)(command.offset + i * indirectCommandSize));
+                        STATS_ADD(drawCalls, command.drawCount);
+                    }
+                    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+                }
+                break;
+
+            default:
+                INVALID_CODE_PATH("Unknown command type");
+        }
+    }
+}
+
+void CommandLists_Init(CommandLists& commandLists, const JobSystem* jobs)
+{
+    for (u32 i = 0; i < Jobs_GetThreadCount(jobs); ++i)
+        commandLists.threadArenas[i] = CreateArena(COMMAND_LIST_ARENA_SIZE);
+    commandLists.useWorkerThreads = true;
+}
+
+void CommandLists_Destroy(CommandLists& commandLists)
+{
+    for (u32 i = 0; i < ARRAY_COUNT(commandLists.threadArenas); ++i)
+        if (commandLists.threadArenas[i].data)
+            DestroyArena(commandLists.threadArenas[i]);
+}
+
+void CommandLists_Reset(CommandLists& commandLists)
+{
+    for (u32 i = 0; i < ARRAY_COUNT(commandLists.threadArenas); ++i)
+        ResetArena(commandLists.threadArenas[i]);
+    commandLists.listCount = 0;
+}
+
+// Merges the lists of all threads in replay order
+void CommandLists_Sort(CommandLists& commandLists)
+{
+    CommandList* lists = commandLists.lists;
+    for (u32 i = 1; i < commandLists.listCount; ++i)
+    {
+        const CommandList list = lists[i];
+        u32 j = i;
+        for (; j > 0 && lists[j - 1].sortKey > list.sortKey; --j)
+            lists[j] = lists[j - 1];
+        lists[j] = list;
+    }
+}
+
+// Submits the lists recorded for queue, must run on the thread that owns the GL context
+void CommandLists_Replay(Device& device, const CommandLists& commandLists, CommandQueue queue)
+{
+    CPU_PROFILE_FUNCTION();
+    const u64 beginNs = GetProfileTimeNs();
+
+    for (u32 i = 0; i < commandLists.listCount; ++i)
+    {
+        const CommandList& list = commandLists.lists[i];
+        if (HIGH_WORD(list.sortKey) == (u32)queue)
+        {
+            CommandList_Replay(device, list);
+            STATS_INC(commandLists);
+            STATS_ADD(commands, list.commandCount);
+        }
+    }
+
+    STATS_ADD(replayTimeMs, (GetProfileTimeNs() - beginNs) / 1000000.0f);
+}
@@ -10,6 +10,11 @@
 #include "opengl_engine.h"
 #elif USE_GFX_API_METAL
 #include "metal_engine.h"
+#elif USE_GFX_API_VULKAN
+#include "vulkan_engine.h"
+#endif
+#if USE_GFX_API_SOFTWARE
+#include "software_engine.h"
 #endif
 
 #include <imgui.h>
@@ -18,12 +23,15 @@
 #include <assimp/cimport.h>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
+#include <float.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <utility>
 
 #define BINDING(b) b
 
-#define TIME_ELAPSED_QUERIES
-//#define TIMESTAMP_QUERIES
-
 
 static App* gApp = NULL;
 
@@ -31,6 +39,28 @@ static Arena StrArena = {};
 
 static bool g_CullFace = true;
 
+static const unsigned int AssimpImportFlags = aiProcess_Triangulate           |
+                                              aiProcess_GenSmoothNormals      |
+                                              aiProcess_CalcTangentSpace      |
+                                              aiProcess_JoinIdenticalVertices |
+                                              aiProcess_PreTransformVertices  |
+                                              aiProcess_ImproveCacheLocality  |
+                                              aiProcess_OptimizeMeshes        |
+                                              aiProcess_SortByPType;
+
+// Counters of the frame in progress, moved to App::frameStats in EndFrame
+static FrameStats g_FrameStats = {};
+
+#define STATS_ADD(counter, value) (g_FrameStats.counter += (value))
+#define STATS_INC(counter) STATS_ADD(counter, 1)
+
+inline void Stats_CountDraw(u32 indexCount, u32 instanceCount)
+{
+    g_FrameStats.drawCalls++;
+    g_FrameStats.instances += instanceCount;
+    g_FrameStats.triangles += (u64)(indexCount / 3) * instanceCount;
+}
+
 
 // https://www.khronos.org/opengl/wiki/Debug_Output
 struct DebugEvent
@@ -49,61 +79,196 @@ struct DebugEvent
     }
 };
 
-u32 GetTimerQueryIndex(u32 frameMod, u32 renderGroupIdx, u32 beginOrEnd)
+// GPU timings are recorded with GL_TIMESTAMP query pairs (GL_TIME_ELAPSED
+// queries cannot nest). Each in-flight frame owns a slot of the ring and its
+// results are read back only once available, MAX_GPU_FRAME_DELAY frames later
+// at worst, so the profiler never stalls the CPU waiting for the GPU.
+
+void ProfileEvent_Init(App* app)
 {
-    ASSERT(frameMod < MAX_GPU_FRAME_DELAY, "Frame mod out of bounds");
-    ASSERT(renderGroupIdx < MAX_RENDER_GROUPS, "Render group out of bounds");
-    ASSERT(beginOrEnd < 2, "An event can only have begin and end markers");
-    u32 queryIdx = frameMod * MAX_RENDER_GROUPS * 2 + renderGroupIdx * 2 + beginOrEnd;
-    return queryIdx;
+#if USE_GFX_API_OPENGL
+    for (u32 i = 0; i < MAX_GPU_FRAME_DELAY; ++i)
+    {
+        GpuProfileFrame& profileFrame = app->gpuProfileFrames[i];
+        glGenQueries(ARRAY_COUNT(profileFrame.eventQueries), profileFrame.eventQueries);
+    }
+#endif
 }
 
-void ProfileEvent_Init(App* app)
+void ProfileEvent_Insert(App* app, u32 renderGroupIdx, ProfileEventType eventType)
 {
 #if USE_GFX_API_OPENGL
-    glGenQueries(ARRAY_COUNT(app->profileEventQueries), app->profileEventQueries);
+    GpuProfileFrame& profileFrame = app->gpuProfileFrames[app->frameMod];
+
+    ASSERT(profileFrame.eventCount < MAX_PROFILE_EVENTS_PER_FRAME, "Max number of timer queries reached");
+    const u32 eventIdx = profileFrame.eventCount++;
+    profileFrame.eventGroups[eventIdx] = renderGroupIdx;
+    profileFrame.eventTypes[eventIdx] = eventType;
+    glQueryCounter(profileFrame.eventQueries[eventIdx], GL_TIMESTAMP);
+
+    if (eventType == ProfileEventType_FrameEnd)
+    {
+        profileFrame.isPending = true;
+    }
 #endif
 }
 
-void ProfileEvent_Insert(App* app, u32 renderGroup, ProfileEventType eventType)
+void RenderGroup_PushTime(RenderGroup& renderGroup, f32 timeMs, u32 frame)
+{
+    renderGroup.timeHistoryMs[renderGroup.timeHistoryHead] = timeMs;
+    renderGroup.timeHistoryHead = (renderGroup.timeHistoryHead + 1) % GPU_PROFILE_HISTORY_FRAMES;
+    renderGroup.timeHistoryCount = min(renderGroup.timeHistoryCount + 1, (u32)GPU_PROFILE_HISTORY_FRAMES);
+    renderGroup.lastResolvedFrame = frame;
+
+    f32 sumMs = 0.0f;
+    f32 maxMs = 0.0f;
+    for (u32 i = 0; i < renderGroup.timeHistoryCount; ++i)
+    {
+        sumMs += renderGroup.timeHistoryMs[i];
+        maxMs = max(maxMs, renderGroup.timeHistoryMs[i]);
+    }
+    renderGroup.averageTimeMs = sumMs / renderGroup.timeHistoryCount;
+    renderGroup.maxTimeMs = maxMs;
+}
+
+void Benchmark_OnGpuGroupTime(App* app, u32 frame, u32 renderGroupIdx, f32 timeMs); // benchmark.cpp
+
+// Returns false if the frame results are not available yet
+bool ProfileEvent_ResolveFrame(App* app, GpuProfileFrame& profileFrame)
 {
 #if USE_GFX_API_OPENGL
-    const u32 renderGroupIdx = app->frameRenderGroup;
-
-    ASSERT(app->profileEventCount < MAX_PROFILE_EVENTS, "Max number of timer queries reached");
-    u32 profileEventIdx = (app->profileEventBegin + app->profileEventCount) % MAX_PROFILE_EVENTS;
-    app->profileEventGroup[ profileEventIdx ] = renderGroup;
-    app->profileEventTypes[ profileEventIdx ] = eventType;
-#if defined(TIMESTAMP_QUERIES)
-    const GLuint timerQuery = app->profileEventQueries[ profileEventIdx ];
-    glQueryCounter(timerQuery, GL_TIMESTAMP);
-#else
-    if (eventType != ProfileEventType_FrameBegin)
+    ASSERT(profileFrame.eventCount > 0, "No profile events... not even BeginFrame?");
+    ASSERT(profileFrame.eventTypes[0] == ProfileEventType_FrameBegin, "First profile event should be FrameBegin...");
+
+    // Timestamps complete in submission order: the last one tells for all of them
+    GLint isAvailable = 0;
+    glGetQueryObjectiv(profileFrame.eventQueries[profileFrame.eventCount - 1], GL_QUERY_RESULT_AVAILABLE, &isAvailable);
+    if (!isAvailable)
+    {
+        return false;
+    }
+
+    f32  renderGroupTimes[MAX_RENDER_GROUPS] = {};
+    bool renderGroupSeen[MAX_RENDER_GROUPS] = {};
+
+    u32 openProfileGroupCount = 0;
+    GLuint64 openProfileGroupStack[16] = {};
+
+    for (u32 eventIdx = 0; eventIdx < profileFrame.eventCount; ++eventIdx)
     {
-        glEndQuery(GL_TIME_ELAPSED);
+        GLuint64 timeNs = 0;
+        glGetQueryObjectui64v(profileFrame.eventQueries[eventIdx], GL_QUERY_RESULT, &timeNs);
+
+        const ProfileEventType eventType = profileFrame.eventTypes[eventIdx];
+        if (eventType == ProfileEventType_FrameBegin || eventType == ProfileEventType_GroupBegin)
+        {
+            ASSERT(openProfileGroupCount < ARRAY_COUNT(openProfileGroupStack), "Too many levels of profile groups");
+            openProfileGroupStack[openProfileGroupCount++] = timeNs;
+        }
+        else if (eventType == ProfileEventType_FrameEnd || eventType == ProfileEventType_GroupEnd)
+        {
+            ASSERT(openProfileGroupCount > 0, "Profile group mismatch (more End than Begin)");
+            const GLuint64 beginTimeNs = openProfileGroupStack[--openProfileGroupCount];
+            const u32 renderGroupIdx = profileFrame.eventGroups[eventIdx];
+            renderGroupTimes[renderGroupIdx] += (timeNs - beginTimeNs) / 1000000.0f;
+            renderGroupSeen[renderGroupIdx] = true;
+
+            Benchmark_OnGpuGroupTime(app, profileFrame.frame, renderGroupIdx, (timeNs - beginTimeNs) / 1000000.0f);
+
+#if USE_CPU_PROFILER
+            // Same timeline as the CPU events
+            CpuProfile_PushGpuEvent(app->renderGroups[renderGroupIdx].name,
+                                    beginTimeNs + app->gpuClockOffsetNs,
+                                    timeNs + app->gpuClockOffsetNs);
+#endif
+        }
+        else
+        {
+            INVALID_CODE_PATH("Unsupported ProfileEventType");
+        }
     }
-    if (eventType != ProfileEventType_FrameEnd)
+    ASSERT(openProfileGroupCount == 0, "Profile group mismatch (more Begin than End)");
+
+    for (u32 renderGroupIdx = 0; renderGroupIdx < app->renderGroupCount; ++renderGroupIdx)
     {
-        const GLuint timeElapsedQuery = app->profileEventQueries[ profileEventIdx ];
-        glBeginQuery(GL_TIME_ELAPSED, timeElapsedQuery);
+        if (renderGroupSeen[renderGroupIdx])
+        {
+            RenderGroup_PushTime(app->renderGroups[renderGroupIdx], renderGroupTimes[renderGroupIdx], profileFrame.frame);
+        }
     }
 #endif
-    app->profileEventCount++;
+
+    return true;
+}
+
+void ProfileEvent_Resolve(App* app)
+{
+    // Oldest frames first, so each group history stays in frame order. The current
+    // slot still holds the frame from MAX_GPU_FRAME_DELAY frames ago.
+    for (u32 i = 0; i < MAX_GPU_FRAME_DELAY; ++i)
+    {
+        GpuProfileFrame& profileFrame = app->gpuProfileFrames[(app->frameMod + i) % MAX_GPU_FRAME_DELAY];
+        if (profileFrame.isPending && ProfileEvent_ResolveFrame(app, profileFrame))
+        {
+            profileFrame.isPending = false;
+        }
+    }
+}
+
+void ProfileEvent_CalibrateClocks(App* app)
+{
+#if USE_GFX_API_OPENGL
+    GLint64 gpuTimeNs = 0;
+    glGetInteger64v(GL_TIMESTAMP, &gpuTimeNs);
+    app->gpuClockOffsetNs = GetProfileTimeNs() - (u64)gpuTimeNs;
 #endif
 }
 
+void ProfileEvent_BeginFrame(App* app)
+{
+    CPU_PROFILE_FUNCTION();
+
+    // Re-sync the GPU clock once in a while, it may drift from the CPU one
+    if (app->frame % GPU_PROFILE_HISTORY_FRAMES == 1)
+    {
+        ProfileEvent_CalibrateClocks(app);
+    }
+
+    ProfileEvent_Resolve(app);
+
+    for (u32 renderGroupIdx = 0; renderGroupIdx < app->renderGroupCount; ++renderGroupIdx)
+    {
+        app->renderGroups[renderGroupIdx].cpuFrameTimeMs = 0.0f;
+    }
+
+    // Never wait on the slot we are about to reuse, just drop its results
+    GpuProfileFrame& profileFrame = app->gpuProfileFrames[app->frameMod];
+    if (profileFrame.isPending)
+    {
+        app->gpuProfileDroppedFrames++;
+    }
+    profileFrame.eventCount = 0;
+    profileFrame.frame = app->frame;
+    profileFrame.isPending = false;
+
+    ProfileEvent_Insert(app, app->frameRenderGroup, ProfileEventType_FrameBegin);
+}
+
 struct ProfileEvent
 {
     App* _app;
     u32  _renderGroupIdx;
+    u64  _cpuBeginNs;
 
     ProfileEvent(App* app, u32 renderGroupIdx) : _app(app), _renderGroupIdx(renderGroupIdx)
     {
         ProfileEvent_Insert(app, renderGroupIdx, ProfileEventType_GroupBegin);
+        _cpuBeginNs = GetProfileTimeNs();
     }
 
     ~ProfileEvent()
     {
+        _app->renderGroups[_renderGroupIdx].cpuFrameTimeMs += (GetProfileTimeNs() - _cpuBeginNs) / 1000000.0f;
         ProfileEvent_Insert(_app, _renderGroupIdx, ProfileEventType_GroupEnd);
     }
 };
@@ -113,6 +278,7 @@ u32 RegisterRenderGroup(App* app, const char* pName, u32 parentGroupIdx = 0xffff
     ASSERT(app->renderGroupCount < MAX_RENDER_GROUPS, "MAX_RENDER_GROUPS limit reached");
     u32 groupIdx = app->renderGroupCount++;
     app->renderGroups[groupIdx].name = pName;
+    app->renderGroups[groupIdx].parent = parentGroupIdx;
 
     // Parent child relationship
     if (parentGroupIdx != 0xffffffff)
@@ -128,7 +294,8 @@ u32 RegisterRenderGroup(App* app, const char* pName, u32 parentGroupIdx = 0xffff
 #define RENDER_GROUP(name, parentIdx) \
     static const u32   renderGroupIdx##__FILE__##__LINE__ = RegisterRenderGroup(gApp, name, parentIdx); \
     const DebugEvent   debugEvent    ##__FILE__##__LINE__(gApp, renderGroupIdx##__FILE__##__LINE__); \
-    const ProfileEvent profileEvent  ##__FILE__##__LINE__(gApp, renderGroupIdx##__FILE__##__LINE__);
+    const ProfileEvent profileEvent  ##__FILE__##__LINE__(gApp, renderGroupIdx##__FILE__##__LINE__); \
+    CPU_PROFILE_SCOPE(name);
 
 #if USE_GFX_API_OPENGL
 #include "opengl_buffers.cpp"
@@ -137,13 +304,55 @@ u32 RegisterRenderGroup(App* app, const char* pName, u32 parentGroupIdx = 0xffff
 #endif
 #include "buffers.cpp"
 
+#include "shader_permutations.cpp"
+
+#include "jobs.cpp"
+
+#include "texture_cooker.cpp"
+#include "mesh_optimizer.cpp"
+
+#include "startup.cpp"
+
+#include "simulation.cpp"
+
+#if USE_GFX_API_VULKAN
+// Pipeline states are reflected from SPIR-V, their VkPipelines are found when drawing
+u32 CreatePipelineState(Device& device, const PipelineStateDesc& desc)
+{
+    ASSERT(device.pipelineStateCount < ARRAY_COUNT(device.pipelineStates), "Max number of pipeline states reached");
+
+    PipelineState& pipelineState = device.pipelineStates[device.pipelineStateCount];
+    pipelineState = {};
+    pipelineState.desc = desc;
+    Vulkan_CreatePipelineState(device, pipelineState);
+
+    return device.pipelineStateCount++;
+}
+
+// Size in bytes of the uniform block at binding, 0 if the program does not use it
+u32 GetUniformBlockSize(const Device& device, u32 pipelineStateIdx, u32 binding)
+{
+    const PipelineState& pipelineState = device.pipelineStates[pipelineStateIdx];
+    for (u32 i = 0; i < pipelineState.uniformBlockCount; ++i)
+        if (pipelineState.uniformBlocks[i].binding == binding)
+            return pipelineState.uniformBlocks[i].size;
+    return 0;
+}
+#endif
+
 #if USE_GFX_API_OPENGL
-GLuint CreateProgramFromSource(String programSource, int glslVersion, const char* shaderName)
+#include "program_cache.cpp"
+#include "pipeline_states.cpp"
+#include "command_lists.cpp"
+
+// Starts compiling and linking a program permutation. With GL_KHR_parallel_shader_compile the
+// driver does it in the background, until its status is queried in EndProgramCompile.
+ProgramCompile BeginProgramCompile(Device& device, const Program& program, String programSource)
 {
-    GLchar  infoLogBuffer[1024] = {};
-    GLsizei infoLogBufferSize = sizeof(infoLogBuffer);
-    GLsizei infoLogSize;
-    GLint   success;
+    CPU_PROFILE_FUNCTION();
+
+    const int glslVersion = device.glslVersion;
+    const char* shaderName = program.programName.str;
 
     ScratchArena arena;
     String glslVersionHeader    = FormatString(arena, "#version %u\n", glslVersion);
@@ -151,6 +360,13 @@ GLuint CreateProgramFromSource(String programSource, int glslVersion, const char
     String shaderNameDefine     = FormatString(arena, "#define %s\n", shaderName);
     String vertexShaderDefine   = MakeString(arena, "#define VERTEX\n");
     String fragmentShaderDefine = MakeString(arena, "#define FRAGMENT\n");
+    String permutationDefines   = MakePermutationDefines(arena, program.defines);
+    String engineDefines        = FormatString(arena,
+        "#define VISIBILITY_TRIANGLE_BITS %u\n"
+        "#define VISIBILITY_MAX_ALBEDO_SLOTS %u\n"
+        "#define VISIBILITY_MAX_ALBEDO_ARRAYS %u\n"
+        "#define VISIBILITY_ALBEDO_LAYER_BITS %u\n",
+        VISIBILITY_TRIANGLE_BITS, VISIBILITY_MAX_ALBEDO_SLOTS, VISIBILITY_MAX_ALBEDO_ARRAYS, VISIBILITY_ALBEDO_LAYER_BITS);
 
     String defineUseInstancing  = MakeString(arena,
 #if defined(USE_INSTANCING)
@@ -163,71 +379,140 @@ GLuint CreateProgramFromSource(String programSource, int glslVersion, const char
     const GLchar* vertexShaderSource[] = {
         glslVersionHeader.str,
         glslVersionDefine.str,
+        engineDefines.str,
         defineUseInstancing.str,
         shaderNameDefine.str,
+        permutationDefines.str,
         vertexShaderDefine.str,
         programSource.str
     };
     const GLint vertexShaderLengths[] = {
         (GLint) glslVersionHeader.len,
         (GLint) glslVersionDefine.len,
+        (GLint) engineDefines.len,
         (GLint) defineUseInstancing.len,
         (GLint) shaderNameDefine.len,
+        (GLint) permutationDefines.len,
         (GLint) vertexShaderDefine.len,
         (GLint) programSource.len
     };
     const GLchar* fragmentShaderSource[] = {
         glslVersionHeader.str,
         glslVersionDefine.str,
+        engineDefines.str,
         shaderNameDefine.str,
+        permutationDefines.str,
         fragmentShaderDefine.str,
         programSource.str
     };
     const GLint fragmentShaderLengths[] = {
         (GLint) glslVersionHeader.len,
         (GLint) glslVersionDefine.len,
+        (GLint) engineDefines.len,
         (GLint) shaderNameDefine.len,
+        (GLint) permutationDefines.len,
         (GLint) fragmentShaderDefine.len,
         (GLint) programSource.len
     };
 
-    GLuint vshader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vshader, ARRAY_COUNT(vertexShaderSource), vertexShaderSource, vertexShaderLengths);
-    glCompileShader(vshader);
-    glGetShaderiv(vshader, GL_COMPILE_STATUS, &success);
+    ProgramCompile compile = {};
+
+    if (device.isProgramCacheEnabled)
+    {
+        compile.cacheKey = ProgramCache_Key(device,
+                                            vertexShaderSource, vertexShaderLengths, ARRAY_COUNT(vertexShaderSource),
+                                            fragmentShaderSource, fragmentShaderLengths, ARRAY_COUNT(fragmentShaderSource));
+
+        compile.handle = ProgramCache_Load(device, program.permutationName.str, compile.cacheKey);
+        if (compile.handle)
+        {
+            device.programCacheHitCount++;
+            compile.isFromCache = true;
+            return compile;
+        }
+        device.programCacheMissCount++;
+    }
+
+    compile.vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(compile.vertexShader, ARRAY_COUNT(vertexShaderSource), vertexShaderSource, vertexShaderLengths);
+    glCompileShader(compile.vertexShader);
+
+    compile.fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(compile.fragmentShader, ARRAY_COUNT(fragmentShaderSource), fragmentShaderSource, fragmentShaderLengths);
+    glCompileShader(compile.fragmentShader);
+
+    compile.handle = glCreateProgram();
+    if (device.isProgramCacheEnabled)
+        glProgramParameteri(compile.handle, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glAttachShader(compile.handle, compile.vertexShader);
+    glAttachShader(compile.handle, compile.fragmentShader);
+    glLinkProgram(compile.handle);
+
+    return compile;
+}
+
+// Whether EndProgramCompile can be called without blocking
+bool IsProgramCompileDone(const Device& device, const ProgramCompile& compile)
+{
+    if (compile.isFromCache || !device.ext.GL_KHR_parallel_shader_compile)
+        return true;
+
+    GLint isDone = GL_FALSE;
+    glGetProgramiv(compile.handle, GL_COMPLETION_STATUS_KHR, &isDone);
+    return isDone == GL_TRUE;
+}
+
+// Logs the compilation errors and releases the shaders, returns whether the program linked
+bool EndProgramCompile(Device& device, const Program& program, ProgramCompile& compile)
+{
+    CPU_PROFILE_FUNCTION();
+
+    if (compile.isFromCache)
+        return true;
+
+    GLchar  infoLogBuffer[1024] = {};
+    GLsizei infoLogBufferSize = sizeof(infoLogBuffer);
+    GLsizei infoLogSize;
+    GLint   success;
+
+    const char* shaderName = program.permutationName.str;
+    const GLuint programHandle = compile.handle;
+
+    glGetShaderiv(compile.vertexShader, GL_COMPILE_STATUS, &success);
     if (!success)
     {
-        glGetShaderInfoLog(vshader, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+        glGetShaderInfoLog(compile.vertexShader, infoLogBufferSize, &infoLogSize, infoLogBuffer);
         ELOG("glCompileShader() failed with vertex shader %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
     }
 
-    GLuint fshader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fshader, ARRAY_COUNT(fragmentShaderSource), fragmentShaderSource, fragmentShaderLengths);
-    glCompileShader(fshader);
-    glGetShaderiv(fshader, GL_COMPILE_STATUS, &success);
+    glGetShaderiv(compile.fragmentShader, GL_COMPILE_STATUS, &success);
     if (!success)
     {
-        glGetShaderInfoLog(fshader, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+        glGetShaderInfoLog(compile.fragmentShader, infoLogBufferSize, &infoLogSize, infoLogBuffer);
         ELOG("glCompileShader() failed with fragment shader %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
     }
 
-    GLuint programHandle = glCreateProgram();
-    glAttachShader(programHandle, vshader);
-    glAttachShader(programHandle, fshader);
-    glLinkProgram(programHandle);
     glGetProgramiv(programHandle, GL_LINK_STATUS, &success);
     if (!success)
     {
         glGetProgramInfoLog(programHandle, infoLogBufferSize, &infoLogSize, infoLogBuffer);
         ELOG("glLinkProgram() failed with program %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
-    }
 
-    glUseProgram(0);
+        // Messages refer to the files by their index (#line directives)
+        for (u32 i = 0; i < program.dependencyCount; ++i)
+            ELOG(" - source string %u: %s", program.dependencies[i], device.shaderFiles[program.dependencies[i]].filepath.str);
+    }
+    else if (device.isProgramCacheEnabled)
+    {
+        ProgramCache_Store(device, shaderName, compile.cacheKey, programHandle);
+    }
 
-    glDetachShader(programHandle, vshader);
-    glDetachShader(programHandle, fshader);
-    glDeleteShader(vshader);
-    glDeleteShader(fshader);
+    glDetachShader(programHandle, compile.vertexShader);
+    glDetachShader(programHandle, compile.fragmentShader);
+    glDeleteShader(compile.vertexShader);
+    glDeleteShader(compile.fragmentShader);
+    compile.vertexShader = 0;
+    compile.fragmentShader = 0;
 
 #if 0
     // Shader reflection
@@ -268,7 +553,24 @@ GLuint CreateProgramFromSource(String programSource, int glslVersion, const char
     }
 #endif
 
-    return programHandle;
+    return success == GL_TRUE;
+}
+
+void CancelProgramCompile(ProgramCompile& compile)
+{
+    if (compile.vertexShader)
+        glDeleteShader(compile.vertexShader);
+    if (compile.fragmentShader)
+        glDeleteShader(compile.fragmentShader);
+    glDeleteProgram(compile.handle);
+    compile = {};
+}
+
+GLuint CreateProgramFromSource(Device& device, const Program& program, String programSource)
+{
+    ProgramCompile compile = BeginProgramCompile(device, program, programSource);
+    EndProgramCompile(device, program, compile);
+    return compile.handle;
 }
 #endif
 
@@ -323,23 +625,101 @@ VertexShaderLayout ExtractVertexShaderLayoutFromProgram(GLuint programHandle)
 #endif
 
 
-u32 LoadProgram(Device& device, String filepath, String programName)
+// Loads a permutation of the program programName in filepath, defines lists its feature switches
+u32 LoadProgram(Device& device, String filepath, String programName, const char* defines = "")
 {
-    String programSource = ReadTextFile(filepath.str);
+    const u64 beginNs = GetProfileTimeNs();
 
     Program program = {};
+    program.filepath = filepath;
+    program.programName = programName;
+    program.defines = CString(defines);
+    program.permutationName = MakePermutationName(StrArena, programName, program.defines);
+
+    ScratchArena arena;
+    String programSource = ExpandProgramSource(device, program, arena);
+    program.sourceHash = HashBytes(programSource.str, programSource.len);
+
 #if USE_GFX_API_OPENGL
-    program.handle = CreateProgramFromSource(programSource, device.glslVersion, programName.str);
+    program.handle = CreateProgramFromSource(device, program, programSource);
     program.vertexInputLayout = ExtractVertexShaderLayoutFromProgram(program.handle);
+#elif USE_GFX_API_VULKAN
+    Vulkan_CreateProgram(device, program);
 #endif
-    program.filepath = filepath;
-    program.programName = programName;
-    program.lastWriteTimestamp = GetFileLastWriteTimestamp(filepath.str);
+    ASSERT(device.programCount < ARRAY_COUNT(device.programs), "Max number of programs reached");
     device.programs[device.programCount++] = program;
 
+    device.programLoadTimeNs += GetProfileTimeNs() - beginNs;
+
     return device.programCount - 1;
 }
 
+#if USE_GFX_API_OPENGL
+// Recompiles the permutations whose expanded source changed, in the background if the driver
+// supports it. Programs keep their current handle until the new one has linked, and keep it
+// for good if the new one fails to compile.
+void UpdateProgramHotReload(Device& device)
+{
+    CPU_PROFILE_FUNCTION();
+
+    // Each shared file is checked once, not once per program
+    for (u32 i = 0; i < device.shaderFileCount; ++i)
+    {
+        ShaderFile& shaderFile = device.shaderFiles[i];
+        const u64 timestamp = GetFileLastWriteTimestamp(shaderFile.filepath.str);
+        shaderFile.hasChanged = timestamp != shaderFile.lastWriteTimestamp;
+        shaderFile.lastWriteTimestamp = timestamp;
+    }
+
+    for (u32 programIdx = 0; programIdx < device.programCount; ++programIdx)
+    {
+        Program& program = device.programs[programIdx];
+
+        bool hasChangedDependencies = false;
+        for (u32 i = 0; i < program.dependencyCount; ++i)
+            hasChangedDependencies |= device.shaderFiles[program.dependencies[i]].hasChanged;
+
+        if (hasChangedDependencies)
+        {
+            ScratchArena arena;
+            String programSource = ExpandProgramSource(device, program, arena);
+            const u64 sourceHash = HashBytes(programSource.str, programSource.len);
+
+            // Edits in sections of other programs do not change the expanded source of this one
+            if (programSource.str && sourceHash != program.sourceHash)
+            {
+                if (program.isCompiling)
+                    CancelProgramCompile(program.pendingCompile);
+
+                program.pendingCompile = BeginProgramCompile(device, program, programSource);
+                program.isCompiling = true;
+                program.sourceHash = sourceHash;
+            }
+        }
+
+        if (program.isCompiling && IsProgramCompileDone(device, program.pendingCompile))
+        {
+            if (EndProgramCompile(device, program, program.pendingCompile))
+            {
+                glDeleteProgram(program.handle);
+                program.handle = program.pendingCompile.handle;
+                program.vertexInputLayout = ExtractVertexShaderLayoutFromProgram(program.handle);
+                device.programReloadCount++;
+                ILOG("Program %s reloaded", program.permutationName.str);
+            }
+            else
+            {
+                glDeleteProgram(program.pendingCompile.handle);
+                ELOG("Program %s failed to reload, keeping the previous version", program.permutationName.str);
+            }
+
+            program.pendingCompile = {};
+            program.isCompiling = false;
+        }
+    }
+}
+#endif
+
 Image LoadImage(const char* filename)
 {
     Image img = {};
@@ -379,8 +759,8 @@ GLuint CreateTexture2DFromImage(Image image)
     glGenTextures(1, &texHandle);
     glBindTexture(GL_TEXTURE_2D, texHandle);
     glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, image.size.x, image.size.y, 0, dataFormat, dataType, image.pixels);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
@@ -389,29 +769,104 @@ GLuint CreateTexture2DFromImage(Image image)
 
     return texHandle;
 }
+
+// Not part of the core profile, but exposed by every desktop driver
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT  0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+// Like CreateTexture2DFromImage, cooked.data can be an offset into the bound pixel unpack buffer
+GLuint CreateTexture2DFromCooked(const CookedTexture& cooked)
+{
+    // Color textures stay sRGB encoded as in their source images, and are sampled as UNORM like
+    // the uncompressed ones since the shaders work on the encoded values
+    static const GLenum internalFormats[] = {
+        GL_COMPRESSED_RGB_S3TC_DXT1_EXT,
+        GL_COMPRESSED_RGBA_S3TC_DXT5_EXT,
+        GL_COMPRESSED_RG_RGTC2,
+        GL_COMPRESSED_RGBA_BPTC_UNORM,
+    };
+    CASSERT(ARRAY_COUNT(internalFormats) == CookedFormat_Count, "");
+
+    GLuint texHandle;
+    glGenTextures(1, &texHandle);
+    glBindTexture(GL_TEXTURE_2D, texHandle);
+    for (u32 level = 0; level < cooked.levelCount; ++level)
+    {
+        const ivec2 levelSize = TextureCooker_LevelSize(cooked.size, level);
+        glCompressedTexImage2D(GL_TEXTURE_2D, level, internalFormats[cooked.format], levelSize.x, levelSize.y, 0,
+                               cooked.levelSizes[level], cooked.data + cooked.levelOffsets[level]);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, cooked.levelCount - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    return texHandle;
+}
 #endif
 
-u32 LoadTexture2D(Device& device, const char* filepath)
+// Uncompressed textures are padded to 4 channels by most drivers, plus a third for the mips
+u32 GetImageMemorySize(const Image& image)
+{
+    return image.size.x * image.size.y * 4 * 4 / 3;
+}
+
+u32 LoadTexture2D(Device& device, const char* filepath, TextureRole role)
 {
     for (u32 texIdx = 0; texIdx < device.textureCount; ++texIdx)
         if (SameString(device.textures[texIdx].filepath, CString(filepath)))
             return texIdx;
 
-    Image image = LoadImage(filepath);
+#if USE_GFX_API_OPENGL
+    if (device.isCookedTextureSupported)
+    {
+        // Read ahead if requested during startup
+        const CookedTexture* startupCooked = Startup_FindCookedTexture(filepath, role);
+        CookedTexture cooked = {};
+        if (startupCooked || TextureCooker_LoadCooked(filepath, role, cooked))
+        {
+            Texture tex = {};
+            tex.handle = CreateTexture2DFromCooked(startupCooked ? *startupCooked : cooked);
+            tex.filepath = InternString(StrArena, filepath);
+            tex.size = startupCooked ? startupCooked->size : cooked.size;
+            tex.memorySize = startupCooked ? startupCooked->dataSize : cooked.dataSize;
+            tex.isCooked = true;
+            FreeCookedTexture(cooked);
+
+            ASSERT(device.textureCount < ARRAY_COUNT(device.textures), "Max number of textures reached");
+            device.textures[device.textureCount] = tex;
+            return device.textureCount++;
+        }
+    }
+#endif
+
+    // Decoded ahead if requested during startup
+    const Image* startupImage = Startup_FindImage(filepath, role);
+    Image image = startupImage ? *startupImage : LoadImage(filepath);
 
     if (image.pixels)
     {
         Texture tex = {};
 #if USE_GFX_API_OPENGL
         tex.handle = CreateTexture2DFromImage(image);
+#elif USE_GFX_API_VULKAN
+        Vulkan_CreateTexture2D(device, tex, image);
 #endif
         tex.filepath = InternString(StrArena, filepath);
+        tex.size = image.size;
+        tex.memorySize = GetImageMemorySize(image);
 
         ASSERT(device.textureCount < ARRAY_COUNT(device.textures), "Max number of textures reached");
         u32 texIdx = device.textureCount;
         device.textures[device.textureCount++] = tex;
 
-        FreeImage(image);
+        if (!startupImage)
+            FreeImage(image);
         return texIdx;
     }
     else
@@ -428,9 +883,16 @@ void ProcessAssimpMesh(const aiScene* scene, aiMesh *mesh, Mesh *myMesh, u32 bas
     const u32 vertexOffset = vertexArena.head;
     const u32 indexOffset = indexArena.head;
 
+    vec3 boundsMin = vec3( FLT_MAX);
+    vec3 boundsMax = vec3(-FLT_MAX);
+
     // process vertices
     for(unsigned int i = 0; i < mesh->mNumVertices; i++)
     {
+        const vec3 position(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
+        boundsMin = min(boundsMin, position);
+        boundsMax = max(boundsMax, position);
+
         PushFloat(vertexArena, mesh->mVertices[i].x);
         PushFloat(vertexArena, mesh->mVertices[i].y);
         PushFloat(vertexArena, mesh->mVertices[i].z);
@@ -503,11 +965,15 @@ void ProcessAssimpMesh(const aiScene* scene, aiMesh *mesh, Mesh *myMesh, u32 bas
 
    // add the submesh into the mesh
    Submesh submesh = {};
+   MeshOptimizer_Optimize(vertexArena.data + vertexOffset, mesh->mNumVertices, vertexBufferLayout.stride,
+                          (u32*)(indexArena.data + indexOffset), mesh->mNumFaces*3, submesh.sourceStats, submesh.optimizedStats);
    submesh.vertexBufferLayout = vertexBufferLayout;
    submesh.vertexOffset = vertexOffset;
    submesh.indexOffset = indexOffset;
    submesh.vertexCount = mesh->mNumVertices;
    submesh.indexCount = mesh->mNumFaces*3;
+   submesh.boundsMin = boundsMin;
+   submesh.boundsMax = boundsMax;
    myMesh->submeshes.push_back( submesh );
 }
 
@@ -537,35 +1003,35 @@ void ProcessAssimpMaterial(Device& device, aiMaterial *material, Material& myMat
         material->GetTexture(aiTextureType_DIFFUSE, 0, &aiFilename);
         String filename = CString(aiFilename.C_Str());
         String filepath = MakePath(TmpArena, directory, filename);
-        myMaterial.albedoTextureIdx = LoadTexture2D(device, filepath.str);
+        myMaterial.albedoTextureIdx = LoadTexture2D(device, filepath.str, TextureRole_Albedo);
     }
     if (material->GetTextureCount(aiTextureType_EMISSIVE) > 0)
     {
         material->GetTexture(aiTextureType_EMISSIVE, 0, &aiFilename);
         String filename = CString(aiFilename.C_Str());
         String filepath = MakePath(TmpArena, directory, filename);
-        myMaterial.emissiveTextureIdx = LoadTexture2D(device, filepath.str);
+        myMaterial.emissiveTextureIdx = LoadTexture2D(device, filepath.str, TextureRole_Emissive);
     }
     if (material->GetTextureCount(aiTextureType_SPECULAR) > 0)
     {
         material->GetTexture(aiTextureType_SPECULAR, 0, &aiFilename);
         String filename = CString(aiFilename.C_Str());
         String filepath = MakePath(TmpArena, directory, filename);
-        myMaterial.specularTextureIdx = LoadTexture2D(device, filepath.str);
+        myMaterial.specularTextureIdx = LoadTexture2D(device, filepath.str, TextureRole_Mask);
     }
     if (material->GetTextureCount(aiTextureType_NORMALS) > 0)
     {
         material->GetTexture(aiTextureType_NORMALS, 0, &aiFilename);
         String filename = CString(aiFilename.C_Str());
         String filepath = MakePath(TmpArena, directory, filename);
-        myMaterial.normalsTextureIdx = LoadTexture2D(device, filepath.str);
+        myMaterial.normalsTextureIdx = LoadTexture2D(device, filepath.str, TextureRole_Normal);
     }
     if (material->GetTextureCount(aiTextureType_HEIGHT) > 0)
     {
         material->GetTexture(aiTextureType_HEIGHT, 0, &aiFilename);
         String filename = CString(aiFilename.C_Str());
         String filepath = MakePath(TmpArena, directory, filename);
-        myMaterial.bumpTextureIdx = LoadTexture2D(device, filepath.str);
+        myMaterial.bumpTextureIdx = LoadTexture2D(device, filepath.str, TextureRole_Mask);
     }
 
     //myMaterial.createNormalFromBump();
@@ -589,15 +1055,11 @@ void ProcessAssimpNode(const aiScene* scene, aiNode *node, Mesh *myMesh, u32 bas
 
 u32 LoadModel(Device& device, const char* filename)
 {
-    const aiScene* scene = aiImportFile(filename,
-                                        aiProcess_Triangulate           |
-                                        aiProcess_GenSmoothNormals      |
-                                        aiProcess_CalcTangentSpace      |
-                                        aiProcess_JoinIdenticalVertices |
-                                        aiProcess_PreTransformVertices  |
-                                        aiProcess_ImproveCacheLocality  |
-                                        aiProcess_OptimizeMeshes        |
-                                        aiProcess_SortByPType);
+    CPU_PROFILE_FUNCTION();
+
+    // Imported and extracted ahead if requested during startup
+    const StartupModel* startupModel = Startup_FindModel(filename);
+    const aiScene* scene = startupModel ? startupModel->scene : aiImportFile(filename, AssimpImportFlags);
 
     if (!scene)
     {
@@ -609,6 +1071,7 @@ u32 LoadModel(Device& device, const char* filename)
     u32 meshIdx = device.meshCount++;
     Mesh& mesh = device.meshes[meshIdx];
     mesh = Mesh{};
+    mesh.name = InternString(StrArena, filename);
 
     ScratchArena TmpArena;
 
@@ -628,12 +1091,23 @@ u32 LoadModel(Device& device, const char* filename)
 
     ScratchArena vertexArena;
     ScratchArena indexArena;
-    ProcessAssimpNode(scene, scene->mRootNode, &mesh, baseMeshMaterialIdx, mesh.materialIndices, vertexArena, indexArena);
-
-    aiReleaseImport(scene);
+    if (startupModel)
+    {
+        // The geometry was extracted on a job thread, relative to the first material
+        mesh.submeshes = startupModel->mesh.submeshes;
+        for (u32 materialIdx : startupModel->mesh.materialIndices)
+            mesh.materialIndices.push_back(baseMeshMaterialIdx + materialIdx);
+    }
+    else
+    {
+        ProcessAssimpNode(scene, scene->mRootNode, &mesh, baseMeshMaterialIdx, mesh.materialIndices, vertexArena, indexArena);
+        aiReleaseImport(scene);
+    }
 
-    const u32 vertexBufferSize = vertexArena.head;
-    const u32 indexBufferSize = indexArena.head;
+    const Arena& vertices = startupModel ? startupModel->vertices : vertexArena;
+    const Arena& indices = startupModel ? startupModel->indices : indexArena;
+    const u32 vertexBufferSize = vertices.head;
+    const u32 indexBufferSize = indices.head;
 
     mesh.vertexBufferIdx = CreateStaticVertexBuffer(device, vertexBufferSize);
     mesh.indexBufferIdx = CreateStaticIndexBuffer(device, indexBufferSize);
@@ -644,12 +1118,14 @@ u32 LoadModel(Device& device, const char* filename)
     MapBuffer(vertexBuffer, Access_Write);
     MapBuffer(indexBuffer, Access_Write);
 
-    BufferPushData(vertexBuffer, vertexArena.data, vertexBufferSize);
-    BufferPushData(indexBuffer, indexArena.data, indexBufferSize);
+    BufferPushData(vertexBuffer, vertices.data, vertexBufferSize);
+    BufferPushData(indexBuffer, indices.data, indexBufferSize);
 
     UnmapBuffer(vertexBuffer);
     UnmapBuffer(indexBuffer);
 
+    MeshOptimizer_LogReport(mesh);
+
     return meshIdx;
 }
 
@@ -765,6 +1241,12 @@ RenderTarget CreateRenderTargetRaw(String name, ivec2 displaySize, RenderTargetT
         externalFormat = GL_DEPTH_COMPONENT;
         channelDataType = GL_FLOAT;
     }
+    else if (type == RenderTargetType_UInt)
+    {
+        internalFormat = GL_R32UI;
+        externalFormat = GL_RED_INTEGER;
+        channelDataType = GL_UNSIGNED_INT;
+    }
 
     // Framebuffer
     GLuint textureHandle;
@@ -780,6 +1262,9 @@ RenderTarget CreateRenderTargetRaw(String name, ivec2 displaySize, RenderTargetT
 #endif
 
     RenderTarget renderTarget = {};
+#if USE_GFX_API_VULKAN
+    Vulkan_CreateRenderTarget(renderTarget, displaySize, type);
+#endif
     renderTarget.name         = name;
     renderTarget.size         = displaySize;
 #if USE_GFX_API_OPENGL
@@ -801,6 +1286,8 @@ void DestroyRenderTargetRaw(const RenderTarget& renderTarget)
 {
 #if USE_GFX_API_OPENGL
     glDeleteTextures(1, &renderTarget.handle);
+#elif USE_GFX_API_VULKAN
+    Vulkan_DestroyRenderTarget(renderTarget);
 #endif
 }
 
@@ -811,14 +1298,30 @@ Framebuffer CreateFramebufferRaw(Device& device, u32 attachmentCount, Attachment
     glGenFramebuffers(1, &framebufferHandle);
     glBindFramebuffer(GL_FRAMEBUFFER, framebufferHandle);
 
+    GLenum drawBuffers[MAX_FRAMEBUFFER_ATTACHMENTS];
+    u32 drawBufferCount = 0;
+    u32 drawBufferMask = 0;
+
     for (u32 i = 0; i < attachmentCount; ++i)
     {
         const GLenum attachmentEnum  = GLenumFromAttachmentPoint[attachments[i].attachmentPoint];
         const u32    renderTargetIdx = attachments[i].renderTargetIdx;
         const RenderTarget& renderTarget = device.renderTargets[ renderTargetIdx ];
         glFramebufferTexture(GL_FRAMEBUFFER, attachmentEnum, renderTarget.handle, 0);
+
+        if (attachments[i].attachmentPoint < Attachment_Depth)
+            drawBufferMask |= 1 << attachments[i].attachmentPoint;
     }
 
+    // Start with all color attachments enabled; passes only change this when they need to
+    for (u32 point = Attachment_Color0; point < Attachment_Depth; ++point)
+        if (drawBufferMask >> point)
+            drawBuffers[drawBufferCount++] = (drawBufferMask & (1 << point)) ? GLenumFromAttachmentPoint[point] : GL_NONE;
+    if (drawBufferCount > 0)
+        glDrawBuffers(drawBufferCount, drawBuffers);
+    else
+        glDrawBuffer(GL_NONE);
+
     GLenum framebufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
     if (framebufferStatus != GL_FRAMEBUFFER_COMPLETE)
     {
@@ -842,6 +1345,7 @@ Framebuffer CreateFramebufferRaw(Device& device, u32 attachmentCount, Attachment
     Framebuffer framebuffer = {};
 #if USE_GFX_API_OPENGL
     framebuffer.handle = framebufferHandle;
+    framebuffer.drawBufferMask = drawBufferMask;
 #endif
     framebuffer.attachmentCount = attachmentCount;
     MemCopy(&framebuffer.attachments, attachments, attachmentCount*sizeof(Attachment));
@@ -880,58 +1384,138 @@ u32 CreateRenderPass(Device& device, u32 framebufferIdx, u32 attachmentActionCou
     return device.renderPassCount - 1;
 }
 
-void BeginRenderPass( const Device& device, u32 renderPassIdx )
+#if USE_GFX_API_OPENGL
+u32 CollectAttachmentsToInvalidate(const RenderPass& renderPass, const Framebuffer& framebuffer, bool atPassBegin, GLenum* attachmentEnums)
+{
+    u32 attachmentCount = 0;
+    for (u32 i = 0; i < renderPass.attachmentActionCount; ++i)
+    {
+        const AttachmentAction& action = renderPass.attachmentActions[i];
+        const bool discard = atPassBegin ? (action.loadOp == LoadOp_DontCare) : (action.storeOp == StoreOp_DontCare);
+        if (discard)
+        {
+            const Attachment& attachment = framebuffer.attachments[action.attachmentIdx];
+            attachmentEnums[attachmentCount++] = GLenumFromAttachmentPoint[attachment.attachmentPoint];
+        }
+    }
+    return attachmentCount;
+}
+#endif
+
+void BeginRenderPass( const Device& device, const RenderPass& renderPass, const Framebuffer& framebuffer )
 {
 #if USE_GFX_API_OPENGL
-    const RenderPass& renderPass = device.renderPasses[renderPassIdx];
-    const Framebuffer& framebuffer = device.framebuffers[renderPass.framebufferIdx];
     glBindFramebuffer(GL_FRAMEBUFFER, framebuffer.handle);
 
-    GLuint colorBuffers[MAX_FRAMEBUFFER_ATTACHMENTS] = {};
-    u32 colorBufferCount = 0;
+    if (framebuffer.handle == 0)
+        return;
+
+    // Previous contents of DontCare attachments need not be loaded
+    GLenum invalidAttachments[MAX_FRAMEBUFFER_ATTACHMENTS];
+    const u32 invalidAttachmentCount = CollectAttachmentsToInvalidate(renderPass, framebuffer, true, invalidAttachments);
+    if (invalidAttachmentCount > 0 && device.glVersion >= MAKE_GLVERSION(4, 3))
+        glInvalidateFramebuffer(GL_FRAMEBUFFER, invalidAttachmentCount, invalidAttachments);
+
+    // Enable the color attachments used by the pass, in attachment point order
+    u32 drawBufferMask = 0;
+    for (u32 i = 0; i < renderPass.attachmentActionCount; ++i)
+    {
+        const Attachment& attachment = framebuffer.attachments[renderPass.attachmentActions[i].attachmentIdx];
+        if (attachment.attachmentPoint < Attachment_Depth)
+            drawBufferMask |= 1 << attachment.attachmentPoint;
+    }
+
+    if (drawBufferMask != framebuffer.drawBufferMask)
+    {
+        GLenum drawBuffers[MAX_FRAMEBUFFER_ATTACHMENTS];
+        u32 drawBufferCount = 0;
+        for (u32 point = Attachment_Color0; point < Attachment_Depth; ++point)
+            drawBuffers[drawBufferCount++] = (drawBufferMask & (1 << point)) ? GLenumFromAttachmentPoint[point] : GL_NONE;
+        while (drawBufferCount > 0 && drawBuffers[drawBufferCount - 1] == GL_NONE)
+            drawBufferCount--;
+
+        if (drawBufferCount > 0)
+            glDrawBuffers(drawBufferCount, drawBuffers);
+        else
+            glDrawBuffer(GL_NONE);
+        framebuffer.drawBufferMask = drawBufferMask;
+    }
 
+    // Clears go through glClearBuffer*, so each attachment gets its own value
+    // without touching the clear color state nor the draw buffer setup
     for (u32 i = 0; i < renderPass.attachmentActionCount; ++i)
     {
         const AttachmentAction& action = renderPass.attachmentActions[i];
-        const Attachment& attachment = framebuffer.attachments[action.attachmentIdx];
+        if (action.loadOp != LoadOp_Clear)
+            continue;
 
-        if (action.loadOp == LoadOp_Clear)
+        const Attachment& attachment = framebuffer.attachments[action.attachmentIdx];
+        if (attachment.attachmentPoint == Attachment_Depth)
         {
-            if (attachment.attachmentPoint < Attachment_Depth)
-            {
-                const GLenum attachmentEnum = GLenumFromAttachmentPoint[attachment.attachmentPoint];
-                glDrawBuffer(attachmentEnum);
-                glClearColor(0.1f, 0.1f, 0.1f, 1.0f); // TODO: Avoid hardcoding this clear color
-                glClear(GL_COLOR_BUFFER_BIT);
-            }
-            else
-            {
-                glClear(GL_DEPTH_BUFFER_BIT);
-            }
+            // Depth clears obey the depth mask, restore the one of the bound pipeline state
+            glDepthMask(GL_TRUE);
+            glClearBufferfv(GL_DEPTH, 0, &action.clearValue.depth);
+            if (device.boundPipelineState.isValid && !device.boundPipelineState.depthWrite)
+                glDepthMask(GL_FALSE);
+            continue;
         }
 
-        if (attachment.attachmentPoint < Attachment_Depth) {
-            const GLenum attachmentEnum = GLenumFromAttachmentPoint[attachment.attachmentPoint];
-            colorBuffers[colorBufferCount++] = attachmentEnum;
+        const GLint drawBufferIdx = attachment.attachmentPoint - Attachment_Color0;
+        const RenderTarget& renderTarget = device.renderTargets[attachment.renderTargetIdx];
+        if (renderTarget.type == RenderTargetType_UInt)
+        {
+            const GLuint clearValue[4] = { action.clearValue.colorUInt, 0, 0, 0 };
+            glClearBufferuiv(GL_COLOR, drawBufferIdx, clearValue);
+        }
+        else
+        {
+            glClearBufferfv(GL_COLOR, drawBufferIdx, value_ptr(action.clearValue.color));
         }
     }
-
-    if (colorBufferCount > 0)
-        glDrawBuffers(colorBufferCount, colorBuffers);
+#elif USE_GFX_API_VULKAN
+    Vulkan_BeginRenderPass(device, renderPass, framebuffer);
 #endif
 }
 
-void EndRenderPass( const Device& )
+void BeginRenderPass( const Device& device, u32 renderPassIdx )
+{
+    const RenderPass& renderPass = device.renderPasses[renderPassIdx];
+    const Framebuffer& framebuffer = device.framebuffers[renderPass.framebufferIdx];
+    BeginRenderPass(device, renderPass, framebuffer);
+}
+
+void EndRenderPass( const Device& device, const RenderPass& renderPass, const Framebuffer& framebuffer )
 {
 #if USE_GFX_API_OPENGL
+    // Contents of StoreOp_DontCare attachments need not be written back
+    GLenum invalidAttachments[MAX_FRAMEBUFFER_ATTACHMENTS];
+    const u32 invalidAttachmentCount = CollectAttachmentsToInvalidate(renderPass, framebuffer, false, invalidAttachments);
+    if (framebuffer.handle != 0 && invalidAttachmentCount > 0 && device.glVersion >= MAKE_GLVERSION(4, 3))
+        glInvalidateFramebuffer(GL_FRAMEBUFFER, invalidAttachmentCount, invalidAttachments);
+
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+#elif USE_GFX_API_VULKAN
+    Vulkan_EndRenderPass(device, renderPass, framebuffer);
 #endif
 }
 
+void EndRenderPass( const Device& device, u32 renderPassIdx )
+{
+    const RenderPass& renderPass = device.renderPasses[renderPassIdx];
+    const Framebuffer& framebuffer = device.framebuffers[renderPass.framebufferIdx];
+    EndRenderPass(device, renderPass, framebuffer);
+}
+
 void AddEntity(Scene& scene, const Entity& entity)
 {
     ASSERT(scene.entityCount < ARRAY_COUNT(scene.entities), "Reached max number of entities");
     scene.entities[scene.entityCount++] = entity;
+
+    // Dynamic entities are looked for every frame instead
+    if (entity.isDynamic)
+        scene.dynamicEntityIndices[scene.dynamicEntityCount++] = scene.entityCount - 1;
+    else
+        scene.staticGeometryVersion++;
 }
 
 void AddModelEntity(Scene& scene, u32 meshIdx, const mat4& worldMatrix)
@@ -1030,17 +1614,42 @@ void InitDevice(Device& device)
 
 #if USE_GFX_API_METAL
     Metal_InitDevice(device);
+#elif USE_GFX_API_VULKAN
+    Vulkan_InitDevice(device);
 #elif USE_GFX_API_OPENGL
     OpenGL_InitDevice(device);
+
+    device.isCookedTextureSupported =
+        !device.disableCookedTextures &&
+        device.ext.GL_EXT_texture_compression_s3tc &&
+        (device.glVersion >= MAKE_GLVERSION(4, 2) || device.ext.GL_ARB_texture_compression_bptc);
+    ILOG("Cooked textures: %s", device.isCookedTextureSupported ? "enabled" :
+                                device.disableCookedTextures ? "disabled" : "unavailable (requires S3TC and BPTC)");
 #endif
 }
 
+struct EmbeddedTexture
+{
+    const char* filepath;
+    TextureRole role;
+};
+
+// Textures of InitEmbedded, decoded on the job threads during startup and cooked by texcook
+static const EmbeddedTexture EmbeddedTextures[] = {
+    { "dice.png",          TextureRole_Albedo },
+    { "color_white.png",   TextureRole_Albedo },
+    { "color_black.png",   TextureRole_Albedo },
+    { "color_normal.png",  TextureRole_Normal },
+    { "color_magenta.png", TextureRole_Albedo },
+};
+
 void InitEmbedded(Device& device, Embedded& embed)
 {
     // Embedded geometry
     embed.meshIdx = device.meshCount++;
     Mesh& mesh = device.meshes[embed.meshIdx];
     mesh = Mesh{};
+    mesh.name = CString("embedded");
 
     mesh.vertexBufferIdx = CreateStaticVertexBuffer(device, MB(1));
     mesh.indexBufferIdx = CreateStaticIndexBuffer(device, MB(1));
@@ -1078,6 +1687,8 @@ void InitEmbedded(Device& device, Embedded& embed)
         submesh.vertexBufferLayout.attributes[0] = VertexBufferAttribute{0, 3, 0};
         submesh.vertexBufferLayout.attributes[1] = VertexBufferAttribute{2, 2, sizeof(vec3)};
         submesh.vertexBufferLayout.attributeCount = 2;
+        MeshOptimizer_Analyze((const u8*)vertices, submesh.vertexCount, sizeof(VertexV3V2), indices, submesh.indexCount, submesh.sourceStats);
+        submesh.optimizedStats = submesh.sourceStats;
 
         BufferPushData(vertexBuffer, vertices, sizeof(vertices));
         BufferPushData(indexBuffer, indices, sizeof(indices));
@@ -1092,14 +1703,14 @@ void InitEmbedded(Device& device, Embedded& embed)
             vec2 uv;
         };
 
-        const VertexV3V3V2 vertices[] = {
+        VertexV3V3V2 vertices[] = {
             { vec3(-1.0, 0.0,  1.0), vec3(0.0, 1.0, 0.0), vec2(0.0, 0.0) }, // bottom-left vertex
             { vec3( 1.0, 0.0,  1.0), vec3(0.0, 1.0, 0.0), vec2(1.0, 0.0) }, // bottom-right vertex
             { vec3( 1.0, 0.0, -1.0), vec3(0.0, 1.0, 0.0), vec2(1.0, 1.0) }, // top-right vertex
             { vec3(-1.0, 0.0, -1.0), vec3(0.0, 1.0, 0.0), vec2(0.0, 1.0) }, // top-left vertex
         };
 
-        const u32 indices[] = {
+        u32 indices[] = {
             0, 1, 2,
             0, 2, 3
         };
@@ -1111,11 +1722,15 @@ void InitEmbedded(Device& device, Embedded& embed)
         submesh.indexOffset = indexBuffer.head;
         submesh.vertexCount = ARRAY_COUNT(vertices);
         submesh.indexCount = ARRAY_COUNT(indices);
+        submesh.boundsMin = vec3(-1.0f, 0.0f, -1.0f);
+        submesh.boundsMax = vec3( 1.0f, 0.0f,  1.0f);
         submesh.vertexBufferLayout.stride = sizeof(VertexV3V3V2);
         submesh.vertexBufferLayout.attributes[0] = VertexBufferAttribute{0, 3, 0};
         submesh.vertexBufferLayout.attributes[1] = VertexBufferAttribute{1, 3, sizeof(vec3)};
         submesh.vertexBufferLayout.attributes[2] = VertexBufferAttribute{2, 2, 2*sizeof(vec3)};
         submesh.vertexBufferLayout.attributeCount = 3;
+        MeshOptimizer_Optimize((u8*)vertices, submesh.vertexCount, sizeof(VertexV3V3V2), indices, submesh.indexCount,
+                               submesh.sourceStats, submesh.optimizedStats);
 
         BufferPushData(vertexBuffer, vertices, sizeof(vertices));
         BufferPushData(indexBuffer, indices, sizeof(indices));
@@ -1173,11 +1788,15 @@ void InitEmbedded(Device& device, Embedded& embed)
         submesh.indexOffset = indexBuffer.head;
         submesh.indexCount = indexArena.head / sizeof(u32);
         submesh.vertexCount = vertexArena.head / sizeof(VertexV3V3V2);
+        submesh.boundsMin = vec3(-1.0f);
+        submesh.boundsMax = vec3( 1.0f);
         submesh.vertexBufferLayout.stride = sizeof(VertexV3V3V2);
         submesh.vertexBufferLayout.attributes[0] = VertexBufferAttribute{0, 3, 0};
         submesh.vertexBufferLayout.attributes[1] = VertexBufferAttribute{1, 3, sizeof(vec3)};
         submesh.vertexBufferLayout.attributes[2] = VertexBufferAttribute{2, 2, 2*sizeof(vec3)};
         submesh.vertexBufferLayout.attributeCount = 3;
+        MeshOptimizer_Optimize(vertexArena.data, submesh.vertexCount, sizeof(VertexV3V3V2), (u32*)indexArena.data, submesh.indexCount,
+                               submesh.sourceStats, submesh.optimizedStats);
 
         BufferPushData(vertexBuffer, vertexArena.data, vertexArena.head);
         BufferPushData(indexBuffer, indexArena.data, indexArena.head);
@@ -1187,11 +1806,11 @@ void InitEmbedded(Device& device, Embedded& embed)
     UnmapBuffer(indexBuffer);
 
     // Textures
-    embed.diceTexIdx = LoadTexture2D(device, "dice.png");
-    embed.whiteTexIdx = LoadTexture2D(device, "color_white.png");
-    embed.blackTexIdx = LoadTexture2D(device, "color_black.png");
-    embed.normalTexIdx = LoadTexture2D(device, "color_normal.png");
-    embed.magentaTexIdx = LoadTexture2D(device, "color_magenta.png");
+    embed.diceTexIdx = LoadTexture2D(device, "dice.png", TextureRole_Albedo);
+    embed.whiteTexIdx = LoadTexture2D(device, "color_white.png", TextureRole_Albedo);
+    embed.blackTexIdx = LoadTexture2D(device, "color_black.png", TextureRole_Albedo);
+    embed.normalTexIdx = LoadTexture2D(device, "color_normal.png", TextureRole_Normal);
+    embed.magentaTexIdx = LoadTexture2D(device, "color_magenta.png", TextureRole_Albedo);
 
     // Materials
     Material defaultMaterial = {};
@@ -1209,9 +1828,18 @@ void InitEmbedded(Device& device, Embedded& embed)
 
     // Textured geometry program
     embed.texturedGeometryProgramIdx = LoadProgram(device, CString("shaders.glsl"), CString("TEXTURED_GEOMETRY"));
-    Program& texturedGeometryProgram = device.programs[embed.texturedGeometryProgramIdx];
 #if USE_GFX_API_OPENGL
-    embed.texturedGeometryProgram_TextureLoc = glGetUniformLocation(texturedGeometryProgram.handle, "uTexture");
+    Program& texturedGeometryProgram = device.programs[embed.texturedGeometryProgramIdx];
+    embed.texturedGeometryProgram_TexCoordScaleLoc = glGetUniformLocation(texturedGeometryProgram.handle, "uTexCoordScale");
+
+    PipelineStateDesc texturedQuadDesc = {};
+    texturedQuadDesc.programIdx = embed.texturedGeometryProgramIdx;
+    texturedQuadDesc.samplers[texturedQuadDesc.samplerCount++] = { "uTexture", 0 };
+    embed.texturedQuadPipelineStateIdx = CreatePipelineState(device, texturedQuadDesc);
+
+    PipelineStateDesc blitDesc = texturedQuadDesc;
+    blitDesc.blendMode = BlendMode_Alpha;
+    embed.blitPipelineStateIdx = CreatePipelineState(device, blitDesc);
 #endif
 }
 
@@ -1233,12 +1861,27 @@ void InitDebugDraw(Device& device, DebugDraw& debugDraw)
                                            vertexBufferLayout,
                                            program.vertexInputLayout,
                                            program, 0, 0);
+
+#if USE_GFX_API_OPENGL
+    PipelineStateDesc opaqueDesc = {};
+    opaqueDesc.programIdx = debugDraw.opaqueProgramIdx;
+    opaqueDesc.depthTest = true;
+    opaqueDesc.depthWrite = true;
+    debugDraw.opaquePipelineStateIdx = CreatePipelineState(device, opaqueDesc);
+#endif
 }
 
-void InitScene(Device& device, Scene& scene, Embedded& embedded)
+#include "assets.cpp"
+
+void InitScene(Device& device, Assets& assets, Scene& scene, Embedded& embedded)
 {
-    // Models
+#if USE_GFX_API_VULKAN
+    // Assets are only streamed on OpenGL
     scene.patrickModelIdx = LoadModel(device, "Patrick/Patrick.obj");
+#else
+    // Models, drawn as a sphere until loaded
+    scene.patrickModelIdx = LoadModelAsync(assets, device, embedded, "Patrick/Patrick.obj");
+#endif
 
     // Camera
     Camera& camera = scene.mainCamera;
@@ -1270,92 +1913,166 @@ void InitScene(Device& device, Scene& scene, Embedded& embedded)
 
 #include "renderers.cpp"
 
+#include "render_graph.cpp"
+
+#include "benchmark.cpp"
+
+#include "snapshots.cpp"
+
+#if USE_GFX_API_VULKAN
+// Only the forward render path is ported to Vulkan: it draws to a color and a depth target in a
+// pass whose contents are recorded on the job threads, and the color target is presented
+void VulkanFrame_Init(App* app)
+{
+    Device& device = app->device;
+
+    app->renderTargetSize = app->displaySize;
+    app->vulkanColorTargetIdx = CreateRenderTarget(device, CString("Vulkan color"), RenderTargetType_Color, app->renderTargetSize);
+    app->vulkanDepthTargetIdx = CreateRenderTarget(device, CString("Vulkan depth"), RenderTargetType_Depth, app->renderTargetSize);
+
+    Attachment attachments[] = {
+        { Attachment_Color0, app->vulkanColorTargetIdx },
+        { Attachment_Depth,  app->vulkanDepthTargetIdx },
+    };
+    const u32 framebufferIdx = CreateFramebuffer(device, ARRAY_COUNT(attachments), attachments);
+
+    AttachmentAction attachmentActions[2] = {};
+    attachmentActions[0].attachmentIdx = 0;
+    attachmentActions[0].loadOp = LoadOp_Clear;
+    attachmentActions[0].storeOp = StoreOp_Store;
+    attachmentActions[0].clearValue.color = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    attachmentActions[1].attachmentIdx = 1;
+    attachmentActions[1].loadOp = LoadOp_Clear;
+    attachmentActions[1].storeOp = StoreOp_DontCare;
+    attachmentActions[1].clearValue.depth = 1.0f;
+    app->vulkanRenderPassIdx = CreateRenderPass(device, framebufferIdx, ARRAY_COUNT(attachmentActions), attachmentActions);
+}
+#endif
+
 void Init(App* app)
 {
+    CPU_PROFILE_FUNCTION();
+
     gApp = app;
 
     StrArena = CreateArena(MB(1));
 
+    app->renderScene = new RenderScene();
+    app->renderQueue = new RenderQueue();
+
     Device& device = app->device;
 
-    InitDevice(device);
+    Startup& startup = app->startup;
+    Startup_Begin(startup);
 
-    InitEmbedded(device, app->embedded);
+    {
+        STARTUP_SCOPE(startup, "Device");
+        InitDevice(device);
+#if USE_GFX_API_OPENGL
+        ProgramCache_Init(device);
+#endif
+    }
+
+    // Before the loader threads start
+    g_OptimizeMeshes = !device.disableMeshOptimization;
+
+#if USE_GFX_API_VULKAN
+    // ImGui_Gfx_Init fails right after and the platform layer exits
+    if (!device.internal)
+        return;
+#endif
 
 #if USE_GFX_API_METAL
+    InitEmbedded(device, app->embedded);
     return;
 #endif
 
-    InitDebugDraw(device, app->debugDraw);
+    app->jobs = Jobs_Create(0);
 
-    ForwardShading_Init(device, app->forwardRenderData);
+    startup.useCookedTextures = device.isCookedTextureSupported;
+    app->assets.useCookedTextures = device.isCookedTextureSupported;
 
-    DeferredShading_Init(device, app->deferredRenderData);
+    // Files are read and decoded on the job threads first...
+    for (u32 i = 0; i < ARRAY_COUNT(EmbeddedTextures); ++i)
+        Startup_DecodeImage(startup, EmbeddedTextures[i].filepath, EmbeddedTextures[i].role);
+    if (app->benchmark.config.isEnabled)
+        Startup_ImportModel(startup, Benchmark_GetModelFilepath(app->benchmark.config));
+    Startup_RunWorkers(startup, app->jobs);
 
-    InitScene(device, app->scene, app->embedded);
+    // ...then the GPU objects are created in order on the main thread
+    {
+        STARTUP_SCOPE(startup, "Embedded");
+        InitEmbedded(device, app->embedded);
+    }
 
-    app->globalParamsBlockSize = KB(1); // TODO: Get the size from the shader?
+#if USE_GFX_API_VULKAN
+    VulkanFrame_Init(app);
+#endif
 
-    // Render targets
-    app->albedoRenderTargetIdx = CreateRenderTarget(device, CString("Albedo"), RenderTargetType_Color, app->displaySize);
-    app->normalRenderTargetIdx = CreateRenderTarget(device, CString("Normal"), RenderTargetType_Color, app->displaySize);
-    app->positionRenderTargetIdx = CreateRenderTarget(device, CString("Position"), RenderTargetType_Floats, app->displaySize);
-    app->radianceRenderTargetIdx = CreateRenderTarget(device, CString("Radiance"), RenderTargetType_Color, app->displaySize);
-    app->depthRenderTargetIdx = CreateRenderTarget(device, CString("Depth"), RenderTargetType_Depth, app->displaySize);
+#if USE_GFX_API_OPENGL
+    CommandLists_Init(app->commandLists, app->jobs);
+#endif
+#if USE_GFX_API_SOFTWARE
+    app->softwareRenderer = Software_Create();
+#endif
 
-    // Framebuffers
     {
-        Attachment attachments[] = {
-            {Attachment_Color0, app->albedoRenderTargetIdx,  }, 
-            {Attachment_Color1, app->normalRenderTargetIdx,  }, 
-            {Attachment_Color2, app->positionRenderTargetIdx,}, 
-            {Attachment_Color3, app->radianceRenderTargetIdx,},
-            {Attachment_Depth,  app->depthRenderTargetIdx,   }, 
-        };
-        app->gbufferFramebufferIdx = CreateFramebuffer(device, ARRAY_COUNT(attachments), attachments);
+        STARTUP_SCOPE(startup, "Debug draw");
+        InitDebugDraw(device, app->debugDraw);
     }
     {
-        Attachment attachments[] = {
-            {Attachment_Color0, app->radianceRenderTargetIdx, },
-            {Attachment_Depth,  app->depthRenderTargetIdx,    },
-        };
-        app->forwardFramebufferIdx = CreateFramebuffer(device, ARRAY_COUNT(attachments), attachments);
+        STARTUP_SCOPE(startup, "Forward shading");
+        ForwardShading_Init(device, app->forwardRenderData);
     }
-
-    // Render passes
     {
-        AttachmentAction attachments[] = {
-            {0, LoadOp_Clear, StoreOp_Store},
-            {1, LoadOp_Clear, StoreOp_Store},
-            {2, LoadOp_Clear, StoreOp_Store},
-            {4, LoadOp_Clear, StoreOp_Store},
-        };
-        app->gbufferPassIdx = CreateRenderPass(device, app->gbufferFramebufferIdx, ARRAY_COUNT(attachments), attachments);
+        STARTUP_SCOPE(startup, "Deferred shading");
+        DeferredShading_Init(device, app->deferredRenderData);
     }
     {
-        AttachmentAction attachments[] = {
-            {3, LoadOp_Clear, StoreOp_Store},
-            {4, LoadOp_Load,  StoreOp_DontCare},
-        };
-        app->deferredShadingPassIdx = CreateRenderPass(device, app->gbufferFramebufferIdx, ARRAY_COUNT(attachments), attachments);
+        STARTUP_SCOPE(startup, "Visibility buffer");
+        VisibilityBuffer_Init(device, app->visibilityBufferRenderData);
     }
     {
-        AttachmentAction attachments[] = {
-            {0, LoadOp_Clear, StoreOp_Store},
-            {1, LoadOp_Clear,  StoreOp_DontCare},
-        };
-        app->forwardShadingPassIdx = CreateRenderPass(device, app->forwardFramebufferIdx, ARRAY_COUNT(attachments), attachments);
+        STARTUP_SCOPE(startup, "Shadow maps");
+        ShadowMaps_Init(device, app->shadowRenderData);
+    }
+    {
+        STARTUP_SCOPE(startup, "Scene");
+        if (app->benchmark.config.isEnabled)
+            Benchmark_InitScene(device, app->scene, app->embedded, app->benchmark);
+        else
+            InitScene(device, app->assets, app->scene, app->embedded);
     }
 
+#if USE_GFX_API_OPENGL
+    if (app->assets.isBlocking)
+    {
+        STARTUP_SCOPE(startup, "Scene assets");
+        Assets_Flush(app);
+    }
 
+    app->globalParamsBlockSize = GetUniformBlockSize(device, app->forwardRenderData.pipelineStateIdx, BINDING(0));
+    app->shadowParamsBlockSize = GetUniformBlockSize(device, app->forwardRenderData.pipelineStateIdx, BINDING(2));
+#elif USE_GFX_API_VULKAN
+    app->globalParamsBlockSize = GetUniformBlockSize(device, app->forwardRenderData.pipelineStateIdx, BINDING(0));
+#endif
 
     app->frameRenderGroup = RegisterRenderGroup(app, "Frame");
 
     ProfileEvent_Init(app);
 
+    if (app->isSimulationThreaded)
+        app->simulation = Simulation_Create(app->scene.mainCamera, app->displaySize, app->deltaTime);
+
+    ILOG("Programs: %u loaded in %.2f ms (binary cache: %u hits, %u misses)",
+         device.programCount, device.programLoadTimeNs / 1000000.0,
+         device.programCacheHitCount, device.programCacheMissCount);
+
     //app->renderPath = RenderPath_Test;
     app->renderPath = RenderPath_ForwardShading;
     //app->renderPath = RenderPath_DeferredShading;
+
+    Startup_End(startup);
 }
 
 void DebugDraw_Render(Device& device, Embedded& embedded, DebugDraw& debugDraw, BufferRange& globalParams)
@@ -1365,28 +2082,29 @@ void DebugDraw_Render(Device& device, Embedded& embedded, DebugDraw& debugDraw,
     {
         RENDER_GROUP("Debug draw - opaque lines", gApp->frameRenderGroup);
 
-        const Program& program = device.programs[debugDraw.opaqueProgramIdx];
-        glUseProgram(program.handle);
+        ApplyPipelineState(device, debugDraw.opaquePipelineStateIdx);
 
         glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), device.constantBuffers[globalParams.bufferIdx].handle, globalParams.offset, globalParams.size);
 
         glBindVertexArray(debugDraw.opaqueLineVao.handle);
+        STATS_INC(vaoBinds);
 
         glDrawArrays(GL_LINES, 0, debugDraw.opaqueLineCount * 2);
+        STATS_INC(drawCalls);
     }
 
     if (debugDraw.texQuadCount > 0)
     {
         RENDER_GROUP("Debug draw - textured quads", gApp->frameRenderGroup);
 
-        Program& program = device.programs[embedded.texturedGeometryProgramIdx];
-        glUseProgram(program.handle);
+        ApplyPipelineState(device, embedded.texturedQuadPipelineStateIdx);
 
+        Program& program = device.programs[embedded.texturedGeometryProgramIdx];
         GLuint vaoHandle = FindVAO(device, embedded.meshIdx, embedded.blitSubmeshIdx, program);
         glBindVertexArray(vaoHandle);
+        STATS_INC(vaoBinds);
 
-        glDisable(GL_DEPTH_TEST);
-        glDisable(GL_BLEND);
+        glUniform2f(embedded.texturedGeometryProgram_TexCoordScaleLoc, 1.0f, 1.0f);
 
         for (u32 i = 0; i < debugDraw.texQuadCount; ++i)
         {
@@ -1396,28 +2114,182 @@ void DebugDraw_Render(Device& device, Embedded& embedded, DebugDraw& debugDraw,
             glActiveTexture(GL_TEXTURE0);
             GLuint textureHandle = debugDraw.texQuadTextureHandles[i];
             glBindTexture(GL_TEXTURE_2D, textureHandle);
-            glUniform1i(embedded.texturedGeometryProgram_TextureLoc, 0);
+            STATS_INC(textureBinds);
 
             glDrawElements(GL_TRIANGLES, 3, GL_UNSIGNED_INT, 0);
+            Stats_CountDraw(3, 1);
         }
 
         glBindVertexArray(0);
-        glUseProgram(0);
     }
 #endif
 }
 
+// Hands the input sampled at inputTimeNs to the simulation. Pipelined runs take back the
+// packet of the previous frame to render, otherwise Update simulates this frame inline.
+void SubmitFrameInput(App* app, u64 inputTimeNs)
+{
+    FramePacket packet = {};
+    packet.input = app->input;
+    packet.displaySize = app->displaySize;
+    packet.deltaTime = app->deltaTime;
+    packet.inputTimeNs = inputTimeNs;
+    packet.renderPath = app->renderPath;
+
+    if (app->simulation)
+    {
+        Simulation_Submit(app->simulation, packet);
+        g_FrameStats.simulationWaitMs = Simulation_TakePacket(app->simulation, app->framePacket);
+    }
+    else
+    {
+        app->framePacket = packet;
+        app->framePacket.renderQueue = app->renderQueue;
+    }
+}
+
 void BeginFrame(App* app)
 {
 #if USE_GFX_API_METAL
     Metal_BeginFrame(app->device);
     return;
+#elif USE_GFX_API_VULKAN
+    app->frame++;
+    Vulkan_BeginFrame(app->device);
+    return;
 #endif
 
     app->frame++;
     app->frameMod = app->frame % MAX_GPU_FRAME_DELAY;
 
-    ProfileEvent_Insert(app, app->frameRenderGroup, ProfileEventType_FrameBegin);
+#if USE_GFX_API_OPENGL
+    // The GUI and the platform layer touch the context state between frames
+    InvalidatePipelineState(app->device);
+#endif
+
+    ProfileEvent_BeginFrame(app);
+}
+
+void FrameStats_WriteCsvHeader(FILE* file)
+{
+    fprintf(file, "frame,frameTimeMs,drawCalls,instances,triangles,programBinds,vaoBinds,textureBinds,"
+                  "bufferBytesMapped,bufferBytesWritten,renderPrimitives,entitiesProcessed,frameArenaBytes,stringArenaBytes,"
+                  "commandLists,commands,recordTimeMs,replayTimeMs,simulationTimeMs,simulationWaitMs,inputLatencyMs,"
+                  "rasterTriangles,rasterPixels,rasterTimeMs\n");
+}
+
+void FrameStats_WriteCsvRow(FILE* file, u32 frame, const FrameStats& stats)
+{
+    fprintf(file, "%u,%.3f,%u,%u,%llu,%u,%u,%u,%llu,%llu,%u,%u,%u,%u,%u,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%llu,%llu,%.3f\n",
+            frame, stats.frameTimeMs, stats.drawCalls, stats.instances, stats.triangles,
+            stats.programBinds, stats.vaoBinds, stats.textureBinds,
+            stats.bufferBytesMapped, stats.bufferBytesWritten,
+            stats.renderPrimitives, stats.entitiesProcessed,
+            stats.frameArenaBytes, stats.stringArenaBytes,
+            stats.commandLists, stats.commands, stats.recordTimeMs, stats.replayTimeMs,
+            stats.simulationTimeMs, stats.simulationWaitMs, stats.inputLatencyMs,
+            stats.rasterTriangles, stats.rasterPixels, stats.rasterTimeMs);
+}
+
+void GuiFrameStats(App* app)
+{
+    // Chronological copy of the frame time history, for the graph and the percentiles
+    const u32 historyCount = app->frameTimeHistoryCount;
+    f32 frameTimesMs[FRAME_STATS_HISTORY_FRAMES];
+    u64 sortedFrameTimesUs[FRAME_STATS_HISTORY_FRAMES];
+    for (u32 i = 0; i < historyCount; ++i)
+    {
+        const u32 historyIdx = (app->frameTimeHistoryHead + FRAME_STATS_HISTORY_FRAMES - historyCount + i) % FRAME_STATS_HISTORY_FRAMES;
+        frameTimesMs[i] = app->frameTimeHistoryMs[historyIdx];
+        sortedFrameTimesUs[i] = (u64)(frameTimesMs[i] * 1000.0f);
+    }
+
+    if (historyCount > 0)
+    {
+        QSort(sortedFrameTimesUs, sortedFrameTimesUs + historyCount - 1);
+        const f32 p50 = sortedFrameTimesUs[(historyCount - 1) * 50 / 100] / 1000.0f;
+        const f32 p95 = sortedFrameTimesUs[(historyCount - 1) * 95 / 100] / 1000.0f;
+        const f32 p99 = sortedFrameTimesUs[(historyCount - 1) * 99 / 100] / 1000.0f;
+
+        char overlay[128];
+        sprintf(overlay, "p50 %.2f  p95 %.2f  p99 %.2f (ms)", p50, p95, p99);
+        ImGui::PlotLines("Frame time", frameTimesMs, historyCount, 0, overlay, 0.0f, 2.0f * p99, ImVec2(0.0f, 60.0f));
+    }
+
+    const FrameStats& stats = app->frameStats;
+    ImGui::Text("Draw calls:          %u", stats.drawCalls);
+    ImGui::Text("Instances:           %u", stats.instances);
+    ImGui::Text("Triangles:           %llu", stats.triangles);
+    ImGui::Text("Program binds:       %u", stats.programBinds);
+    ImGui::Text("VAO binds:           %u", stats.vaoBinds);
+    ImGui::Text("Texture binds:       %u", stats.textureBinds);
+    ImGui::Text("Buffer KB mapped:    %.1f", stats.bufferBytesMapped / 1024.0f);
+    ImGui::Text("Buffer KB written:   %.1f", stats.bufferBytesWritten / 1024.0f);
+    ImGui::Text("Render primitives:   %u", stats.renderPrimitives);
+    ImGui::Text("Entities processed:  %u", stats.entitiesProcessed);
+    ImGui::Text("Frame arena KB:      %.1f", stats.frameArenaBytes / 1024.0f);
+    ImGui::Text("String arena KB:     %.1f", stats.stringArenaBytes / 1024.0f);
+    ImGui::Text("Command lists:       %u (%u commands)", stats.commandLists, stats.commands);
+    ImGui::Text("Record / replay ms:  %.3f / %.3f", stats.recordTimeMs, stats.replayTimeMs);
+    ImGui::Checkbox("Record on worker threads", &app->commandLists.useWorkerThreads);
+    ImGui::SameLine();
+    ImGui::Text("(%u threads)", Jobs_GetThreadCount(app->jobs));
+    ImGui::Text("Simulation / wait ms: %.3f / %.3f (%s)", stats.simulationTimeMs, stats.simulationWaitMs, app->simulation ? "threaded" : "inline");
+    ImGui::Text("Input latency ms:    %.2f", stats.inputLatencyMs);
+    if (app->framePacket.renderQueue)
+        ImGui::Text("Queued / culled:     %u / %u", app->framePacket.renderQueue->keyCount, app->framePacket.renderQueue->culledCount);
+#if USE_GFX_API_SOFTWARE
+    const f32 rasterSeconds = max(stats.rasterTimeMs, 0.001f) / 1000.0f;
+    ImGui::Text("Raster ms:           %.3f", stats.rasterTimeMs);
+    ImGui::Text("Raster Mtris/s:      %.2f", stats.rasterTriangles / rasterSeconds / 1000000.0f);
+    ImGui::Text("Raster Mpixels/s:    %.2f", stats.rasterPixels / rasterSeconds / 1000000.0f);
+#endif
+
+    if (!app->frameStatsCsvFile)
+    {
+        if (ImGui::Button("Start CSV export"))
+        {
+            app->frameStatsCsvFile = fopen("frame_stats.csv", "wb");
+            if (app->frameStatsCsvFile)
+                FrameStats_WriteCsvHeader(app->frameStatsCsvFile);
+            else
+                ELOG("Could not open frame_stats.csv for writing\n");
+        }
+    }
+    else
+    {
+        if (ImGui::Button("Stop CSV export"))
+        {
+            fclose(app->frameStatsCsvFile);
+            app->frameStatsCsvFile = NULL;
+        }
+        ImGui::SameLine();
+        ImGui::Text("Writing frame_stats.csv");
+    }
+}
+
+void GuiRenderGroupTimes(App* app, u32 renderGroupIdx, u32 depth)
+{
+    const RenderGroup& renderGroup = app->renderGroups[renderGroupIdx];
+
+    // Skip groups that did not run recently (e.g. other render paths)
+    if (renderGroup.timeHistoryCount == 0 || renderGroup.lastResolvedFrame + 2 * MAX_GPU_FRAME_DELAY < app->frame)
+        return;
+
+    char buf[128];
+    sprintf(buf, "%.03f / %.03f (ms)", renderGroup.averageTimeMs, renderGroup.maxTimeMs);
+    ImGui::Indent(depth * 8.0f + 1.0f);
+    ImGui::PushStyleVar(ImGuiStyleVar_ButtonTextAlign, ImVec2(1.0, 0.5));
+    ImGui::ProgressBar(renderGroup.averageTimeMs/16.0f, ImVec2(0.0f, 0.0f), buf);
+    ImGui::PopStyleVar();
+    ImGui::SameLine();
+    ImGui::Text("%s", renderGroup.name);
+    ImGui::Unindent(depth * 8.0f + 1.0f);
+
+    for (u32 i = 0; i < renderGroup.childrenCount; ++i)
+    {
+        GuiRenderGroupTimes(app, renderGroup.children[i], depth + 1);
+    }
 }
 
 void Gui(App* app)
@@ -1429,6 +2301,13 @@ void Gui(App* app)
     ImGui::Text("FPS: ---");
     ImGui::End();
     return;
+#elif USE_GFX_API_VULKAN
+    ImGui::Begin("Info");
+    ImGui::Text("Device name: %s", app->device.name);
+    ImGui::Text("API version: %s", app->device.glVersionString);
+    ImGui::Text("Frame time: %.2f ms", app->frameStats.frameTimeMs);
+    ImGui::End();
+    return;
 #endif
 
     DebugDraw_Clear(app->debugDraw);
@@ -1438,8 +2317,26 @@ void Gui(App* app)
     ImGui::Begin("Info");
     ImGui::Text("Device name: %s", device.name);
     ImGui::Text("OGL Version: %s", device.glVersionString);
+    ImGui::Text("Programs loaded in %.2f ms (cache %s: %u hits, %u misses), %u reloads",
+                device.programLoadTimeNs / 1000000.0, device.isProgramCacheEnabled ? "on" : "off",
+                device.programCacheHitCount, device.programCacheMissCount, device.programReloadCount);
     ImGui::Text("FPS: %f", 1.0f/app->deltaTime);
 
+    if (ImGui::CollapsingHeader("Frame stats"))
+    {
+        GuiFrameStats(app);
+    }
+
+    if (ImGui::CollapsingHeader("Startup"))
+    {
+        Startup_Gui(app);
+    }
+
+    if (ImGui::CollapsingHeader("Meshes"))
+    {
+        MeshOptimizer_Gui(app);
+    }
+
     ImGui::Separator();
     
     ImGui::Text("Camera");
@@ -1451,135 +2348,47 @@ void Gui(App* app)
 
     ImGui::Checkbox("Back-face culling", &g_CullFace);
 
-    if (ImGui::Button("Take snapshot"))
-    {
-        app->takeSnapshot = true;
-    }
+    ImGui::Text("Shadows");
+    ShadowRenderData& shadowData = app->shadowRenderData;
+    ImGui::SliderFloat("Shadow distance", &shadowData.shadowDistance, 10.0f, 500.0f);
+    ImGui::SliderFloat("Split lambda", &shadowData.splitLambda, 0.0f, 1.0f);
+    ImGui::Checkbox("Cache far cascades", &shadowData.cacheFarCascades);
+    ImGui::Text("Cascades rendered: %u/%u", shadowData.renderedCascadeCount, SHADOW_CASCADE_COUNT);
+    ImGui::Text("Casters: %u (culled %u, dynamic %u)", shadowData.casterCount, shadowData.culledCasterCount, shadowData.dynamicCasterCount);
 
     ImGui::Separator();
 
-//    for (u32 renderGroupIdx = 0; renderGroupIdx < app->renderGroupCount; ++renderGroupIdx)
-//    {
-//        f32 timeMs = 0.0f;
-//        if (app->frame >= MAX_GPU_FRAME_DELAY )
-//        {
-////#if defined(TIMESTAMP_QUERIES)
-//            const GLuint beginTimerQuery = app->timerQueries[ GetTimerQueryIndex(app->frameMod, renderGroupIdx, 0) ];
-//            const GLuint endTimerQuery   = app->timerQueries[ GetTimerQueryIndex(app->frameMod, renderGroupIdx, 1) ];
-//            GLint endTimerQueryAvailable = 0;
-//            while (!endTimerQueryAvailable)
-//                glGetQueryObjectiv(endTimerQuery, GL_QUERY_RESULT_AVAILABLE, &endTimerQueryAvailable);
-//            GLuint64 beginTimeNs;
-//            GLuint64 endTimeNs;
-//            glGetQueryObjectui64v(beginTimerQuery, GL_QUERY_RESULT, &beginTimeNs);
-//            glGetQueryObjectui64v(endTimerQuery,   GL_QUERY_RESULT, &endTimeNs);
-//            timeMs = (endTimeNs - beginTimeNs) / 1000000.0f;
-////#else
-////            if (renderGroupIdx == 0 ) continue;
-////            const GLuint timeElapsedQuery = app->timerQueries[ GetTimerQueryIndex(app->frameMod, renderGroupIdx, 0) ];
-////            // Wait for all results to become available
-////            GLint available = 0;
-////            while (!available) glGetQueryObjectiv(timeElapsedQuery, GL_QUERY_RESULT_AVAILABLE, &available);
-////            GLuint64 timeElapsedNs;
-////            glGetQueryObjectui64v(timeElapsedQuery, GL_QUERY_RESULT, &timeElapsedNs);
-////            timeMs = timeElapsedNs / 1000000.0f;
-////#endif
-//        }
-//        char buf[128];
-//        sprintf(buf, "%.03f (ms)", timeMs);
-//        ImGui::PushStyleVar(ImGuiStyleVar_ButtonTextAlign, ImVec2(1.0, 0.5));
-//        ImGui::ProgressBar(timeMs/16.0f, ImVec2(0.0f, 0.0f), buf);
-//        ImGui::PopStyleVar();
-//        ImGui::SameLine();
-//        ImGui::Text("%s", app->renderGroups[renderGroupIdx].name);
-//    }
-
-#if USE_GFX_API_OPENGL
-    if (app->frame >= MAX_GPU_FRAME_DELAY)
-    {
-        ASSERT(app->profileEventCount > 0, "No profile events... not event BeginFrame?");
-        ASSERT(app->profileEventTypes[app->profileEventBegin] == ProfileEventType_FrameBegin, "First profile event should be FrameBegin...");
-
-        // We start right after the first profile event at BeginFrame
-        u32 profileGroupCount = 1;
-        u32 openProfileGroupCount = 1;
-        u32 openProfileGroupStack[8] = {};
-        openProfileGroupStack[0] = app->profileEventBegin;
-        app->profileEventBegin = (app->profileEventBegin + 1) % MAX_PROFILE_EVENTS;
-        app->profileEventCount--;
+    Snapshots_Gui(app);
 
-        float renderGroupTimes[MAX_RENDER_GROUPS] = {};
-
-        while (openProfileGroupCount > 0)
-        {
-            ASSERT(app->profileEventCount > 0, "No more profile events... maybe there was a mismatch (more Begin than End)");
-
-            if (app->profileEventTypes[app->profileEventBegin] == ProfileEventType_GroupBegin)
-            {
-                ASSERT(openProfileGroupCount < ARRAY_COUNT(openProfileGroupStack), "Too many levels of profile groups");
-                openProfileGroupStack[openProfileGroupCount] = app->profileEventBegin;
-                profileGroupCount++;
-                openProfileGroupCount++;
-            }
-            else if (app->profileEventTypes[app->profileEventBegin] == ProfileEventType_GroupEnd ||
-                     app->profileEventTypes[app->profileEventBegin] == ProfileEventType_FrameEnd )
-            {
-                openProfileGroupCount--;
-
-#if TIMESTAMP_QUERIES
-                const u32 beginTimerQueryIdx = openProfileGroupStack[openProfileGroupCount];
-                const u32 endTimerQueryIdx = app->profileEventBegin;
-
-                const GLuint beginTimerQuery = app->profileEventQueries[ beginTimerQueryIdx ];
-                const GLuint endTimerQuery   = app->profileEventQueries[ endTimerQueryIdx ];
-                GLint endTimerQueryAvailable = 0;
-                while (!endTimerQueryAvailable)
-                    glGetQueryObjectiv(endTimerQuery, GL_QUERY_RESULT_AVAILABLE, &endTimerQueryAvailable);
-                GLuint64 beginTimeNs;
-                GLuint64 endTimeNs;
-                glGetQueryObjectui64v(beginTimerQuery, GL_QUERY_RESULT, &beginTimeNs);
-                glGetQueryObjectui64v(endTimerQuery,   GL_QUERY_RESULT, &endTimeNs);
-                const float timeMs = (endTimeNs - beginTimeNs) / 1000000.0f;
-#else
-                // TODO
-                const float timeMs = 0.0f;
-#endif
+    ImGui::Separator();
 
-                const u32 renderGroupIdx = app->profileEventGroup[ app->profileEventBegin ];
-                renderGroupTimes[renderGroupIdx] += timeMs;
-            }
-            else
-            {
-                INVALID_CODE_PATH("Unsupported ProfileEventType");
-            }
+    Assets_Gui(app);
 
-            app->profileEventBegin = (app->profileEventBegin + 1) % MAX_PROFILE_EVENTS;
-            app->profileEventCount--;
-        }
+    ImGui::Separator();
 
-        for (u32 renderGroupIdx = 0; renderGroupIdx < app->renderGroupCount; ++renderGroupIdx)
+#if USE_GFX_API_OPENGL
+    ImGui::Text("GPU times (avg/max over %u frames)", GPU_PROFILE_HISTORY_FRAMES);
+    for (u32 renderGroupIdx = 0; renderGroupIdx < app->renderGroupCount; ++renderGroupIdx)
+    {
+        if (app->renderGroups[renderGroupIdx].parent == 0xffffffff)
         {
-            char buf[128];
-            const float timeMs = renderGroupTimes[renderGroupIdx];
-            sprintf(buf, "%.03f (ms)", timeMs);
-            ImGui::PushStyleVar(ImGuiStyleVar_ButtonTextAlign, ImVec2(1.0, 0.5));
-            ImGui::ProgressBar(timeMs/16.0f, ImVec2(0.0f, 0.0f), buf);
-            ImGui::PopStyleVar();
-            ImGui::SameLine();
-            ImGui::Text("%s", app->renderGroups[renderGroupIdx].name);
+            GuiRenderGroupTimes(app, renderGroupIdx, 0);
         }
     }
+    ImGui::Text("Dropped GPU frames: %u", app->gpuProfileDroppedFrames);
 #endif
 
     ImGui::Separator();
 
-    const char* renderPathNames[] = { "Test", "Forward", "Deferred"};
+    const char* renderPathNames[] = { "Test", "Forward", "Deferred", "Visibility buffer"};
     CASSERT(ARRAY_COUNT(renderPathNames) == RenderPath_Count, "Number of render paths do not match");
     const char* currentItem = renderPathNames[app->renderPath];
     if (ImGui::BeginCombo("Render path", currentItem))
     {
         for (u32 renderPathIdx = 0; renderPathIdx < ARRAY_COUNT(renderPathNames); ++renderPathIdx)
         {
+            if (!IsRenderPathSupported((RenderPath)renderPathIdx))
+                continue;
             bool isSelected = app->renderPath == renderPathIdx;
             if (ImGui::Selectable(renderPathNames[renderPathIdx], isSelected))
                 app->renderPath = (RenderPath)renderPathIdx;
@@ -1602,6 +2411,15 @@ void Gui(App* app)
 
     if (ImGui::CollapsingHeader("Textures"))
     {
+        u64 memorySize = 0;
+        u32 cookedCount = 0;
+        for (u32 i = 1; i < app->device.textureCount; ++i)
+        {
+            memorySize += app->device.textures[i].memorySize;
+            cookedCount += app->device.textures[i].isCooked;
+        }
+        ImGui::Text("Memory: %.2f MB, %u of %u textures cooked", (f32)memorySize / (f32)MB(1), cookedCount, app->device.textureCount - 1);
+
         for (u32 i = 1; i < app->device.textureCount; ++i)
         {
             const Texture& texture = app->device.textures[i];
@@ -1626,11 +2444,27 @@ void Gui(App* app)
         }
     }
 
+    if (ImGui::CollapsingHeader("Render graph"))
+    {
+        const RenderGraph& graph = app->renderGraph;
+        for (u32 i = 0; i < graph.passCount; ++i)
+        {
+            const RenderGraphPass& pass = graph.passes[i];
+            ImGui::Text("%s%s", pass.name.str, pass.isCulled ? " (culled)" : "");
+        }
+        ImGui::Text("Virtual targets:  %.2f MB", (f32)graph.virtualBytes / (f32)MB(1));
+        ImGui::Text("Physical targets: %.2f MB", (f32)graph.physicalBytes / (f32)MB(1));
+        ImGui::Text("Aliased targets:  %.2f MB", (f32)graph.aliasedBytes / (f32)MB(1));
+        ImGui::Text("Target size: %dx%d (display %dx%d)", app->renderTargetSize.x, app->renderTargetSize.y, app->displaySize.x, app->displaySize.y);
+    }
+
     if (ImGui::CollapsingHeader("Render targets"))
     {
         for (u32 i = 1; i < device.renderTargetCount; ++i)
         {
             const RenderTarget& renderTarget = app->device.renderTargets[i];
+            if (!renderTarget.handle)
+                continue;
 
             bool showInDebugDraw = false;
             for (u32 i = 0; i < visibleTextureCount && !showInDebugDraw; ++i)
@@ -1668,101 +2502,122 @@ void Resize(App* app)
     return;
 #endif
 
-    Device& device = app->device;
+    // Render targets are not reallocated here, see UpdateRenderTargetSize
+    app->stableDisplaySizeFrames = 0;
+}
+
+ivec2 RoundUpToRenderTargetBucket(ivec2 size)
+{
+    const i32 bucket = RENDER_TARGET_SIZE_BUCKET;
+    return ivec2( ((max(size.x, 1) + bucket - 1) / bucket) * bucket,
+                  ((max(size.y, 1) + bucket - 1) / bucket) * bucket );
+}
 
-    // Resize render targets
-    for (u32 i = 1; i < device.renderTargetCount; ++i)
+void UpdateRenderTargetSize(App* app)
+{
+    if (app->displaySize != app->lastDisplaySize)
+    {
+        app->lastDisplaySize = app->displaySize;
+        app->stableDisplaySizeFrames = 0;
+    }
+    else
     {
-        RenderTarget& renderTarget = device.renderTargets[i];
-        DestroyRenderTargetRaw(renderTarget);
-        renderTarget = CreateRenderTargetRaw(renderTarget.name, app->displaySize, renderTarget.type);
+        app->stableDisplaySizeFrames++;
     }
 
-    // Recreate framebuffers
-    for (u32 i = 1; i < device.framebufferCount; ++i)
+    const ivec2 bucketSize = RoundUpToRenderTargetBucket(app->displaySize);
+    const bool isOutgrown = app->displaySize.x > app->renderTargetSize.x || app->displaySize.y > app->renderTargetSize.y;
+    const bool isOversized = bucketSize != app->renderTargetSize && app->stableDisplaySizeFrames >= RENDER_TARGET_SHRINK_DELAY_FRAMES;
+
+    if (isOutgrown || isOversized)
     {
-        Framebuffer& framebuffer = device.framebuffers[i];
-        DestroyFramebufferRaw(framebuffer);
-        framebuffer = CreateFramebufferRaw(device, framebuffer.attachmentCount, framebuffer.attachments);
+        app->renderTargetSize = bucketSize;
+        app->renderGraph.isCompiled = false;
     }
 }
 
+// Render paths the graphics API can draw, the rest are hidden from the GUI and the benchmark
+bool IsRenderPathSupported(RenderPath renderPath)
+{
+#if USE_GFX_API_VULKAN
+    // Only forward shading is ported to Vulkan
+    return renderPath == RenderPath_ForwardShading;
+#endif
+    return true;
+}
+
+// Render paths that sample the shadow maps, the rest skip updating and rendering them
+bool RenderPathUsesShadows(RenderPath renderPath)
+{
+#if USE_GFX_API_VULKAN
+    // Shadow maps are not ported to Vulkan
+    return false;
+#endif
+    return renderPath == RenderPath_ForwardShading || renderPath == RenderPath_VisibilityBuffer;
+}
+
 void Update(App* app)
 {
+    CPU_PROFILE_FUNCTION();
+
 #if USE_GFX_API_METAL
     return;
 #endif
 
+#if USE_CPU_PROFILER
+    // Key states already went from PRESS to PRESSED at this point, detect the edge here
+    static bool wasCaptureKeyPressed = false;
+    const bool isCaptureKeyPressed = app->input.keys[K_T] == BUTTON_PRESSED;
+    if (isCaptureKeyPressed && !wasCaptureKeyPressed)
+        CpuProfile_RequestCapture(CPU_PROFILE_DEFAULT_CAPTURE_FRAMES, "trace.json");
+    wasCaptureKeyPressed = isCaptureKeyPressed;
+#endif
+
     if (app->input.mouseButtons[LEFT] == BUTTON_PRESS)
         ILOG("Mouse button left pressed");
 
     if (app->input.mouseButtons[LEFT] == BUTTON_RELEASE)
         ILOG("Mouse button left released");
 
-    for (u64 i = 0; i < app->device.programCount; ++i)
-    {
-        Program& program = app->device.programs[i];
-        u64 currentTimestamp = GetFileLastWriteTimestamp(program.filepath.str);
-        if (currentTimestamp > program.lastWriteTimestamp)
-        {
-            String programSource = ReadTextFile(program.filepath.str);
-            const char* programName = program.programName.str;
 #if USE_GFX_API_OPENGL
-            glDeleteProgram(program.handle);
-            program.handle = CreateProgramFromSource(programSource, app->device.glslVersion, programName);
-            program.vertexInputLayout = ExtractVertexShaderLayoutFromProgram(program.handle);
+    UpdateProgramHotReload(app->device);
+
+    Assets_Update(app);
 #endif
-            program.lastWriteTimestamp = currentTimestamp;
-        }
+
+    Benchmark_Update(app);
+
+    // Render scene the simulation culls and sorts into the render queue
+    bool hasNewRenderScene = RenderScene_Update(app->device, app->scene, app->embedded, app->renderPath, app->visibilityBufferRenderData, *app->renderScene);
+    if (app->renderPath == RenderPath_VisibilityBuffer && !app->visibilityBufferRenderData.isSceneSupported)
+    {
+        // More instances, triangles in a submesh or albedo textures than the encoding holds
+        ILOG("The scene does not fit the visibility buffer encoding, falling back to forward shading");
+        app->renderPath = RenderPath_ForwardShading;
+        hasNewRenderScene = RenderScene_Update(app->device, app->scene, app->embedded, app->renderPath, app->visibilityBufferRenderData, *app->renderScene);
     }
+    if (hasNewRenderScene && app->simulation)
+        Simulation_SetScene(app->simulation, *app->renderScene);
 
     // Update camera
     Camera& camera = app->scene.mainCamera;
-
-    const float rotationSpeed = 0.1f * PI;
-    if (app->input.mouseButtons[RIGHT] == BUTTON_PRESSED)
+    if (app->simulation)
     {
-        camera.yaw += app->input.mouseDelta.x * rotationSpeed * app->deltaTime;
-        camera.pitch -= app->input.mouseDelta.y * rotationSpeed * app->deltaTime;
+        // Snapshot simulated on the simulation thread while the previous frame was rendering
+        camera = app->framePacket.camera;
     }
-    camera.yaw = mod(camera.yaw, TAU);
-    camera.pitch = clamp(camera.pitch, -PI/2.1f, PI/2.1f);
-    camera.forward = vec3(cosf(camera.pitch)*sinf(camera.yaw),
-                               sinf(camera.pitch),
-                               -cosf(camera.pitch)*cosf(camera.yaw));
-    camera.right = vec3(cosf(camera.yaw), 0.0f, sinf(camera.yaw));
-    vec3 upVector = vec3(0.0f, 1.0f, 0.0f);
-
-    vec3 newDirection = vec3(0.0);
-    if (app->input.keys[K_W] == BUTTON_PRESSED) { newDirection += camera.forward; }
-    if (app->input.keys[K_S] == BUTTON_PRESSED) { newDirection -= camera.forward; }
-    if (app->input.keys[K_D] == BUTTON_PRESSED) { newDirection += camera.right;   }
-    if (app->input.keys[K_A] == BUTTON_PRESSED) { newDirection -= camera.right;   }
-
-    const float newdirMagnitude = length(newDirection);
-    newDirection = (newdirMagnitude > 0.0f) ? newDirection / newdirMagnitude : vec3(0.0f);
-
-    float speedMagnitude = length(camera.speed);
-    vec3 speedDirection = (speedMagnitude > 0.0f) ? camera.speed / speedMagnitude : vec3(0.0f);
-
-    const float MAX_SPEED = 100.0f;
-    if (newdirMagnitude > 0.0f) {
-        speedDirection = 0.5f * (speedDirection + newDirection);
-        speedMagnitude = min(speedMagnitude + 1.0f, MAX_SPEED);
-    } else {
-        speedMagnitude *= 0.8f;
-        if (speedMagnitude < 0.01f)
-            speedMagnitude = 0.0f;
+    else
+    {
+        Simulation_Step(camera, *app->renderScene, app->framePacket);
     }
 
-    camera.speed = speedMagnitude * speedDirection;
+    // The simulation built the queue from an older snapshot or for another render path, which
+    // only happens on the frames the scene or the render path change
+    RenderQueue& renderQueue = *app->framePacket.renderQueue;
+    if (renderQueue.sceneVersion != app->renderScene->version || renderQueue.renderPath != app->renderPath)
+        RenderQueue_Build(*app->renderScene, camera, app->renderPath, renderQueue);
 
-    camera.position += camera.speed * app->deltaTime;
-
-    float aspectRatio = (float)app->displaySize.x/(float)app->displaySize.y;
-    camera.viewMatrix = lookAt(camera.position, camera.position + camera.forward, upVector);
-    camera.projectionMatrix = perspective(radians(60.0f), aspectRatio, 0.1f, 1000.0f);
-    camera.viewProjectionMatrix = camera.projectionMatrix * camera.viewMatrix;
+    const float aspectRatio = (float)app->displaySize.x/(float)app->displaySize.y;
 
     // Upload uniforms to buffer
 
@@ -1774,33 +2629,59 @@ void Update(App* app)
     app->globalParamsBufferIdx = app->device.currentConstantBufferIdx;
     app->globalParamsOffset = constantBuffer.head;
 
-    BufferPushMat4(constantBuffer, camera.viewProjectionMatrix);
-    BufferPushVec3(constantBuffer, camera.position);
+    // Lights past SHADER_MAX_LIGHTS are not shaded
+    GlobalParams globalParams = {};
+    globalParams.viewProjectionMatrix = camera.viewProjectionMatrix;
+    globalParams.cameraPosition = camera.position;
+    globalParams.lightCount = min(app->scene.lightCount, (u32)SHADER_MAX_LIGHTS);
+    for (u32 i = 0; i < globalParams.lightCount; ++i)
+    {
+        const Light& light = app->scene.lights[i];
+        globalParams.lights[i].type = light.type;
+        globalParams.lights[i].color = light.color;
+        globalParams.lights[i].direction = light.direction;
+        globalParams.lights[i].position = light.position;
+    }
+    PushAlignedData(constantBuffer, &globalParams, offsetof(GlobalParams, lights) + globalParams.lightCount * sizeof(LightParams), sizeof(vec4));
 
-    BufferPushUInt(constantBuffer, app->scene.lightCount);
+    app->globalParamsSize = constantBuffer.head - app->globalParamsOffset;
 
-    for (u32 i = 0; i < app->scene.lightCount; ++i)
+    // -- Shadow params
+    if (RenderPathUsesShadows(app->renderPath))
     {
-        AlignHead(constantBuffer, sizeof(vec4));
+        ShadowMaps_Update(app->device, app->scene, aspectRatio, app->shadowRenderData);
 
-        Light& light = app->scene.lights[i];
-        BufferPushUInt(constantBuffer, light.type);
-        BufferPushVec3(constantBuffer, light.color);
-        BufferPushVec3(constantBuffer, light.direction);
-        BufferPushVec3(constantBuffer, light.position);
-    }
+        Buffer& shadowConstantBuffer = GetMappedConstantBufferForRange( app->device, app->shadowParamsBlockSize );
+        app->shadowParamsBufferIdx = app->device.currentConstantBufferIdx;
+        app->shadowParamsOffset = shadowConstantBuffer.head;
 
-    app->globalParamsSize = constantBuffer.head - app->globalParamsOffset;
+        const ShadowRenderData& shadowData = app->shadowRenderData;
+        ShadowParams shadowParams = {};
+        for (u32 i = 0; i < SHADOW_CASCADE_COUNT; ++i)
+        {
+            shadowParams.viewProjectionMatrices[i] = shadowData.cascades[i].viewProjectionMatrix;
+            shadowParams.cascadeSplits[i] = shadowData.cascades[i].splitFar;
+            shadowParams.cascadeTexelSizes[i] = shadowData.cascades[i].texelSize;
+        }
+        shadowParams.cameraForward = camera.forward;
+        shadowParams.lightIdx = shadowData.lightIdx;
+        PushAlignedData(shadowConstantBuffer, &shadowParams, sizeof(shadowParams), sizeof(vec4));
+
+        app->shadowParamsSize = shadowConstantBuffer.head - app->shadowParamsOffset;
+    }
 
     switch (app->renderPath)
     {
         case RenderPath_Test:
             break;
         case RenderPath_ForwardShading:
-            ForwardShading_Update(app->device, app->scene, app->embedded, app->forwardRenderData);
+            ForwardShading_Update(app->device, app->scene, renderQueue, app->embedded, app->forwardRenderData);
             break;
         case RenderPath_DeferredShading:
-            DeferredShading_Update(app->device, app->scene, app->embedded, app->deferredRenderData);
+            DeferredShading_Update(app->device, app->scene, renderQueue, app->embedded, app->deferredRenderData);
+            break;
+        case RenderPath_VisibilityBuffer:
+            VisibilityBuffer_Update(app->device, app->scene, renderQueue, app->embedded, app->visibilityBufferRenderData);
             break;
         default:
             ASSERT(0, "Invalid code path");
@@ -1822,132 +2703,431 @@ void Update(App* app)
 }
 
 #if USE_GFX_API_OPENGL
-void BlitTexture(Device& device, const Embedded& embedded, ivec4 viewportRect, GLuint textureHandle)
+void BlitTexture(Device& device, const Embedded& embedded, ivec4 viewportRect, GLuint textureHandle, vec2 texCoordScale = vec2(1.0f))
 {
     glViewport(viewportRect.x, viewportRect.y, viewportRect.z, viewportRect.w);
 
-    Program& program = device.programs[embedded.texturedGeometryProgramIdx];
-    glUseProgram(program.handle);
+    ApplyPipelineState(device, embedded.blitPipelineStateIdx);
 
+    Program& program = device.programs[embedded.texturedGeometryProgramIdx];
     GLuint vaoHandle = FindVAO(device, embedded.meshIdx, embedded.blitSubmeshIdx, program);
     glBindVertexArray(vaoHandle);
+    STATS_INC(vaoBinds);
 
-    glDisable(GL_DEPTH_TEST);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-    glUniform1i(embedded.texturedGeometryProgram_TextureLoc, 0);
+    glUniform2f(embedded.texturedGeometryProgram_TexCoordScaleLoc, texCoordScale.x, texCoordScale.y);
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, textureHandle);
+    STATS_INC(textureBinds);
 
     glDrawElements(GL_TRIANGLES, 3, GL_UNSIGNED_INT, 0);
+    Stats_CountDraw(3, 1);
 
     glBindVertexArray(0);
-    glUseProgram(0);
 }
 #endif
 #if USE_GFX_API_METAL
-void BlitTexture(Device& device, const Embedded& embedded, ivec4 viewportRect, u32 textureHandle)
+void BlitTexture(Device& device, const Embedded& embedded, ivec4 viewportRect, u32 textureHandle, vec2 texCoordScale = vec2(1.0f))
 {
 }
 #endif
 
-void Render(App* app)
+//
+// Render graph passes
+//
+
+BufferRange GetGlobalParamsRange(const App* app)
 {
-#if USE_GFX_API_METAL
-    Metal_Render(app->device);
-    return;
+    BufferRange globalParamsRange = {
+        app->globalParamsBufferIdx,
+        app->globalParamsOffset,
+        app->globalParamsSize
+    };
+    return globalParamsRange;
+}
+
+void ForwardShadingPass(App* app, const RenderGraph& graph, const RenderGraphPass& pass)
+{
+#if USE_GFX_API_OPENGL
+    RENDER_GROUP("Forward render", gApp->frameRenderGroup);
+
+    glViewport(0.0f, 0.0f, app->displaySize.x, app->displaySize.y);
+
+    BufferRange globalParamsRange = GetGlobalParamsRange(app);
+
+    ForwardShading_Render(app->device, app->commandLists, app->forwardRenderData);
+
+    DebugDraw_Render(app->device, app->embedded, app->debugDraw, globalParamsRange);
+
+    glBindVertexArray(0);
 #endif
+}
 
+void GBufferPass(App* app, const RenderGraph& graph, const RenderGraphPass& pass)
+{
 #if USE_GFX_API_OPENGL
-    Device& device = app->device;
+    RENDER_GROUP("Deferred render - G-Buffer", gApp->frameRenderGroup);
+
+    glViewport(0.0f, 0.0f, app->displaySize.x, app->displaySize.y);
+
+    DeferredShading_RenderOpaques(app->device, app->commandLists, app->deferredRenderData);
+
+    glBindVertexArray(0);
+#endif
+}
+
+void DeferredShadingPass(App* app, const RenderGraph& graph, const RenderGraphPass& pass)
+{
+#if USE_GFX_API_OPENGL
+    RENDER_GROUP("Deferred render - Lighting", gApp->frameRenderGroup);
+
+    glViewport(0.0f, 0.0f, app->displaySize.x, app->displaySize.y);
+
+    BufferRange globalParamsRange = GetGlobalParamsRange(app);
+
+    const GLuint gbufferTextureHandles[] = {
+        RenderGraph_GetTextureHandle(app->device, graph, pass.reads[0]),
+        RenderGraph_GetTextureHandle(app->device, graph, pass.reads[1]),
+        RenderGraph_GetTextureHandle(app->device, graph, pass.reads[2]),
+    };
+    DeferredShading_RenderLights(app->device, app->embedded, app->deferredRenderData, globalParamsRange, gbufferTextureHandles);
+
+    DebugDraw_Render(app->device, app->embedded, app->debugDraw, globalParamsRange);
+
+    glBindVertexArray(0);
+#endif
+}
+
+void VisibilityPass(App* app, const RenderGraph& graph, const RenderGraphPass& pass)
+{
+#if USE_GFX_API_OPENGL
+    RENDER_GROUP("Visibility buffer render - Visibility", gApp->frameRenderGroup);
+
+    glViewport(0.0f, 0.0f, app->displaySize.x, app->displaySize.y);
+
+    VisibilityBuffer_RenderVisibility(app->device, app->commandLists, app->visibilityBufferRenderData);
+#endif
+}
+
+void VisibilityResolvePass(App* app, const RenderGraph& graph, const RenderGraphPass& pass)
+{
+#if USE_GFX_API_OPENGL
+    RENDER_GROUP("Visibility buffer render - Resolve", gApp->frameRenderGroup);
+
+    BufferRange globalParamsRange = GetGlobalParamsRange(app);
+
+    const GLuint visibilityTextureHandle = RenderGraph_GetTextureHandle(app->device, graph, pass.reads[0]);
+    VisibilityBuffer_Resolve(app->device, app->embedded, app->visibilityBufferRenderData, globalParamsRange, visibilityTextureHandle, app->displaySize);
+
+    DebugDraw_Render(app->device, app->embedded, app->debugDraw, globalParamsRange);
+
+    glBindVertexArray(0);
+#endif
+}
+
+void CopyPass(App* app, const RenderGraph& graph, const RenderGraphPass& pass)
+{
+#if USE_GFX_API_OPENGL
+    const GLuint textureHandle = RenderGraph_GetTextureHandle(app->device, graph, pass.reads[0]);
+    ivec4 viewportRect(0, 0, app->renderTargetSize.x, app->renderTargetSize.y);
+    BlitTexture(app->device, app->embedded, viewportRect, textureHandle);
+#endif
+}
+
+void BlitToBackbufferPass(App* app, const RenderGraph& graph, const RenderGraphPass& pass)
+{
+#if USE_GFX_API_OPENGL
+    // Only the displaySize corner of the (bucket sized) render target is valid
+    const GLuint textureHandle = RenderGraph_GetTextureHandle(app->device, graph, pass.reads[0]);
+    const vec2 texCoordScale = vec2(app->displaySize) / vec2(app->renderTargetSize);
+    ivec4 viewportRect(0, 0, app->displaySize.x, app->displaySize.y);
+    BlitTexture(app->device, app->embedded, viewportRect, textureHandle, texCoordScale);
+#endif
+}
+
+void BuildRenderGraph(App* app)
+{
+    CPU_PROFILE_FUNCTION();
+
+    RenderGraph& graph = app->renderGraph;
+    RenderGraph_Reset(graph);
+
+    const ivec2 size = app->renderTargetSize;
+    const u32 backbuffer = RenderGraph_ImportBackbuffer(graph, size);
+    const u32 radiance = RenderGraph_CreateResource(graph, CString("Radiance"), RenderTargetType_Color, size);
 
     switch (app->renderPath)
     {
         case RenderPath_Test:
             {
-                RenderTarget& renderTarget = device.renderTargets[app->radianceRenderTargetIdx];
-                ivec4 viewportRect(0, 0, app->displaySize.x, app->displaySize.y);
-                BlitTexture(app->device, app->embedded, viewportRect, renderTarget.handle);
+                // Copies a cleared target through a chain of transient ones, so
+                // radiance starts living after the first target died and aliases it
+                const u32 scratchA = RenderGraph_CreateResource(graph, CString("Scratch A"), RenderTargetType_Color, size);
+                const u32 scratchB = RenderGraph_CreateResource(graph, CString("Scratch B"), RenderTargetType_Color, size);
+
+                const u32 clearPass = RenderGraph_AddPass(graph, CString("Clear"), NULL);
+                RenderGraph_Write(graph, clearPass, scratchA, Attachment_Color0);
+
+                const u32 copyPassA = RenderGraph_AddPass(graph, CString("Copy A to B"), CopyPass);
+                RenderGraph_Read(graph, copyPassA, scratchA);
+                RenderGraph_Write(graph, copyPassA, scratchB, Attachment_Color0);
+
+                const u32 copyPassB = RenderGraph_AddPass(graph, CString("Copy B to radiance"), CopyPass);
+                RenderGraph_Read(graph, copyPassB, scratchB);
+                RenderGraph_Write(graph, copyPassB, radiance, Attachment_Color0);
             }
             break;
 
         case RenderPath_ForwardShading:
             {
-                RENDER_GROUP("Forward render", gApp->frameRenderGroup);
+                const u32 depth = RenderGraph_CreateResource(graph, CString("Depth"), RenderTargetType_Depth, size);
 
-                BeginRenderPass(device, app->forwardShadingPassIdx);
-
-                glViewport(0.0f, 0.0f, app->displaySize.x, app->displaySize.y);
-                glEnable(GL_DEPTH_TEST);
+                const u32 forwardPass = RenderGraph_AddPass(graph, CString("Forward shading"), ForwardShadingPass);
+                RenderGraph_Write(graph, forwardPass, radiance, Attachment_Color0);
+                RenderGraph_Write(graph, forwardPass, depth, Attachment_Depth);
+            }
+            break;
 
-                BufferRange globalParamsRange = {
-                    app->globalParamsBufferIdx,
-                    app->globalParamsOffset,
-                    app->globalParamsSize
-                };
+        case RenderPath_DeferredShading:
+            {
+                const u32 albedo = RenderGraph_CreateResource(graph, CString("Albedo"), RenderTargetType_Color, size);
+                const u32 normal = RenderGraph_CreateResource(graph, CString("Normal"), RenderTargetType_Color, size);
+                const u32 position = RenderGraph_CreateResource(graph, CString("Position"), RenderTargetType_Floats, size);
+                ClearValue positionClearValue = {}; // Zero alpha marks the pixels nothing was drawn to
+                RenderGraph_SetClearValue(graph, position, positionClearValue);
+                const u32 depth = RenderGraph_CreateResource(graph, CString("Depth"), RenderTargetType_Depth, size);
+
+                const u32 gbufferPass = RenderGraph_AddPass(graph, CString("G-Buffer"), GBufferPass);
+                RenderGraph_Write(graph, gbufferPass, albedo, Attachment_Color0);
+                RenderGraph_Write(graph, gbufferPass, normal, Attachment_Color1);
+                RenderGraph_Write(graph, gbufferPass, position, Attachment_Color2);
+                RenderGraph_Write(graph, gbufferPass, depth, Attachment_Depth);
+
+                const u32 shadingPass = RenderGraph_AddPass(graph, CString("Deferred shading"), DeferredShadingPass);
+                RenderGraph_Read(graph, shadingPass, albedo);
+                RenderGraph_Read(graph, shadingPass, normal);
+                RenderGraph_Read(graph, shadingPass, position);
+                RenderGraph_Write(graph, shadingPass, radiance, Attachment_Color0);
+                RenderGraph_Write(graph, shadingPass, depth, Attachment_Depth);
+            }
+            break;
 
-                ForwardShading_Render(app->device, app->embedded, app->forwardRenderData, globalParamsRange);
+        case RenderPath_VisibilityBuffer:
+            {
+                const u32 visibility = RenderGraph_CreateResource(graph, CString("Visibility"), RenderTargetType_UInt, size);
+                ClearValue visibilityClearValue = {};
+                visibilityClearValue.colorUInt = VISIBILITY_EMPTY;
+                RenderGraph_SetClearValue(graph, visibility, visibilityClearValue);
+                const u32 depth = RenderGraph_CreateResource(graph, CString("Depth"), RenderTargetType_Depth, size);
+
+                const u32 visibilityPass = RenderGraph_AddPass(graph, CString("Visibility"), VisibilityPass);
+                RenderGraph_Write(graph, visibilityPass, visibility, Attachment_Color0);
+                RenderGraph_Write(graph, visibilityPass, depth, Attachment_Depth);
+
+                const u32 resolvePass = RenderGraph_AddPass(graph, CString("Visibility resolve"), VisibilityResolvePass);
+                RenderGraph_Read(graph, resolvePass, visibility);
+                RenderGraph_Write(graph, resolvePass, radiance, Attachment_Color0);
+                RenderGraph_Write(graph, resolvePass, depth, Attachment_Depth);
+            }
+            break;
 
-                DebugDraw_Render(device, app->embedded, app->debugDraw, globalParamsRange);
+        default:
+            INVALID_CODE_PATH("Unsupported render path");
+    }
 
-                glBindVertexArray(0);
+    const u32 blitPass = RenderGraph_AddPass(graph, CString("Blit to backbuffer"), BlitToBackbufferPass);
+    RenderGraph_Read(graph, blitPass, radiance);
+    RenderGraph_Write(graph, blitPass, backbuffer, Attachment_Color0);
 
-                glUseProgram(0);
+    app->renderGraphPath = app->renderPath;
+}
 
-                EndRenderPass(device);
-            }
-            {
-                RenderTarget& renderTarget = device.renderTargets[app->radianceRenderTargetIdx];
-                ivec4 viewportRect(0, 0, app->displaySize.x, app->displaySize.y);
 #if USE_GFX_API_OPENGL
-                BlitTexture(app->device, app->embedded, viewportRect, renderTarget.handle);
-#endif
-            }
+// A chunk of render primitives of one queue, recorded into its own command list
+struct CommandListJob
+{
+    CommandQueue queue;
+    u32          chunkIdx;
+    u32          begin;
+    u32          end;
+};
+
+struct CommandListJobs
+{
+    App*           app;
+    BufferRange    globalParamsRange;
+    CommandListJob jobs[MAX_COMMAND_LISTS];
+    u32            jobCount;
+};
+
+static void AddCommandListJobs(CommandListJobs& jobs, CommandQueue queue, u32 begin, u32 end)
+{
+    u32 chunkIdx = 0;
+    for (u32 chunkBegin = begin; chunkBegin < end; chunkBegin += COMMAND_LIST_CHUNK_PRIMITIVES)
+    {
+        ASSERT(jobs.jobCount < ARRAY_COUNT(jobs.jobs), "Max number of command lists reached");
+        const u32 chunkEnd = min(chunkBegin + COMMAND_LIST_CHUNK_PRIMITIVES, end);
+        jobs.jobs[jobs.jobCount++] = CommandListJob{ queue, chunkIdx++, chunkBegin, chunkEnd };
+    }
+}
+
+static void RecordCommandListJob(void* data, u32 jobIdx, u32 threadIdx)
+{
+    CPU_PROFILE_SCOPE("Record command list");
+
+    const CommandListJobs& jobs = *(const CommandListJobs*)data;
+    const CommandListJob& job = jobs.jobs[jobIdx];
+    App* app = jobs.app;
+    CommandLists& commandLists = app->commandLists;
+
+    CommandRecorder recorder;
+    CommandRecorder_Begin(recorder, commandLists.threadArenas[threadIdx], commandLists.lists[jobIdx], MAKE_DWORD(job.queue, job.chunkIdx));
+
+    switch (job.queue)
+    {
+        case CommandQueue_Forward:
+            ForwardShading_Record(app->forwardRenderData, jobs.globalParamsRange, job.begin, job.end, recorder);
+            break;
+        case CommandQueue_GBuffer:
+            DeferredShading_RecordOpaques(app->deferredRenderData, jobs.globalParamsRange, job.begin, job.end, recorder);
+            break;
+        case CommandQueue_Visibility:
+            VisibilityBuffer_RecordVisibility(app->visibilityBufferRenderData, job.begin, job.end, recorder);
+            break;
+        default:
+            ShadowMaps_Record(app->shadowRenderData, job.begin, job.end, recorder);
             break;
+    }
 
-        case RenderPath_DeferredShading:
-            {
-                RENDER_GROUP("Deferred render", gApp->frameRenderGroup);
+    CommandRecorder_End(recorder);
+}
 
-                BeginRenderPass(device, app->gbufferPassIdx);
+// Records the draw loops of the frame, in chunks spread over the worker threads. No GL calls
+// happen here, the passes replay the lists on this thread.
+void RecordCommandLists(App* app)
+{
+    CPU_PROFILE_FUNCTION();
+    const u64 beginNs = GetProfileTimeNs();
 
-                glViewport(0.0f, 0.0f, app->displaySize.x, app->displaySize.y);
-                glEnable(GL_DEPTH_TEST);
+    CommandLists& commandLists = app->commandLists;
+    CommandLists_Reset(commandLists);
 
-                BufferRange globalParamsRange = {
-                    app->globalParamsBufferIdx,
-                    app->globalParamsOffset,
-                    app->globalParamsSize
-                };
+    CommandListJobs jobs = {};
+    jobs.app = app;
+    jobs.globalParamsRange = GetGlobalParamsRange(app);
 
-                DeferredShading_RenderOpaques(app->device, app->embedded, app->deferredRenderData, globalParamsRange);
-                EndRenderPass(device);
+#if defined(USE_INSTANCING)
+    const ShadowRenderData& shadowData = app->shadowRenderData;
+    if (RenderPathUsesShadows(app->renderPath) && shadowData.lightIdx != SHADOW_NO_LIGHT)
+    {
+        for (u32 cascadeIdx = 0; cascadeIdx < SHADOW_CASCADE_COUNT; ++cascadeIdx)
+        {
+            const ShadowCascade& cascade = shadowData.cascades[cascadeIdx];
+            if (cascade.dirty)
+                AddCommandListJobs(jobs, (CommandQueue)(CommandQueue_ShadowCascade0 + cascadeIdx),
+                                   cascade.renderPrimitiveBegin, cascade.renderPrimitiveBegin + cascade.renderPrimitiveCount);
+        }
+    }
+#endif
 
-                BeginRenderPass(device, app->deferredShadingPassIdx);
+    switch (app->renderPath)
+    {
+        case RenderPath_ForwardShading:
+            AddCommandListJobs(jobs, CommandQueue_Forward, 0, app->forwardRenderData.renderPrimitiveCount);
+            break;
+        case RenderPath_DeferredShading:
+            AddCommandListJobs(jobs, CommandQueue_GBuffer, 0, app->deferredRenderData.renderPrimitiveCount);
+            break;
+        case RenderPath_VisibilityBuffer:
+            AddCommandListJobs(jobs, CommandQueue_Visibility, 0, app->visibilityBufferRenderData.renderPrimitiveCount);
+            break;
+        default:
+            break;
+    }
 
-                DeferredShading_RenderLights(app->device, app->embedded, app->deferredRenderData, globalParamsRange);
+    commandLists.listCount = jobs.jobCount;
+    Jobs_ParallelFor(commandLists.useWorkerThreads ? app->jobs : NULL, jobs.jobCount, RecordCommandListJob, &jobs);
+    CommandLists_Sort(commandLists);
 
-                DebugDraw_Render(device, app->embedded, app->debugDraw, globalParamsRange);
+    g_FrameStats.recordTimeMs = (GetProfileTimeNs() - beginNs) / 1000000.0f;
+}
+#endif
 
-                EndRenderPass(device);
+#if USE_GFX_API_VULKAN
+void VulkanFrame_Render(App* app)
+{
+    CPU_PROFILE_FUNCTION();
 
-                glBindVertexArray(0);
+    Device& device = app->device;
 
-                glUseProgram(0);
+    // Same size buckets as the render graph targets
+    const ivec2 renderTargetSize = app->renderTargetSize;
+    UpdateRenderTargetSize(app);
+    if (app->renderTargetSize != renderTargetSize)
+    {
+        const u32 renderTargetIndices[] = { app->vulkanColorTargetIdx, app->vulkanDepthTargetIdx };
+        for (u32 i = 0; i < ARRAY_COUNT(renderTargetIndices); ++i)
+        {
+            RenderTarget& renderTarget = device.renderTargets[renderTargetIndices[i]];
+            DestroyRenderTargetRaw(renderTarget);
+            renderTarget = CreateRenderTargetRaw(renderTarget.name, app->renderTargetSize, renderTarget.type);
+        }
+    }
 
-            }
-            {
-                RenderTarget& renderTarget = device.renderTargets[app->radianceRenderTargetIdx];
-                ivec4 viewportRect(0, 0, app->displaySize.x, app->displaySize.y);
-#if USE_GFX_API_OPENGL
-                BlitTexture(app->device, app->embedded, viewportRect, renderTarget.handle);
+    BeginRenderPass(device, app->vulkanRenderPassIdx);
+    if (app->renderPath == RenderPath_ForwardShading)
+        ForwardShading_Render(device, app->jobs, app->forwardRenderData, GetGlobalParamsRange(app), app->displaySize);
+    EndRenderPass(device, app->vulkanRenderPassIdx);
+}
 #endif
-            }
-            break;
 
-        default:;
+void Render(App* app)
+{
+    CPU_PROFILE_FUNCTION();
+
+#if USE_GFX_API_METAL
+    Metal_Render(app->device);
+    return;
+#elif USE_GFX_API_VULKAN
+    VulkanFrame_Render(app);
+    return;
+#endif
+
+#if USE_GFX_API_OPENGL
+    Device& device = app->device;
+
+    RecordCommandLists(app);
+
+    if (RenderPathUsesShadows(app->renderPath))
+    {
+        RENDER_GROUP("Shadow maps", gApp->frameRenderGroup);
+
+        ShadowMaps_Render(device, app->commandLists, app->shadowRenderData);
+
+        // Shadow params and maps stay bound for all the shading passes of the frame
+        glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(2), device.constantBuffers[app->shadowParamsBufferIdx].handle, app->shadowParamsOffset, app->shadowParamsSize);
+        glActiveTexture(GL_TEXTURE0 + SHADOW_MAP_TEXTURE_UNIT);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, app->shadowRenderData.depthTextureHandle);
+        STATS_INC(textureBinds);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    UpdateRenderTargetSize(app);
+
+    if (!app->renderGraph.isCompiled || app->renderGraphPath != app->renderPath)
+    {
+        BuildRenderGraph(app);
+        RenderGraph_Compile(device, app->renderGraph);
     }
+
+    RenderGraph_Execute(app, app->renderGraph);
+#endif
+
+#if USE_GFX_API_SOFTWARE
+    // The rasterized frame is what the (null) default framebuffer reads back
+    const SoftwareFrameStats softwareStats = Software_Render(app->softwareRenderer, app, g_CullFace);
+    STATS_ADD(rasterTriangles, softwareStats.triangles);
+    STATS_ADD(rasterPixels, softwareStats.pixels);
+    STATS_ADD(rasterTimeMs, softwareStats.timeMs);
 #endif
 
     //
@@ -1955,18 +3135,39 @@ void Render(App* app)
     //
 
 #if USE_GFX_API_OPENGL
-    if (app->takeSnapshot)
+    Snapshots_Update(app);
+#endif
+}
+
+void FrameStats_EndFrame(App* app)
+{
+    const u64 nowNs = GetProfileTimeNs();
+    const f32 frameTimeMs = app->lastFrameEndNs ? (nowNs - app->lastFrameEndNs) / 1000000.0f : 0.0f;
+    app->lastFrameEndNs = nowNs;
+
+    g_FrameStats.frameArenaBytes = GetGlobalFrameArena().head;
+    g_FrameStats.stringArenaBytes = StrArena.head;
+    g_FrameStats.frameTimeMs = frameTimeMs;
+    g_FrameStats.simulationTimeMs = app->framePacket.simulationTimeMs;
+    g_FrameStats.inputLatencyMs = app->framePacket.inputTimeNs ? (nowNs - app->framePacket.inputTimeNs) / 1000000.0f : 0.0f;
+
+    app->frameStats = g_FrameStats;
+    g_FrameStats = {};
+
+    if (!app->startup.firstFrameNs)
     {
-        glFinish();
+        app->startup.firstFrameNs = nowNs;
+        ILOG("First frame after %.2f ms", (nowNs - app->startup.beginNs) / 1000000.0f);
+    }
+
+    app->frameTimeHistoryMs[app->frameTimeHistoryHead] = frameTimeMs;
+    app->frameTimeHistoryHead = (app->frameTimeHistoryHead + 1) % FRAME_STATS_HISTORY_FRAMES;
+    app->frameTimeHistoryCount = min(app->frameTimeHistoryCount + 1, (u32)FRAME_STATS_HISTORY_FRAMES);
 
-        const u32 width = app->displaySize.x;
-        const u32 height = app->displaySize.y;
-        u8* outPixels = new u8[width*height*3];
-        glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, outPixels);
-        stbi_write_png("snapshot.png", width, height, 3, (const void*)outPixels, width*3);
-        delete[] outPixels;
+    if (app->frameStatsCsvFile)
+    {
+        FrameStats_WriteCsvRow(app->frameStatsCsvFile, app->frame, app->frameStats);
     }
-#endif
 }
 
 void EndFrame(App* app)
@@ -1974,8 +3175,47 @@ void EndFrame(App* app)
 #if USE_GFX_API_METAL
     Metal_EndFrame(app->device);
     return;
+#elif USE_GFX_API_VULKAN
+    Vulkan_EndFrame(app->device, &app->device.renderTargets[app->vulkanColorTargetIdx], app->displaySize);
+    FrameStats_EndFrame(app);
+    return;
 #endif
 
     ProfileEvent_Insert(app, app->frameRenderGroup, ProfileEventType_FrameEnd);
+
+    FrameStats_EndFrame(app);
+
+    Benchmark_EndFrame(app);
+}
+
+void Shutdown(App* app)
+{
+    Simulation_Destroy(app->simulation);
+    app->simulation = NULL;
+
+    delete app->renderQueue;
+    delete app->renderScene;
+
+#if USE_GFX_API_OPENGL
+    // Writes the snapshots still in flight
+    Snapshots_Shutdown(app);
+
+    Assets_Shutdown(app);
+
+    Jobs_Destroy(app->jobs);
+    app->jobs = NULL;
+    CommandLists_Destroy(app->commandLists);
+#endif
+
+#if USE_GFX_API_SOFTWARE
+    Software_Destroy(app->softwareRenderer);
+    app->softwareRenderer = NULL;
+#endif
+
+#if USE_GFX_API_VULKAN
+    Jobs_Destroy(app->jobs);
+    app->jobs = NULL;
+    Vulkan_ShutdownDevice(app->device);
+#endif
 }
 
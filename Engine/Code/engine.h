@@ -5,26 +5,63 @@
 #pragma once
 
 #include "platform.h"
+#include <stdio.h>
 
 #if USE_GFX_API_OPENGL
 #include <glad/glad.h>
+#elif USE_GFX_API_VULKAN
+#include <vulkan/vulkan.h>
+#endif
+
+// The null backend runs the OpenGL code paths on a driver that does no GPU work (null_engine.cpp)
+#if USE_GFX_API_NULL && !USE_GFX_API_OPENGL
+#error USE_GFX_API_NULL needs USE_GFX_API_OPENGL
+#endif
+
+// The software backend rasterizes the frame on the CPU, on top of the null driver (software_engine.cpp)
+#if USE_GFX_API_SOFTWARE && !USE_GFX_API_NULL
+#error USE_GFX_API_SOFTWARE needs USE_GFX_API_NULL
 #endif
 
 using namespace glm;
 
-#define MAX_PROFILE_EVENTS 1024
+#define MAX_PROFILE_EVENTS_PER_FRAME 128
 #define MAX_RENDER_GROUPS 16
 #define MAX_GPU_FRAME_DELAY 5
+#define GPU_PROFILE_HISTORY_FRAMES 64
+#define FRAME_STATS_HISTORY_FRAMES 256
+#define SNAPSHOT_READBACK_SLOTS 4
+#define SNAPSHOT_MAX_QUEUED_IMAGES 32
+#define ASSET_LOADER_THREAD_COUNT 2
+#define ASSET_MAX_REQUESTS 1024
+#define ASSET_UPLOAD_SEGMENT_COUNT 3
+#define ASSET_UPLOAD_SEGMENT_SIZE MB(8)
+#define ASSET_UPLOAD_BUDGET_MS 2.0f
 #define USE_INSTANCING
 #define MAX_RENDER_GROUP_CHILDREN_COUNT 16
 #define MAX_RENDER_PRIMITIVES 4096
+#define MAX_PROGRAM_DEPENDENCIES 8
+#define MAX_SHADER_FILES 32
 #define MAX_FRAMEBUFFER_ATTACHMENTS 16
+#define TEXTURE_MAX_LEVELS 16
 
 struct RenderGroup
 {
     const char* name;
     u32 children[MAX_RENDER_GROUP_CHILDREN_COUNT];
     u32 childrenCount;
+    u32 parent;
+
+    // CPU time spent inside the group during the current frame, in ms
+    f32 cpuFrameTimeMs;
+
+    // GPU times of the last resolved frames, in ms
+    f32 timeHistoryMs[GPU_PROFILE_HISTORY_FRAMES];
+    u32 timeHistoryHead;
+    u32 timeHistoryCount;
+    f32 averageTimeMs;
+    f32 maxTimeMs;
+    u32 lastResolvedFrame;
 };
 
 struct Image
@@ -35,12 +72,52 @@ struct Image
     i32   stride;
 };
 
+// Role of a texture in its material, it picks the block compression of its cooked version
+enum TextureRole
+{
+    TextureRole_Albedo,   // BC7
+    TextureRole_Emissive, // BC1
+    TextureRole_Normal,   // BC5, x and y of the normal, z = sqrt(1 - x*x - y*y)
+    TextureRole_Mask,     // BC1, or BC3 if it has alpha
+    TextureRole_Count
+};
+
+enum CookedFormat
+{
+    CookedFormat_BC1,
+    CookedFormat_BC3,
+    CookedFormat_BC5,
+    CookedFormat_BC7,
+    CookedFormat_Count
+};
+
+// Image with its whole mip chain block compressed, see texture_cooker.cpp
+struct CookedTexture
+{
+    CookedFormat format;
+    bool         isSrgb;
+    ivec2        size;
+    u32          levelCount;
+    u32          levelOffsets[TEXTURE_MAX_LEVELS]; // Into data, level 0 first
+    u32          levelSizes[TEXTURE_MAX_LEVELS];
+    u8*          data;
+    u32          dataSize;
+};
+
 struct Texture
 {
 #if USE_GFX_API_OPENGL
     GLuint handle;
+#elif USE_GFX_API_VULKAN
+    VkImage         handle;
+    VkImageView     view;
+    VkDeviceMemory  memory;
+    VkDescriptorSet descriptorSet; // Set 1 of the draws that sample it, see vulkan_engine.cpp
 #endif
     String filepath;
+    ivec2  size;
+    u32    memorySize; // Of all its levels on the GPU, estimated for uncompressed textures
+    bool   isCooked;
 };
 
 struct Material
@@ -123,6 +200,11 @@ struct Buffer
     GLuint handle;
 #elif USE_GFX_API_METAL
     void* handle;
+#elif USE_GFX_API_VULKAN
+    VkBuffer       handle;
+    VkDeviceMemory memory;
+    mutable VkBuffer uploadBuffer; // Staging memory while mapped, see vulkan_engine.cpp
+    mutable u32      uploadOffset;
 #endif
     BufferType type;
     u32    size;
@@ -137,6 +219,15 @@ struct BufferRange
     u32 size;
 };
 
+// Cost of drawing a triangle list, simulated on the CPU by mesh_optimizer.cpp
+struct MeshStats
+{
+    f32 acmr;      // Vertices transformed per triangle
+    f32 atvr;      // Vertices transformed per vertex used, 1 is ideal
+    f32 overfetch; // Vertex buffer bytes fetched per byte of the buffer, 1 is ideal
+    f32 overdraw;  // Pixels shaded per pixel covered, averaged over views along the axes
+};
+
 struct Submesh
 {
     VertexBufferLayout vertexBufferLayout;
@@ -144,25 +235,143 @@ struct Submesh
     u32                indexOffset;
     u32                vertexCount;
     u32                indexCount;
+    vec3               boundsMin; // Object space AABB
+    vec3               boundsMax;
+    MeshStats          sourceStats;    // Triangle order as imported
+    MeshStats          optimizedStats; // Once reordered by MeshOptimizer_Optimize
 };
 
 struct Mesh
 {
+    String               name; // Model file, or embedded
     std::vector<Submesh> submeshes;
     std::vector<u32>     materialIndices;
     u32                  vertexBufferIdx;
     u32                  indexBufferIdx;
 };
 
+// Shader source file watched for hot reloads, shared by all the programs that include it
+struct ShaderFile
+{
+    String filepath;
+    u64    lastWriteTimestamp;
+    bool   hasChanged;
+};
+
+// Compilation in flight, the driver may run it in the background (GL_KHR_parallel_shader_compile)
+struct ProgramCompile
+{
+#if USE_GFX_API_OPENGL
+    GLuint handle;
+    GLuint vertexShader;
+    GLuint fragmentShader;
+#endif
+    u64    cacheKey;
+    bool   isFromCache; // Linked from a cached binary, no shaders to wait for
+};
+
 struct Program
 {
 #if USE_GFX_API_OPENGL
     GLuint             handle;
+#elif USE_GFX_API_VULKAN
+    VkShaderModule     vertexModule;   // Precompiled from spirv/<permutationName>.vert
+    VkShaderModule     fragmentModule;
 #endif
     VertexShaderLayout vertexInputLayout;
     String             filepath;
     String             programName;
-    u64                lastWriteTimestamp;
+    String             defines;         // Feature switches of this permutation, separated by spaces
+    String             permutationName; // programName+define+...
+
+    // Files the expanded source came from (the program file and its active #includes)
+    u32                dependencies[MAX_PROGRAM_DEPENDENCIES];
+    u32                dependencyCount;
+    u64                sourceHash; // Of the expanded source, unchanged by edits in inactive sections
+
+    // Hot reload, the current handle stays in use until the new one has linked
+    ProgramCompile     pendingCompile;
+    bool               isCompiling;
+};
+
+#define MAX_PIPELINE_UNIFORM_BLOCKS 4
+#define MAX_PIPELINE_SAMPLERS       12
+
+enum CullMode
+{
+    CullMode_None,
+    CullMode_Back,
+};
+
+enum BlendMode
+{
+    BlendMode_Opaque,
+    BlendMode_Alpha,
+};
+
+struct PipelineSampler
+{
+    const char* name;
+    u32         unit;
+};
+
+struct PipelineStateDesc
+{
+    u32             programIdx;
+
+    // Vertex layout of the instancing stream (vec4 columns from location 6 on)
+    u32             instanceAttributeCount;
+    u32             instanceStride;
+
+    // Raster state
+    CullMode        cullMode;
+    bool            depthClamp;
+    bool            polygonOffset;
+    f32             polygonOffsetFactor;
+    f32             polygonOffsetUnits;
+
+    // Depth and blend state
+    bool            depthTest;
+    bool            depthWrite;
+    BlendMode       blendMode;
+
+    // Texture units of the program samplers
+    PipelineSampler samplers[MAX_PIPELINE_SAMPLERS];
+    u32             samplerCount;
+};
+
+struct PipelineUniformBlock
+{
+    char name[32];
+    u32  binding;
+    u32  size;
+};
+
+struct PipelineState
+{
+    PipelineStateDesc    desc;
+#if USE_GFX_API_OPENGL
+    GLuint               programHandle; // The reflection below belongs to this program handle
+#endif
+    PipelineUniformBlock uniformBlocks[MAX_PIPELINE_UNIFORM_BLOCKS];
+    u32                  uniformBlockCount;
+};
+
+// Context state set by the last applied pipeline state
+struct BoundPipelineState
+{
+    bool      isValid;
+#if USE_GFX_API_OPENGL
+    GLuint    programHandle;
+#endif
+    CullMode  cullMode;
+    bool      depthClamp;
+    bool      polygonOffset;
+    f32       polygonOffsetFactor;
+    f32       polygonOffsetUnits;
+    bool      depthTest;
+    bool      depthWrite;
+    BlendMode blendMode;
 };
 
 enum RenderTargetType
@@ -170,6 +379,7 @@ enum RenderTargetType
     RenderTargetType_Color,
     RenderTargetType_Floats,
     RenderTargetType_Depth,
+    RenderTargetType_UInt,
     RenderTargetType_Count
 };
 
@@ -179,6 +389,13 @@ struct RenderTarget
     vec2             size;
 #if USE_GFX_API_OPENGL
     GLuint           handle;
+#elif USE_GFX_API_VULKAN
+    VkImage          handle;
+    VkImageView      view;
+    VkDeviceMemory   memory;
+    mutable VkImageLayout layout; // Tracked to transition the image between passes
+#else
+    void*            handle;
 #endif
     RenderTargetType type;
 };
@@ -214,16 +431,25 @@ struct Framebuffer
 {
 #if USE_GFX_API_OPENGL
     GLuint       handle;
+    mutable u32  drawBufferMask; // Color attachments currently enabled with glDrawBuffers
 #endif
     u32          attachmentCount;
     Attachment   attachments[MAX_FRAMEBUFFER_ATTACHMENTS];
 };
 
+struct ClearValue
+{
+    vec4         color;     // Normalized and float targets
+    u32          colorUInt; // Integer targets
+    f32          depth;
+};
+
 struct AttachmentAction
 {
     u32          attachmentIdx;
     LoadOp       loadOp;
     StoreOp      storeOp;
+    ClearValue   clearValue; // Used with LoadOp_Clear
 };
 
 struct RenderPass
@@ -233,12 +459,87 @@ struct RenderPass
     AttachmentAction attachmentActions[MAX_FRAMEBUFFER_ATTACHMENTS];
 };
 
+#define RENDER_TARGET_SIZE_BUCKET         256
+#define RENDER_TARGET_SHRINK_DELAY_FRAMES 30
+
+#define MAX_RENDER_GRAPH_RESOURCES  32
+#define MAX_RENDER_GRAPH_PASSES     16
+#define MAX_RENDER_GRAPH_PASS_READS 8
+
+struct App;
+struct RenderGraph;
+struct RenderGraphPass;
+
+typedef void (*RenderGraphExecuteFunc)(App* app, const RenderGraph& graph, const RenderGraphPass& pass);
+
+// Virtual render target. It only gets a physical render target when the graph
+// is compiled, and that target may be shared with other resources whose
+// lifetimes do not overlap.
+struct RenderGraphResource
+{
+    String           name;
+    RenderTargetType type;
+    ivec2            size;
+    bool             isBackbuffer;    // Imported default framebuffer
+    bool             isOutput;        // Must survive until the end of the frame
+    ClearValue       clearValue;      // Used by the first pass writing it
+    u32              refCount;        // Number of passes reading it
+    u32              firstPass;       // Position in the execution order
+    u32              lastPass;
+    u32              renderTargetIdx; // Physical render target in Device::renderTargets
+};
+
+struct RenderGraphPass
+{
+    String                 name;
+    RenderGraphExecuteFunc execute;
+
+    u32                    reads[MAX_RENDER_GRAPH_PASS_READS];
+    u32                    readCount;
+    u32                    writes[MAX_FRAMEBUFFER_ATTACHMENTS];
+    AttachmentPoint        writeAttachmentPoints[MAX_FRAMEBUFFER_ATTACHMENTS];
+    u32                    writeCount;
+
+    u32                    refCount;  // Number of written resources still in use
+    bool                   isCulled;
+
+    // Built when compiling
+    Framebuffer            framebuffer;
+    RenderPass             renderPass;
+};
+
+struct RenderGraph
+{
+    RenderGraphResource resources[MAX_RENDER_GRAPH_RESOURCES];
+    u32                 resourceCount;
+
+    RenderGraphPass     passes[MAX_RENDER_GRAPH_PASSES];
+    u32                 passCount;
+
+    u32                 executionOrder[MAX_RENDER_GRAPH_PASSES];
+    u32                 executionCount;
+
+    bool                isCompiled;
+
+    // Physical render targets (Device::renderTargets indices) owned by the graph
+    u32                 pool[16];
+    u32                 poolCount;
+
+    // Stats
+    u32                 virtualBytes;
+    u32                 physicalBytes;
+    u32                 aliasedBytes;  // Virtual targets sharing a physical one used earlier in the frame
+};
+
 struct RenderPrimitive
 {
     u32    entityIdx;
+    u32    meshSubmeshIdx; // meshIdx (16bits) and submeshIdx (16bits)
 #if USE_GFX_API_OPENGL
     GLuint vaoHandle;
     GLuint albedoTextureHandle;
+#elif USE_GFX_API_VULKAN
+    VkDescriptorSet albedoDescriptorSet;
 #endif
     u32    indexCount;
     u32    indexOffset;
@@ -257,12 +558,10 @@ struct RenderPrimitive
 struct ForwardRenderData
 {
     u32    programIdx;
-#if USE_GFX_API_OPENGL
-    GLuint uniLoc_Albedo;
-#endif
+    u32    pipelineStateIdx;
 
     // Local params
-    u32 localParamsBlockSize;
+    u32 localParamsBlockSize; // Reflected, 0 when instancing
 
     u32 instancingBufferIdx;
 
@@ -274,14 +573,13 @@ struct ForwardRenderData
 struct DeferredRenderData
 {
     u32    gbufferProgramIdx;
-#if USE_GFX_API_OPENGL
-    GLuint uniLoc_Albedo;
-#endif
+    u32    gbufferPipelineStateIdx;
 
     u32    shadingProgramIdx;
+    u32    shadingPipelineStateIdx;
 
     // Local params
-    u32 localParamsBlockSize;
+    u32 localParamsBlockSize; // Reflected, 0 when instancing
 
     u32 instancingBufferIdx;
 
@@ -290,6 +588,281 @@ struct DeferredRenderData
     u32             renderPrimitiveCount;
 };
 
+// Visibility buffer texels pack the instance index in the high bits and the
+// triangle index (gl_PrimitiveID) within the submesh in the low bits
+#define VISIBILITY_TRIANGLE_BITS 20
+#define VISIBILITY_INSTANCE_BITS (32 - VISIBILITY_TRIANGLE_BITS)
+#define VISIBILITY_EMPTY 0xffffffff
+
+// Every instance has its world and world-view-projection matrices followed by two uvec4s
+// telling the resolve where its submesh and material are, see VisibilityBuffer_Update
+#define VISIBILITY_INSTANCE_STRIDE (2 * sizeof(mat4) + 2 * sizeof(uvec4))
+#define VISIBILITY_NO_ATTRIBUTE 0xffffffff
+
+// Instances refer to their albedo texture by slot. Textures are copied at their resolution and
+// with all their mips into the layers of an array texture per size, the slot table tells the
+// resolve the array and layer of each slot. Textures of more sizes than there are arrays go to
+// the smallest array they fit in, or the largest one.
+#define VISIBILITY_MAX_ALBEDO_SLOTS  64
+#define VISIBILITY_MAX_ALBEDO_ARRAYS 4 // On texture units 4 to 7 of the resolve
+#define VISIBILITY_NO_ALBEDO_SLOT    0xffffffff
+#define VISIBILITY_NO_ALBEDO_ENTRY   0xffffffff
+#define VISIBILITY_ALBEDO_LAYER_BITS 16 // Of a slot table entry, the array index goes above
+#define VISIBILITY_ALBEDO_LAYER_MASK ((1u << VISIBILITY_ALBEDO_LAYER_BITS) - 1)
+
+#if USE_GFX_API_OPENGL
+struct VisibilityAlbedoArray
+{
+    GLuint handle;
+    ivec2  size;          // Of level 0, zero if unused
+    u32    levelCount;
+    u32    layerCapacity;
+    u64    usedLayers;    // One bit per layer
+};
+#endif
+
+struct VisibilityBufferRenderData
+{
+    u32    visibilityProgramIdx;
+    u32    visibilityPipelineStateIdx;
+#if USE_GFX_API_OPENGL
+    GLuint uniLoc_BaseInstance;
+#endif
+
+    u32    resolveProgramIdx;
+    u32    resolvePipelineStateIdx;
+#if USE_GFX_API_OPENGL
+    GLuint uniLoc_ViewportSize;
+    GLuint uniLoc_AlbedoSlots;
+
+    // Copies of the mesh vertex and index buffers packed one after the other, so that the
+    // resolve reaches any submesh. Repacked when meshes or buffers are added.
+    GLuint geometryVertexBufferHandle;
+    GLuint geometryIndexBufferHandle;
+    GLuint geometryVertexTexture;
+    GLuint geometryIndexTexture;
+    u32    geometryVertexBases[16]; // In 32-bit elements, indexed like Device::vertexBuffers
+    u32    geometryIndexBases[16];  // In 32-bit elements, indexed like Device::indexBuffers
+    u32    geometryMeshCount;
+    u32    geometryBufferCount;
+
+    // Albedo texture of each slot, copied again when its handle changes (streamed in)
+    VisibilityAlbedoArray albedoArrays[VISIBILITY_MAX_ALBEDO_ARRAYS];
+    GLuint                albedoFramebufferHandle;
+    u32                   albedoTextureIndices[VISIBILITY_MAX_ALBEDO_SLOTS];
+    GLuint                albedoSlotSources[VISIBILITY_MAX_ALBEDO_SLOTS];
+    u32                   albedoSlotEntries[VISIBILITY_MAX_ALBEDO_SLOTS]; // The slot table
+    u32                   albedoSlotCount;
+
+    GLuint instancingBufferTexture; // Integer view, matrices are read back with uintBitsToFloat
+#endif
+
+    u32 instancingBufferIdx;
+
+    // Whether the last render scene fits the encoding of the visibility buffer and the albedo
+    // slots, the engine falls back to forward shading otherwise
+    bool isSceneSupported;
+
+    // Render primitives
+    RenderPrimitive renderPrimitives[MAX_RENDER_PRIMITIVES];
+    u32             renderPrimitiveCount;
+};
+
+#define CAMERA_FOV_Y_DEGREES 60.0f
+#define CAMERA_Z_NEAR        0.1f
+#define CAMERA_Z_FAR         1000.0f
+
+#define SHADOW_CASCADE_COUNT      4
+#define SHADOW_MAP_RESOLUTION     2048
+#define SHADOW_MAP_TEXTURE_UNIT   8
+#define SHADOW_NO_LIGHT           0xffffffff
+
+// Cascade splits and texel sizes are packed in vec4s in the ShadowParams block
+CASSERT(SHADOW_CASCADE_COUNT == 4, "Shadow params layout expects 4 cascades");
+
+// Uniform blocks of shaders.glsl as the engine uploads them, laid out as std140
+#define SHADER_MAX_LIGHTS 16 // uLight[] in GlobalParams
+
+struct LightParams
+{
+    u32  type;
+    u32  padding0[3];
+    vec3 color;
+    f32  padding1;
+    vec3 direction;
+    f32  padding2;
+    vec3 position;
+    f32  padding3;
+};
+
+struct GlobalParams
+{
+    mat4        viewProjectionMatrix;
+    vec3        cameraPosition;
+    u32         lightCount;
+    LightParams lights[SHADER_MAX_LIGHTS]; // Only lightCount are uploaded
+};
+
+CASSERT(sizeof(LightParams) == 4 * sizeof(vec4), "Light array stride must follow std140");
+
+struct LocalParams
+{
+    mat4 worldMatrix;
+    mat4 worldViewProjectionMatrix;
+};
+
+struct ShadowParams
+{
+    mat4 viewProjectionMatrices[SHADOW_CASCADE_COUNT];
+    vec4 cascadeSplits;
+    vec4 cascadeTexelSizes;
+    vec3 cameraForward;
+    u32  lightIdx;
+};
+
+struct ShadowCascade
+{
+    mat4 viewProjectionMatrix; // Light space, texel snapped
+    vec3 center;               // Bounding sphere of the covered view slice (light view space)
+    f32  radius;
+    f32  splitFar;             // View depth where this cascade ends
+    f32  texelSize;            // World units per shadow map texel
+    u32  renderPrimitiveBegin;
+    u32  renderPrimitiveCount;
+    u32  dynamicCasterCount;   // Dynamic casters drawn the last time the cascade was rendered
+    bool dirty;
+};
+
+struct ShadowRenderData
+{
+    u32    programIdx;
+    u32    pipelineStateIdx;
+#if USE_GFX_API_OPENGL
+    GLuint depthTextureHandle; // 2D array, one layer per cascade
+    GLuint framebufferHandles[SHADOW_CASCADE_COUNT];
+#endif
+
+    u32 instancingBufferIdx;
+
+    // Settings
+    f32  shadowDistance;
+    f32  splitLambda;           // Blend between uniform (0) and logarithmic (1) splits
+    bool cacheFarCascades;
+    u32  firstCachedCascade;
+    f32  cachedRadiusScale;     // Cached cascades cover more than their slice so they survive camera motion
+
+    // State used to detect what changed since the cascades were last rendered
+    u32  lightIdx;
+    vec3 lightDirection;
+    u32  staticGeometryVersion;
+    f32  aspectRatio;
+
+    ShadowCascade cascades[SHADOW_CASCADE_COUNT];
+    mat4          lightViewMatrix;
+
+    // Stats
+    u32 renderedCascadeCount;
+    u32 casterCount;
+    u32 culledCasterCount;
+    u32 dynamicCasterCount;
+
+    // Render primitives of all dirty cascades
+    RenderPrimitive renderPrimitives[MAX_RENDER_PRIMITIVES];
+    u32             renderPrimitiveCount;
+};
+
+#define MAX_JOB_THREADS 16
+
+// Pool of worker threads, see jobs.cpp
+struct JobSystem;
+
+typedef void (*JobFunc)(void* data, u32 jobIdx, u32 threadIdx);
+
+u32  Jobs_GetThreadCount(const JobSystem* jobs);
+void Jobs_ParallelFor(JobSystem* jobs, u32 jobCount, JobFunc func, void* data);
+
+#define MAX_STARTUP_TASKS 128
+#define MAX_STARTUP_TASK_DEPENDENCIES 4
+
+struct Startup;
+
+typedef void (*StartupTaskFunc)(Startup& startup, void* data);
+
+// Worker tasks only read files and decode them, main thread tasks create the GL objects
+enum StartupTaskQueue
+{
+    StartupTaskQueue_Worker,
+    StartupTaskQueue_Main,
+};
+
+struct StartupTask
+{
+    char             name[64];
+    StartupTaskQueue queue;
+    StartupTaskFunc  func; // NULL for main thread tasks, they time a scope of Init
+    void*            data;
+    u32              dependencies[MAX_STARTUP_TASK_DEPENDENCIES];
+    u32              dependencyCount;
+    u32              threadIdx; // Job thread, 0 is the main thread
+    u64              beginNs;
+    u64              endNs;
+    bool             isDone;
+};
+
+// Dependency graph of the work done by Init, and its timeline, see startup.cpp
+struct Startup
+{
+    StartupTask tasks[MAX_STARTUP_TASKS];
+    u32         taskCount;
+    u32         threadCount;
+
+    bool useCookedTextures; // Image tasks read the cooked textures instead of decoding their sources
+
+    u64 beginNs;
+    u64 endNs;        // Init returned
+    u64 firstFrameNs; // The first frame ended
+
+    u32 criticalPath[MAX_STARTUP_TASKS]; // Task indices, first to last
+    u32 criticalPathCount;
+};
+
+#define COMMAND_LIST_CHUNK_PRIMITIVES 256 // Render primitives recorded per list
+#define COMMAND_LIST_PRIMITIVE_SIZE   64  // Encoded commands of a render primitive (or of the binds opening a list) at most
+
+// Each queue holds at most MAX_RENDER_PRIMITIVES, and a frame records the forward, G-Buffer or
+// visibility queue plus one queue per shadow cascade
+#define MAX_COMMAND_LISTS ((MAX_RENDER_PRIMITIVES / COMMAND_LIST_CHUNK_PRIMITIVES) * (1 + SHADOW_CASCADE_COUNT))
+
+// Per recording thread, enough for one thread to record the whole frame: up to MAX_RENDER_PRIMITIVES
+// in the main queue, as many across the shadow cascades, and the binds opening every list
+#define COMMAND_LIST_ARENA_SIZE ((2 * MAX_RENDER_PRIMITIVES + MAX_COMMAND_LISTS) * COMMAND_LIST_PRIMITIVE_SIZE)
+
+// Lists are replayed per queue, in chunk order
+enum CommandQueue
+{
+    CommandQueue_ShadowCascade0,
+    CommandQueue_Forward = CommandQueue_ShadowCascade0 + SHADOW_CASCADE_COUNT,
+    CommandQueue_GBuffer,
+    CommandQueue_Visibility,
+    CommandQueue_Count
+};
+
+struct CommandList
+{
+    u32 sortKey;      // Queue (high word) and chunk (low word)
+    u8* commands;     // Encoded commands, in the arena of the thread that recorded them
+    u32 size;
+    u32 commandCount;
+};
+
+struct CommandLists
+{
+    Arena       threadArenas[MAX_JOB_THREADS];
+    CommandList lists[MAX_COMMAND_LISTS];
+    u32         listCount;
+    bool        useWorkerThreads;
+};
+
 struct Camera
 {
     float yaw;
@@ -315,6 +888,7 @@ struct Entity
     EntityType type;
     mat4       worldMatrix;
     u32        meshSubmeshIdx; // meshIdx (16bits) and submeshIdx (16bits)
+    bool       isDynamic;      // Moves every frame, so cached shadow cascades cannot keep it
 };
 
 enum LightType
@@ -336,6 +910,7 @@ enum RenderPath
     RenderPath_Test,
     RenderPath_ForwardShading,
     RenderPath_DeferredShading,
+    RenderPath_VisibilityBuffer,
     RenderPath_Count
 };
 
@@ -353,6 +928,10 @@ struct Device
     struct Extensions
     {
         bool GL_ARB_timer_query : 1;
+        bool GL_ARB_get_program_binary : 1;
+        bool GL_KHR_parallel_shader_compile : 1;
+        bool GL_EXT_texture_compression_s3tc : 1;
+        bool GL_ARB_texture_compression_bptc : 1;
     } ext;
 
     // Resources
@@ -368,6 +947,13 @@ struct Device
     Program      programs[1024];
     u32          programCount;
 
+    ShaderFile   shaderFiles[MAX_SHADER_FILES];
+    u32          shaderFileCount;
+
+    PipelineState      pipelineStates[64];
+    u32                pipelineStateCount;
+    BoundPipelineState boundPipelineState;
+
     Buffer       constantBuffers[1024];
     u32          constantBufferCount;
 
@@ -395,6 +981,22 @@ struct Device
 
     // For transient constant buffer storage...
     u32 currentConstantBufferIdx;
+
+    // Program binary cache, see program_cache.cpp
+    bool disableProgramCache; // Requested with --no-program-cache, to measure cold startups
+    bool isProgramCacheEnabled;
+    u64  programCacheDriverHash;
+    u32  programCacheHitCount;
+    u32  programCacheMissCount;
+    u64  programLoadTimeNs;
+    u32  programReloadCount;
+
+    // Cooked textures, see texture_cooker.cpp
+    bool disableCookedTextures; // Requested with --no-cooked-textures, to compare with the source images
+    bool isCookedTextureSupported;
+
+    // Mesh optimization, see mesh_optimizer.cpp
+    bool disableMeshOptimization; // Requested with --no-mesh-optimization, to compare with the import order
 };
 
 struct Embedded
@@ -417,8 +1019,10 @@ struct Embedded
 
     // Textured geometry program
     u32    texturedGeometryProgramIdx;
+    u32    blitPipelineStateIdx;         // Alpha blended
+    u32    texturedQuadPipelineStateIdx; // Opaque
 #if USE_GFX_API_OPENGL
-    GLuint texturedGeometryProgram_TextureLoc;
+    GLuint texturedGeometryProgram_TexCoordScaleLoc;
 #endif
 };
 
@@ -428,6 +1032,7 @@ struct DebugDraw
     Vao    opaqueLineVao;
     u32    opaqueLineCount;
     u32    opaqueProgramIdx;
+    u32    opaquePipelineStateIdx;
 
     u32    texQuadCount;
     u32    texQuadTextureHandles[32];
@@ -444,10 +1049,83 @@ struct Scene
     Entity entities[MAX_ENTITIES];
     u32 entityCount;
 
+    // Entities flagged isDynamic, the only ones looked at again while caches stay valid
+    u32 dynamicEntityIndices[MAX_ENTITIES];
+    u32 dynamicEntityCount;
+
     Light  lights[MAX_LIGHTS];
     u32 lightCount;
 
     Camera mainCamera;
+
+    // Bumped whenever static geometry is added, removed or moved
+    u32 staticGeometryVersion;
+};
+
+// Pipelined simulation (--threaded): a simulation thread produces frame N+1 while the render
+// thread, which owns the GL context, draws frame N from an immutable frame packet. Packets go
+// through a ring of FRAME_PACKET_COUNT slots, so the pipeline adds at most
+// FRAME_PACKET_COUNT - 1 frames of input latency.
+#define FRAME_PACKET_COUNT 2
+
+struct Simulation;
+
+// Submesh instances of the scene as the simulation sees them. The render thread snapshots them
+// when entities, meshes, materials or the render path change, and every frame the simulation
+// culls and sorts them into the render queue of its packet.
+struct RenderSceneItem
+{
+    u32   meshSubmeshIdx;
+    mat4  worldMatrix;
+    vec3  boundsMin;             // Local space
+    vec3  boundsMax;
+    uvec4 visibilityDrawData[2]; // Instance tail of the visibility buffer resolve
+};
+
+struct RenderScene
+{
+    RenderSceneItem items[MAX_RENDER_PRIMITIVES];
+    u32             itemCount;
+    u32             version;      // Bumped on every snapshot
+
+    // What the snapshot was taken from
+    RenderPath renderPath;
+    u32        staticGeometryVersion;
+    u32        entityCount;
+    u32        dynamicEntityCount; // Snapshotted every frame while there are any
+    u32        meshCount;
+    u32        materialCount;
+    u32        geometryBufferCount;
+};
+
+// Visible instances of a frame sorted by (mesh << 48 | submesh << 32 | item) key, with their
+// instance data already laid out for the render path, so the render thread only copies it
+#define RENDER_QUEUE_MAX_INSTANCE_STRIDE VISIBILITY_INSTANCE_STRIDE
+
+struct RenderQueue
+{
+    RenderPath renderPath;
+    u32        sceneVersion;
+    u64        keys[MAX_RENDER_PRIMITIVES];
+    u32        keyCount;
+    u32        culledCount;
+    u8         instanceData[MAX_RENDER_PRIMITIVES * RENDER_QUEUE_MAX_INSTANCE_STRIDE];
+    u32        instanceDataSize;
+};
+
+struct FramePacket
+{
+    // Input of the frame, sampled by the platform layer
+    Input      input;
+    ivec2      displaySize;
+    f32        deltaTime;
+    u64        inputTimeNs;
+    RenderPath renderPath;
+
+    // Output of the simulation
+    Camera       camera;
+    RenderQueue* renderQueue; // Owned by the packet slot
+    f32          simulationTimeMs;
 };
 
 enum ProfileEventType {
@@ -459,6 +1137,157 @@ enum ProfileEventType {
     ProfileEventType_Count
 };
 
+// Counters of the work done in a frame, to catch regressions when content or code changes
+struct FrameStats
+{
+    u32 drawCalls;
+    u32 instances;
+    u64 triangles;
+    u32 programBinds;
+    u32 vaoBinds;
+    u32 textureBinds;
+    u64 bufferBytesMapped;
+    u64 bufferBytesWritten;
+    u32 renderPrimitives;
+    u32 entitiesProcessed;
+    u32 frameArenaBytes;
+    u32 stringArenaBytes;
+    u32 commandLists;
+    u32 commands;
+    f32 recordTimeMs; // Wall time of the (parallel) command list recording
+    f32 replayTimeMs; // Command list decoding and GL submission
+    f32 simulationTimeMs;
+    f32 simulationWaitMs; // Render thread blocked on the packet of the frame
+    f32 inputLatencyMs;   // From sampling the input to the end of the frame submission
+    u64 rasterTriangles;  // Software rasterizer, triangles fetched
+    u64 rasterPixels;     // Software rasterizer, pixels shaded
+    f32 rasterTimeMs;
+    f32 frameTimeMs;
+};
+
+enum BenchmarkScene
+{
+    BenchmarkScene_Grid,         // N x N instanced models
+    BenchmarkScene_UniqueMeshes, // Many copies of a model, each one with its own mesh
+    BenchmarkScene_Canyon,       // Project3 canyon_rocks model
+    BenchmarkScene_Sibenik,      // Project3 sibenik model
+    BenchmarkScene_Count
+};
+
+struct BenchmarkConfig
+{
+    bool           isEnabled;
+    const char*    outputFilepath;
+    BenchmarkScene scene;
+    u32            gridSize;
+    u32            uniqueMeshCount;
+    u32            pointLightCount;
+    u32            warmupFrames;
+    u32            frameCount;
+};
+
+// Measurements of one render path over the camera path
+struct BenchmarkRun
+{
+    RenderPath  renderPath;
+    u32         firstMeasuredFrame; // App::frame of the first measured frame
+    FrameStats* frameStats;         // One per measured frame
+
+    f64 cpuGroupTotalMs[MAX_RENDER_GROUPS];
+    f32 cpuGroupMaxMs[MAX_RENDER_GROUPS];
+    u32 cpuGroupSamples[MAX_RENDER_GROUPS];
+    f64 gpuGroupTotalMs[MAX_RENDER_GROUPS];
+    f32 gpuGroupMaxMs[MAX_RENDER_GROUPS];
+    u32 gpuGroupSamples[MAX_RENDER_GROUPS];
+};
+
+struct Benchmark
+{
+    BenchmarkConfig config;
+    BenchmarkRun    runs[RenderPath_Count];
+    u32             runCount;
+    u32             currentRun;
+    u32             runFrame;    // Frames elapsed in the current run, warmup included
+    u32             flushFrames; // Frames waited for late GPU timings after the last run
+    vec3            cameraTarget;
+    f32             cameraRadius;
+    f32             cameraHeight;
+};
+
+// Framebuffer readback into a pixel pack buffer, mapped once its fence signals
+struct SnapshotReadback
+{
+#if USE_GFX_API_OPENGL
+    GLuint pbo;
+    GLsync fence;
+#endif
+    u32    pboSize;
+    ivec2  size;
+    char   filepath[256];
+    bool   isPending;
+};
+
+struct SnapshotWriter; // PNG encoder thread and its queue, see snapshots.cpp
+
+struct Snapshots
+{
+    SnapshotReadback readbacks[SNAPSHOT_READBACK_SLOTS];
+    u32              readbackHead; // Oldest readback, next slot to reuse
+    SnapshotWriter*  writer;
+
+    bool        takeSnapshot;        // Single image of the next frame
+    bool        isCapturingSequence; // An image of every frame until stopped
+    const char* sequencePrefix;      // Images are named <prefix>_<index>.png
+    u32         sequenceIndex;
+
+    u32 readbackCount;
+    u32 readbackStallCount; // Readbacks that waited for the GPU so that no frame was dropped
+    u32 queueStallCount;    // Readbacks that waited for the writer to free a queue slot
+};
+
+// Segment of the texture upload ring, a pixel unpack buffer filled once per frame at most and
+// reused only after its fence signals
+struct AssetUploadSegment
+{
+#if USE_GFX_API_OPENGL
+    GLuint pbo;
+    GLsync fence;
+#endif
+};
+
+struct AssetLoader; // Decoding threads and their request queue, see assets.cpp
+
+struct Assets
+{
+    AssetLoader*       loader;
+    AssetUploadSegment uploadSegments[ASSET_UPLOAD_SEGMENT_COUNT];
+    u32                uploadSegmentIdx; // Next segment to fill
+
+    bool isBlocking;        // Init waits for the assets of the scene, so headless runs are deterministic
+    bool useCookedTextures; // Loader threads read the cooked textures instead of decoding their sources
+
+    u32 requestCount;
+    u32 loadedCount;
+    u32 failedCount;
+    u64 uploadedBytes;
+    u32 uploadStallCount; // Frames whose texture uploads waited for the GPU to release the next segment
+};
+
+struct GpuProfileFrame
+{
+    ProfileEventType eventTypes[MAX_PROFILE_EVENTS_PER_FRAME];
+    u32              eventGroups[MAX_PROFILE_EVENTS_PER_FRAME];
+#if USE_GFX_API_OPENGL
+    GLuint           eventQueries[MAX_PROFILE_EVENTS_PER_FRAME];
+#endif
+    u32              eventCount;
+    u32              frame;
+    bool             isPending; // Submitted, timestamps not read back yet
+};
+
+// CPU rasterizer of the software backend, see software_engine.cpp
+struct SoftwareRenderer;
+
 struct App
 {
     // Loop
@@ -482,23 +1311,22 @@ struct App
 
     DeferredRenderData deferredRenderData;
 
-    Scene scene;
+    VisibilityBufferRenderData visibilityBufferRenderData;
 
-    // Render targets
-    u32 albedoRenderTargetIdx;
-    u32 normalRenderTargetIdx;
-    u32 positionRenderTargetIdx;
-    u32 radianceRenderTargetIdx;
-    u32 depthRenderTargetIdx;
+    ShadowRenderData shadowRenderData;
+
+    Scene scene;
 
-    // Framebuffers
-    u32 gbufferFramebufferIdx;
-    u32 forwardFramebufferIdx;
+    // Frame render graph, rebuilt when the render path or the render target size changes
+    RenderGraph renderGraph;
+    RenderPath  renderGraphPath;
 
-    // Render passes
-    u32 gbufferPassIdx;
-    u32 deferredShadingPassIdx;
-    u32 forwardShadingPassIdx;
+    // Render targets are allocated in size buckets and frames render into the
+    // displaySize sub-rectangle, so resizing only reallocates when the window
+    // outgrows the bucket or has kept a smaller size for a while
+    ivec2 renderTargetSize;
+    ivec2 lastDisplaySize;
+    u32   stableDisplaySizeFrames;
 
     // Global params
     u32 globalParamsBufferIdx;
@@ -506,26 +1334,71 @@ struct App
     u32 globalParamsOffset;
     u32 globalParamsSize;
 
+    // Shadow params
+    u32 shadowParamsBufferIdx;
+    u32 shadowParamsBlockSize;
+    u32 shadowParamsOffset;
+    u32 shadowParamsSize;
+
     // Mode
     RenderPath renderPath;
 
-    bool takeSnapshot;
+    // Asynchronous framebuffer captures
+    Snapshots snapshots;
+
+    // Textures and models streamed in by loader threads, bound to placeholders until uploaded
+    Assets assets;
+
+    // Timeline of Init
+    Startup startup;
+
+    // Multi-threaded recording of the draw loops
+    JobSystem*   jobs;
+    CommandLists commandLists;
+
+    // Simulation, on its own thread if isSimulationThreaded (NULL otherwise)
+    bool        isSimulationThreaded;
+    Simulation* simulation;
+    FramePacket framePacket; // Packet of the frame being rendered
+    RenderScene* renderScene;
+    RenderQueue* renderQueue; // Of the packets simulated inline
+
+#if USE_GFX_API_SOFTWARE
+    SoftwareRenderer* softwareRenderer;
+#endif
+
+#if USE_GFX_API_VULKAN
+    // Frame of the Vulkan backend until the render paths are ported to it
+    u32 vulkanColorTargetIdx;
+    u32 vulkanDepthTargetIdx;
+    u32 vulkanRenderPassIdx;
+#endif
 
     u32         renderGroupCount;
     RenderGroup renderGroups[MAX_RENDER_GROUPS];
     u32         frameRenderGroup;
 
-    ProfileEventType profileEventTypes[MAX_PROFILE_EVENTS];
-    u32              profileEventGroup[MAX_PROFILE_EVENTS];
-#if USE_GFX_API_OPENGL
-    GLuint           profileEventQueries[MAX_PROFILE_EVENTS];
-#endif
-    u32              profileEventCount;
-    u32              profileEventBegin;
+    // GPU profiling, one slot per in-flight frame
+    GpuProfileFrame gpuProfileFrames[MAX_GPU_FRAME_DELAY];
+    u32             gpuProfileDroppedFrames;
+    u64             gpuClockOffsetNs; // Added to GPU timestamps to get profile (CPU) times
+
+    // Stats of the last finished frame, and frame time history
+    FrameStats frameStats;
+    f32        frameTimeHistoryMs[FRAME_STATS_HISTORY_FRAMES];
+    u32        frameTimeHistoryHead;
+    u32        frameTimeHistoryCount;
+    u64        lastFrameEndNs;
+    FILE*      frameStatsCsvFile;
+
+    // Benchmark mode, replaces the default scene and drives the camera and render path
+    Benchmark benchmark;
 };
 
 void Init(App* app);
 
+void SubmitFrameInput(App* app, u64 inputTimeNs);
+
 void BeginFrame(App* app);
 
 void Gui(App* app);
@@ -538,6 +1411,12 @@ void Render(App* app);
 
 void EndFrame(App* app);
 
+void Shutdown(App* app);
+
+bool BenchmarkSceneFromName(const char* name, BenchmarkScene& scene);
+
+bool IsRenderPathSupported(RenderPath renderPath);
+
 
 // Rendering API
 
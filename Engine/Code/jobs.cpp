@@ -0,0 +1,140 @@
+//
+// jobs.cpp : Pool of worker threads for fork-join work. Jobs_ParallelFor hands out the job
+// indices of a batch to the workers and the calling thread alike, and returns once all of
+// them have run. Jobs get the index of the thread running them (0 is the calling thread),
+// so they can use per-thread memory without locking.
+//
+
+struct JobSystem
+{
+    std::thread             workers[MAX_JOB_THREADS];
+    u32                     workerCount;
+
+    std::mutex              mutex;
+    std::condition_variable wakeCondition; // A new batch or quit
+    std::condition_variable doneCondition; // A worker left the batch
+    u32                     batchIdx;
+    u32                     busyWorkerCount;
+    bool                    quit;
+
+    // Current batch
+    JobFunc                 func;
+    void*                   data;
+    u32                     jobCount;
+    std::atomic<u32>        nextJobIdx;
+};
+
+static void Jobs_RunBatch(JobSystem* jobs, u32 threadIdx)
+{
+    for (;;)
+    {
+        const u32 jobIdx = jobs->nextJobIdx++;
+        if (jobIdx >= jobs->jobCount)
+            break;
+        jobs->func(jobs->data, jobIdx, threadIdx);
+    }
+}
+
+static void Jobs_RunWorker(JobSystem* jobs, u32 threadIdx)
+{
+#if USE_CPU_PROFILER
+    char threadName[32];
+    snprintf(threadName, sizeof(threadName), "Worker %u", threadIdx);
+    CpuProfile_SetThreadName(threadName);
+#endif
+
+    u32 batchIdx = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(jobs->mutex);
+            jobs->wakeCondition.wait(lock, [jobs, batchIdx]() { return jobs->batchIdx != batchIdx || jobs->quit; });
+            if (jobs->quit)
+                break;
+            batchIdx = jobs->batchIdx;
+            jobs->busyWorkerCount++;
+        }
+
+        Jobs_RunBatch(jobs, threadIdx);
+
+        {
+            std::lock_guard<std::mutex> lock(jobs->mutex);
+            jobs->busyWorkerCount--;
+        }
+        jobs->doneCondition.notify_all();
+    }
+}
+
+// workerCount 0 picks one worker per hardware thread besides the calling one
+JobSystem* Jobs_Create(u32 workerCount)
+{
+    if (workerCount == 0)
+    {
+        const u32 hardwareThreadCount = std::thread::hardware_concurrency();
+        workerCount = hardwareThreadCount > 1 ? hardwareThreadCount - 1 : 0;
+    }
+    workerCount = min(workerCount, (u32)MAX_JOB_THREADS - 1);
+
+    JobSystem* jobs = new JobSystem();
+    jobs->workerCount = workerCount;
+    for (u32 i = 0; i < workerCount; ++i)
+        jobs->workers[i] = std::thread(Jobs_RunWorker, jobs, i + 1);
+
+    ILOG("Job system: %u worker threads", workerCount);
+    return jobs;
+}
+
+void Jobs_Destroy(JobSystem* jobs)
+{
+    if (!jobs)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(jobs->mutex);
+        jobs->quit = true;
+    }
+    jobs->wakeCondition.notify_all();
+    for (u32 i = 0; i < jobs->workerCount; ++i)
+        jobs->workers[i].join();
+
+    delete jobs;
+}
+
+// Number of threads that may run jobs, to size per-thread data
+u32 Jobs_GetThreadCount(const JobSystem* jobs)
+{
+    return jobs ? jobs->workerCount + 1 : 1;
+}
+
+// Runs func(data, jobIdx, threadIdx) for every jobIdx in [0, jobCount) and waits for all of them.
+// Without jobs (or workers) everything runs on the calling thread. Batches do not nest, and
+// only one thread at a time may submit them.
+void Jobs_ParallelFor(JobSystem* jobs, u32 jobCount, JobFunc func, void* data)
+{
+    if (!jobs || jobs->workerCount == 0 || jobCount <= 1)
+    {
+        for (u32 jobIdx = 0; jobIdx < jobCount; ++jobIdx)
+            func(data, jobIdx, 0);
+        return;
+    }
+
+    {
+        // A worker that woke up late for the previous batch may still be leaving it
+        std::unique_lock<std::mutex> lock(jobs->mutex);
+        jobs->doneCondition.wait(lock, [jobs]() { return jobs->busyWorkerCount == 0; });
+
+        jobs->func = func;
+        jobs->data = data;
+        jobs->jobCount = jobCount;
+        jobs->nextJobIdx = 0;
+        jobs->batchIdx++;
+    }
+    jobs->wakeCondition.notify_all();
+
+    Jobs_RunBatch(jobs, 0);
+
+    // Workers still inside Jobs_RunBatch could be running the last jobs, and must not see the
+    // batch change under them
+    std::unique_lock<std::mutex> lock(jobs->mutex);
+    jobs->doneCondition.wait(lock, [jobs]() { return jobs->busyWorkerCount == 0; });
+}
@@ -0,0 +1,539 @@
+//
+// mesh_optimizer.cpp : Reordering of the triangle lists of every submesh for the GPU, as they
+// are imported. Triangles are first sorted for the post-transform vertex cache with Tipsify
+// (Sander et al. 2007). The clusters it leaves behind are then split wherever that costs little
+// in cache hits, and sorted so the ones facing away from the center of the mesh are drawn first,
+// which lowers overdraw from most points of view. Last, vertices are renumbered in the order the
+// indices first reference them, so the vertex fetch walks the buffer forwards. The figures of
+// each submesh before and after are kept in its MeshStats for the asset report. None of the
+// functions here log nor touch the frame or scratch arenas, loader threads call them too.
+//
+
+#define MESH_OPTIMIZER_CACHE_SIZE         16    // Entries of the simulated FIFO post-transform cache
+#define MESH_OPTIMIZER_FETCH_LINE_SIZE    64
+#define MESH_OPTIMIZER_FETCH_LINE_COUNT   256   // Direct mapped, 16 KB of simulated vertex fetch cache
+#define MESH_OPTIMIZER_OVERDRAW_THRESHOLD 1.05f // ACMR allowed to the split clusters over their Tipsify order
+#define MESH_OPTIMIZER_OVERDRAW_VIEWPORT  128   // Resolution of the views rasterized to estimate the overdraw
+
+static bool g_OptimizeMeshes = true; // Cleared with --no-mesh-optimization, read by the loader threads
+
+inline const vec3& MeshOptimizer_Position(const u8* vertices, u32 vertexStride, u32 vertexIdx)
+{
+    // Every vertex layout starts with the position
+    return *(const vec3*)(vertices + (u64)vertexIdx * vertexStride);
+}
+
+// Transforms and vertex fetch of the indices through FIFO caches, see MeshStats
+static void MeshOptimizer_AnalyzeVertexCache(const u32* indices, u32 indexCount, u32 vertexCount, u32 vertexStride, MeshStats& stats)
+{
+    u32* cacheTimestamps = (u32*)calloc(vertexCount, sizeof(u32));
+    u32 timestamp = MESH_OPTIMIZER_CACHE_SIZE + 1;
+
+    u64 fetchLines[MESH_OPTIMIZER_FETCH_LINE_COUNT];
+    for (u32 i = 0; i < MESH_OPTIMIZER_FETCH_LINE_COUNT; ++i)
+        fetchLines[i] = UINT64_MAX;
+
+    u32 transformedCount = 0;
+    u32 uniqueCount = 0;
+    u64 fetchedSize = 0;
+    for (u32 i = 0; i < indexCount; ++i)
+    {
+        const u32 vertexIdx = indices[i];
+        if (timestamp - cacheTimestamps[vertexIdx] <= MESH_OPTIMIZER_CACHE_SIZE)
+            continue;
+
+        uniqueCount += (cacheTimestamps[vertexIdx] == 0);
+        cacheTimestamps[vertexIdx] = timestamp++;
+        transformedCount++;
+
+        const u64 firstLine = (u64)vertexIdx * vertexStride / MESH_OPTIMIZER_FETCH_LINE_SIZE;
+        const u64 lastLine = ((u64)vertexIdx * vertexStride + vertexStride - 1) / MESH_OPTIMIZER_FETCH_LINE_SIZE;
+        for (u64 line = firstLine; line <= lastLine; ++line)
+        {
+            u64& cachedLine = fetchLines[line % MESH_OPTIMIZER_FETCH_LINE_COUNT];
+            if (cachedLine != line)
+            {
+                cachedLine = line;
+                fetchedSize += MESH_OPTIMIZER_FETCH_LINE_SIZE;
+            }
+        }
+    }
+
+    free(cacheTimestamps);
+
+    const u32 triangleCount = indexCount / 3;
+    stats.acmr = triangleCount ? (f32)transformedCount / (f32)triangleCount : 0.0f;
+    stats.atvr = uniqueCount ? (f32)transformedCount / (f32)uniqueCount : 0.0f;
+    stats.overfetch = vertexCount ? (f32)fetchedSize / (f32)((u64)vertexCount * vertexStride) : 0.0f;
+}
+
+// Depth tested rasterization of a counter-clockwise triangle in viewport coordinates, returns
+// the number of pixels shaded, back faces are culled
+static u32 MeshOptimizer_RasterizeTriangle(f32* depths, const vec3& a, const vec3& b, const vec3& c)
+{
+    const f32 area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    if (area <= 0.0f)
+        return 0;
+
+    const i32 viewport = MESH_OPTIMIZER_OVERDRAW_VIEWPORT;
+    const i32 minX = max((i32)floorf(min(a.x, min(b.x, c.x))), 0);
+    const i32 minY = max((i32)floorf(min(a.y, min(b.y, c.y))), 0);
+    const i32 maxX = min((i32)ceilf(max(a.x, max(b.x, c.x))), viewport - 1);
+    const i32 maxY = min((i32)ceilf(max(a.y, max(b.y, c.y))), viewport - 1);
+
+    u32 shadedCount = 0;
+    for (i32 y = minY; y <= maxY; ++y)
+    {
+        for (i32 x = minX; x <= maxX; ++x)
+        {
+            // Edge functions at the pixel center, all positive inside
+            const f32 px = x + 0.5f;
+            const f32 py = y + 0.5f;
+            const f32 wa = (c.x - b.x) * (py - b.y) - (c.y - b.y) * (px - b.x);
+            const f32 wb = (a.x - c.x) * (py - c.y) - (a.y - c.y) * (px - c.x);
+            const f32 wc = (b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x);
+            if (wa < 0.0f || wb < 0.0f || wc < 0.0f)
+                continue;
+
+            const f32 depth = (wa * a.z + wb * b.z + wc * c.z) / area;
+            f32& storedDepth = depths[y * viewport + x];
+            if (depth < storedDepth)
+            {
+                storedDepth = depth;
+                shadedCount++;
+            }
+        }
+    }
+    return shadedCount;
+}
+
+// Pixels shaded per pixel covered, drawing the triangles in order with orthographic views from
+// both sides of the three axes
+static f32 MeshOptimizer_AnalyzeOverdraw(const u8* vertices, u32 vertexCount, u32 vertexStride, const u32* indices, u32 indexCount)
+{
+    const u32 viewport = MESH_OPTIMIZER_OVERDRAW_VIEWPORT;
+    f32* depths = (f32*)malloc(viewport * viewport * sizeof(f32));
+    vec3* projected = (vec3*)malloc(vertexCount * sizeof(vec3));
+
+    u64 coveredCount = 0;
+    u64 shadedCount = 0;
+    for (u32 axis = 0; axis < 3; ++axis)
+    {
+        for (i32 side = -1; side <= 1; side += 2)
+        {
+            // Looking down the axis towards negative values for side -1, the other two axes span
+            // the viewport and keep the winding of the triangles
+            vec2 boundsMin = vec2( FLT_MAX);
+            vec2 boundsMax = vec2(-FLT_MAX);
+            for (u32 i = 0; i < vertexCount; ++i)
+            {
+                const vec3& position = MeshOptimizer_Position(vertices, vertexStride, i);
+                projected[i] = vec3(-side * position[(axis + 1) % 3], position[(axis + 2) % 3], side * position[axis]);
+                boundsMin = min(boundsMin, vec2(projected[i]));
+                boundsMax = max(boundsMax, vec2(projected[i]));
+            }
+
+            const f32 extent = max(boundsMax.x - boundsMin.x, boundsMax.y - boundsMin.y);
+            if (extent <= 0.0f)
+                continue;
+
+            const f32 scale = viewport / extent;
+            for (u32 i = 0; i < vertexCount; ++i)
+            {
+                projected[i].x = (projected[i].x - boundsMin.x) * scale;
+                projected[i].y = (projected[i].y - boundsMin.y) * scale;
+            }
+
+            for (u32 i = 0; i < viewport * viewport; ++i)
+                depths[i] = FLT_MAX;
+
+            for (u32 i = 0; i + 2 < indexCount; i += 3)
+                shadedCount += MeshOptimizer_RasterizeTriangle(depths, projected[indices[i]], projected[indices[i + 1]], projected[indices[i + 2]]);
+
+            for (u32 i = 0; i < viewport * viewport; ++i)
+                coveredCount += (depths[i] < FLT_MAX);
+        }
+    }
+
+    free(projected);
+    free(depths);
+
+    return coveredCount ? (f32)shadedCount / (f32)coveredCount : 1.0f;
+}
+
+void MeshOptimizer_Analyze(const u8* vertices, u32 vertexCount, u32 vertexStride, const u32* indices, u32 indexCount, MeshStats& stats)
+{
+    MeshOptimizer_AnalyzeVertexCache(indices, indexCount, vertexCount, vertexStride, stats);
+    stats.overdraw = MeshOptimizer_AnalyzeOverdraw(vertices, vertexCount, vertexStride, indices, indexCount);
+}
+
+// Next vertex to fan around once the current fan leaves no candidate: the last vertex emitted
+// that still has triangles left, or the first one in index order. Returns UINT32_MAX when done.
+static u32 MeshOptimizer_SkipDeadEnd(const u32* liveCounts, u32* deadEnds, u32& deadEndCount, u32 vertexCount, u32& cursor)
+{
+    while (deadEndCount > 0)
+    {
+        const u32 vertexIdx = deadEnds[--deadEndCount];
+        if (liveCounts[vertexIdx] > 0)
+            return vertexIdx;
+    }
+
+    for (; cursor < vertexCount; ++cursor)
+        if (liveCounts[cursor] > 0)
+            return cursor;
+
+    return UINT32_MAX;
+}
+
+// Tipsify, emits the triangles around each vertex in turn and moves on to the neighbour that
+// is most likely to still be in the cache. Whenever it has to jump to a dead end a new cluster
+// starts, their first triangles are written to clusterStarts and their count is returned.
+static u32 MeshOptimizer_Tipsify(const u32* indices, u32 indexCount, u32 vertexCount, u32* outIndices, u32* clusterStarts)
+{
+    const u32 triangleCount = indexCount / 3;
+
+    // Triangles around each vertex
+    u32* liveCounts = (u32*)calloc(vertexCount, sizeof(u32));
+    u32* adjacencyOffsets = (u32*)malloc((vertexCount + 1) * sizeof(u32));
+    u32* adjacency = (u32*)malloc(indexCount * sizeof(u32));
+    u32* cacheTimestamps = (u32*)calloc(vertexCount, sizeof(u32));
+    u32* deadEnds = (u32*)malloc(indexCount * sizeof(u32));
+    u32* candidates = (u32*)malloc(indexCount * sizeof(u32));
+    bool* isEmitted = (bool*)calloc(triangleCount, sizeof(bool));
+
+    for (u32 i = 0; i < indexCount; ++i)
+        liveCounts[indices[i]]++;
+
+    adjacencyOffsets[0] = 0;
+    for (u32 i = 0; i < vertexCount; ++i)
+        adjacencyOffsets[i + 1] = adjacencyOffsets[i] + liveCounts[i];
+
+    // The timestamps are zero again once the adjacency is filled
+    for (u32 i = 0; i < indexCount; ++i)
+        adjacency[adjacencyOffsets[indices[i]] + cacheTimestamps[indices[i]]++] = i / 3;
+    for (u32 i = 0; i < vertexCount; ++i)
+        cacheTimestamps[i] = 0;
+
+    u32 timestamp = MESH_OPTIMIZER_CACHE_SIZE + 1;
+    u32 deadEndCount = 0;
+    u32 cursor = 0;
+    u32 outIndexCount = 0;
+    u32 clusterCount = 0;
+
+    u32 fanVertexIdx = MeshOptimizer_SkipDeadEnd(liveCounts, deadEnds, deadEndCount, vertexCount, cursor);
+    while (fanVertexIdx != UINT32_MAX)
+    {
+        if (clusterCount == 0 || clusterStarts[clusterCount - 1] != outIndexCount / 3)
+            clusterStarts[clusterCount++] = outIndexCount / 3;
+
+        u32 nextVertexIdx = UINT32_MAX;
+        while (fanVertexIdx != UINT32_MAX)
+        {
+            u32 candidateCount = 0;
+            for (u32 i = adjacencyOffsets[fanVertexIdx]; i < adjacencyOffsets[fanVertexIdx + 1]; ++i)
+            {
+                const u32 triangleIdx = adjacency[i];
+                if (isEmitted[triangleIdx])
+                    continue;
+
+                for (u32 j = 0; j < 3; ++j)
+                {
+                    const u32 vertexIdx = indices[triangleIdx * 3 + j];
+                    outIndices[outIndexCount++] = vertexIdx;
+                    deadEnds[deadEndCount++] = vertexIdx;
+                    candidates[candidateCount++] = vertexIdx;
+                    liveCounts[vertexIdx]--;
+                    if (timestamp - cacheTimestamps[vertexIdx] > MESH_OPTIMIZER_CACHE_SIZE)
+                        cacheTimestamps[vertexIdx] = timestamp++;
+                }
+                isEmitted[triangleIdx] = true;
+            }
+
+            // Prefer the oldest candidate whose remaining triangles would still find it in the cache,
+            // if none would the fan ends and the next one starts from the dead-end stack
+            nextVertexIdx = UINT32_MAX;
+            i32 bestPriority = 0;
+            for (u32 i = 0; i < candidateCount; ++i)
+            {
+                const u32 vertexIdx = candidates[i];
+                if (liveCounts[vertexIdx] == 0)
+                    continue;
+
+                const u32 age = timestamp - cacheTimestamps[vertexIdx];
+                const i32 priority = (age + 2 * liveCounts[vertexIdx] <= MESH_OPTIMIZER_CACHE_SIZE) ? (i32)age : 0;
+                if (priority > bestPriority)
+                {
+                    bestPriority = priority;
+                    nextVertexIdx = vertexIdx;
+                }
+            }
+
+            fanVertexIdx = nextVertexIdx;
+        }
+
+        fanVertexIdx = MeshOptimizer_SkipDeadEnd(liveCounts, deadEnds, deadEndCount, vertexCount, cursor);
+    }
+
+    free(isEmitted);
+    free(candidates);
+    free(deadEnds);
+    free(cacheTimestamps);
+    free(adjacency);
+    free(adjacencyOffsets);
+    free(liveCounts);
+
+    return clusterCount;
+}
+
+static int MeshOptimizer_CompareKeys(const void* a, const void* b)
+{
+    const u64 ka = *(const u64*)a;
+    const u64 kb = *(const u64*)b;
+    return (ka < kb) ? -1 : (ka > kb) ? 1 : 0;
+}
+
+// Splits the Tipsify clusters further wherever the ACMR of the part so far stays within the
+// threshold of the whole cluster, then draws the clusters that face away from the center of
+// the mesh first, since they tend to occlude the rest (Sander et al. 2007)
+static void MeshOptimizer_SortClustersForOverdraw(const u8* vertices, u32 vertexCount, u32 vertexStride, const u32* indices, u32 indexCount,
+                                                  const u32* clusterStarts, u32 clusterCount, u32* outIndices)
+{
+    const u32 triangleCount = indexCount / 3;
+    u32* cacheTimestamps = (u32*)calloc(vertexCount, sizeof(u32));
+    u32* splitStarts = (u32*)malloc((triangleCount + 1) * sizeof(u32));
+    u32 splitCount = 0;
+
+    // Moving the timestamp past the cache size flushes the simulated cache
+    u32 timestamp = MESH_OPTIMIZER_CACHE_SIZE + 1;
+    for (u32 i = 0; i < clusterCount; ++i)
+    {
+        const u32 begin = clusterStarts[i];
+        const u32 end = (i + 1 < clusterCount) ? clusterStarts[i + 1] : triangleCount;
+
+        u32 clusterMissCount = 0;
+        timestamp += MESH_OPTIMIZER_CACHE_SIZE + 1;
+        for (u32 j = begin * 3; j < end * 3; ++j)
+        {
+            if (timestamp - cacheTimestamps[indices[j]] > MESH_OPTIMIZER_CACHE_SIZE)
+            {
+                cacheTimestamps[indices[j]] = timestamp++;
+                clusterMissCount++;
+            }
+        }
+        const f32 clusterAcmr = (f32)clusterMissCount / (f32)(end - begin);
+
+        u32 splitBegin = begin;
+        u32 missCount = 0;
+        splitStarts[splitCount++] = begin;
+        timestamp += MESH_OPTIMIZER_CACHE_SIZE + 1;
+        for (u32 j = begin; j < end; ++j)
+        {
+            for (u32 k = j * 3; k < j * 3 + 3; ++k)
+            {
+                if (timestamp - cacheTimestamps[indices[k]] > MESH_OPTIMIZER_CACHE_SIZE)
+                {
+                    cacheTimestamps[indices[k]] = timestamp++;
+                    missCount++;
+                }
+            }
+
+            if (j + 1 < end && missCount <= MESH_OPTIMIZER_OVERDRAW_THRESHOLD * clusterAcmr * (j + 1 - splitBegin))
+            {
+                splitBegin = j + 1;
+                missCount = 0;
+                splitStarts[splitCount++] = splitBegin;
+                timestamp += MESH_OPTIMIZER_CACHE_SIZE + 1;
+            }
+        }
+    }
+    splitStarts[splitCount] = triangleCount;
+    free(cacheTimestamps);
+
+    // Area weighted centroid and normal of each cluster, and of the whole mesh
+    vec3* centroids = (vec3*)malloc(splitCount * sizeof(vec3));
+    vec3* normals = (vec3*)malloc(splitCount * sizeof(vec3));
+    vec3 meshCentroid = vec3(0.0f);
+    f32 meshArea = 0.0f;
+    for (u32 i = 0; i < splitCount; ++i)
+    {
+        vec3 centroid = vec3(0.0f);
+        vec3 normal = vec3(0.0f);
+        f32 area = 0.0f;
+        for (u32 j = splitStarts[i]; j < splitStarts[i + 1]; ++j)
+        {
+            const vec3& a = MeshOptimizer_Position(vertices, vertexStride, indices[j * 3 + 0]);
+            const vec3& b = MeshOptimizer_Position(vertices, vertexStride, indices[j * 3 + 1]);
+            const vec3& c = MeshOptimizer_Position(vertices, vertexStride, indices[j * 3 + 2]);
+            const vec3 triangleNormal = cross(b - a, c - a);
+            const f32 triangleArea = length(triangleNormal);
+            centroid += (a + b + c) * (triangleArea / 3.0f);
+            normal += triangleNormal;
+            area += triangleArea;
+        }
+
+        meshCentroid += centroid;
+        meshArea += area;
+        centroids[i] = area > 0.0f ? centroid / area : vec3(0.0f);
+        normals[i] = normal;
+    }
+    if (meshArea > 0.0f)
+        meshCentroid /= meshArea;
+
+    // Descending by how much each cluster faces away, the cluster index in the low bits
+    u64* keys = (u64*)malloc(splitCount * sizeof(u64));
+    for (u32 i = 0; i < splitCount; ++i)
+    {
+        const f32 normalLength = length(normals[i]);
+        const f32 facing = normalLength > 0.0f ? dot(centroids[i] - meshCentroid, normals[i] / normalLength) : 0.0f;
+
+        u32 bits;
+        memcpy(&bits, &facing, sizeof(bits));
+        bits = (bits & 0x80000000) ? ~bits : (bits | 0x80000000); // Ascending as unsigned
+        keys[i] = ((u64)~bits << 32) | i;
+    }
+    qsort(keys, splitCount, sizeof(u64), MeshOptimizer_CompareKeys);
+
+    u32 outIndexCount = 0;
+    for (u32 i = 0; i < splitCount; ++i)
+    {
+        const u32 clusterIdx = (u32)keys[i];
+        const u32 begin = splitStarts[clusterIdx] * 3;
+        const u32 end = splitStarts[clusterIdx + 1] * 3;
+        memcpy(outIndices + outIndexCount, indices + begin, (end - begin) * sizeof(u32));
+        outIndexCount += end - begin;
+    }
+
+    free(keys);
+    free(normals);
+    free(centroids);
+    free(splitStarts);
+}
+
+// Renumbers the vertices in the order the indices first use them, unreferenced ones go last
+static void MeshOptimizer_RemapVertexFetch(u8* vertices, u32 vertexCount, u32 vertexStride, u32* indices, u32 indexCount)
+{
+    u32* remap = (u32*)malloc(vertexCount * sizeof(u32));
+    for (u32 i = 0; i < vertexCount; ++i)
+        remap[i] = UINT32_MAX;
+
+    u32 nextVertexIdx = 0;
+    for (u32 i = 0; i < indexCount; ++i)
+    {
+        u32& newVertexIdx = remap[indices[i]];
+        if (newVertexIdx == UINT32_MAX)
+            newVertexIdx = nextVertexIdx++;
+        indices[i] = newVertexIdx;
+    }
+    for (u32 i = 0; i < vertexCount; ++i)
+        if (remap[i] == UINT32_MAX)
+            remap[i] = nextVertexIdx++;
+
+    const u64 verticesSize = (u64)vertexCount * vertexStride;
+    u8* sourceVertices = (u8*)malloc(verticesSize);
+    memcpy(sourceVertices, vertices, verticesSize);
+    for (u32 i = 0; i < vertexCount; ++i)
+        memcpy(vertices + (u64)remap[i] * vertexStride, sourceVertices + (u64)i * vertexStride, vertexStride);
+
+    free(sourceVertices);
+    free(remap);
+}
+
+// Reorders the triangle list and its vertices in place, sourceStats and optimizedStats receive
+// the figures before and after (the same ones if optimizations are disabled)
+void MeshOptimizer_Optimize(u8* vertices, u32 vertexCount, u32 vertexStride, u32* indices, u32 indexCount,
+                            MeshStats& sourceStats, MeshStats& optimizedStats)
+{
+    CPU_PROFILE_FUNCTION();
+
+    MeshOptimizer_Analyze(vertices, vertexCount, vertexStride, indices, indexCount, sourceStats);
+    optimizedStats = sourceStats;
+
+    const u32 triangleCount = indexCount / 3;
+    if (!g_OptimizeMeshes || triangleCount < 2)
+        return;
+
+    u32* tipsifiedIndices = (u32*)malloc(indexCount * sizeof(u32));
+    u32* clusterStarts = (u32*)malloc(triangleCount * sizeof(u32));
+    const u32 clusterCount = MeshOptimizer_Tipsify(indices, indexCount, vertexCount, tipsifiedIndices, clusterStarts);
+    MeshOptimizer_SortClustersForOverdraw(vertices, vertexCount, vertexStride, tipsifiedIndices, indexCount, clusterStarts, clusterCount, indices);
+    free(clusterStarts);
+    free(tipsifiedIndices);
+
+    MeshOptimizer_RemapVertexFetch(vertices, vertexCount, vertexStride, indices, indexCount);
+
+    MeshOptimizer_Analyze(vertices, vertexCount, vertexStride, indices, indexCount, optimizedStats);
+}
+
+// Triangle weighted figures of the whole mesh, or vertex weighted for those per vertex
+static void MeshOptimizer_Total(const Mesh& mesh, bool optimized, MeshStats& total, u32& triangleCount, u32& vertexCount)
+{
+    total = MeshStats{};
+    triangleCount = 0;
+    vertexCount = 0;
+    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+    {
+        const Submesh& submesh = mesh.submeshes[i];
+        const MeshStats& stats = optimized ? submesh.optimizedStats : submesh.sourceStats;
+        const u32 submeshTriangleCount = submesh.indexCount / 3;
+        total.acmr += stats.acmr * submeshTriangleCount;
+        total.overdraw += stats.overdraw * submeshTriangleCount;
+        total.atvr += stats.atvr * submesh.vertexCount;
+        total.overfetch += stats.overfetch * submesh.vertexCount;
+        triangleCount += submeshTriangleCount;
+        vertexCount += submesh.vertexCount;
+    }
+
+    if (triangleCount > 0)
+    {
+        total.acmr /= triangleCount;
+        total.overdraw /= triangleCount;
+    }
+    if (vertexCount > 0)
+    {
+        total.atvr /= vertexCount;
+        total.overfetch /= vertexCount;
+    }
+}
+
+void MeshOptimizer_LogReport(const Mesh& mesh)
+{
+    MeshStats source, optimized;
+    u32 triangleCount, vertexCount;
+    MeshOptimizer_Total(mesh, false, source, triangleCount, vertexCount);
+    MeshOptimizer_Total(mesh, true, optimized, triangleCount, vertexCount);
+
+    ILOG("Mesh %s: %u submeshes, %u triangles, ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, overfetch %.3f -> %.3f, overdraw %.3f -> %.3f",
+         mesh.name.str, (u32)mesh.submeshes.size(), triangleCount, source.acmr, optimized.acmr, source.atvr, optimized.atvr,
+         source.overfetch, optimized.overfetch, source.overdraw, optimized.overdraw);
+}
+
+void MeshOptimizer_Gui(App* app)
+{
+    const Device& device = app->device;
+
+    ImGui::Text("Vertex cache optimization: %s (FIFO of %d, before -> after)", g_OptimizeMeshes ? "on" : "off", MESH_OPTIMIZER_CACHE_SIZE);
+    for (u32 i = 0; i < device.meshCount; ++i)
+    {
+        const Mesh& mesh = device.meshes[i];
+        if (!mesh.name.str)
+            continue;
+
+        MeshStats source, optimized;
+        u32 triangleCount, vertexCount;
+        MeshOptimizer_Total(mesh, false, source, triangleCount, vertexCount);
+        MeshOptimizer_Total(mesh, true, optimized, triangleCount, vertexCount);
+
+        ImGui::Text("%s: %u triangles, ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, overdraw %.3f -> %.3f",
+                    mesh.name.str, triangleCount, source.acmr, optimized.acmr, source.atvr, optimized.atvr,
+                    source.overdraw, optimized.overdraw);
+        for (u32 j = 0; j < mesh.submeshes.size(); ++j)
+        {
+            const Submesh& submesh = mesh.submeshes[j];
+            ImGui::BulletText("%u: %u triangles, ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, overfetch %.3f -> %.3f, overdraw %.3f -> %.3f",
+                              j, submesh.indexCount / 3, submesh.sourceStats.acmr, submesh.optimizedStats.acmr,
+                              submesh.sourceStats.atvr, submesh.optimizedStats.atvr,
+                              submesh.sourceStats.overfetch, submesh.optimizedStats.overfetch,
+                              submesh.sourceStats.overdraw, submesh.optimizedStats.overdraw);
+        }
+    }
+}
@@ -0,0 +1,536 @@
+//
+// microbench.cpp : Standalone micro-benchmarks of the engine CPU hot paths. It builds the
+// platform layer and the engine into its own executable, but never opens a window nor
+// creates a graphics context, so it only exercises code that runs on the CPU with
+// synthetic inputs. Usage: microbench [filter] [--reps N]
+//
+
+#define PLATFORM_NO_MAIN
+#include "platform.cpp"
+#include "engine.cpp"
+
+#define MICROBENCH_DEFAULT_REPETITIONS 31
+#define MICROBENCH_WARMUP_REPETITIONS  3
+#define MICROBENCH_MAX_REPETITIONS     1024
+
+// Written by the benchmarks so the compiler cannot optimize away their results
+static volatile u64 MicrobenchSink = 0;
+
+struct MicrobenchOptions
+{
+    const char* filter;
+    u32         repetitions;
+};
+
+static MicrobenchOptions MicrobenchOpts = { NULL, MICROBENCH_DEFAULT_REPETITIONS };
+
+static int CompareU64(const void* a, const void* b)
+{
+    const u64 va = *(const u64*)a;
+    const u64 vb = *(const u64*)b;
+    return (va < vb) ? -1 : (va > vb) ? 1 : 0;
+}
+
+static u64 MedianU64(u64* values, u32 count)
+{
+    qsort(values, count, sizeof(u64), CompareU64);
+    return values[count / 2];
+}
+
+// Runs the benchmark a few times to warm up caches, then times every repetition and reports the
+// median and the median absolute deviation, which are robust against the outliers caused by the OS
+template <typename Function>
+static void RunBenchmark(const char* name, u64 itemsPerRep, u64 bytesPerRep, Function function)
+{
+    if (MicrobenchOpts.filter && !strstr(name, MicrobenchOpts.filter))
+        return;
+
+    for (u32 i = 0; i < MICROBENCH_WARMUP_REPETITIONS; ++i)
+        function();
+
+    u64 timesNs[MICROBENCH_MAX_REPETITIONS];
+    u64 deviationsNs[MICROBENCH_MAX_REPETITIONS];
+    const u32 repetitions = MicrobenchOpts.repetitions;
+
+    for (u32 i = 0; i < repetitions; ++i)
+    {
+        const u64 beginNs = GetProfileTimeNs();
+        function();
+        timesNs[i] = GetProfileTimeNs() - beginNs;
+    }
+
+    const u64 medianNs = MedianU64(timesNs, repetitions);
+    for (u32 i = 0; i < repetitions; ++i)
+        deviationsNs[i] = (timesNs[i] > medianNs) ? timesNs[i] - medianNs : medianNs - timesNs[i];
+    const u64 madNs = MedianU64(deviationsNs, repetitions);
+
+    const double seconds = (medianNs > 0 ? medianNs : 1) * 1.0e-9;
+    const double itemsPerSecond = itemsPerRep / seconds;
+    const double gigabytesPerSecond = bytesPerRep / seconds * 1.0e-9;
+
+    printf("%-32s %12.3f us %10.3f us (%5.1f%%) %12.2f Mitems/s",
+           name,
+           medianNs * 1.0e-3,
+           madNs * 1.0e-3,
+           100.0 * madNs / (medianNs > 0 ? medianNs : 1),
+           itemsPerSecond * 1.0e-6);
+    if (bytesPerRep > 0)
+        printf(" %8.2f GB/s", gigabytesPerSecond);
+    printf("\n");
+}
+
+// Deterministic inputs, so different builds can be compared run to run
+static u64 MicrobenchRandomState = 0x9E3779B97F4A7C15ull;
+
+static u64 RandomU64()
+{
+    // xorshift64*
+    MicrobenchRandomState ^= MicrobenchRandomState >> 12;
+    MicrobenchRandomState ^= MicrobenchRandomState << 25;
+    MicrobenchRandomState ^= MicrobenchRandomState >> 27;
+    return MicrobenchRandomState * 0x2545F4914F6CDD1Dull;
+}
+
+static float RandomFloat()
+{
+    return (RandomU64() >> 40) / (float)(1 << 24);
+}
+
+static void Benchmark_PushData()
+{
+    const u32 chunkSize = 64;
+    const u32 chunkCount = 16384;
+    u8 chunk[chunkSize] = {};
+    Arena arena = CreateArena(chunkSize * chunkCount);
+
+    RunBenchmark("PushData", chunkCount, chunkSize * chunkCount, [&]() {
+        arena.head = 0;
+        for (u32 i = 0; i < chunkCount; ++i)
+            PushData(arena, chunk, chunkSize);
+        MicrobenchSink += arena.head;
+    });
+
+    DestroyArena(arena);
+}
+
+static void Benchmark_PushAlignedData()
+{
+    // Mimics the per-entity local params pushed into the constant buffers
+    const u32 entityCount = 16384;
+    const mat4 worldMatrix(1.0f);
+    Buffer buffer = {};
+    buffer.size = entityCount * 2 * sizeof(mat4);
+    buffer.data = malloc(buffer.size);
+
+    RunBenchmark("PushAlignedData", entityCount, entityCount * 2 * sizeof(mat4), [&]() {
+        buffer.head = 0;
+        for (u32 i = 0; i < entityCount; ++i)
+        {
+            BufferPushMat4(buffer, worldMatrix);
+            BufferPushMat4(buffer, worldMatrix);
+        }
+        MicrobenchSink += buffer.head;
+    });
+
+    free(buffer.data);
+}
+
+static void Benchmark_QSort()
+{
+    const u32 keyCount = MAX_RENDER_PRIMITIVES;
+    u64* sourceKeys = new u64[keyCount];
+    u64* keys = new u64[keyCount];
+    for (u32 i = 0; i < keyCount; ++i)
+        sourceKeys[i] = RandomU64();
+
+    RunBenchmark("QSort", keyCount, keyCount * sizeof(u64), [&]() {
+        MemCopy(keys, sourceKeys, keyCount * sizeof(u64));
+        QSort(keys, keys + keyCount - 1);
+        MicrobenchSink += keys[0];
+    });
+
+    delete[] keys;
+    delete[] sourceKeys;
+}
+
+static void Benchmark_FindVAO()
+{
+    // The vaos are already created, so this only measures the linear search of the hit path
+    Device* device = new Device();
+    const u32 meshCount = 64;
+    const u32 programCount = 8;
+
+    device->meshCount = meshCount;
+    for (u32 meshIdx = 0; meshIdx < meshCount; ++meshIdx)
+        device->meshes[meshIdx].submeshes.resize(2);
+
+    for (u32 programIdx = 0; programIdx < programCount; ++programIdx)
+        device->programs[programIdx].handle = programIdx + 1;
+    device->programCount = programCount;
+
+    for (u32 meshIdx = 0; meshIdx < meshCount; ++meshIdx)
+        for (u32 submeshIdx = 0; submeshIdx < 2; ++submeshIdx)
+            for (u32 programIdx = 0; programIdx < programCount; ++programIdx)
+            {
+                ASSERT(device->vaoCount < ARRAY_COUNT(device->vaos), "Max number of vaos reached");
+                Vao& vao = device->vaos[device->vaoCount++];
+                vao.handle = device->vaoCount;
+                vao.programHandle = device->programs[programIdx].handle;
+                vao.meshIdx = meshIdx;
+                vao.submeshIdx = submeshIdx;
+            }
+
+    const u32 lookupCount = 4096;
+    u32* lookups = new u32[lookupCount];
+    for (u32 i = 0; i < lookupCount; ++i)
+        lookups[i] = RandomU64() % device->vaoCount;
+
+    RunBenchmark("FindVAO", lookupCount, 0, [&]() {
+        u64 sum = 0;
+        for (u32 i = 0; i < lookupCount; ++i)
+        {
+            const Vao& vao = device->vaos[lookups[i]];
+            const Program& program = device->programs[vao.programHandle - 1];
+            sum += FindVAO(*device, vao.meshIdx, vao.submeshIdx, program);
+        }
+        MicrobenchSink += sum;
+    });
+
+    delete[] lookups;
+    delete device;
+}
+
+static void Benchmark_ProcessAssimpMesh()
+{
+    // Grid of quads with normals, texture coordinates and tangent space
+    const u32 gridSize = 128;
+    const u32 vertexCount = gridSize * gridSize;
+    const u32 faceCount = (gridSize - 1) * (gridSize - 1) * 2;
+
+    aiMesh* mesh = new aiMesh();
+    mesh->mNumVertices = vertexCount;
+    mesh->mVertices = new aiVector3D[vertexCount];
+    mesh->mNormals = new aiVector3D[vertexCount];
+    mesh->mTangents = new aiVector3D[vertexCount];
+    mesh->mBitangents = new aiVector3D[vertexCount];
+    mesh->mTextureCoords[0] = new aiVector3D[vertexCount];
+    mesh->mNumUVComponents[0] = 2;
+
+    for (u32 i = 0; i < vertexCount; ++i)
+    {
+        const float x = (float)(i % gridSize);
+        const float z = (float)(i / gridSize);
+        mesh->mVertices[i] = aiVector3D(x, RandomFloat(), z);
+        mesh->mNormals[i] = aiVector3D(0.0f, 1.0f, 0.0f);
+        mesh->mTangents[i] = aiVector3D(1.0f, 0.0f, 0.0f);
+        mesh->mBitangents[i] = aiVector3D(0.0f, 0.0f, 1.0f);
+        mesh->mTextureCoords[0][i] = aiVector3D(x / gridSize, z / gridSize, 0.0f);
+    }
+
+    mesh->mNumFaces = faceCount;
+    mesh->mFaces = new aiFace[faceCount];
+    u32 faceIdx = 0;
+    for (u32 z = 0; z + 1 < gridSize; ++z)
+        for (u32 x = 0; x + 1 < gridSize; ++x)
+        {
+            const u32 i0 = z * gridSize + x;
+            const u32 i1 = i0 + 1;
+            const u32 i2 = i0 + gridSize;
+            const u32 i3 = i2 + 1;
+            const u32 quad[2][3] = { { i0, i2, i1 }, { i1, i2, i3 } };
+            for (u32 t = 0; t < 2; ++t)
+            {
+                aiFace& face = mesh->mFaces[faceIdx++];
+                face.mNumIndices = 3;
+                face.mIndices = new unsigned int[3];
+                face.mIndices[0] = quad[t][0];
+                face.mIndices[1] = quad[t][1];
+                face.mIndices[2] = quad[t][2];
+            }
+        }
+
+    const u32 vertexSize = 14 * sizeof(float);
+    Arena vertexArena = CreateArena(vertexCount * vertexSize);
+    Arena indexArena = CreateArena(faceCount * 3 * sizeof(u32));
+    std::vector<u32> submeshMaterialIndices;
+    Mesh myMesh;
+
+    RunBenchmark("ProcessAssimpMesh", vertexCount, vertexArena.size + indexArena.size, [&]() {
+        vertexArena.head = 0;
+        indexArena.head = 0;
+        myMesh.submeshes.clear();
+        submeshMaterialIndices.clear();
+        ProcessAssimpMesh(NULL, mesh, &myMesh, 0, submeshMaterialIndices, vertexArena, indexArena);
+        MicrobenchSink += vertexArena.head + indexArena.head;
+    });
+
+    DestroyArena(indexArena);
+    DestroyArena(vertexArena);
+    delete mesh;
+}
+
+static void Benchmark_MeshOptimizer()
+{
+    // Grid of quads with the vertex layout of ProcessAssimpMesh, triangles in random order
+    const u32 gridSize = 128;
+    const u32 vertexCount = gridSize * gridSize;
+    const u32 indexCount = (gridSize - 1) * (gridSize - 1) * 6;
+    const u32 vertexStride = 14 * sizeof(float);
+
+    f32* sourceVertices = new f32[vertexCount * 14];
+    for (u32 i = 0; i < vertexCount; ++i)
+    {
+        f32* vertex = sourceVertices + i * 14;
+        memset(vertex, 0, vertexStride);
+        vertex[0] = (f32)(i % gridSize);
+        vertex[1] = RandomFloat();
+        vertex[2] = (f32)(i / gridSize);
+        vertex[4] = 1.0f;
+    }
+
+    u32* sourceIndices = new u32[indexCount];
+    u32 indexIdx = 0;
+    for (u32 z = 0; z + 1 < gridSize; ++z)
+        for (u32 x = 0; x + 1 < gridSize; ++x)
+        {
+            const u32 i0 = z * gridSize + x;
+            const u32 i1 = i0 + 1;
+            const u32 i2 = i0 + gridSize;
+            const u32 i3 = i2 + 1;
+            const u32 quad[6] = { i0, i2, i1, i1, i2, i3 };
+            memcpy(sourceIndices + indexIdx, quad, sizeof(quad));
+            indexIdx += 6;
+        }
+
+    const u32 triangleCount = indexCount / 3;
+    for (u32 i = triangleCount - 1; i > 0; --i)
+    {
+        const u32 j = (u32)(RandomFloat() * (i + 1)) % (i + 1);
+        for (u32 k = 0; k < 3; ++k)
+            std::swap(sourceIndices[i * 3 + k], sourceIndices[j * 3 + k]);
+    }
+
+    f32* vertices = new f32[vertexCount * 14];
+    u32* indices = new u32[indexCount];
+    MeshStats sourceStats, optimizedStats;
+
+    RunBenchmark("MeshOptimizer_Optimize", triangleCount, vertexCount * vertexStride + indexCount * sizeof(u32), [&]() {
+        memcpy(vertices, sourceVertices, vertexCount * vertexStride);
+        memcpy(indices, sourceIndices, indexCount * sizeof(u32));
+        MeshOptimizer_Optimize((u8*)vertices, vertexCount, vertexStride, indices, indexCount, sourceStats, optimizedStats);
+        MicrobenchSink += indices[0];
+    });
+
+    if (!MicrobenchOpts.filter || strstr("MeshOptimizer_Optimize", MicrobenchOpts.filter))
+        printf("%-32s ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, overfetch %.3f -> %.3f, overdraw %.3f -> %.3f\n", "",
+               sourceStats.acmr, optimizedStats.acmr, sourceStats.atvr, optimizedStats.atvr,
+               sourceStats.overfetch, optimizedStats.overfetch, sourceStats.overdraw, optimizedStats.overdraw);
+
+    delete[] indices;
+    delete[] vertices;
+    delete[] sourceIndices;
+    delete[] sourceVertices;
+}
+
+static void Benchmark_LoadTexture2DDedup()
+{
+    // Worst case of the scan for already loaded textures: the requested one is the last one
+    Device* device = new Device();
+    Arena pathArena = CreateArena(KB(64));
+    const u32 textureCount = 256;
+
+    for (u32 i = 0; i < textureCount; ++i)
+    {
+        Texture& texture = device->textures[device->textureCount++];
+        texture.filepath = FormatString(pathArena, "../../Assets/Textures/material_%03u_albedo.png", i);
+    }
+
+    const char* filepath = device->textures[textureCount - 1].filepath.str;
+    const u32 lookupCount = 256;
+
+    RunBenchmark("LoadTexture2D (dedup)", lookupCount, 0, [&]() {
+        u64 sum = 0;
+        for (u32 i = 0; i < lookupCount; ++i)
+            sum += LoadTexture2D(*device, filepath, TextureRole_Albedo);
+        MicrobenchSink += sum;
+    });
+
+    DestroyArena(pathArena);
+    delete device;
+}
+
+static void Benchmark_SameString()
+{
+    // Pairs of paths sharing a long prefix, as most asset paths do
+    const u32 stringCount = 1024;
+    Arena stringArena = CreateArena(KB(128));
+    String* strings = new String[stringCount];
+    for (u32 i = 0; i < stringCount; ++i)
+        strings[i] = FormatString(stringArena, "../../Assets/Models/Sponza/textures/texture_%04u.png", (u32)(RandomU64() % 64));
+
+    u64 totalLength = 0;
+    for (u32 i = 0; i + 1 < stringCount; ++i)
+        totalLength += strings[i].len;
+
+    RunBenchmark("SameString", stringCount - 1, totalLength, [&]() {
+        u64 matches = 0;
+        for (u32 i = 0; i + 1 < stringCount; ++i)
+            matches += SameString(strings[i], strings[i + 1]);
+        MicrobenchSink += matches;
+    });
+
+    RunBenchmark("SameString (C strings)", stringCount - 1, totalLength, [&]() {
+        u64 matches = 0;
+        for (u32 i = 0; i + 1 < stringCount; ++i)
+            matches += SameString(strings[i].str, strings[i + 1].str);
+        MicrobenchSink += matches;
+    });
+
+    delete[] strings;
+    DestroyArena(stringArena);
+}
+
+static void Benchmark_BuildRenderPrimitiveSortKeys()
+{
+    // Full scene of meshes and three-submesh models, as the renderers see it every frame
+    Device* device = new Device();
+    Scene* scene = new Scene();
+    const u32 meshCount = 32;
+
+    device->meshCount = meshCount;
+    for (u32 meshIdx = 0; meshIdx < meshCount; ++meshIdx)
+        device->meshes[meshIdx].submeshes.resize(3);
+
+    for (u32 entityIdx = 0; entityIdx < MAX_ENTITIES; ++entityIdx)
+    {
+        Entity& entity = scene->entities[scene->entityCount++];
+        const u32 meshIdx = RandomU64() % meshCount;
+        entity.type = (entityIdx % 4 == 0) ? EntityType_Model : EntityType_Mesh;
+        entity.meshSubmeshIdx = MAKE_DWORD(meshIdx, entity.type == EntityType_Mesh ? RandomU64() % 3 : 0);
+        entity.worldMatrix = mat4(1.0f);
+    }
+
+    u64* keys = new u64[MAX_RENDER_PRIMITIVES];
+
+    RunBenchmark("BuildRenderPrimitiveSortKeys", scene->entityCount, 0, [&]() {
+        const u32 keyCount = BuildRenderPrimitiveSortKeys(*device, *scene, keys);
+        MicrobenchSink += keyCount;
+    });
+
+    RunBenchmark("BuildRenderPrimitiveSortKeys+QSort", scene->entityCount, 0, [&]() {
+        const u32 keyCount = BuildRenderPrimitiveSortKeys(*device, *scene, keys);
+        QSort(keys, keys + keyCount - 1);
+        MicrobenchSink += keys[0];
+    });
+
+    delete[] keys;
+    delete scene;
+    delete device;
+}
+
+static void Benchmark_RecordCommandLists()
+{
+    // A full forward queue, recorded in chunks as RecordCommandLists does
+    ForwardRenderData* forwardRender = new ForwardRenderData();
+    forwardRender->renderPrimitiveCount = MAX_RENDER_PRIMITIVES;
+    for (u32 i = 0; i < forwardRender->renderPrimitiveCount; ++i)
+    {
+        RenderPrimitive& renderPrimitive = forwardRender->renderPrimitives[i];
+        renderPrimitive.vaoHandle = 1 + (u32)(RandomU64() % 64);
+        renderPrimitive.albedoTextureHandle = 1 + (u32)(RandomU64() % 16);
+        renderPrimitive.indexCount = 3 * 1024;
+        renderPrimitive.indexOffset = i * renderPrimitive.indexCount * sizeof(u32);
+#if defined(USE_INSTANCING)
+        renderPrimitive.instanceCount = 1 + i % 4;
+        renderPrimitive.instancingOffset = i * 4 * 2 * sizeof(mat4);
+#endif
+    }
+
+    JobSystem* jobs = Jobs_Create(0);
+    CommandLists* commandLists = new CommandLists();
+    CommandLists_Init(*commandLists, jobs);
+
+    struct RecordJobData
+    {
+        CommandLists*      commandLists;
+        ForwardRenderData* forwardRender;
+    };
+    RecordJobData data = { commandLists, forwardRender };
+    const u32 chunkCount = MAX_RENDER_PRIMITIVES / COMMAND_LIST_CHUNK_PRIMITIVES;
+    const JobFunc recordChunk = [](void* userData, u32 jobIdx, u32 threadIdx) {
+        RecordJobData& data = *(RecordJobData*)userData;
+        const u32 begin = jobIdx * COMMAND_LIST_CHUNK_PRIMITIVES;
+        CommandRecorder recorder;
+        CommandRecorder_Begin(recorder, data.commandLists->threadArenas[threadIdx], data.commandLists->lists[jobIdx], MAKE_DWORD(CommandQueue_Forward, jobIdx));
+        ForwardShading_Record(*data.forwardRender, BufferRange{}, begin, begin + COMMAND_LIST_CHUNK_PRIMITIVES, recorder);
+        CommandRecorder_End(recorder);
+    };
+
+    RunBenchmark("RecordCommandLists (1 thread)", MAX_RENDER_PRIMITIVES, 0, [&]() {
+        CommandLists_Reset(*commandLists);
+        Jobs_ParallelFor(NULL, chunkCount, recordChunk, &data);
+        MicrobenchSink += commandLists->lists[0].size;
+    });
+
+    char name[64];
+    snprintf(name, sizeof(name), "RecordCommandLists (%u threads)", Jobs_GetThreadCount(jobs));
+    RunBenchmark(name, MAX_RENDER_PRIMITIVES, 0, [&]() {
+        CommandLists_Reset(*commandLists);
+        Jobs_ParallelFor(jobs, chunkCount, recordChunk, &data);
+        MicrobenchSink += commandLists->lists[0].size;
+    });
+
+    CommandLists_Destroy(*commandLists);
+    delete commandLists;
+    Jobs_Destroy(jobs);
+    delete forwardRender;
+}
+
+int main(int argc, char** argv)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (SameString(argv[i], "--reps") && i + 1 < argc)
+        {
+            const int repetitions = atoi(argv[++i]);
+            if (repetitions <= 0 || repetitions > MICROBENCH_MAX_REPETITIONS)
+            {
+                fprintf(stderr, "microbench: --reps must be in [1, %d]\n", MICROBENCH_MAX_REPETITIONS);
+                return EXIT_CODE_BAD_ARGUMENTS;
+            }
+            MicrobenchOpts.repetitions = (u32)repetitions;
+        }
+        else if (argv[i][0] != '-')
+        {
+            MicrobenchOpts.filter = argv[i];
+        }
+        else
+        {
+            fprintf(stderr, "Usage: microbench [filter] [--reps N]\n");
+            return EXIT_CODE_BAD_ARGUMENTS;
+        }
+    }
+
+    GlobalFrameArena = CreateArena(GLOBAL_FRAME_ARENA_SIZE);
+    GlobalScratchArena = CreateArena(GLOBAL_SCRATCH_ARENA_SIZE);
+    StrArena = CreateArena(MB(1));
+
+    printf("%-32s %15s %21s %21s %13s\n", "benchmark", "median", "MAD", "items", "bandwidth");
+
+    Benchmark_PushData();
+    Benchmark_PushAlignedData();
+    Benchmark_QSort();
+    Benchmark_FindVAO();
+    Benchmark_ProcessAssimpMesh();
+    Benchmark_MeshOptimizer();
+    Benchmark_LoadTexture2DDedup();
+    Benchmark_SameString();
+    Benchmark_BuildRenderPrimitiveSortKeys();
+    Benchmark_RecordCommandLists();
+
+    DestroyArena(StrArena);
+    DestroyArena(GlobalScratchArena);
+    DestroyArena(GlobalFrameArena);
+
+    return EXIT_CODE_SUCCESS;
+}
@@ -0,0 +1,644 @@
+//
+// null_engine.cpp : Null OpenGL driver of USE_GFX_API_NULL builds. The GL loader gets functions
+// that do no GPU work, so the OpenGL code paths of the engine (scene, culling, render lists,
+// command lists, constant and instancing buffer writes) run without a context, a display or
+// driver noise. Buffers live in host memory so they map as usual, object names come from a
+// counter, and every status query reports success. Draws and state changes are no-ops, the
+// engine frame stats still count them. Buffers, texture uploads and the framebuffer image
+// are also reachable from the software rasterizer (software_engine.cpp).
+//
+
+#include "null_engine.h"
+#include "opengl_engine.h"
+
+#if USE_GFX_API_NULL
+
+#include <string.h>
+#include <stdlib.h>
+
+#define NULL_GL_VERSION   "4.3.0 AGP Null"
+#define NULL_GLSL_VERSION "4.30"
+#define NULL_EXTENSION    "GL_AGP_null_driver" // glad fails to load without any extension
+
+// The null driver compiles no shaders to reflect, so every program reports the uniform blocks
+// of shaders.glsl, in binding order, with the sizes of the structs the engine uploads
+struct NullUniformBlock
+{
+    const char* name;
+    GLint       size;
+};
+
+static const NullUniformBlock NullUniformBlocks[] = {
+    { "GlobalParams", sizeof(GlobalParams) },
+    { "LocalParams",  sizeof(LocalParams) },
+    { "ShadowParams", sizeof(ShadowParams) },
+};
+
+struct NullBuffer
+{
+    u8* data;
+    u64 size;
+};
+
+static const GLenum NullBufferTargets[] = {
+    GL_ARRAY_BUFFER,
+    GL_ELEMENT_ARRAY_BUFFER,
+    GL_UNIFORM_BUFFER,
+    GL_PIXEL_PACK_BUFFER,
+    GL_PIXEL_UNPACK_BUFFER,
+    GL_DRAW_INDIRECT_BUFFER,
+    GL_TEXTURE_BUFFER,
+    GL_COPY_READ_BUFFER,
+    GL_COPY_WRITE_BUFFER,
+    GL_SHADER_STORAGE_BUFFER,
+};
+
+// Level 0 of 2D textures, host copies are only kept for 8-bit RGB(A) uploads
+struct NullTexture
+{
+    u8*   data;
+    ivec2 size;
+    u32   channelCount;
+};
+
+#define NULL_TEXTURE_UNITS 32
+
+// Only touched from the thread that would own the GL context
+struct NullDriver
+{
+    std::vector<NullBuffer> buffers; // Indexed by buffer name, 0 is never handed out
+    GLuint boundBuffers[ARRAY_COUNT(NullBufferTargets)];
+    GLuint nextName;
+
+    std::vector<NullTexture> textures; // Indexed by texture name
+    GLuint boundTextures[NULL_TEXTURE_UNITS]; // GL_TEXTURE_2D binding of each unit
+    u32    activeTextureUnit;
+
+    GLint  packAlignment;
+
+    // Contents of the default framebuffer, see Null_SetFramebufferImage
+    const u8* framebufferPixels;
+    ivec2     framebufferSize;
+};
+
+static NullDriver Null = {};
+
+static void Null_GrowObjects()
+{
+    if (Null.buffers.size() <= Null.nextName)
+        Null.buffers.resize(Null.nextName + 1, NullBuffer{});
+    if (Null.textures.size() <= Null.nextName)
+        Null.textures.resize(Null.nextName + 1, NullTexture{});
+}
+
+static GLuint Null_NewName()
+{
+    return ++Null.nextName;
+}
+
+static GLuint& Null_BoundBuffer(GLenum target)
+{
+    for (u32 i = 0; i < ARRAY_COUNT(NullBufferTargets); ++i)
+        if (NullBufferTargets[i] == target)
+            return Null.boundBuffers[i];
+    INVALID_CODE_PATH("Unsupported buffer target");
+    return Null.boundBuffers[0];
+}
+
+static NullBuffer* Null_GetBuffer(GLuint name)
+{
+    return name < Null.buffers.size() ? &Null.buffers[name] : NULL;
+}
+
+static NullTexture* Null_GetTexture(GLuint name)
+{
+    return name < Null.textures.size() ? &Null.textures[name] : NULL;
+}
+
+//
+// Strings and state queries
+//
+
+static const GLubyte* APIENTRY Null_glGetString(GLenum name)
+{
+    switch (name)
+    {
+        case GL_VENDOR:                   return (const GLubyte*)"AGP";
+        case GL_RENDERER:                 return (const GLubyte*)"Null";
+        case GL_VERSION:                  return (const GLubyte*)NULL_GL_VERSION;
+        case GL_SHADING_LANGUAGE_VERSION: return (const GLubyte*)NULL_GLSL_VERSION;
+        case GL_EXTENSIONS:               return (const GLubyte*)NULL_EXTENSION;
+        default:                          return (const GLubyte*)"";
+    }
+}
+
+static const GLubyte* APIENTRY Null_glGetStringi(GLenum name, GLuint index)
+{
+    return (const GLubyte*)NULL_EXTENSION;
+}
+
+static void APIENTRY Null_glGetIntegerv(GLenum pname, GLint* data)
+{
+    switch (pname)
+    {
+        case GL_MAJOR_VERSION:                   data[0] = 4; break;
+        case GL_MINOR_VERSION:                   data[0] = 3; break;
+        case GL_NUM_EXTENSIONS:                  data[0] = 1; break;
+        case GL_MAX_UNIFORM_BLOCK_SIZE:          data[0] = KB(64); break;
+        case GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT: data[0] = 256; break;
+        case GL_VIEWPORT:
+        case GL_SCISSOR_BOX:                     data[0] = data[1] = data[2] = data[3] = 0; break;
+        case GL_POLYGON_MODE:                    data[0] = data[1] = GL_FILL; break;
+        case GL_ACTIVE_TEXTURE:                  data[0] = GL_TEXTURE0 + Null.activeTextureUnit; break;
+        case GL_TEXTURE_BINDING_2D:              data[0] = Null.boundTextures[Null.activeTextureUnit]; break;
+        default:                                 data[0] = 0; break;
+    }
+}
+
+static void APIENTRY Null_glGetInteger64v(GLenum pname, GLint64* data)
+{
+    data[0] = pname == GL_TIMESTAMP ? (GLint64)GetProfileTimeNs() : 0;
+}
+
+static GLenum APIENTRY Null_glGetError()
+{
+    return GL_NO_ERROR;
+}
+
+static GLboolean APIENTRY Null_glIsEnabled(GLenum cap)
+{
+    return GL_FALSE;
+}
+
+//
+// Object names
+//
+
+static void Null_GenNames(GLsizei n, GLuint* names)
+{
+    for (GLsizei i = 0; i < n; ++i)
+        names[i] = Null_NewName();
+}
+
+static void APIENTRY Null_glGenVertexArrays(GLsizei n, GLuint* arrays)   { Null_GenNames(n, arrays); }
+static void APIENTRY Null_glGenFramebuffers(GLsizei n, GLuint* framebuffers) { Null_GenNames(n, framebuffers); }
+static void APIENTRY Null_glGenQueries(GLsizei n, GLuint* ids)           { Null_GenNames(n, ids); }
+static GLuint APIENTRY Null_glCreateProgram()                            { return Null_NewName(); }
+static GLuint APIENTRY Null_glCreateShader(GLenum type)                  { return Null_NewName(); }
+
+//
+// Buffers, backed by host memory
+//
+
+static void APIENTRY Null_glGenBuffers(GLsizei n, GLuint* buffers)
+{
+    Null_GenNames(n, buffers);
+    Null_GrowObjects();
+}
+
+static void APIENTRY Null_glDeleteBuffers(GLsizei n, const GLuint* buffers)
+{
+    for (GLsizei i = 0; i < n; ++i)
+    {
+        NullBuffer* buffer = Null_GetBuffer(buffers[i]);
+        if (buffer)
+        {
+            free(buffer->data);
+            *buffer = {};
+        }
+    }
+}
+
+static void APIENTRY Null_glBindBuffer(GLenum target, GLuint buffer)
+{
+    Null_BoundBuffer(target) = buffer;
+}
+
+static void APIENTRY Null_glBindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+    Null_BoundBuffer(target) = buffer;
+}
+
+static void APIENTRY Null_glBindBufferBase(GLenum target, GLuint index, GLuint buffer)
+{
+    Null_BoundBuffer(target) = buffer;
+}
+
+static void APIENTRY Null_glBufferData(GLenum target, GLsizeiptr size, const void* data, GLenum usage)
+{
+    NullBuffer* buffer = Null_GetBuffer(Null_BoundBuffer(target));
+    ASSERT(buffer, "No buffer bound to the target");
+
+    free(buffer->data);
+    buffer->data = (u8*)malloc(size);
+    buffer->size = size;
+    if (data)
+        memcpy(buffer->data, data, size);
+}
+
+static void* APIENTRY Null_glMapBufferRange(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access)
+{
+    NullBuffer* buffer = Null_GetBuffer(Null_BoundBuffer(target));
+    ASSERT(buffer && offset + length <= (GLintptr)buffer->size, "Mapped range out of the buffer");
+    return buffer->data + offset;
+}
+
+static void* APIENTRY Null_glMapBuffer(GLenum target, GLenum access)
+{
+    NullBuffer* buffer = Null_GetBuffer(Null_BoundBuffer(target));
+    ASSERT(buffer, "No buffer bound to the target");
+    return buffer->data;
+}
+
+static GLboolean APIENTRY Null_glUnmapBuffer(GLenum target)
+{
+    return GL_TRUE;
+}
+
+//
+// Textures, level 0 of 2D textures is kept for the software rasterizer
+//
+
+static void APIENTRY Null_glGenTextures(GLsizei n, GLuint* textures)
+{
+    Null_GenNames(n, textures);
+    Null_GrowObjects();
+}
+
+static void APIENTRY Null_glDeleteTextures(GLsizei n, const GLuint* textures)
+{
+    for (GLsizei i = 0; i < n; ++i)
+    {
+        NullTexture* texture = Null_GetTexture(textures[i]);
+        if (texture)
+        {
+            free(texture->data);
+            *texture = {};
+        }
+    }
+}
+
+// Invalid units are ignored, as GL does after raising the error
+static void APIENTRY Null_glActiveTexture(GLenum texture)
+{
+    if (texture - GL_TEXTURE0 < NULL_TEXTURE_UNITS)
+        Null.activeTextureUnit = texture - GL_TEXTURE0;
+}
+
+static void APIENTRY Null_glBindTexture(GLenum target, GLuint texture)
+{
+    if (target == GL_TEXTURE_2D)
+        Null.boundTextures[Null.activeTextureUnit] = texture;
+}
+
+static void APIENTRY Null_glTexImage2D(GLenum target, GLint level, GLint internalFormat, GLsizei width, GLsizei height,
+                                       GLint border, GLenum format, GLenum type, const void* pixels)
+{
+    if (target != GL_TEXTURE_2D || level != 0)
+        return;
+
+    NullTexture* texture = Null_GetTexture(Null.boundTextures[Null.activeTextureUnit]);
+    ASSERT(texture, "No texture bound to the unit");
+
+    free(texture->data);
+    *texture = {};
+    texture->size = ivec2(width, height);
+
+    // With a pixel unpack buffer bound, pixels is an offset into it
+    const u8* src = (const u8*)pixels;
+    const GLuint unpackBufferName = Null_BoundBuffer(GL_PIXEL_UNPACK_BUFFER);
+    NullBuffer* unpackBuffer = unpackBufferName ? Null_GetBuffer(unpackBufferName) : NULL;
+    if (unpackBuffer)
+        src = unpackBuffer->data + (u64)pixels;
+
+    // Render targets and formats the rasterizer does not sample keep no host copy
+    const bool isHostCopy = (pixels || unpackBuffer) && type == GL_UNSIGNED_BYTE &&
+                            (format == GL_RGB || format == GL_RGBA);
+    if (isHostCopy)
+    {
+        texture->channelCount = format == GL_RGBA ? 4 : 3;
+        const u64 size = (u64)width * height * texture->channelCount;
+        ASSERT(!unpackBuffer || (u64)pixels + size <= unpackBuffer->size, "Upload out of the pixel unpack buffer");
+        texture->data = (u8*)malloc(size);
+        memcpy(texture->data, src, size);
+    }
+}
+
+//
+// Shaders and programs, they always compile and link
+//
+
+static void APIENTRY Null_glGetShaderiv(GLuint shader, GLenum pname, GLint* params)
+{
+    switch (pname)
+    {
+        case GL_COMPILE_STATUS:
+        case GL_COMPLETION_STATUS_KHR: params[0] = GL_TRUE; break;
+        default:                       params[0] = 0; break;
+    }
+}
+
+static void APIENTRY Null_glGetProgramiv(GLuint program, GLenum pname, GLint* params)
+{
+    switch (pname)
+    {
+        case GL_LINK_STATUS:
+        case GL_COMPLETION_STATUS_KHR: params[0] = GL_TRUE; break;
+        case GL_ACTIVE_UNIFORM_BLOCKS: params[0] = ARRAY_COUNT(NullUniformBlocks); break;
+        default:                       params[0] = 0; break;
+    }
+}
+
+static void APIENTRY Null_glGetInfoLog(GLuint object, GLsizei bufSize, GLsizei* length, GLchar* infoLog)
+{
+    if (length)
+        *length = 0;
+    if (infoLog && bufSize > 0)
+        infoLog[0] = '\0';
+}
+
+static void APIENTRY Null_glGetActiveUniformBlockName(GLuint program, GLuint uniformBlockIndex, GLsizei bufSize, GLsizei* length, GLchar* uniformBlockName)
+{
+    ASSERT(uniformBlockIndex < ARRAY_COUNT(NullUniformBlocks), "Uniform block index out of range");
+    const i32 nameLength = snprintf(uniformBlockName, bufSize, "%s", NullUniformBlocks[uniformBlockIndex].name);
+    if (length)
+        *length = min(nameLength, bufSize - 1);
+}
+
+static void APIENTRY Null_glGetActiveUniformBlockiv(GLuint program, GLuint uniformBlockIndex, GLenum pname, GLint* params)
+{
+    ASSERT(uniformBlockIndex < ARRAY_COUNT(NullUniformBlocks), "Uniform block index out of range");
+    switch (pname)
+    {
+        case GL_UNIFORM_BLOCK_DATA_SIZE: params[0] = NullUniformBlocks[uniformBlockIndex].size; break;
+        case GL_UNIFORM_BLOCK_BINDING:   params[0] = uniformBlockIndex; break;
+        default:                         params[0] = 0; break;
+    }
+}
+
+static GLint APIENTRY Null_glGetLocation(GLuint program, const GLchar* name)
+{
+    return 0;
+}
+
+static void APIENTRY Null_glGetProgramBinary(GLuint program, GLsizei bufSize, GLsizei* length, GLenum* binaryFormat, void* binary)
+{
+    if (length)
+        *length = 0;
+}
+
+//
+// Queries and syncs, always available and signaled
+//
+
+static void APIENTRY Null_glGetQueryiv(GLenum target, GLenum pname, GLint* params)
+{
+    params[0] = pname == GL_QUERY_COUNTER_BITS ? 64 : 0;
+}
+
+static void APIENTRY Null_glGetQueryObjectiv(GLuint id, GLenum pname, GLint* params)
+{
+    params[0] = pname == GL_QUERY_RESULT_AVAILABLE ? GL_TRUE : 0;
+}
+
+static void APIENTRY Null_glGetQueryObjectui64v(GLuint id, GLenum pname, GLuint64* params)
+{
+    params[0] = pname == GL_QUERY_RESULT_AVAILABLE ? GL_TRUE : 0;
+}
+
+static GLsync APIENTRY Null_glFenceSync(GLenum condition, GLbitfield flags)
+{
+    return (GLsync)(u64)Null_NewName();
+}
+
+static GLenum APIENTRY Null_glClientWaitSync(GLsync sync, GLbitfield flags, GLuint64 timeout)
+{
+    return GL_ALREADY_SIGNALED;
+}
+
+static void APIENTRY Null_glGetSynciv(GLsync sync, GLenum pname, GLsizei bufSize, GLsizei* length, GLint* values)
+{
+    if (length)
+        *length = 1;
+    values[0] = pname == GL_SYNC_STATUS ? GL_SIGNALED : 0;
+}
+
+static GLenum APIENTRY Null_glCheckFramebufferStatus(GLenum target)
+{
+    return GL_FRAMEBUFFER_COMPLETE;
+}
+
+static void APIENTRY Null_glPixelStorei(GLenum pname, GLint param)
+{
+    if (pname == GL_PACK_ALIGNMENT)
+        Null.packAlignment = param;
+}
+
+// Reads of the framebuffer image, into the pixel pack buffer if one is bound. Pixels out of
+// the image, and every pixel without an image or of non 8-bit types, read as zeros.
+static void APIENTRY Null_glReadPixels(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, void* pixels)
+{
+    const u32 componentCount = format == GL_RGBA ? 4 : format == GL_RGB ? 3 : 1;
+    const u32 componentSize = type == GL_UNSIGNED_BYTE ? 1 : 4;
+    const u32 alignment = Null.packAlignment > 0 ? Null.packAlignment : 4;
+    const u64 rowSize = ((u64)width * componentCount * componentSize + alignment - 1) / alignment * alignment;
+
+    u8* dst = (u8*)pixels;
+    const GLuint packBufferName = Null_BoundBuffer(GL_PIXEL_PACK_BUFFER);
+    if (packBufferName)
+    {
+        NullBuffer* packBuffer = Null_GetBuffer(packBufferName);
+        ASSERT(packBuffer && (u64)pixels + rowSize * height <= packBuffer->size, "Read out of the pixel pack buffer");
+        dst = packBuffer->data + (u64)pixels;
+    }
+
+    memset(dst, 0, rowSize * height);
+    if (!Null.framebufferPixels || type != GL_UNSIGNED_BYTE)
+        return;
+
+    const ivec2 imageSize = Null.framebufferSize;
+    for (GLint row = 0; row < height; ++row)
+    {
+        const GLint srcY = y + row;
+        if (srcY < 0 || srcY >= imageSize.y)
+            continue;
+        u8* dstRow = dst + row * rowSize;
+        for (GLint col = 0; col < width; ++col)
+        {
+            const GLint srcX = x + col;
+            if (srcX < 0 || srcX >= imageSize.x)
+                continue;
+            const u8* src = Null.framebufferPixels + ((u64)srcY * imageSize.x + srcX) * 4;
+            memcpy(dstRow + col * componentCount, src, componentCount);
+        }
+    }
+}
+
+// Every other entry point the engine calls, none of them returns a value or writes through a
+// pointer the engine reads back. Each gets a stub of its own glad pointer type, so no call goes
+// through a mismatched function type.
+template <typename T> struct NullNoop;
+template <typename R, typename... Args> struct NullNoop<R (APIENTRYP)(Args...)>
+{
+    static R APIENTRY Call(Args...) { return R(); }
+};
+
+struct NullProc
+{
+    const char* name;
+    void*       proc;
+};
+
+// The casts fail to compile if an implementation does not match the entry point it replaces
+#define NULL_PROC(name, proc) { #name, (void*)static_cast<decltype(glad_##name)>(proc) }
+#define NULL_NOOP(name)       { #name, (void*)&NullNoop<decltype(glad_##name)>::Call }
+
+static const NullProc NullProcs[] = {
+    NULL_PROC(glGetString,                 Null_glGetString),
+    NULL_PROC(glGetStringi,                Null_glGetStringi),
+    NULL_PROC(glGetIntegerv,               Null_glGetIntegerv),
+    NULL_PROC(glGetInteger64v,             Null_glGetInteger64v),
+    NULL_PROC(glGetError,                  Null_glGetError),
+    NULL_PROC(glIsEnabled,                 Null_glIsEnabled),
+    NULL_PROC(glGenVertexArrays,           Null_glGenVertexArrays),
+    NULL_PROC(glGenFramebuffers,           Null_glGenFramebuffers),
+    NULL_PROC(glGenQueries,                Null_glGenQueries),
+    NULL_PROC(glCreateProgram,             Null_glCreateProgram),
+    NULL_PROC(glCreateShader,              Null_glCreateShader),
+    NULL_PROC(glGenBuffers,                Null_glGenBuffers),
+    NULL_PROC(glDeleteBuffers,             Null_glDeleteBuffers),
+    NULL_PROC(glBindBuffer,                Null_glBindBuffer),
+    NULL_PROC(glBindBufferRange,           Null_glBindBufferRange),
+    NULL_PROC(glBindBufferBase,            Null_glBindBufferBase),
+    NULL_PROC(glBufferData,                Null_glBufferData),
+    NULL_PROC(glGenTextures,               Null_glGenTextures),
+    NULL_PROC(glDeleteTextures,            Null_glDeleteTextures),
+    NULL_PROC(glActiveTexture,             Null_glActiveTexture),
+    NULL_PROC(glBindTexture,               Null_glBindTexture),
+    NULL_PROC(glTexImage2D,                Null_glTexImage2D),
+    NULL_PROC(glMapBufferRange,            Null_glMapBufferRange),
+    NULL_PROC(glMapBuffer,                 Null_glMapBuffer),
+    NULL_PROC(glUnmapBuffer,               Null_glUnmapBuffer),
+    NULL_PROC(glGetShaderiv,               Null_glGetShaderiv),
+    NULL_PROC(glGetProgramiv,              Null_glGetProgramiv),
+    NULL_PROC(glGetShaderInfoLog,          Null_glGetInfoLog),
+    NULL_PROC(glGetProgramInfoLog,         Null_glGetInfoLog),
+    NULL_PROC(glGetActiveUniformBlockName, Null_glGetActiveUniformBlockName),
+    NULL_PROC(glGetActiveUniformBlockiv,   Null_glGetActiveUniformBlockiv),
+    NULL_PROC(glGetUniformLocation,        Null_glGetLocation),
+    NULL_PROC(glGetAttribLocation,         Null_glGetLocation),
+    NULL_PROC(glGetProgramBinary,          Null_glGetProgramBinary),
+    NULL_PROC(glGetQueryiv,                Null_glGetQueryiv),
+    NULL_PROC(glGetQueryObjectiv,          Null_glGetQueryObjectiv),
+    NULL_PROC(glGetQueryObjectui64v,       Null_glGetQueryObjectui64v),
+    NULL_PROC(glFenceSync,                 Null_glFenceSync),
+    NULL_PROC(glClientWaitSync,            Null_glClientWaitSync),
+    NULL_PROC(glGetSynciv,                 Null_glGetSynciv),
+    NULL_PROC(glCheckFramebufferStatus,    Null_glCheckFramebufferStatus),
+    NULL_PROC(glPixelStorei,               Null_glPixelStorei),
+    NULL_PROC(glReadPixels,                Null_glReadPixels),
+
+    NULL_NOOP(glAttachShader),
+    NULL_NOOP(glBindFramebuffer),
+    NULL_NOOP(glBindSampler),
+    NULL_NOOP(glBindVertexArray),
+    NULL_NOOP(glBlendEquation),
+    NULL_NOOP(glBlendEquationSeparate),
+    NULL_NOOP(glBlendFunc),
+    NULL_NOOP(glBlendFuncSeparate),
+    NULL_NOOP(glClear),
+    NULL_NOOP(glClearBufferfv),
+    NULL_NOOP(glClearBufferuiv),
+    NULL_NOOP(glClearColor),
+    NULL_NOOP(glCompileShader),
+    NULL_NOOP(glCompressedTexImage2D),
+    NULL_NOOP(glCopyBufferSubData),
+    NULL_NOOP(glCullFace),
+    NULL_NOOP(glDebugMessageCallback),
+    NULL_NOOP(glDeleteFramebuffers),
+    NULL_NOOP(glDeleteProgram),
+    NULL_NOOP(glDeleteShader),
+    NULL_NOOP(glDeleteSync),
+    NULL_NOOP(glDeleteVertexArrays),
+    NULL_NOOP(glDepthMask),
+    NULL_NOOP(glDetachShader),
+    NULL_NOOP(glDisable),
+    NULL_NOOP(glDrawArrays),
+    NULL_NOOP(glDrawBuffer),
+    NULL_NOOP(glDrawBuffers),
+    NULL_NOOP(glDrawElements),
+    NULL_NOOP(glDrawElementsBaseVertex),
+    NULL_NOOP(glDrawElementsIndirect),
+    NULL_NOOP(glDrawElementsInstanced),
+    NULL_NOOP(glEnable),
+    NULL_NOOP(glEnableVertexAttribArray),
+    NULL_NOOP(glFramebufferTexture),
+    NULL_NOOP(glFramebufferTextureLayer),
+    NULL_NOOP(glFrontFace),
+    NULL_NOOP(glGenerateMipmap),
+    NULL_NOOP(glGetActiveAttrib),
+    NULL_NOOP(glGetActiveUniform),
+    NULL_NOOP(glGetActiveUniformsiv),
+    NULL_NOOP(glInvalidateFramebuffer),
+    NULL_NOOP(glLinkProgram),
+    NULL_NOOP(glMultiDrawElementsIndirect),
+    NULL_NOOP(glPolygonMode),
+    NULL_NOOP(glPolygonOffset),
+    NULL_NOOP(glPopDebugGroup),
+    NULL_NOOP(glProgramBinary),
+    NULL_NOOP(glProgramParameteri),
+    NULL_NOOP(glPushDebugGroup),
+    NULL_NOOP(glQueryCounter),
+    NULL_NOOP(glReadBuffer),
+    NULL_NOOP(glScissor),
+    NULL_NOOP(glShaderSource),
+    NULL_NOOP(glTexBuffer),
+    NULL_NOOP(glTexImage3D),
+    NULL_NOOP(glTexParameteri),
+    NULL_NOOP(glUniform1i),
+    NULL_NOOP(glUniform1ui),
+    NULL_NOOP(glUniform1uiv),
+    NULL_NOOP(glUniform2f),
+    NULL_NOOP(glUniformBlockBinding),
+    NULL_NOOP(glUniformMatrix4fv),
+    NULL_NOOP(glUseProgram),
+    NULL_NOOP(glVertexAttribDivisor),
+    NULL_NOOP(glVertexAttribPointer),
+    NULL_NOOP(glViewport),
+};
+
+#undef NULL_PROC
+#undef NULL_NOOP
+
+// Entry points the engine never calls stay NULL, so a new call shows up as a crash rather
+// than as silently missing work.
+void* Null_GetProcAddress(const char* name)
+{
+    for (u32 i = 0; i < ARRAY_COUNT(NullProcs); ++i)
+        if (strcmp(NullProcs[i].name, name) == 0)
+            return NullProcs[i].proc;
+    return NULL;
+}
+
+const u8* Null_GetBufferData(GLuint buffer, u64* size)
+{
+    NullBuffer* nullBuffer = Null_GetBuffer(buffer);
+    *size = nullBuffer ? nullBuffer->size : 0;
+    return nullBuffer ? nullBuffer->data : NULL;
+}
+
+const u8* Null_GetTextureData(GLuint texture, ivec2* size, u32* channelCount)
+{
+    NullTexture* nullTexture = Null_GetTexture(texture);
+    *size = nullTexture ? nullTexture->size : ivec2(0);
+    *channelCount = nullTexture ? nullTexture->channelCount : 0;
+    return nullTexture ? nullTexture->data : NULL;
+}
+
+void Null_SetFramebufferImage(const u8* pixels, ivec2 size)
+{
+    Null.framebufferPixels = pixels;
+    Null.framebufferSize = size;
+}
+
+#endif // USE_GFX_API_NULL
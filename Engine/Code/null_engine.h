@@ -0,0 +1,15 @@
+#pragma once
+
+#include "engine.h"
+
+// GL loader function of the null driver, for gladLoadGLLoader
+void* Null_GetProcAddress(const char* name);
+
+
+// Host copies of driver objects, NULL if the driver kept none
+const u8* Null_GetBufferData(GLuint buffer, u64* size);
+const u8* Null_GetTextureData(GLuint texture, ivec2* size, u32* channelCount);
+
+// RGBA8 image, rows bottom-up, that glReadPixels returns for the default framebuffer. It must
+// stay alive until the next call.
+void Null_SetFramebufferImage(const u8* pixels, ivec2 size);
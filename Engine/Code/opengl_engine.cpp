@@ -41,8 +41,8 @@ static void OnGlError(GLenum source, GLenum type, GLuint id, GLenum severity, GL
 
 bool OpenGL_InitDevice(Device& device)
 {
-    sprintf(device.name, "%s\n", glGetString(GL_RENDERER));
-    sprintf(device.glVersionString,"%s\n", glGetString(GL_VERSION));
+    sprintf(device.name, "%s", glGetString(GL_RENDERER));
+    sprintf(device.glVersionString,"%s", glGetString(GL_VERSION));
     u32 majorVersion = device.glVersionString[0] - '0';
     u32 minorVersion = device.glVersionString[2] - '0';
     device.glVersion   = MAKE_GLVERSION(majorVersion, minorVersion);
@@ -55,6 +55,11 @@ bool OpenGL_InitDevice(Device& device)
     {
         const char* extName = (const char*)glGetStringi(GL_EXTENSIONS, extIdx);
         device.ext.GL_ARB_timer_query |= SameString(extName, "GL_ARB_timer_query");
+        device.ext.GL_ARB_get_program_binary |= SameString(extName, "GL_ARB_get_program_binary");
+        device.ext.GL_KHR_parallel_shader_compile |= SameString(extName, "GL_KHR_parallel_shader_compile") ||
+                                                     SameString(extName, "GL_ARB_parallel_shader_compile");
+        device.ext.GL_EXT_texture_compression_s3tc |= SameString(extName, "GL_EXT_texture_compression_s3tc");
+        device.ext.GL_ARB_texture_compression_bptc |= SameString(extName, "GL_ARB_texture_compression_bptc");
         ILOG(" - %s", extName);
     }
 
@@ -5,5 +5,10 @@
 #define MAKE_GLVERSION(major, minor) (major*10 + minor)
 #define MAKE_GLSLVERSION(major, minor) (major*100 + minor*10)
 
+// GL_KHR_parallel_shader_compile, not in the generated loader
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
 bool OpenGL_InitDevice(Device& device);
 
@@ -0,0 +1,201 @@
+//
+// pipeline_states.cpp : Immutable pipeline state objects. A PSO bundles a program with the
+// layout of its instancing stream, its raster/depth/blend state and the reflection of its
+// uniform blocks and samplers. Block bindings and sampler units are program state in GL, so
+// they are set once when the PSO is resolved instead of every frame. Applying a PSO only
+// issues the GL calls for the state that differs from the currently bound one.
+//
+
+// Uniform block bindings by name, they match the UNIFORM_BLOCK(binding) declarations in the
+// shaders (which GL < 4.2 cannot express)
+static const char* UniformBlockBindingNames[] = {
+    "GlobalParams", // BINDING(0)
+    "LocalParams",  // BINDING(1)
+    "ShadowParams", // BINDING(2)
+};
+
+static i32 FindUniformBlockBinding(const char* blockName)
+{
+    for (u32 i = 0; i < ARRAY_COUNT(UniformBlockBindingNames); ++i)
+        if (strcmp(UniformBlockBindingNames[i], blockName) == 0)
+            return BINDING(i);
+    return -1;
+}
+
+// Reflects the program the PSO was created with, called again if hot reload swaps it
+static void ResolvePipelineState(Device& device, PipelineState& pipelineState)
+{
+    CPU_PROFILE_FUNCTION();
+
+    const PipelineStateDesc& desc = pipelineState.desc;
+    const Program& program = device.programs[desc.programIdx];
+    const GLuint programHandle = program.handle;
+
+    pipelineState.programHandle = programHandle;
+    pipelineState.uniformBlockCount = 0;
+
+    GLint blockCount = 0;
+    glGetProgramiv(programHandle, GL_ACTIVE_UNIFORM_BLOCKS, &blockCount);
+    for (GLint blockIdx = 0; blockIdx < blockCount; ++blockIdx)
+    {
+        ASSERT(pipelineState.uniformBlockCount < ARRAY_COUNT(pipelineState.uniformBlocks), "Max number of uniform blocks per pipeline reached");
+        PipelineUniformBlock& block = pipelineState.uniformBlocks[pipelineState.uniformBlockCount++];
+
+        GLsizei blockNameLen = 0;
+        glGetActiveUniformBlockName(programHandle, blockIdx, ARRAY_COUNT(block.name), &blockNameLen, block.name);
+
+        GLint blockSize = 0;
+        glGetActiveUniformBlockiv(programHandle, blockIdx, GL_UNIFORM_BLOCK_DATA_SIZE, &blockSize);
+        block.size = blockSize;
+
+        const i32 binding = FindUniformBlockBinding(block.name);
+        if (binding < 0)
+            ELOG("Uniform block %s of program %s has no known binding", block.name, program.permutationName.str);
+        else if (device.glVersion < MAKE_GLVERSION(4, 2))
+            glUniformBlockBinding(programHandle, blockIdx, binding);
+
+        GLint blockBinding = 0;
+        glGetActiveUniformBlockiv(programHandle, blockIdx, GL_UNIFORM_BLOCK_BINDING, &blockBinding);
+        block.binding = blockBinding;
+    }
+
+    // Sampler units are program state, they stay set until the program is relinked
+    glUseProgram(programHandle);
+    STATS_INC(programBinds);
+    device.boundPipelineState.programHandle = programHandle;
+
+    for (u32 i = 0; i < desc.samplerCount; ++i)
+    {
+        const PipelineSampler& sampler = desc.samplers[i];
+        const GLint location = glGetUniformLocation(programHandle, sampler.name);
+        if (location >= 0)
+            glUniform1i(location, sampler.unit);
+    }
+}
+
+u32 CreatePipelineState(Device& device, const PipelineStateDesc& desc)
+{
+    ASSERT(device.pipelineStateCount < ARRAY_COUNT(device.pipelineStates), "Max number of pipeline states reached");
+    ASSERT(desc.samplerCount <= ARRAY_COUNT(desc.samplers), "Max number of samplers per pipeline reached");
+
+    PipelineState& pipelineState = device.pipelineStates[device.pipelineStateCount];
+    pipelineState = {};
+    pipelineState.desc = desc;
+    ResolvePipelineState(device, pipelineState);
+
+    return device.pipelineStateCount++;
+}
+
+// Size in bytes of the uniform block at binding, 0 if the program does not use it
+u32 GetUniformBlockSize(const Device& device, u32 pipelineStateIdx, u32 binding)
+{
+    const PipelineState& pipelineState = device.pipelineStates[pipelineStateIdx];
+    for (u32 i = 0; i < pipelineState.uniformBlockCount; ++i)
+        if (pipelineState.uniformBlocks[i].binding == binding)
+            return pipelineState.uniformBlocks[i].size;
+    return 0;
+}
+
+// Forgets what is bound, for code that changes the context state behind the PSOs' back
+void InvalidatePipelineState(Device& device)
+{
+    device.boundPipelineState = {};
+}
+
+void ApplyPipelineState(Device& device, u32 pipelineStateIdx)
+{
+    PipelineState& pipelineState = device.pipelineStates[pipelineStateIdx];
+    const PipelineStateDesc& desc = pipelineState.desc;
+    const Program& program = device.programs[desc.programIdx];
+
+    if (pipelineState.programHandle != program.handle)
+        ResolvePipelineState(device, pipelineState);
+
+    BoundPipelineState& bound = device.boundPipelineState;
+    const bool force = !bound.isValid;
+
+    if (force || bound.programHandle != program.handle)
+    {
+        glUseProgram(program.handle);
+        STATS_INC(programBinds);
+        bound.programHandle = program.handle;
+    }
+
+    // Culling can be turned off globally from the GUI
+    const CullMode cullMode = g_CullFace ? desc.cullMode : CullMode_None;
+    if (force || bound.cullMode != cullMode)
+    {
+        if (cullMode == CullMode_None)
+            glDisable(GL_CULL_FACE);
+        else
+        {
+            glEnable(GL_CULL_FACE);
+            glCullFace(GL_BACK);
+            glFrontFace(GL_CCW);
+        }
+        bound.cullMode = cullMode;
+    }
+
+    if (force || bound.depthClamp != desc.depthClamp)
+    {
+        if (desc.depthClamp) glEnable(GL_DEPTH_CLAMP);
+        else                 glDisable(GL_DEPTH_CLAMP);
+        bound.depthClamp = desc.depthClamp;
+    }
+
+    if (force || bound.polygonOffset != desc.polygonOffset)
+    {
+        if (desc.polygonOffset) glEnable(GL_POLYGON_OFFSET_FILL);
+        else                    glDisable(GL_POLYGON_OFFSET_FILL);
+        bound.polygonOffset = desc.polygonOffset;
+    }
+
+    if (desc.polygonOffset && (force || bound.polygonOffsetFactor != desc.polygonOffsetFactor || bound.polygonOffsetUnits != desc.polygonOffsetUnits))
+    {
+        glPolygonOffset(desc.polygonOffsetFactor, desc.polygonOffsetUnits);
+        bound.polygonOffsetFactor = desc.polygonOffsetFactor;
+        bound.polygonOffsetUnits = desc.polygonOffsetUnits;
+    }
+
+    if (force || bound.depthTest != desc.depthTest)
+    {
+        if (desc.depthTest) glEnable(GL_DEPTH_TEST);
+        else                glDisable(GL_DEPTH_TEST);
+        bound.depthTest = desc.depthTest;
+    }
+
+    if (force || bound.depthWrite != desc.depthWrite)
+    {
+        glDepthMask(desc.depthWrite ? GL_TRUE : GL_FALSE);
+        bound.depthWrite = desc.depthWrite;
+    }
+
+    if (force || bound.blendMode != desc.blendMode)
+    {
+        if (desc.blendMode == BlendMode_Opaque)
+            glDisable(GL_BLEND);
+        else
+        {
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        }
+        bound.blendMode = desc.blendMode;
+    }
+
+    bound.isValid = true;
+}
+
+// Points the instancing stream of the PSO vertex layout at offset in the bound instancing buffer
+void BindInstanceAttributes(const Device& device, u32 pipelineStateIdx, u64 offset)
+{
+    const PipelineStateDesc& desc = device.pipelineStates[pipelineStateIdx].desc;
+    const u32 VertexStream_FirstInstancingStream = 6;
+    for (u32 i = 0; i < desc.instanceAttributeCount; ++i)
+    {
+        const u32 location = VertexStream_FirstInstancingStream + i;
+        glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, desc.instanceStride, (void*)(u64)offset);
+        glVertexAttribDivisor(location, 1);
+        glEnableVertexAttribArray(location);
+        offset += sizeof(vec4);
+    }
+}
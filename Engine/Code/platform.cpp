@@ -18,17 +18,43 @@
 #include "engine.h"
 
 #include <GLFW/glfw3.h>
+#if USE_EGL_HEADLESS
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 #include <stdio.h>
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
 #include "imgui_gfx.h"
+#if USE_GFX_API_NULL
+#include "null_engine.h"
+#endif
+#if USE_GFX_API_VULKAN
+#include "vulkan_engine.h"
+#endif
 
 #include <cstdarg>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <errno.h>
+#if !defined(_WIN32)
+#include <time.h>
+#endif
 
 #define WINDOW_TITLE  "Advanced Graphics Programming"
 #define WINDOW_WIDTH  800
 #define WINDOW_HEIGHT 600
 
+#define HEADLESS_DEFAULT_FRAME_COUNT 100
+
+#define EXIT_CODE_SUCCESS        0
+#define EXIT_CODE_BAD_ARGUMENTS  1
+#define EXIT_CODE_INIT_FAILED    2
+#define EXIT_CODE_GL_ERROR       3
+#define EXIT_CODE_VULKAN_ERROR   4
+
 GLFWwindow* GlfwWindow = NULL;
 
 #define GLOBAL_FRAME_ARENA_SIZE MB(16)
@@ -124,7 +150,411 @@ void OnGlfwCloseWindow(GLFWwindow* window)
     app->isRunning = false;
 }
 
-int main()
+struct PlatformOptions
+{
+    // Headless runs render offscreen for a fixed number of frames (or seconds) with a fixed deltaTime
+    bool headless;
+    u32  maxFrames;
+    f32  maxSeconds;
+    f32  fixedDeltaTime;
+    bool hasFixedDeltaTime; // Given explicitly, also overrides replayed frame times
+
+    // Input recording and replay
+    const char* recordFilepath;
+    const char* replayFilepath;
+    bool        replayLoop;
+
+    // Writes every frame as <prefix>_<index>.png, e.g. for golden image checks
+    const char* capturePrefix;
+
+    // Compiles every program from source, to measure cold startups
+    bool disableProgramCache;
+
+    // Loads the source images instead of their cooked versions, to compare memory and quality
+    bool disableCookedTextures;
+
+    // Keeps the triangle order of the imported meshes, to compare the vertex cache and overdraw
+    bool disableMeshOptimization;
+
+    // Simulates frame N+1 on its own thread while frame N renders
+    bool threaded;
+};
+
+static bool ParseCommandLine(int argc, char** argv, PlatformOptions& options, BenchmarkConfig& benchmark)
+{
+    options = {};
+    options.fixedDeltaTime = 1.0f/60.0f;
+
+    benchmark = {};
+    benchmark.scene = BenchmarkScene_Grid;
+    benchmark.gridSize = 10;
+    benchmark.uniqueMeshCount = 64;
+    benchmark.pointLightCount = 3;
+    benchmark.warmupFrames = 30;
+    benchmark.frameCount = 300;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool hasValue = i + 1 < argc;
+        if (SameString(argv[i], "--headless"))
+        {
+            options.headless = true;
+        }
+        else if (SameString(argv[i], "--frames") && hasValue)
+        {
+            options.maxFrames = (u32)atoi(argv[++i]);
+        }
+        else if (SameString(argv[i], "--duration") && hasValue)
+        {
+            options.maxSeconds = (f32)atof(argv[++i]);
+        }
+        else if (SameString(argv[i], "--delta-time") && hasValue)
+        {
+            options.fixedDeltaTime = (f32)atof(argv[++i]);
+            options.hasFixedDeltaTime = true;
+        }
+        else if (SameString(argv[i], "--record") && hasValue)
+        {
+            options.recordFilepath = argv[++i];
+        }
+        else if (SameString(argv[i], "--replay") && hasValue)
+        {
+            options.replayFilepath = argv[++i];
+        }
+        else if (SameString(argv[i], "--replay-loop"))
+        {
+            options.replayLoop = true;
+        }
+        else if (SameString(argv[i], "--no-program-cache"))
+        {
+            options.disableProgramCache = true;
+        }
+        else if (SameString(argv[i], "--no-cooked-textures"))
+        {
+            options.disableCookedTextures = true;
+        }
+        else if (SameString(argv[i], "--no-mesh-optimization"))
+        {
+            options.disableMeshOptimization = true;
+        }
+        else if (SameString(argv[i], "--threaded"))
+        {
+            options.threaded = true;
+        }
+        else if (SameString(argv[i], "--capture") && hasValue)
+        {
+            options.capturePrefix = argv[++i];
+        }
+        else if (SameString(argv[i], "--benchmark") && hasValue)
+        {
+            benchmark.isEnabled = true;
+            benchmark.outputFilepath = argv[++i];
+        }
+        else if (SameString(argv[i], "--benchmark-scene") && hasValue)
+        {
+            if (!BenchmarkSceneFromName(argv[++i], benchmark.scene))
+            {
+                ELOG("Unknown benchmark scene: %s\n", argv[i]);
+                return false;
+            }
+        }
+        else if (SameString(argv[i], "--benchmark-grid") && hasValue)
+        {
+            benchmark.gridSize = (u32)atoi(argv[++i]);
+        }
+        else if (SameString(argv[i], "--benchmark-meshes") && hasValue)
+        {
+            benchmark.uniqueMeshCount = (u32)atoi(argv[++i]);
+        }
+        else if (SameString(argv[i], "--benchmark-lights") && hasValue)
+        {
+            benchmark.pointLightCount = (u32)atoi(argv[++i]);
+        }
+        else if (SameString(argv[i], "--benchmark-frames") && hasValue)
+        {
+            benchmark.frameCount = (u32)atoi(argv[++i]);
+        }
+        else if (SameString(argv[i], "--benchmark-warmup") && hasValue)
+        {
+            benchmark.warmupFrames = (u32)atoi(argv[++i]);
+        }
+#if USE_CPU_PROFILER
+        // --trace <frameCount> <filepath> captures the first frames of the run
+        else if (SameString(argv[i], "--trace") && i + 2 < argc)
+        {
+            CpuProfile_RequestCapture((u32)atoi(argv[i + 1]), argv[i + 2]);
+            i += 2;
+        }
+#endif
+        else
+        {
+            ELOG("Unknown or incomplete command line option: %s\n", argv[i]);
+            return false;
+        }
+    }
+
+    if (options.recordFilepath && options.replayFilepath)
+    {
+        ELOG("--record and --replay cannot be used together\n");
+        return false;
+    }
+
+    // Benchmarks drive the camera of every frame from the render thread
+    if (options.threaded && benchmark.isEnabled)
+    {
+        ELOG("--threaded and --benchmark cannot be used together\n");
+        return false;
+    }
+
+#if USE_GFX_API_NULL
+    // There is nothing to show a window with
+    options.headless = true;
+#endif
+
+    // Headless runs must finish on their own (a replay ends with its recording, a benchmark after its runs)
+    const bool replayEnds = options.replayFilepath && !options.replayLoop;
+    if (options.headless && !replayEnds && !benchmark.isEnabled && options.maxFrames == 0 && options.maxSeconds <= 0.0f)
+    {
+        options.maxFrames = HEADLESS_DEFAULT_FRAME_COUNT;
+    }
+
+    return true;
+}
+
+// Input recordings store, for every frame, the Input seen by Update together with
+// displaySize and deltaTime, so replays run exactly the same frames.
+// Layout: InputRecordingHeader followed by one packed record per frame.
+
+#define INPUT_RECORDING_MAGIC   0x49504741 // 'AGPI'
+#define INPUT_RECORDING_VERSION 1
+
+struct InputRecordingHeader
+{
+    u32 magic;
+    u32 version;
+    u32 keyCount;
+    u32 mouseButtonCount;
+};
+
+struct InputRecording
+{
+    FILE* file;
+    bool  isReplay;
+    bool  loop;
+    u32   frameCount;
+};
+
+static bool InputRecording_Open(InputRecording& recording, const char* filepath, bool isReplay, bool loop)
+{
+    recording = {};
+    recording.isReplay = isReplay;
+    recording.loop = loop;
+    recording.file = fopen(filepath, isReplay ? "rb" : "wb");
+    if (!recording.file)
+    {
+        ELOG("Could not open input recording %s\n", filepath);
+        return false;
+    }
+
+    InputRecordingHeader header = {};
+    if (isReplay)
+    {
+        if (fread(&header, sizeof(header), 1, recording.file) != 1 ||
+            header.magic != INPUT_RECORDING_MAGIC || header.version != INPUT_RECORDING_VERSION ||
+            header.keyCount != KEY_COUNT || header.mouseButtonCount != MOUSE_BUTTON_COUNT)
+        {
+            ELOG("%s is not a compatible input recording\n", filepath);
+            fclose(recording.file);
+            recording.file = NULL;
+            return false;
+        }
+    }
+    else
+    {
+        header.magic = INPUT_RECORDING_MAGIC;
+        header.version = INPUT_RECORDING_VERSION;
+        header.keyCount = KEY_COUNT;
+        header.mouseButtonCount = MOUSE_BUTTON_COUNT;
+        fwrite(&header, sizeof(header), 1, recording.file);
+    }
+    return true;
+}
+
+static void InputRecording_Close(InputRecording& recording)
+{
+    if (recording.file)
+    {
+        ILOG("Input %s: %u frames\n", recording.isReplay ? "replayed" : "recorded", recording.frameCount);
+        fclose(recording.file);
+    }
+    recording = {};
+}
+
+static void InputRecording_WriteFrame(InputRecording& recording, const App& app)
+{
+    u8 buttons[KEY_COUNT + MOUSE_BUTTON_COUNT];
+    for (u32 i = 0; i < KEY_COUNT; ++i)          buttons[i] = (u8)app.input.keys[i];
+    for (u32 i = 0; i < MOUSE_BUTTON_COUNT; ++i) buttons[KEY_COUNT + i] = (u8)app.input.mouseButtons[i];
+
+    fwrite(&app.deltaTime, sizeof(f32), 1, recording.file);
+    fwrite(value_ptr(app.displaySize), sizeof(i32), 2, recording.file);
+    fwrite(value_ptr(app.input.mousePos), sizeof(f32), 2, recording.file);
+    fwrite(value_ptr(app.input.mouseDelta), sizeof(f32), 2, recording.file);
+    fwrite(buttons, sizeof(buttons), 1, recording.file);
+    recording.frameCount++;
+}
+
+// Returns false once the recording is over
+static bool InputRecording_ReadFrame(InputRecording& recording, App& app)
+{
+    f32 deltaTime;
+    ivec2 displaySize;
+    vec2 mousePos, mouseDelta;
+    u8 buttons[KEY_COUNT + MOUSE_BUTTON_COUNT];
+
+    for (u32 attempt = 0; attempt < 2; ++attempt)
+    {
+        const bool isFrameRead =
+            fread(&deltaTime, sizeof(f32), 1, recording.file) == 1 &&
+            fread(value_ptr(displaySize), sizeof(i32), 2, recording.file) == 2 &&
+            fread(value_ptr(mousePos), sizeof(f32), 2, recording.file) == 2 &&
+            fread(value_ptr(mouseDelta), sizeof(f32), 2, recording.file) == 2 &&
+            fread(buttons, sizeof(buttons), 1, recording.file) == 1;
+
+        if (isFrameRead)
+        {
+            app.deltaTime = deltaTime;
+            app.displaySize = displaySize;
+            app.input.mousePos = mousePos;
+            app.input.mouseDelta = mouseDelta;
+            for (u32 i = 0; i < KEY_COUNT; ++i)          app.input.keys[i] = (ButtonState)buttons[i];
+            for (u32 i = 0; i < MOUSE_BUTTON_COUNT; ++i) app.input.mouseButtons[i] = (ButtonState)buttons[KEY_COUNT + i];
+            recording.frameCount++;
+            return true;
+        }
+
+        if (!recording.loop || recording.frameCount == 0)
+            break;
+
+        fseek(recording.file, sizeof(InputRecordingHeader), SEEK_SET);
+    }
+
+    return false;
+}
+
+#if USE_EGL_HEADLESS
+
+struct HeadlessContext
+{
+    EGLDisplay display;
+    EGLSurface surface;
+    EGLContext context;
+};
+
+static HeadlessContext GlobalHeadlessContext = {};
+
+// Offscreen GL context without any window system: the Mesa surfaceless platform
+// when available (works with llvmpipe on machines without display nor GPU), the
+// default display otherwise. Renders into a pbuffer of the given size.
+static bool CreateHeadlessContext(ivec2 size)
+{
+    HeadlessContext& headless = GlobalHeadlessContext;
+
+    PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (eglGetPlatformDisplayEXT && clientExtensions && strstr(clientExtensions, "EGL_MESA_platform_surfaceless"))
+    {
+        headless.display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (headless.display == EGL_NO_DISPLAY)
+    {
+        headless.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+
+    EGLint major, minor;
+    if (headless.display == EGL_NO_DISPLAY || !eglInitialize(headless.display, &major, &minor))
+    {
+        ELOG("eglInitialize() failed\n");
+        return false;
+    }
+    ILOG("EGL %d.%d (%s)\n", major, minor, eglQueryString(headless.display, EGL_VENDOR));
+
+    const EGLint configAttributes[] = {
+        EGL_SURFACE_TYPE,    EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+        EGL_DEPTH_SIZE, 24,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configCount = 0;
+    if (!eglChooseConfig(headless.display, configAttributes, &config, 1, &configCount) || configCount == 0)
+    {
+        ELOG("eglChooseConfig() found no pbuffer config\n");
+        return false;
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+    {
+        ELOG("eglBindAPI(EGL_OPENGL_API) failed\n");
+        return false;
+    }
+
+    // Same versions as the windowed path, 4.3 first and 4.1 as fallback
+    int majorVersionsArray[] = {4, 4};
+    int minorVersionsArray[] = {3, 1};
+    for (u32 i = 0; i < ARRAY_COUNT(majorVersionsArray) && headless.context == EGL_NO_CONTEXT; ++i)
+    {
+        const EGLint contextAttributes[] = {
+            EGL_CONTEXT_MAJOR_VERSION,       majorVersionsArray[i],
+            EGL_CONTEXT_MINOR_VERSION,       minorVersionsArray[i],
+            EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+            EGL_NONE
+        };
+        headless.context = eglCreateContext(headless.display, config, EGL_NO_CONTEXT, contextAttributes);
+    }
+    if (headless.context == EGL_NO_CONTEXT)
+    {
+        ELOG("eglCreateContext() failed\n");
+        return false;
+    }
+
+    const EGLint surfaceAttributes[] = { EGL_WIDTH, size.x, EGL_HEIGHT, size.y, EGL_NONE };
+    headless.surface = eglCreatePbufferSurface(headless.display, config, surfaceAttributes);
+    if (headless.surface == EGL_NO_SURFACE)
+    {
+        ELOG("eglCreatePbufferSurface() failed\n");
+        return false;
+    }
+
+    if (!eglMakeCurrent(headless.display, headless.surface, headless.surface, headless.context))
+    {
+        ELOG("eglMakeCurrent() failed\n");
+        return false;
+    }
+
+    return true;
+}
+
+static void DestroyHeadlessContext()
+{
+    HeadlessContext& headless = GlobalHeadlessContext;
+    if (headless.display == EGL_NO_DISPLAY)
+        return;
+    eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (headless.surface != EGL_NO_SURFACE) eglDestroySurface(headless.display, headless.surface);
+    if (headless.context != EGL_NO_CONTEXT) eglDestroyContext(headless.display, headless.context);
+    eglTerminate(headless.display);
+    headless = {};
+}
+
+#endif // USE_EGL_HEADLESS
+
+// Tools that reuse the platform layer in their own executable (e.g. microbench.cpp)
+// define PLATFORM_NO_MAIN to provide their own entry point
+#if !defined(PLATFORM_NO_MAIN)
+int main(int argc, char** argv)
 {
     App app         = {};
     app.deltaTime   = 1.0f/60.0f;
@@ -133,70 +563,114 @@ int main()
 
     ivec2 oldDisplaySize = app.displaySize;
 
-    glfwSetErrorCallback(OnGlfwError);
+#if USE_CPU_PROFILER
+    CpuProfile_SetThreadName("Main");
+#endif
 
-    if (!glfwInit())
+    PlatformOptions options;
+    if (!ParseCommandLine(argc, argv, options, app.benchmark.config))
     {
-        ELOG("glfwInit() failed\n");
-        return -1;
+        return EXIT_CODE_BAD_ARGUMENTS;
     }
 
-#if USE_GFX_API_OPENGL
+    const bool headless = options.headless;
     GLFWwindow* window = NULL;
-    int majorVersionsArray[] = {4, 4};
-    int minorVersionsArray[] = {3, 1};
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    for (int i = 0; i < ARRAY_COUNT(majorVersionsArray) && !window; ++i)
+
+    if (headless)
     {
-        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, majorVersionsArray[i]);
-        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, minorVersionsArray[i]);
-        window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+#if USE_GFX_API_NULL
+        if (!gladLoadGLLoader((GLADloadproc) Null_GetProcAddress))
+        {
+            ELOG("Failed to initialize the null OpenGL driver\n");
+            return EXIT_CODE_INIT_FAILED;
+        }
+#elif USE_EGL_HEADLESS && USE_GFX_API_OPENGL
+        if (!CreateHeadlessContext(app.displaySize))
+        {
+            DestroyHeadlessContext();
+            return EXIT_CODE_INIT_FAILED;
+        }
+
+        if (!gladLoadGLLoader((GLADloadproc) eglGetProcAddress))
+        {
+            ELOG("Failed to initialize OpenGL context\n");
+            return EXIT_CODE_INIT_FAILED;
+        }
+#elif USE_GFX_API_VULKAN
+        // Vulkan renders offscreen without a window, there is no context to create
+#else
+        ELOG("Headless mode is not supported in this build (needs USE_EGL_HEADLESS and OpenGL)\n");
+        return EXIT_CODE_INIT_FAILED;
+#endif
     }
-#elif USE_GFX_API_METAL
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    GLFWwindow *window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+    else
+    {
+        glfwSetErrorCallback(OnGlfwError);
+
+        if (!glfwInit())
+        {
+            ELOG("glfwInit() failed\n");
+            return EXIT_CODE_INIT_FAILED;
+        }
+
+#if USE_GFX_API_OPENGL
+        int majorVersionsArray[] = {4, 4};
+        int minorVersionsArray[] = {3, 1};
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        for (u32 i = 0; i < ARRAY_COUNT(majorVersionsArray) && !window; ++i)
+        {
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, majorVersionsArray[i]);
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, minorVersionsArray[i]);
+            window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+        }
+#elif USE_GFX_API_METAL || USE_GFX_API_VULKAN
+        glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+        window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
 #else
 #error No GFX API defined
 #endif
 
-    if (!window)
-    {
-        ELOG("glfwCreateWindow() failed\n");
-        return -1;
-    }
+        if (!window)
+        {
+            ELOG("glfwCreateWindow() failed\n");
+            return EXIT_CODE_INIT_FAILED;
+        }
 
-    GlfwWindow = window;
+        GlfwWindow = window;
 
-    glfwSetWindowUserPointer(window, &app);
+        glfwSetWindowUserPointer(window, &app);
 
-    glfwSetMouseButtonCallback(window, OnGlfwMouseEvent);
-    glfwSetCursorPosCallback(window, OnGlfwMouseMoveEvent);
-    glfwSetScrollCallback(window, OnGlfwScrollEvent);
-    glfwSetKeyCallback(window, OnGlfwKeyboardEvent);
-    glfwSetCharCallback(window, OnGlfwCharEvent);
-    glfwSetFramebufferSizeCallback(window, OnGlfwResizeFramebuffer);
-    glfwSetWindowCloseCallback(window, OnGlfwCloseWindow);
+        glfwSetMouseButtonCallback(window, OnGlfwMouseEvent);
+        glfwSetCursorPosCallback(window, OnGlfwMouseMoveEvent);
+        glfwSetScrollCallback(window, OnGlfwScrollEvent);
+        glfwSetKeyCallback(window, OnGlfwKeyboardEvent);
+        glfwSetCharCallback(window, OnGlfwCharEvent);
+        glfwSetFramebufferSizeCallback(window, OnGlfwResizeFramebuffer);
+        glfwSetWindowCloseCallback(window, OnGlfwCloseWindow);
 
 #if USE_GFX_API_OPENGL
-    glfwMakeContextCurrent(window);
+        glfwMakeContextCurrent(window);
 
-    // Load all OpenGL functions using the glfw loader function
-    if (!gladLoadGLLoader((GLADloadproc) glfwGetProcAddress))
-    {
-        ELOG("Failed to initialize OpenGL context\n");
-        return -1;
-    }
+        // Load all OpenGL functions using the glfw loader function
+        if (!gladLoadGLLoader((GLADloadproc) glfwGetProcAddress))
+        {
+            ELOG("Failed to initialize OpenGL context\n");
+            return EXIT_CODE_INIT_FAILED;
+        }
 #endif
+    }
 
     IMGUI_CHECKVERSION();
     ImGui::CreateContext();
 
     ImGuiIO& io = ImGui::GetIO(); (void)io;
-    io.ConfigFlags |= ImGuiConfigFlags_NavEnableKeyboard;       // Enable Keyboard Controls
+    if (!headless)
+        io.ConfigFlags |= ImGuiConfigFlags_NavEnableKeyboard;   // Enable Keyboard Controls (headless runs have no key map)
     //io.ConfigFlags |= ImGuiConfigFlags_NavEnableGamepad;      // Enable Gamepad Controls
     io.ConfigFlags |= ImGuiConfigFlags_DockingEnable;           // Enable Docking
-    io.ConfigFlags |= ImGuiConfigFlags_ViewportsEnable;         // Enable Multi-Viewport / Platform Windows
+    if (!headless)
+        io.ConfigFlags |= ImGuiConfigFlags_ViewportsEnable;     // Enable Multi-Viewport / Platform Windows
     //io.ConfigViewportsNoAutoMerge = true;
     //io.ConfigViewportsNoTaskBarIcon = true;
 
@@ -213,36 +687,97 @@ int main()
     }
 
     // Even Metal apps init this window for OpenGL
-    if (!ImGui_ImplGlfw_InitForOpenGL(window, true))
+    // Headless runs have no window, ImGui gets its display size and time step below instead
+#if USE_GFX_API_VULKAN
+    if (!headless && !ImGui_ImplGlfw_InitForVulkan(window, true))
+    {
+        ELOG("ImGui_ImplGlfw_InitForVulkan() failed\n");
+        return EXIT_CODE_INIT_FAILED;
+    }
+#else
+    if (!headless && !ImGui_ImplGlfw_InitForOpenGL(window, true))
     {
         ELOG("ImGui_ImplGlfw_InitForOpenGL() failed\n");
-        return -1;
+        return EXIT_CODE_INIT_FAILED;
     }
+#endif
 
-    f64 lastFrameTime = glfwGetTime();
+    u64 lastFrameTimeNs = GetProfileTimeNs();
+    const u64 runBeginTimeNs = lastFrameTimeNs;
 
     GlobalFrameArena = CreateArena(GLOBAL_FRAME_ARENA_SIZE);
     GlobalScratchArena = CreateArena(GLOBAL_SCRATCH_ARENA_SIZE);
 
+    app.device.disableProgramCache = options.disableProgramCache;
+    app.device.disableCookedTextures = options.disableCookedTextures;
+    app.device.disableMeshOptimization = options.disableMeshOptimization;
+    app.isSimulationThreaded = options.threaded;
+    // Nobody watches headless runs stream in, and their captures must not depend on load times
+    app.assets.isBlocking = options.headless;
+
     Init(&app);
 
     if (!ImGui_Gfx_Init(app.device))
     {
         ELOG("ImGui_Gfx_Init() failed\n");
-        return -1;
+        return EXIT_CODE_INIT_FAILED;
+    }
+
+    if (headless)
+    {
+        app.deltaTime = options.fixedDeltaTime;
     }
 
+    if (options.capturePrefix)
+    {
+        app.snapshots.sequencePrefix = options.capturePrefix;
+        app.snapshots.isCapturingSequence = true;
+    }
+
+    InputRecording inputRecording = {};
+    if (options.recordFilepath && !InputRecording_Open(inputRecording, options.recordFilepath, false, false))
+    {
+        return EXIT_CODE_INIT_FAILED;
+    }
+    if (options.replayFilepath && !InputRecording_Open(inputRecording, options.replayFilepath, true, options.replayLoop))
+    {
+        return EXIT_CODE_INIT_FAILED;
+    }
+
+    u32 frameCount = 0;
+
     while (app.isRunning)
     {
+#if USE_CPU_PROFILER
+        CpuProfile_BeginFrame();
+#endif
+        CPU_PROFILE_SCOPE("Frame");
+
         // Tell GLFW to call platform callbacks
-        glfwPollEvents();
+        if (!headless)
+        {
+            CPU_PROFILE_SCOPE("PollEvents");
+            glfwPollEvents();
+        }
+        const u64 inputTimeNs = GetProfileTimeNs();
 
         // ImGui
-        ImGui_Gfx_NewFrame(app.device);
-        ImGui_ImplGlfw_NewFrame();
-        ImGui::NewFrame();
-        Gui(&app);
-        ImGui::Render();
+        {
+            CPU_PROFILE_SCOPE("ImGui");
+            ImGui_Gfx_NewFrame(app.device);
+            if (headless)
+            {
+                io.DisplaySize = ImVec2((f32)app.displaySize.x, (f32)app.displaySize.y);
+                io.DeltaTime = app.deltaTime;
+            }
+            else
+            {
+                ImGui_ImplGlfw_NewFrame();
+            }
+            ImGui::NewFrame();
+            Gui(&app);
+            ImGui::Render();
+        }
 
         // Any click on the root windows unfocuses the focused window
         if (!ImGui::IsWindowHovered(ImGuiHoveredFlags_AnyWindow) && !ImGui::IsAnyItemHovered())
@@ -268,12 +803,38 @@ int main()
                 else if (app.input.mouseButtons[i] == BUTTON_RELEASE) app.input.mouseButtons[i] = BUTTON_IDLE;
         }
 
+        // Input recording/replay, with the input exactly as Update sees it
+        if (inputRecording.file && inputRecording.isReplay)
+        {
+            if (!InputRecording_ReadFrame(inputRecording, app))
+            {
+                app.isRunning = false;
+                break;
+            }
+            if (options.hasFixedDeltaTime)
+            {
+                app.deltaTime = options.fixedDeltaTime;
+            }
+            if (window && app.displaySize != oldDisplaySize)
+            {
+                glfwSetWindowSize(window, app.displaySize.x, app.displaySize.y);
+            }
+        }
+        else if (inputRecording.file)
+        {
+            InputRecording_WriteFrame(inputRecording, app);
+        }
+
         if (oldDisplaySize != app.displaySize)
         {
             oldDisplaySize = app.displaySize;
             Resize(&app);
         }
 
+        // With a simulation thread this hands over the input of the next frame and takes the
+        // simulated packet of this one
+        SubmitFrameInput(&app, inputTimeNs);
+
         BeginFrame(&app);
 
         // Update
@@ -285,43 +846,101 @@ int main()
         Render(&app);
 
         // ImGui Render
-        ImGui_Gfx_DrawData(app.device);
-        if (io.ConfigFlags & ImGuiConfigFlags_ViewportsEnable) {
-            GLFWwindow* backup_current_context = glfwGetCurrentContext();
-            ImGui::UpdatePlatformWindows();
-            ImGui::RenderPlatformWindowsDefault();
-            glfwMakeContextCurrent(backup_current_context);
+        {
+            CPU_PROFILE_SCOPE("ImGui render");
+            ImGui_Gfx_DrawData(app.device);
+            if (io.ConfigFlags & ImGuiConfigFlags_ViewportsEnable) {
+                GLFWwindow* backup_current_context = glfwGetCurrentContext();
+                ImGui::UpdatePlatformWindows();
+                ImGui::RenderPlatformWindowsDefault();
+                glfwMakeContextCurrent(backup_current_context);
+            }
         }
 
         EndFrame(&app);
 
         // Present image on screen
 #if USE_GFX_API_OPENGL
-        glfwSwapBuffers(window);
+        if (!headless)
+        {
+            CPU_PROFILE_SCOPE("SwapBuffers");
+            glfwSwapBuffers(window);
+        }
 #endif
 
         // Frame time
-        f64 currentFrameTime = glfwGetTime();
-        app.deltaTime = (f32)(currentFrameTime - lastFrameTime);
-        lastFrameTime = currentFrameTime;
+        const u64 currentFrameTimeNs = GetProfileTimeNs();
+        if (!headless)
+        {
+            app.deltaTime = (f32)((currentFrameTimeNs - lastFrameTimeNs) / 1000000000.0);
+        }
+        lastFrameTimeNs = currentFrameTimeNs;
+
+        // Run limits
+        frameCount++;
+        const f32 runSeconds = (f32)((currentFrameTimeNs - runBeginTimeNs) / 1000000000.0);
+        if ((options.maxFrames > 0 && frameCount >= options.maxFrames) ||
+            (options.maxSeconds > 0.0f && runSeconds >= options.maxSeconds))
+        {
+            app.isRunning = false;
+        }
 
         // Reset frame allocator
         ResetArena(GlobalFrameArena);
         ResetArena(GlobalScratchArena);
     }
 
+    InputRecording_Close(inputRecording);
+
+    Shutdown(&app);
+
+    int exitCode = EXIT_CODE_SUCCESS;
+
+#if USE_GFX_API_OPENGL
+    // Let automated runs notice GL errors nobody looked at
+    const GLenum glError = glGetError();
+    if (glError != GL_NO_ERROR)
+    {
+        ELOG("OpenGL error 0x%x pending at exit\n", glError);
+        exitCode = EXIT_CODE_GL_ERROR;
+    }
+#elif USE_GFX_API_VULKAN
+    // Same for the messages of the validation layer
+    if (Vulkan_GetValidationErrorCount() > 0)
+    {
+        ELOG("%u Vulkan validation errors\n", Vulkan_GetValidationErrorCount());
+        exitCode = EXIT_CODE_VULKAN_ERROR;
+    }
+#endif
+
+    if (headless)
+    {
+        ILOG("Headless run finished: %u frames\n", frameCount);
+    }
+
     DestroyArena(GlobalFrameArena);
     DestroyArena(GlobalScratchArena);
 
     ImGui_Gfx_Shutdown(app.device);
-    ImGui_ImplGlfw_Shutdown();
 
-    glfwDestroyWindow(window);
+    if (headless)
+    {
+#if USE_EGL_HEADLESS
+        DestroyHeadlessContext();
+#endif
+    }
+    else
+    {
+        ImGui_ImplGlfw_Shutdown();
 
-    glfwTerminate();
+        glfwDestroyWindow(window);
 
-    return 0;
+        glfwTerminate();
+    }
+
+    return exitCode;
 }
+#endif // !PLATFORM_NO_MAIN
 
 static u32 Strlen(const char* string)
 {
@@ -346,8 +965,9 @@ bool SameString(const char* a, const char* b)
 
 bool SameString(String a, String b)
 {
+    // Compares len chars only, strings may point into a larger buffer (e.g. a parsed token)
     if (a.len == b.len)
-        return (Strcmp(a.str, b.str) == 0);
+        return (memcmp(a.str, b.str, a.len) == 0);
     return false;
 }
 
@@ -464,6 +1084,15 @@ u64 GetFileLastWriteTimestamp(const char* filepath)
     return 0;
 }
 
+bool MakeDirectory(const char* path)
+{
+#ifdef _WIN32
+    return CreateDirectoryA(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+#endif
+}
+
 void LogString(const char* str)
 {
 #ifdef _WIN32
@@ -474,25 +1103,279 @@ void LogString(const char* str)
 #endif
 }
 
+static std::mutex GlobalLogMutex;
+
+// Called from the job workers, the asset loader and the snapshot writer as well, so
+// it formats on the stack (the heap for long messages) instead of the frame arena
+// the main thread resets, and serializes the output
 void LogFormattedString(const char* format, ...)
 {
     va_list arguments;
 
+    char stackString[1024];
     va_start(arguments, format);
-    const int charCount = vsnprintf(NULL, 0, format, arguments);
+    const int charCount = vsnprintf(stackString, sizeof(stackString), format, arguments);
     va_end(arguments);
 
-    va_start(arguments, format);
-    String str = {};
-    str.len = charCount;
-    char* formattedString = (char*)PushSize(GlobalFrameArena, str.len + 1);
-    vsnprintf(formattedString, charCount+1, format, arguments);
-    str.str = formattedString;
-    va_end(arguments);
+    char* formattedString = stackString;
+    if (charCount >= (int)sizeof(stackString))
+    {
+        formattedString = (char*)malloc(charCount + 1);
+        va_start(arguments, format);
+        vsnprintf(formattedString, charCount + 1, format, arguments);
+        va_end(arguments);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(GlobalLogMutex);
+        LogString(charCount >= 0 ? formattedString : format);
+    }
+
+    if (formattedString != stackString)
+        free(formattedString);
+}
+
+u64 GetProfileTimeNs()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency = {};
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (u64)((f64)counter.QuadPart * 1000000000.0 / (f64)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+#endif
+}
+
+#if USE_CPU_PROFILER
+
+struct CpuProfileEvent
+{
+    const char* name;
+    u64         beginNs;
+    u64         endNs;
+};
+
+// Single producer ring: only the owning thread writes, and publishes each event
+// by bumping writeCount. Readers may race with the oldest entries being
+// overwritten, which is acceptable for profiling data.
+struct CpuProfileTimeline
+{
+    char              name[CPU_PROFILE_THREAD_NAME_SIZE];
+    std::atomic<bool> isUsed; // Owned by a running thread
+    std::atomic<u32>  writeCount;
+    CpuProfileEvent  events[CPU_PROFILE_EVENTS_PER_THREAD];
+};
+
+enum CpuProfileCaptureState
+{
+    CpuProfileCaptureState_Idle,
+    CpuProfileCaptureState_Requested,
+    CpuProfileCaptureState_Recording,
+    CpuProfileCaptureState_Flushing,
+};
+
+// Frames to wait after a capture so that late GPU timings make it into the trace
+#define CPU_PROFILE_CAPTURE_LATENCY_FRAMES 8
+
+static CpuProfileTimeline        CpuProfileThreads[CPU_PROFILE_MAX_THREADS];
+static std::atomic<u32>          CpuProfileThreadCount; // Slots ever used
+static CpuProfileTimeline        CpuProfileGpuTimeline;
+
+// Gives the slot back when the thread exits
+struct CpuProfileThreadSlot
+{
+    CpuProfileTimeline* timeline;
+
+    ~CpuProfileThreadSlot()
+    {
+        if (timeline)
+            timeline->isUsed.store(false, std::memory_order_release);
+    }
+};
+
+static thread_local CpuProfileThreadSlot CpuProfileThisThread;
+
+static CpuProfileCaptureState CpuProfileCapture = CpuProfileCaptureState_Idle;
+static u32         CpuProfileCaptureFrameCount;
+static u32         CpuProfileCaptureFramesLeft;
+static u64         CpuProfileCaptureBeginNs;
+static u64         CpuProfileCaptureEndNs;
+static const char* CpuProfileCaptureFilepath;
+
+// Returns null when every slot is taken, the scopes of that thread record nothing then
+static CpuProfileTimeline* CpuProfile_GetThreadTimeline()
+{
+    if (!CpuProfileThisThread.timeline)
+    {
+        u32 threadIdx = 0;
+        for (; threadIdx < CPU_PROFILE_MAX_THREADS; ++threadIdx)
+        {
+            bool isUsed = false;
+            if (CpuProfileThreads[threadIdx].isUsed.compare_exchange_strong(isUsed, true, std::memory_order_acquire))
+                break;
+        }
+        if (threadIdx == CPU_PROFILE_MAX_THREADS)
+            return NULL;
+
+        u32 threadCount = CpuProfileThreadCount.load();
+        while (threadCount < threadIdx + 1 && !CpuProfileThreadCount.compare_exchange_weak(threadCount, threadIdx + 1)) {}
+
+        // The slot may have been released by a thread that already exited
+        CpuProfileTimeline* timeline = &CpuProfileThreads[threadIdx];
+        timeline->writeCount.store(0, std::memory_order_release);
+        snprintf(timeline->name, CPU_PROFILE_THREAD_NAME_SIZE, "Thread");
+        CpuProfileThisThread.timeline = timeline;
+    }
+    return CpuProfileThisThread.timeline;
+}
+
+static void CpuProfile_Push(CpuProfileTimeline& timeline, const char* name, u64 beginNs, u64 endNs)
+{
+    const u32 writeCount = timeline.writeCount.load(std::memory_order_relaxed);
+    CpuProfileEvent& event = timeline.events[writeCount % CPU_PROFILE_EVENTS_PER_THREAD];
+    event.name = name;
+    event.beginNs = beginNs;
+    event.endNs = endNs;
+    timeline.writeCount.store(writeCount + 1, std::memory_order_release);
+}
+
+void CpuProfile_SetThreadName(const char* name)
+{
+    CpuProfileTimeline* timeline = CpuProfile_GetThreadTimeline();
+    if (timeline)
+        snprintf(timeline->name, CPU_PROFILE_THREAD_NAME_SIZE, "%s", name);
+}
+
+void CpuProfile_PushEvent(const char* name, u64 beginNs, u64 endNs)
+{
+    CpuProfileTimeline* timeline = CpuProfile_GetThreadTimeline();
+    if (timeline)
+        CpuProfile_Push(*timeline, name, beginNs, endNs);
+}
+
+void CpuProfile_PushGpuEvent(const char* name, u64 beginNs, u64 endNs)
+{
+    CpuProfile_Push(CpuProfileGpuTimeline, name, beginNs, endNs);
+}
+
+// Writes a quoted JSON string, escaping quotes, backslashes and control characters
+static void CpuProfile_WriteString(FILE* file, const char* string)
+{
+    fputc('"', file);
+    for (const char* c = string; *c; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+            fprintf(file, "\\%c", *c);
+        else if ((u8)*c < 0x20)
+            fprintf(file, "\\u%04x", (u8)*c);
+        else
+            fputc(*c, file);
+    }
+    fputc('"', file);
+}
 
-    LogString(str.str);
+static void CpuProfile_WriteTimeline(FILE* file, const CpuProfileTimeline& timeline, u32 tid, bool& isFirstEvent)
+{
+    fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":",
+            isFirstEvent ? "" : ",", tid);
+    CpuProfile_WriteString(file, timeline.name[0] ? timeline.name : "Unknown");
+    fprintf(file, "}}");
+    isFirstEvent = false;
+
+    const u32 writeCount = timeline.writeCount.load(std::memory_order_acquire);
+    const u32 readCount = writeCount > CPU_PROFILE_EVENTS_PER_THREAD ? CPU_PROFILE_EVENTS_PER_THREAD : writeCount;
+    for (u32 i = writeCount - readCount; i < writeCount; ++i)
+    {
+        const CpuProfileEvent& event = timeline.events[i % CPU_PROFILE_EVENTS_PER_THREAD];
+        if (event.beginNs < CpuProfileCaptureBeginNs || event.beginNs >= CpuProfileCaptureEndNs)
+            continue;
+
+        // Trace timestamps are in microseconds, relative to the capture begin
+        fprintf(file, ",\n{\"name\":");
+        CpuProfile_WriteString(file, event.name);
+        fprintf(file, ",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                tid,
+                (event.beginNs - CpuProfileCaptureBeginNs) / 1000.0,
+                (event.endNs - event.beginNs) / 1000.0);
+    }
 }
 
+static void CpuProfile_WriteCapture()
+{
+    FILE* file = fopen(CpuProfileCaptureFilepath, "wb");
+    if (!file)
+    {
+        ELOG("Could not open %s to write the profile capture\n", CpuProfileCaptureFilepath);
+        return;
+    }
+
+    bool isFirstEvent = true;
+    fprintf(file, "{\"traceEvents\":[");
+    const u32 threadCount = CpuProfileThreadCount.load();
+    for (u32 i = 0; i < threadCount && i < CPU_PROFILE_MAX_THREADS; ++i)
+    {
+        CpuProfile_WriteTimeline(file, CpuProfileThreads[i], i, isFirstEvent);
+    }
+    snprintf(CpuProfileGpuTimeline.name, CPU_PROFILE_THREAD_NAME_SIZE, "GPU");
+    CpuProfile_WriteTimeline(file, CpuProfileGpuTimeline, CPU_PROFILE_MAX_THREADS, isFirstEvent);
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(file);
+
+    ILOG("Profile capture of %u frames written to %s\n", CpuProfileCaptureFrameCount, CpuProfileCaptureFilepath);
+}
+
+void CpuProfile_BeginFrame()
+{
+    const u64 nowNs = GetProfileTimeNs();
+
+    switch (CpuProfileCapture)
+    {
+        case CpuProfileCaptureState_Requested:
+            CpuProfileCaptureBeginNs = nowNs;
+            CpuProfileCaptureFramesLeft = CpuProfileCaptureFrameCount;
+            CpuProfileCapture = CpuProfileCaptureState_Recording;
+            break;
+        case CpuProfileCaptureState_Recording:
+            if (--CpuProfileCaptureFramesLeft == 0)
+            {
+                CpuProfileCaptureEndNs = nowNs;
+                CpuProfileCaptureFramesLeft = CPU_PROFILE_CAPTURE_LATENCY_FRAMES;
+                CpuProfileCapture = CpuProfileCaptureState_Flushing;
+            }
+            break;
+        case CpuProfileCaptureState_Flushing:
+            if (--CpuProfileCaptureFramesLeft == 0)
+            {
+                CpuProfile_WriteCapture();
+                CpuProfileCapture = CpuProfileCaptureState_Idle;
+            }
+            break;
+        default:;
+    }
+}
+
+void CpuProfile_RequestCapture(u32 frameCount, const char* filepath)
+{
+    if (CpuProfileCapture != CpuProfileCaptureState_Idle || frameCount == 0)
+        return;
+
+    CpuProfileCaptureFrameCount = frameCount;
+    CpuProfileCaptureFilepath = filepath;
+    CpuProfileCapture = CpuProfileCaptureState_Requested;
+}
+
+bool CpuProfile_IsCapturing()
+{
+    return CpuProfileCapture != CpuProfileCaptureState_Idle;
+}
+
+#endif // USE_CPU_PROFILER
+
 void MemCopy(void* dst, const void* src, u32 byteCount)
 {
     memcpy(dst, src, byteCount);
@@ -567,6 +1450,11 @@ Arena& GetGlobalScratchArena()
     return GlobalScratchArena;
 }
 
+Arena& GetGlobalFrameArena()
+{
+    return GlobalFrameArena;
+}
+
 GLFWwindow* GetGlfwWindow()
 {
     return GlfwWindow;
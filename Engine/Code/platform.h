@@ -94,6 +94,12 @@ String ReadTextFile(const char *filepath);
  */
 u64 GetFileLastWriteTimestamp(const char *filepath);
 
+/**
+ * Creates a directory if it does not exist yet (its parent has to exist).
+ * Returns false if the directory could not be created.
+ */
+bool MakeDirectory(const char *path);
+
 /**
  * It logs a string to whichever outputs are configured in the platform layer.
  * By default, the string is printed in the output console of VisualStudio.
@@ -142,6 +148,7 @@ void* PushU32(Arena& arena, u32 v);
 #define PUSH_LVALUE(arena, lvalue) PushData(arena, &lvalue, sizeof(lvalue))
 
 Arena& GetGlobalScratchArena();
+Arena& GetGlobalFrameArena();
 
 struct ScratchArena : public Arena
 {
@@ -164,3 +171,57 @@ struct ScratchArena : public Arena
     }
 };
 
+
+/**
+ * Monotonic time in nanoseconds, the clock shared by all the profiling timelines.
+ */
+u64 GetProfileTimeNs();
+
+//
+// CPU profiler: CPU_PROFILE_SCOPE(name) records the begin/end time of the enclosing
+// scope in a per-thread ring buffer. Captures of several frames can be dumped to a
+// Chrome trace JSON file (chrome://tracing, ui.perfetto.dev), together with the GPU
+// render group timings. Define USE_CPU_PROFILER to 0 to compile it all out.
+//
+
+#ifndef USE_CPU_PROFILER
+#define USE_CPU_PROFILER 1
+#endif
+
+// Job workers (MAX_JOB_THREADS, see engine.h) plus the main, simulation, asset loader and snapshot
+// writer threads. Slots are released when their thread exits, so pools can come and go.
+#define CPU_PROFILE_AUX_THREADS           8
+#define CPU_PROFILE_MAX_THREADS           (MAX_JOB_THREADS + CPU_PROFILE_AUX_THREADS)
+#define CPU_PROFILE_THREAD_NAME_SIZE      32
+#define CPU_PROFILE_EVENTS_PER_THREAD     16384
+#define CPU_PROFILE_DEFAULT_CAPTURE_FRAMES 60
+
+#if USE_CPU_PROFILER
+
+void CpuProfile_SetThreadName(const char* name);
+void CpuProfile_PushEvent(const char* name, u64 beginNs, u64 endNs);
+void CpuProfile_PushGpuEvent(const char* name, u64 beginNs, u64 endNs);
+void CpuProfile_BeginFrame();
+void CpuProfile_RequestCapture(u32 frameCount, const char* filepath);
+bool CpuProfile_IsCapturing();
+
+struct CpuProfileScope
+{
+    const char* name;
+    u64         beginNs;
+
+    CpuProfileScope(const char* scopeName) : name(scopeName), beginNs(GetProfileTimeNs()) {}
+    ~CpuProfileScope() { CpuProfile_PushEvent(name, beginNs, GetProfileTimeNs()); }
+};
+
+#define CPU_PROFILE_CONCAT_(a, b) a##b
+#define CPU_PROFILE_CONCAT(a, b) CPU_PROFILE_CONCAT_(a, b)
+#define CPU_PROFILE_SCOPE(name) const CpuProfileScope CPU_PROFILE_CONCAT(cpuProfileScope, __LINE__)(name)
+#define CPU_PROFILE_FUNCTION() CPU_PROFILE_SCOPE(__FUNCTION__)
+
+#else
+
+#define CPU_PROFILE_SCOPE(name)
+#define CPU_PROFILE_FUNCTION()
+
+#endif
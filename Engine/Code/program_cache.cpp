@@ -0,0 +1,183 @@
+//
+// program_cache.cpp : On-disk cache of linked program binaries (glGetProgramBinary).
+// Entries are keyed by a hash of the assembled shader sources (version header, defines,
+// program name and the shaders file) and the driver identification strings. Entries that
+// do not validate, or that the driver rejects, fall back to compiling from source.
+//
+
+#define PROGRAM_CACHE_DIRECTORY "program_cache"
+#define PROGRAM_CACHE_MAGIC     0x50504741 // "AGPP"
+#define PROGRAM_CACHE_VERSION   1
+
+struct ProgramCacheHeader
+{
+    u32 magic;
+    u32 version;
+    u64 key;
+    u32 binaryFormat;
+    u32 binarySize;
+    u64 binaryHash; // Catches truncated or corrupted files before handing them to the driver
+};
+
+static u64 HashString(const char* string, u64 hash)
+{
+    return HashBytes(string, string ? (u32)strlen(string) : 0, hash);
+}
+
+void ProgramCache_Init(Device& device)
+{
+    device.isProgramCacheEnabled = false;
+
+    if (device.disableProgramCache)
+    {
+        ILOG("Program binary cache disabled");
+        return;
+    }
+
+    if (device.glVersion < MAKE_GLVERSION(4, 1) && !device.ext.GL_ARB_get_program_binary)
+    {
+        ILOG("Program binary cache unavailable (requires GL 4.1 or GL_ARB_get_program_binary)");
+        return;
+    }
+
+    GLint binaryFormatCount = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormatCount);
+    if (binaryFormatCount == 0)
+    {
+        ILOG("Program binary cache unavailable (the driver exposes no binary formats)");
+        return;
+    }
+
+    if (!MakeDirectory(PROGRAM_CACHE_DIRECTORY))
+    {
+        ELOG("Could not create the program cache directory %s", PROGRAM_CACHE_DIRECTORY);
+        return;
+    }
+
+    // Binaries are only valid for the exact driver that produced them
+    u64 hash = HashString((const char*)glGetString(GL_VENDOR), 0xcbf29ce484222325ull);
+    hash = HashString((const char*)glGetString(GL_RENDERER), hash);
+    hash = HashString((const char*)glGetString(GL_VERSION), hash);
+    hash = HashString((const char*)glGetString(GL_SHADING_LANGUAGE_VERSION), hash);
+    device.programCacheDriverHash = hash;
+
+    device.isProgramCacheEnabled = true;
+}
+
+u64 ProgramCache_Key(const Device& device,
+                     const GLchar* const* vertexSources, const GLint* vertexLengths, u32 vertexSourceCount,
+                     const GLchar* const* fragmentSources, const GLint* fragmentLengths, u32 fragmentSourceCount)
+{
+    u64 hash = device.programCacheDriverHash;
+    for (u32 i = 0; i < vertexSourceCount; ++i)
+        hash = HashBytes(vertexSources[i], vertexLengths[i], hash);
+
+    // Keeps a part moving from the vertex to the fragment shader from producing the same key
+    const u8 separator = 0xff;
+    hash = HashBytes(&separator, sizeof(separator), hash);
+
+    for (u32 i = 0; i < fragmentSourceCount; ++i)
+        hash = HashBytes(fragmentSources[i], fragmentLengths[i], hash);
+    return hash;
+}
+
+static void ProgramCache_GetFilepath(const char* programName, char* filepath, u32 filepathSize)
+{
+    snprintf(filepath, filepathSize, "%s/%s.bin", PROGRAM_CACHE_DIRECTORY, programName);
+}
+
+// Returns 0 if there is no valid binary for this key
+GLuint ProgramCache_Load(Device& device, const char* programName, u64 key)
+{
+    CPU_PROFILE_FUNCTION();
+
+    char filepath[256];
+    ProgramCache_GetFilepath(programName, filepath, sizeof(filepath));
+
+    FILE* file = fopen(filepath, "rb");
+    if (!file)
+        return 0;
+
+    ProgramCacheHeader header = {};
+    const bool validHeader =
+        fread(&header, sizeof(header), 1, file) == 1 &&
+        header.magic == PROGRAM_CACHE_MAGIC &&
+        header.version == PROGRAM_CACHE_VERSION &&
+        header.key == key &&
+        header.binarySize > 0;
+
+    void* binary = NULL;
+    bool validBinary = false;
+    if (validHeader)
+    {
+        binary = malloc(header.binarySize);
+        validBinary =
+            fread(binary, header.binarySize, 1, file) == 1 &&
+            HashBytes(binary, header.binarySize) == header.binaryHash;
+    }
+
+    fclose(file);
+
+    GLuint programHandle = 0;
+    if (validBinary)
+    {
+        programHandle = glCreateProgram();
+        glProgramBinary(programHandle, header.binaryFormat, binary, header.binarySize);
+
+        GLint success = GL_FALSE;
+        glGetProgramiv(programHandle, GL_LINK_STATUS, &success);
+        if (!success)
+        {
+            // Usually a driver update that slipped through the key, recompile and overwrite it
+            ILOG("Program binary of %s rejected by the driver", programName);
+            glDeleteProgram(programHandle);
+            programHandle = 0;
+        }
+    }
+
+    free(binary);
+    return programHandle;
+}
+
+void ProgramCache_Store(Device& device, const char* programName, u64 key, GLuint programHandle)
+{
+    CPU_PROFILE_FUNCTION();
+
+    GLint binarySize = 0;
+    glGetProgramiv(programHandle, GL_PROGRAM_BINARY_LENGTH, &binarySize);
+    if (binarySize <= 0)
+        return;
+
+    void* binary = malloc(binarySize);
+    GLenum binaryFormat = 0;
+    GLsizei writtenSize = 0;
+    glGetProgramBinary(programHandle, binarySize, &writtenSize, &binaryFormat, binary);
+
+    if (writtenSize > 0)
+    {
+        ProgramCacheHeader header = {};
+        header.magic = PROGRAM_CACHE_MAGIC;
+        header.version = PROGRAM_CACHE_VERSION;
+        header.key = key;
+        header.binaryFormat = binaryFormat;
+        header.binarySize = (u32)writtenSize;
+        header.binaryHash = HashBytes(binary, header.binarySize);
+
+        char filepath[256];
+        ProgramCache_GetFilepath(programName, filepath, sizeof(filepath));
+
+        FILE* file = fopen(filepath, "wb");
+        if (file)
+        {
+            fwrite(&header, sizeof(header), 1, file);
+            fwrite(binary, header.binarySize, 1, file);
+            fclose(file);
+        }
+        else
+        {
+            ELOG("Could not write the program binary %s", filepath);
+        }
+    }
+
+    free(binary);
+}
@@ -0,0 +1,415 @@
+//
+// render_graph.cpp : Frame render graph. Passes declare which virtual render
+// targets they read and write, and compiling the graph culls unused passes,
+// sorts them, assigns pooled physical render targets (aliasing the ones with
+// disjoint lifetimes) and derives attachment load/store operations.
+//
+
+u32 RenderTargetBytesPerPixel(RenderTargetType type)
+{
+    switch (type)
+    {
+        case RenderTargetType_Color:  return 4;
+        case RenderTargetType_Floats: return 16;
+        case RenderTargetType_Depth:  return 4;
+        case RenderTargetType_UInt:   return 4;
+        default: INVALID_CODE_PATH("Unsupported RenderTargetType");
+    }
+    return 0;
+}
+
+void RenderGraph_Reset(RenderGraph& graph)
+{
+#if USE_GFX_API_OPENGL
+    for (u32 i = 0; i < graph.passCount; ++i)
+    {
+        const RenderGraphPass& pass = graph.passes[i];
+        if (pass.framebuffer.handle)
+            DestroyFramebufferRaw(pass.framebuffer);
+    }
+#endif
+
+    graph.resourceCount = 0;
+    graph.passCount = 0;
+    graph.executionCount = 0;
+    graph.isCompiled = false;
+}
+
+u32 RenderGraph_CreateResource(RenderGraph& graph, String name, RenderTargetType type, ivec2 size)
+{
+    ASSERT(graph.resourceCount < ARRAY_COUNT(graph.resources), "Max number of render graph resources reached");
+    RenderGraphResource& resource = graph.resources[graph.resourceCount];
+    resource = RenderGraphResource{};
+    resource.name = name;
+    resource.type = type;
+    resource.size = size;
+    resource.clearValue.color = vec4(0.1f, 0.1f, 0.1f, 1.0f);
+    resource.clearValue.depth = 1.0f;
+    return graph.resourceCount++;
+}
+
+u32 RenderGraph_ImportBackbuffer(RenderGraph& graph, ivec2 size)
+{
+    const u32 resourceIdx = RenderGraph_CreateResource(graph, CString("Backbuffer"), RenderTargetType_Color, size);
+    graph.resources[resourceIdx].isBackbuffer = true;
+    graph.resources[resourceIdx].isOutput = true;
+    return resourceIdx;
+}
+
+u32 RenderGraph_AddPass(RenderGraph& graph, String name, RenderGraphExecuteFunc execute)
+{
+    ASSERT(graph.passCount < ARRAY_COUNT(graph.passes), "Max number of render graph passes reached");
+    RenderGraphPass& pass = graph.passes[graph.passCount];
+    pass = RenderGraphPass{};
+    pass.name = name;
+    pass.execute = execute;
+    return graph.passCount++;
+}
+
+void RenderGraph_Read(RenderGraph& graph, u32 passIdx, u32 resourceIdx)
+{
+    RenderGraphPass& pass = graph.passes[passIdx];
+    ASSERT(pass.readCount < ARRAY_COUNT(pass.reads), "Max number of pass reads reached");
+    ASSERT(!graph.resources[resourceIdx].isBackbuffer, "The backbuffer cannot be read");
+    pass.reads[pass.readCount++] = resourceIdx;
+}
+
+void RenderGraph_SetClearValue(RenderGraph& graph, u32 resourceIdx, const ClearValue& clearValue)
+{
+    graph.resources[resourceIdx].clearValue = clearValue;
+}
+
+void RenderGraph_Write(RenderGraph& graph, u32 passIdx, u32 resourceIdx, AttachmentPoint attachmentPoint)
+{
+    RenderGraphPass& pass = graph.passes[passIdx];
+    ASSERT(pass.writeCount < ARRAY_COUNT(pass.writes), "Max number of pass writes reached");
+    pass.writes[pass.writeCount] = resourceIdx;
+    pass.writeAttachmentPoints[pass.writeCount] = attachmentPoint;
+    pass.writeCount++;
+}
+
+bool RenderGraph_PassReads(const RenderGraphPass& pass, u32 resourceIdx)
+{
+    for (u32 i = 0; i < pass.readCount; ++i)
+        if (pass.reads[i] == resourceIdx)
+            return true;
+    return false;
+}
+
+bool RenderGraph_PassWrites(const RenderGraphPass& pass, u32 resourceIdx)
+{
+    for (u32 i = 0; i < pass.writeCount; ++i)
+        if (pass.writes[i] == resourceIdx)
+            return true;
+    return false;
+}
+
+// Passes are declared in submission order, which defines what version of a
+// resource each pass sees: a pass depends on the previous writer of everything
+// it reads or writes, and a writer depends on the previous readers (WAR).
+bool RenderGraph_DependsOn(const RenderGraph& graph, u32 passIdx, u32 otherPassIdx)
+{
+    if (otherPassIdx >= passIdx)
+        return false;
+
+    const RenderGraphPass& pass = graph.passes[passIdx];
+    const RenderGraphPass& other = graph.passes[otherPassIdx];
+
+    for (u32 i = 0; i < other.writeCount; ++i)
+    {
+        const u32 resourceIdx = other.writes[i];
+        if (RenderGraph_PassReads(pass, resourceIdx) || RenderGraph_PassWrites(pass, resourceIdx))
+            return true;
+    }
+    for (u32 i = 0; i < other.readCount; ++i)
+    {
+        if (RenderGraph_PassWrites(pass, other.reads[i]))
+            return true;
+    }
+    return false;
+}
+
+void RenderGraph_CullPasses(RenderGraph& graph)
+{
+    u32 stack[MAX_RENDER_GRAPH_RESOURCES];
+    u32 stackSize = 0;
+
+    for (u32 i = 0; i < graph.resourceCount; ++i)
+        graph.resources[i].refCount = 0;
+
+    for (u32 passIdx = 0; passIdx < graph.passCount; ++passIdx)
+    {
+        RenderGraphPass& pass = graph.passes[passIdx];
+        pass.refCount = pass.writeCount;
+        pass.isCulled = false;
+        for (u32 i = 0; i < pass.readCount; ++i)
+            graph.resources[pass.reads[i]].refCount++;
+    }
+
+    for (u32 i = 0; i < graph.resourceCount; ++i)
+        if (graph.resources[i].refCount == 0 && !graph.resources[i].isOutput)
+            stack[stackSize++] = i;
+
+    // Flood unused resources back to the passes producing them
+    while (stackSize > 0)
+    {
+        const u32 resourceIdx = stack[--stackSize];
+
+        for (u32 passIdx = 0; passIdx < graph.passCount; ++passIdx)
+        {
+            RenderGraphPass& pass = graph.passes[passIdx];
+            if (pass.isCulled || !RenderGraph_PassWrites(pass, resourceIdx))
+                continue;
+
+            ASSERT(pass.refCount > 0, "Invalid pass reference count");
+            if (--pass.refCount > 0)
+                continue;
+
+            pass.isCulled = true;
+            for (u32 i = 0; i < pass.readCount; ++i)
+            {
+                RenderGraphResource& readResource = graph.resources[pass.reads[i]];
+                ASSERT(readResource.refCount > 0, "Invalid resource reference count");
+                if (--readResource.refCount == 0 && !readResource.isOutput)
+                    stack[stackSize++] = pass.reads[i];
+            }
+        }
+    }
+}
+
+void RenderGraph_SortPasses(RenderGraph& graph)
+{
+    // Kahn's algorithm, picking the earliest declared pass among the ready ones
+    u32 dependencyCount[MAX_RENDER_GRAPH_PASSES] = {};
+    bool isScheduled[MAX_RENDER_GRAPH_PASSES] = {};
+
+    for (u32 passIdx = 0; passIdx < graph.passCount; ++passIdx)
+        for (u32 otherPassIdx = 0; otherPassIdx < graph.passCount; ++otherPassIdx)
+            if (!graph.passes[otherPassIdx].isCulled && RenderGraph_DependsOn(graph, passIdx, otherPassIdx))
+                dependencyCount[passIdx]++;
+
+    graph.executionCount = 0;
+    for (;;)
+    {
+        u32 readyPassIdx = MAX_RENDER_GRAPH_PASSES;
+        for (u32 passIdx = 0; passIdx < graph.passCount; ++passIdx)
+        {
+            if (!graph.passes[passIdx].isCulled && !isScheduled[passIdx] && dependencyCount[passIdx] == 0)
+            {
+                readyPassIdx = passIdx;
+                break;
+            }
+        }
+        if (readyPassIdx == MAX_RENDER_GRAPH_PASSES)
+            break;
+
+        isScheduled[readyPassIdx] = true;
+        graph.executionOrder[graph.executionCount++] = readyPassIdx;
+
+        for (u32 passIdx = 0; passIdx < graph.passCount; ++passIdx)
+            if (RenderGraph_DependsOn(graph, passIdx, readyPassIdx))
+                dependencyCount[passIdx]--;
+    }
+}
+
+void RenderGraph_ComputeLifetimes(RenderGraph& graph)
+{
+    for (u32 i = 0; i < graph.resourceCount; ++i)
+    {
+        graph.resources[i].firstPass = MAX_RENDER_GRAPH_PASSES;
+        graph.resources[i].lastPass = 0;
+    }
+
+    for (u32 order = 0; order < graph.executionCount; ++order)
+    {
+        const RenderGraphPass& pass = graph.passes[graph.executionOrder[order]];
+        for (u32 i = 0; i < pass.writeCount + pass.readCount; ++i)
+        {
+            const u32 resourceIdx = (i < pass.writeCount) ? pass.writes[i] : pass.reads[i - pass.writeCount];
+            RenderGraphResource& resource = graph.resources[resourceIdx];
+            ASSERT(i < pass.writeCount || resource.firstPass < MAX_RENDER_GRAPH_PASSES, "Render graph resource read before being written");
+            resource.firstPass = min(resource.firstPass, order);
+            resource.lastPass = max(resource.lastPass, order);
+        }
+    }
+
+    for (u32 i = 0; i < graph.resourceCount; ++i)
+        if (graph.resources[i].isOutput)
+            graph.resources[i].lastPass = graph.executionCount;
+}
+
+void RenderGraph_AssignRenderTargets(Device& device, RenderGraph& graph)
+{
+    // Busy entries hold a live resource. Used entries were assigned earlier in the
+    // frame, so they can be shared but not reallocated with a different format.
+    bool isPoolEntryUsed[ARRAY_COUNT(graph.pool)] = {};
+    bool isPoolEntryBusy[ARRAY_COUNT(graph.pool)] = {};
+
+    graph.virtualBytes = 0;
+    graph.aliasedBytes = 0;
+
+    for (u32 order = 0; order < graph.executionCount; ++order)
+    {
+        // Acquire the resources that start living in this pass
+        for (u32 resourceIdx = 0; resourceIdx < graph.resourceCount; ++resourceIdx)
+        {
+            RenderGraphResource& resource = graph.resources[resourceIdx];
+            if (resource.firstPass != order || resource.isBackbuffer)
+                continue;
+
+            const u32 resourceBytes = resource.size.x * resource.size.y * RenderTargetBytesPerPixel(resource.type);
+            graph.virtualBytes += resourceBytes;
+
+            u32 poolIdx = ARRAY_COUNT(graph.pool);
+            for (u32 i = 0; i < graph.poolCount && poolIdx == ARRAY_COUNT(graph.pool); ++i)
+            {
+                const RenderTarget& renderTarget = device.renderTargets[graph.pool[i]];
+                if (!isPoolEntryBusy[i] &&
+                    renderTarget.handle && renderTarget.type == resource.type && ivec2(renderTarget.size) == resource.size)
+                    poolIdx = i;
+            }
+            for (u32 i = 0; i < graph.poolCount && poolIdx == ARRAY_COUNT(graph.pool); ++i)
+            {
+                if (!isPoolEntryUsed[i])
+                {
+                    RenderTarget& renderTarget = device.renderTargets[graph.pool[i]];
+                    if (renderTarget.handle)
+                        DestroyRenderTargetRaw(renderTarget);
+                    renderTarget = CreateRenderTargetRaw(resource.name, resource.size, resource.type);
+                    poolIdx = i;
+                }
+            }
+            if (poolIdx == ARRAY_COUNT(graph.pool))
+            {
+                ASSERT(graph.poolCount < ARRAY_COUNT(graph.pool), "Render graph pool is full");
+                poolIdx = graph.poolCount++;
+                graph.pool[poolIdx] = CreateRenderTarget(device, resource.name, resource.type, resource.size);
+            }
+
+            if (isPoolEntryUsed[poolIdx])
+                graph.aliasedBytes += resourceBytes;
+
+            isPoolEntryUsed[poolIdx] = true;
+            isPoolEntryBusy[poolIdx] = true;
+            resource.renderTargetIdx = graph.pool[poolIdx];
+        }
+
+        // Release the resources whose last use is this pass
+        for (u32 resourceIdx = 0; resourceIdx < graph.resourceCount; ++resourceIdx)
+        {
+            const RenderGraphResource& resource = graph.resources[resourceIdx];
+            if (resource.lastPass != order || resource.isBackbuffer || resource.firstPass > order)
+                continue;
+
+            for (u32 i = 0; i < graph.poolCount; ++i)
+                if (graph.pool[i] == resource.renderTargetIdx)
+                    isPoolEntryBusy[i] = false;
+        }
+    }
+
+    // Give back the memory of the pool entries this graph does not need
+    graph.physicalBytes = 0;
+    for (u32 i = 0; i < graph.poolCount; ++i)
+    {
+        RenderTarget& renderTarget = device.renderTargets[graph.pool[i]];
+        bool isReferenced = false;
+        for (u32 resourceIdx = 0; resourceIdx < graph.resourceCount && !isReferenced; ++resourceIdx)
+        {
+            const RenderGraphResource& resource = graph.resources[resourceIdx];
+            isReferenced = !resource.isBackbuffer && resource.firstPass < MAX_RENDER_GRAPH_PASSES && resource.renderTargetIdx == graph.pool[i];
+        }
+
+        if (isReferenced)
+        {
+            graph.physicalBytes += (u32)renderTarget.size.x * (u32)renderTarget.size.y * RenderTargetBytesPerPixel(renderTarget.type);
+        }
+        else if (renderTarget.handle)
+        {
+            DestroyRenderTargetRaw(renderTarget);
+            renderTarget.handle = 0;
+        }
+    }
+}
+
+void RenderGraph_BuildRenderPasses(Device& device, RenderGraph& graph)
+{
+    for (u32 order = 0; order < graph.executionCount; ++order)
+    {
+        RenderGraphPass& pass = graph.passes[graph.executionOrder[order]];
+
+        Attachment attachments[MAX_FRAMEBUFFER_ATTACHMENTS];
+        AttachmentAction attachmentActions[MAX_FRAMEBUFFER_ATTACHMENTS];
+        bool writesBackbuffer = false;
+
+        for (u32 i = 0; i < pass.writeCount; ++i)
+        {
+            const RenderGraphResource& resource = graph.resources[pass.writes[i]];
+            writesBackbuffer = writesBackbuffer || resource.isBackbuffer;
+
+            attachments[i].attachmentPoint = pass.writeAttachmentPoints[i];
+            attachments[i].renderTargetIdx = resource.renderTargetIdx;
+
+            // Contents are only loaded if an earlier pass produced them, and only
+            // stored if a later pass (or the end of the frame) consumes them
+            attachmentActions[i].attachmentIdx = i;
+            attachmentActions[i].loadOp = (resource.firstPass < order) ? LoadOp_Load : LoadOp_Clear;
+            attachmentActions[i].storeOp = (resource.lastPass > order) ? StoreOp_Store : StoreOp_DontCare;
+            attachmentActions[i].clearValue = resource.clearValue;
+        }
+
+        ASSERT(!writesBackbuffer || pass.writeCount == 1, "Passes writing the backbuffer cannot write other targets");
+
+#if USE_GFX_API_OPENGL
+        if (pass.framebuffer.handle)
+            DestroyFramebufferRaw(pass.framebuffer);
+#endif
+
+        pass.framebuffer = Framebuffer{};
+        if (!writesBackbuffer && pass.writeCount > 0)
+            pass.framebuffer = CreateFramebufferRaw(device, pass.writeCount, attachments);
+
+        pass.renderPass = CreateRenderPassRaw(device, 0, writesBackbuffer ? 0 : pass.writeCount, attachmentActions);
+    }
+}
+
+void RenderGraph_Compile(Device& device, RenderGraph& graph)
+{
+    CPU_PROFILE_FUNCTION();
+
+    RenderGraph_CullPasses(graph);
+    RenderGraph_SortPasses(graph);
+    RenderGraph_ComputeLifetimes(graph);
+    RenderGraph_AssignRenderTargets(device, graph);
+    RenderGraph_BuildRenderPasses(device, graph);
+    graph.isCompiled = true;
+
+    ILOG("Render graph compiled: %u of %u passes, %u KB allocated, %u KB aliased",
+         graph.executionCount, graph.passCount, graph.physicalBytes / KB(1), graph.aliasedBytes / KB(1));
+}
+
+void RenderGraph_Execute(App* app, const RenderGraph& graph)
+{
+    ASSERT(graph.isCompiled, "The render graph must be compiled before executing it");
+
+    const Device& device = app->device;
+    for (u32 order = 0; order < graph.executionCount; ++order)
+    {
+        const RenderGraphPass& pass = graph.passes[graph.executionOrder[order]];
+
+        BeginRenderPass(device, pass.renderPass, pass.framebuffer);
+
+        if (pass.execute)
+            pass.execute(app, graph, pass);
+
+        EndRenderPass(device, pass.renderPass, pass.framebuffer);
+    }
+}
+
+#if USE_GFX_API_OPENGL
+GLuint RenderGraph_GetTextureHandle(const Device& device, const RenderGraph& graph, u32 resourceIdx)
+{
+    const RenderGraphResource& resource = graph.resources[resourceIdx];
+    ASSERT(!resource.isBackbuffer, "The backbuffer has no texture");
+    return device.renderTargets[resource.renderTargetIdx].handle;
+}
+#endif
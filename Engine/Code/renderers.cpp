@@ -34,34 +34,11 @@ void QSort(u64* begin, u64* end)
     }
 }
 
-
-
-// FORWARD RENDERER
-
-void ForwardShading_Init(Device& device, ForwardRenderData& forwardRenderData)
+// Writes a (mesh << 48 | submesh << 32 | entity) key per submesh to render, once
+// sorted, consecutive keys with the same mesh/submesh can be instanced together
+u32 BuildRenderPrimitiveSortKeys(const Device& device, const Scene& scene, u64* keys)
 {
-#if USE_GFX_API_OPENGL
-    forwardRenderData.programIdx = LoadProgram(device, CString("shaders.glsl"), CString("FORWARD_RENDER"));
-    Program& forwardRenderProgram = device.programs[forwardRenderData.programIdx];
-    forwardRenderData.uniLoc_Albedo = glGetUniformLocation(forwardRenderProgram.handle, "uAlbedo");
-    forwardRenderData.localParamsBlockSize = KB(1); // TODO: Get the size from the shader?
-    forwardRenderData.instancingBufferIdx = CreateDynamicVertexBuffer(device, MB(1));
-#endif
-}
-
-void ForwardShading_Update(Device& device, const Scene& scene, const Embedded& embedded, ForwardRenderData& forwardRenderData)
-{
-#if USE_GFX_API_OPENGL
-    Program& program = device.programs[forwardRenderData.programIdx];
-
-    forwardRenderData.renderPrimitiveCount = 0;
-
-#if defined(USE_INSTANCING)
-    Buffer& instancingBuffer = device.vertexBuffers[forwardRenderData.instancingBufferIdx];
-    MapBuffer(instancingBuffer, Access_Write);
-
-    static u64* renderPrimitivesToSort = new u64[MAX_RENDER_PRIMITIVES]; // TODO: this is a mem leak, put this in another place
-    u32 renderPrimitivesToSortCount = 0;
+    u32 keyCount = 0;
 
     for (u32 entityIdx = 0; entityIdx < scene.entityCount; ++entityIdx)
     {
@@ -73,27 +50,195 @@ void ForwardShading_Update(Device& device, const Scene& scene, const Embedded& e
         {
             case EntityType_Mesh:
                 {
+                    ASSERT(keyCount < MAX_RENDER_PRIMITIVES, "Max number of render primitives reached");
                     u64 rp = ((u64)meshIdx << 48) | ((u64)submeshIdx << 32) | (entityIdx);
-                    renderPrimitivesToSort[renderPrimitivesToSortCount++] = rp;
+                    keys[keyCount++] = rp;
                 }
                 break;
 
             case EntityType_Model:
                 {
-                    Mesh& mesh = device.meshes[meshIdx];
+                    const Mesh& mesh = device.meshes[meshIdx];
 
                     for (u32 submeshIdx = 0; submeshIdx < mesh.submeshes.size(); ++submeshIdx)
                     {
+                        ASSERT(keyCount < MAX_RENDER_PRIMITIVES, "Max number of render primitives reached");
                         u64 rp = ((u64)meshIdx << 48) | ((u64)submeshIdx << 32) | (entityIdx);
-                        renderPrimitivesToSort[renderPrimitivesToSortCount++] = rp;
+                        keys[keyCount++] = rp;
                     }
                 }
                 break;
         }
     }
 
+    return keyCount;
+}
+
+
+
+// SHADOW MAPS
+
+void ShadowMaps_Init(Device& device, ShadowRenderData& shadowData)
+{
+    shadowData.shadowDistance = 60.0f;
+    shadowData.splitLambda = 0.75f;
+    shadowData.cacheFarCascades = true;
+    shadowData.firstCachedCascade = 2;
+    shadowData.cachedRadiusScale = 1.5f;
+    shadowData.lightIdx = SHADOW_NO_LIGHT;
+
+#if USE_GFX_API_OPENGL
+    shadowData.programIdx = LoadProgram(device, CString("shaders.glsl"), CString("SHADOW_DEPTH"));
+    shadowData.instancingBufferIdx = CreateDynamicVertexBuffer(device, MB(1));
+
+    // Only the world-light-projection matrix is instanced. Casters behind the near plane are
+    // clamped instead of clipped, and the slope-scaled bias fights acne
+    PipelineStateDesc shadowDesc = {};
+    shadowDesc.programIdx = shadowData.programIdx;
+    shadowDesc.instanceAttributeCount = 4;
+    shadowDesc.instanceStride = sizeof(mat4);
+    shadowDesc.cullMode = CullMode_None;
+    shadowDesc.depthClamp = true;
+    shadowDesc.polygonOffset = true;
+    shadowDesc.polygonOffsetFactor = 1.5f;
+    shadowDesc.polygonOffsetUnits = 4.0f;
+    shadowDesc.depthTest = true;
+    shadowDesc.depthWrite = true;
+    shadowData.pipelineStateIdx = CreatePipelineState(device, shadowDesc);
+
+    glGenTextures(1, &shadowData.depthTextureHandle);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shadowData.depthTextureHandle);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT32F, SHADOW_MAP_RESOLUTION, SHADOW_MAP_RESOLUTION, SHADOW_CASCADE_COUNT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    for (u32 i = 0; i < SHADOW_CASCADE_COUNT; ++i)
+    {
+        glGenFramebuffers(1, &shadowData.framebufferHandles[i]);
+        glBindFramebuffer(GL_FRAMEBUFFER, shadowData.framebufferHandles[i]);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadowData.depthTextureHandle, 0, i);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        {
+            ELOG("Shadow map framebuffer for cascade %u is not complete", i);
+        }
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+#endif
+}
+
+// Bounding sphere (world space) of the slice of the camera frustum between two view depths.
+// It only depends on the slice shape, so its radius does not change when the camera rotates.
+void ComputeFrustumSliceBoundingSphere(const Camera& camera, f32 aspectRatio, f32 sliceNear, f32 sliceFar, vec3& center, f32& radius)
+{
+    const f32 tanHalfFovY = tanf(0.5f * radians(CAMERA_FOV_Y_DEGREES));
+    const mat4 viewToWorld = inverse(camera.viewMatrix);
+
+    vec3 corners[8];
+    for (u32 i = 0; i < 8; ++i)
+    {
+        const f32 depth = (i < 4) ? sliceNear : sliceFar;
+        const f32 halfHeight = depth * tanHalfFovY;
+        const f32 halfWidth = halfHeight * aspectRatio;
+        const vec3 viewCorner((i & 1) ? halfWidth : -halfWidth,
+                              (i & 2) ? halfHeight : -halfHeight,
+                              -depth);
+        corners[i] = vec3(viewToWorld * vec4(viewCorner, 1.0f));
+    }
+
+    center = vec3(0.0f);
+    for (u32 i = 0; i < 8; ++i)
+        center += corners[i];
+    center /= 8.0f;
+
+    radius = 0.0f;
+    for (u32 i = 0; i < 8; ++i)
+        radius = max(radius, length(corners[i] - center));
+}
+
+// A caster can only shadow a cascade if it overlaps its light space footprint and
+// is not completely behind it. Casters between the light and the cascade are kept
+// and pancaked onto the near plane with depth clamping.
+bool IsShadowCasterCulled(const ShadowCascade& cascade, const mat4& worldToLightView, const Submesh& submesh)
+{
+    const vec3 localCenter = 0.5f * (submesh.boundsMax + submesh.boundsMin);
+    const vec3 localExtent = 0.5f * (submesh.boundsMax - submesh.boundsMin);
+
+    const vec3 center = vec3(worldToLightView * vec4(localCenter, 1.0f));
+    const mat3 absMatrix = mat3(abs(vec3(worldToLightView[0])),
+                                abs(vec3(worldToLightView[1])),
+                                abs(vec3(worldToLightView[2])));
+    const vec3 extent = absMatrix * localExtent;
+
+    const vec3 casterMin = center - extent;
+    const vec3 casterMax = center + extent;
+    const vec3 cascadeMin = cascade.center - vec3(cascade.radius);
+    const vec3 cascadeMax = cascade.center + vec3(cascade.radius);
+
+    return casterMax.x < cascadeMin.x || casterMin.x > cascadeMax.x ||
+           casterMax.y < cascadeMin.y || casterMin.y > cascadeMax.y ||
+           casterMax.z < cascadeMin.z;
+}
+
+void ShadowMaps_BuildCascadeRenderList(Device& device, const Scene& scene, ShadowRenderData& shadowData, ShadowCascade& cascade, Buffer& instancingBuffer)
+{
+    STATS_ADD(entitiesProcessed, scene.entityCount);
+
+#if USE_GFX_API_OPENGL && defined(USE_INSTANCING)
+    const Program& program = device.programs[shadowData.programIdx];
+
+    ScratchArena scratchArena;
+    u64* renderPrimitivesToSort = PUSH_ARRAY(scratchArena, u64, MAX_RENDER_PRIMITIVES);
+    u32 renderPrimitivesToSortCount = 0;
+
+    cascade.dynamicCasterCount = 0;
+
+    for (u32 entityIdx = 0; entityIdx < scene.entityCount; ++entityIdx)
+    {
+        const Entity& entity = scene.entities[entityIdx];
+        const u32 meshIdx = HIGH_WORD(entity.meshSubmeshIdx);
+        const Mesh& mesh = device.meshes[meshIdx];
+        const mat4 worldToLightView = shadowData.lightViewMatrix * entity.worldMatrix;
+
+        u32 firstSubmeshIdx = LOW_WORD(entity.meshSubmeshIdx);
+        u32 lastSubmeshIdx = firstSubmeshIdx + 1;
+        if (entity.type == EntityType_Model)
+        {
+            firstSubmeshIdx = 0;
+            lastSubmeshIdx = mesh.submeshes.size();
+        }
+
+        for (u32 submeshIdx = firstSubmeshIdx; submeshIdx < lastSubmeshIdx; ++submeshIdx)
+        {
+            if (IsShadowCasterCulled(cascade, worldToLightView, mesh.submeshes[submeshIdx]))
+            {
+                shadowData.culledCasterCount++;
+                continue;
+            }
+
+            if (entity.isDynamic)
+                cascade.dynamicCasterCount++;
+
+            ASSERT(renderPrimitivesToSortCount < MAX_RENDER_PRIMITIVES, "Max number of shadow casters reached");
+            u64 rp = ((u64)meshIdx << 48) | ((u64)submeshIdx << 32) | (entityIdx);
+            renderPrimitivesToSort[renderPrimitivesToSortCount++] = rp;
+        }
+    }
+
+    shadowData.casterCount += renderPrimitivesToSortCount;
+    shadowData.dynamicCasterCount += cascade.dynamicCasterCount;
+
     QSort((u64*)renderPrimitivesToSort, (u64*)renderPrimitivesToSort + renderPrimitivesToSortCount - 1);
 
+    cascade.renderPrimitiveBegin = shadowData.renderPrimitiveCount;
+
     u16 prevMeshIdx = 0xffff;
     u16 prevSubmeshIdx = 0xffff;
 
@@ -104,33 +249,336 @@ void ForwardShading_Update(Device& device, const Scene& scene, const Embedded& e
         u32 submeshIdx = (rp >> 32) & 0xffff;
         u32 entityIdx  = (rp >>  0) & 0xffffffff;
 
-        const Entity& entity = scene.entities[entityIdx];
-
         if (meshIdx != prevMeshIdx || submeshIdx != prevSubmeshIdx)
         {
-            Mesh& mesh = device.meshes[meshIdx];
+            const Submesh& submesh = device.meshes[meshIdx].submeshes[submeshIdx];
 
             RenderPrimitive renderPrimitive = {};
+            renderPrimitive.meshSubmeshIdx = MAKE_DWORD(meshIdx, submeshIdx);
             renderPrimitive.vaoHandle = FindVAO(device, meshIdx, submeshIdx, program);
+            renderPrimitive.indexCount = submesh.indexCount;
+            renderPrimitive.indexOffset = submesh.indexOffset;
+            renderPrimitive.instanceCount = 0;
+            renderPrimitive.instancingOffset = instancingBuffer.head;
 
-            if (submeshIdx < mesh.materialIndices.size())
-            {
-                u32 submeshMaterialIdx = mesh.materialIndices[submeshIdx];
-                Material& submeshMaterial = device.materials[submeshMaterialIdx];
-                renderPrimitive.albedoTextureHandle = device.textures[submeshMaterial.albedoTextureIdx].handle;
-            }
-            else
+            ASSERT(shadowData.renderPrimitiveCount < ARRAY_COUNT(shadowData.renderPrimitives), "Max number of render primitives reached");
+            shadowData.renderPrimitives[shadowData.renderPrimitiveCount++] = renderPrimitive;
+
+            prevMeshIdx = meshIdx;
+            prevSubmeshIdx = submeshIdx;
+        }
+
+        RenderPrimitive& renderPrimitive = shadowData.renderPrimitives[shadowData.renderPrimitiveCount - 1];
+
+        const mat4 worldViewProjection = cascade.viewProjectionMatrix * scene.entities[entityIdx].worldMatrix;
+        BufferPushMat4(instancingBuffer, worldViewProjection);
+        renderPrimitive.instanceCount++;
+    }
+
+    cascade.renderPrimitiveCount = shadowData.renderPrimitiveCount - cascade.renderPrimitiveBegin;
+#endif
+}
+
+// Whether a dynamic entity casts onto the cascade with its current transform
+bool HasDynamicShadowCaster(const Device& device, const Scene& scene, const ShadowRenderData& shadowData, const ShadowCascade& cascade)
+{
+    for (u32 i = 0; i < scene.dynamicEntityCount; ++i)
+    {
+        const Entity& entity = scene.entities[scene.dynamicEntityIndices[i]];
+        const Mesh& mesh = device.meshes[HIGH_WORD(entity.meshSubmeshIdx)];
+        const mat4 worldToLightView = shadowData.lightViewMatrix * entity.worldMatrix;
+
+        u32 firstSubmeshIdx = LOW_WORD(entity.meshSubmeshIdx);
+        u32 lastSubmeshIdx = firstSubmeshIdx + 1;
+        if (entity.type == EntityType_Model)
+        {
+            firstSubmeshIdx = 0;
+            lastSubmeshIdx = mesh.submeshes.size();
+        }
+
+        for (u32 submeshIdx = firstSubmeshIdx; submeshIdx < lastSubmeshIdx; ++submeshIdx)
+        {
+            if (!IsShadowCasterCulled(cascade, worldToLightView, mesh.submeshes[submeshIdx]))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+void ShadowMaps_Update(Device& device, const Scene& scene, f32 aspectRatio, ShadowRenderData& shadowData)
+{
+    CPU_PROFILE_FUNCTION();
+
+    shadowData.casterCount = 0;
+    shadowData.culledCasterCount = 0;
+    shadowData.dynamicCasterCount = 0;
+    shadowData.renderPrimitiveCount = 0;
+
+    // The first directional light is the one casting shadows
+    u32 lightIdx = SHADOW_NO_LIGHT;
+    for (u32 i = 0; i < scene.lightCount; ++i)
+    {
+        if (scene.lights[i].type == LightType_Directional)
+        {
+            lightIdx = i;
+            break;
+        }
+    }
+
+    shadowData.lightIdx = lightIdx;
+    if (lightIdx == SHADOW_NO_LIGHT)
+        return;
+
+    const vec3 lightDirection = normalize(scene.lights[lightIdx].direction);
+    const bool lightChanged = lightDirection != shadowData.lightDirection;
+    const bool staticGeometryChanged = scene.staticGeometryVersion != shadowData.staticGeometryVersion;
+    const bool projectionChanged = aspectRatio != shadowData.aspectRatio;
+    const bool invalidateCache = lightChanged || staticGeometryChanged || projectionChanged || !shadowData.cacheFarCascades;
+
+    shadowData.lightDirection = lightDirection;
+    shadowData.staticGeometryVersion = scene.staticGeometryVersion;
+    shadowData.aspectRatio = aspectRatio;
+
+    if (lightChanged)
+    {
+        // Light space only depends on the light, so cascades move in whole texels
+        const vec3 upVector = (abs(lightDirection.y) > 0.99f) ? vec3(0.0f, 0.0f, 1.0f) : vec3(0.0f, 1.0f, 0.0f);
+        shadowData.lightViewMatrix = lookAt(vec3(0.0f), -lightDirection, upVector);
+    }
+
+    const Camera& camera = scene.mainCamera;
+    const f32 nearDistance = CAMERA_Z_NEAR;
+    const f32 farDistance = shadowData.shadowDistance;
+
+    for (u32 i = 0; i < SHADOW_CASCADE_COUNT; ++i)
+    {
+        ShadowCascade& cascade = shadowData.cascades[i];
+
+        // Practical split scheme: blend of uniform and logarithmic splits
+        const f32 t = (f32)(i + 1) / (f32)SHADOW_CASCADE_COUNT;
+        const f32 uniformSplit = nearDistance + (farDistance - nearDistance) * t;
+        const f32 logSplit = nearDistance * powf(farDistance / nearDistance, t);
+        const f32 splitFar = mix(uniformSplit, logSplit, shadowData.splitLambda);
+        const f32 splitNear = (i == 0) ? nearDistance : shadowData.cascades[i - 1].splitFar;
+        cascade.splitFar = splitFar;
+
+        vec3 worldCenter;
+        f32 radius;
+        ComputeFrustumSliceBoundingSphere(camera, aspectRatio, splitNear, splitFar, worldCenter, radius);
+        vec3 center = vec3(shadowData.lightViewMatrix * vec4(worldCenter, 1.0f));
+
+        // Quantize the radius so that float noise does not change the texel size
+        radius = ceilf(radius * 16.0f) / 16.0f;
+
+        const bool isCached = shadowData.cacheFarCascades && i >= shadowData.firstCachedCascade;
+        if (isCached)
+        {
+            // Keep the previous fit while it still encloses the current slice
+            const bool fitIsValid = !invalidateCache && cascade.radius > 0.0f &&
+                length(vec2(center - cascade.center)) + radius <= cascade.radius &&
+                center.z - radius >= cascade.center.z - cascade.radius;
+            if (fitIsValid)
             {
-                Material& defaultMaterial = device.materials[embedded.defaultMaterialIdx];
-                renderPrimitive.albedoTextureHandle = device.textures[defaultMaterial.albedoTextureIdx].handle;
+                // The fit stays, but the contents are redrawn while a dynamic caster is (or
+                // was, the last time it was drawn) inside, so its shadow does not smear
+                if (cascade.dynamicCasterCount > 0 || (scene.dynamicEntityCount > 0 && HasDynamicShadowCaster(device, scene, shadowData, cascade)))
+                    cascade.dirty = true;
+                continue;
             }
 
+            radius = ceilf(radius * shadowData.cachedRadiusScale * 16.0f) / 16.0f;
+        }
+
+        // Snap the cascade center to shadow map texels to avoid shimmering
+        const f32 texelSize = 2.0f * radius / (f32)SHADOW_MAP_RESOLUTION;
+        center.x = floorf(center.x / texelSize) * texelSize;
+        center.y = floorf(center.y / texelSize) * texelSize;
+
+        const mat4 projectionMatrix = ortho(center.x - radius, center.x + radius,
+                                            center.y - radius, center.y + radius,
+                                            -(center.z + radius), -(center.z - radius));
+
+        cascade.viewProjectionMatrix = projectionMatrix * shadowData.lightViewMatrix;
+        cascade.center = center;
+        cascade.radius = radius;
+        cascade.texelSize = texelSize;
+        cascade.dirty = true;
+    }
+
+    bool anyCascadeDirty = false;
+    for (u32 i = 0; i < SHADOW_CASCADE_COUNT; ++i)
+        anyCascadeDirty = anyCascadeDirty || shadowData.cascades[i].dirty;
+
+    if (!anyCascadeDirty)
+        return;
+
+#if USE_GFX_API_OPENGL && defined(USE_INSTANCING)
+    Buffer& instancingBuffer = device.vertexBuffers[shadowData.instancingBufferIdx];
+    MapBuffer(instancingBuffer, Access_Write);
+
+    for (u32 i = 0; i < SHADOW_CASCADE_COUNT; ++i)
+    {
+        ShadowCascade& cascade = shadowData.cascades[i];
+        if (cascade.dirty)
+            ShadowMaps_BuildCascadeRenderList(device, scene, shadowData, cascade, instancingBuffer);
+    }
+
+    UnmapBuffer(instancingBuffer);
+#endif
+}
+
+#if USE_GFX_API_OPENGL
+// Records the render primitives [begin, end), which belong to a single cascade
+void ShadowMaps_Record(const ShadowRenderData& shadowData, u32 begin, u32 end, CommandRecorder& recorder)
+{
+#if defined(USE_INSTANCING)
+    Cmd_BindPipelineState(recorder, shadowData.pipelineStateIdx);
+    Cmd_BindVertexBuffer(recorder, shadowData.instancingBufferIdx);
+
+    for (u32 i = begin; i < end; ++i)
+    {
+        const RenderPrimitive& renderPrimitive = shadowData.renderPrimitives[i];
+        Cmd_BindVertexArray(recorder, renderPrimitive.vaoHandle);
+        Cmd_BindInstances(recorder, renderPrimitive.instancingOffset);
+        Cmd_DrawIndexed(recorder, renderPrimitive.indexCount, renderPrimitive.indexOffset, renderPrimitive.instanceCount);
+    }
+#endif
+}
+#endif
+
+void ShadowMaps_Render(Device& device, const CommandLists& commandLists, ShadowRenderData& shadowData)
+{
+    shadowData.renderedCascadeCount = 0;
+
+#if USE_GFX_API_OPENGL && defined(USE_INSTANCING)
+    if (shadowData.lightIdx == SHADOW_NO_LIGHT)
+        return;
+
+    // Sets the depth mask for the clears, the recorded lists bind it again
+    ApplyPipelineState(device, shadowData.pipelineStateIdx);
+
+    glViewport(0, 0, SHADOW_MAP_RESOLUTION, SHADOW_MAP_RESOLUTION);
+
+    for (u32 cascadeIdx = 0; cascadeIdx < SHADOW_CASCADE_COUNT; ++cascadeIdx)
+    {
+        ShadowCascade& cascade = shadowData.cascades[cascadeIdx];
+        if (!cascade.dirty)
+            continue;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, shadowData.framebufferHandles[cascadeIdx]);
+        glClear(GL_DEPTH_BUFFER_BIT);
+
+        STATS_ADD(renderPrimitives, cascade.renderPrimitiveCount);
+        CommandLists_Replay(device, commandLists, (CommandQueue)(CommandQueue_ShadowCascade0 + cascadeIdx));
+
+        cascade.dirty = false;
+        shadowData.renderedCascadeCount++;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindVertexArray(0);
+#endif
+}
+
+
+
+
+
+// FORWARD RENDERER
+
+void ForwardShading_Init(Device& device, ForwardRenderData& forwardRenderData)
+{
+#if USE_GFX_API_OPENGL
+    forwardRenderData.programIdx = LoadProgram(device, CString("shaders.glsl"), CString("FORWARD_RENDER"), "USE_SHADOWS");
+    forwardRenderData.instancingBufferIdx = CreateDynamicVertexBuffer(device, MB(1));
+
+    PipelineStateDesc forwardDesc = {};
+    forwardDesc.programIdx = forwardRenderData.programIdx;
+#if defined(USE_INSTANCING)
+    forwardDesc.instanceAttributeCount = 8;
+    forwardDesc.instanceStride = sizeof(mat4) * 2;
+#endif
+    forwardDesc.cullMode = CullMode_Back;
+    forwardDesc.depthTest = true;
+    forwardDesc.depthWrite = true;
+    forwardDesc.samplers[forwardDesc.samplerCount++] = { "uAlbedo", 0 };
+    forwardDesc.samplers[forwardDesc.samplerCount++] = { "uShadowMap", SHADOW_MAP_TEXTURE_UNIT };
+    forwardRenderData.pipelineStateIdx = CreatePipelineState(device, forwardDesc);
+    forwardRenderData.localParamsBlockSize = GetUniformBlockSize(device, forwardRenderData.pipelineStateIdx, BINDING(1));
+#elif USE_GFX_API_VULKAN && defined(USE_INSTANCING)
+    // No shadows on Vulkan yet, see spirv/FORWARD_RENDER.frag
+    forwardRenderData.programIdx = LoadProgram(device, CString("shaders.glsl"), CString("FORWARD_RENDER"));
+    forwardRenderData.instancingBufferIdx = CreateDynamicVertexBuffer(device, MB(1));
+
+    PipelineStateDesc forwardDesc = {};
+    forwardDesc.programIdx = forwardRenderData.programIdx;
+    forwardDesc.instanceAttributeCount = 8;
+    forwardDesc.instanceStride = sizeof(mat4) * 2;
+    forwardDesc.cullMode = CullMode_Back;
+    forwardDesc.depthTest = true;
+    forwardDesc.depthWrite = true;
+    forwardRenderData.pipelineStateIdx = CreatePipelineState(device, forwardDesc);
+#endif
+}
+
+void ForwardShading_Update(Device& device, const Scene& scene, const RenderQueue& queue, const Embedded& embedded, ForwardRenderData& forwardRenderData)
+{
+    CPU_PROFILE_FUNCTION();
+    STATS_ADD(entitiesProcessed, scene.entityCount);
+
+#if USE_GFX_API_OPENGL || USE_GFX_API_VULKAN
+#if USE_GFX_API_OPENGL
+    Program& program = device.programs[forwardRenderData.programIdx];
+#endif
+
+    forwardRenderData.renderPrimitiveCount = 0;
+
+#if defined(USE_INSTANCING)
+    Buffer& instancingBuffer = device.vertexBuffers[forwardRenderData.instancingBufferIdx];
+    MapBuffer(instancingBuffer, Access_Write);
+
+    // The simulation culled and sorted the instances and laid out their matrices
+    ASSERT(queue.renderPath == RenderPath_ForwardShading, "The render queue was built for another render path");
+    const u32 instancingBase = instancingBuffer.head;
+    const u32 instanceStride = sizeof(mat4) * 2;
+    BufferPushData(instancingBuffer, queue.instanceData, queue.instanceDataSize);
+
+    u16 prevMeshIdx = 0xffff;
+    u16 prevSubmeshIdx = 0xffff;
+
+    for (u32 primIdx = 0; primIdx < queue.keyCount; ++primIdx)
+    {
+        u64 rp = queue.keys[primIdx];
+        u32 meshIdx    = (rp >> 48) & 0xffff;
+        u32 submeshIdx = (rp >> 32) & 0xffff;
+
+        if (meshIdx != prevMeshIdx || submeshIdx != prevSubmeshIdx)
+        {
+            Mesh& mesh = device.meshes[meshIdx];
+
+            RenderPrimitive renderPrimitive = {};
+            renderPrimitive.meshSubmeshIdx = MAKE_DWORD(meshIdx, submeshIdx);
+#if USE_GFX_API_OPENGL
+            renderPrimitive.vaoHandle = FindVAO(device, meshIdx, submeshIdx, program);
+#endif
+
+            const u32 materialIdx = submeshIdx < mesh.materialIndices.size() ? mesh.materialIndices[submeshIdx] : embedded.defaultMaterialIdx;
+            const u32 albedoTextureIdx = device.materials[materialIdx].albedoTextureIdx;
+#if USE_GFX_API_OPENGL
+            renderPrimitive.albedoTextureHandle = device.textures[albedoTextureIdx].handle;
+#else
+            // Every draw binds a texture set, missing textures sample black
+            const bool hasAlbedo = albedoTextureIdx < device.textureCount && device.textures[albedoTextureIdx].descriptorSet;
+            renderPrimitive.albedoDescriptorSet = device.textures[hasAlbedo ? albedoTextureIdx : embedded.blackTexIdx].descriptorSet;
+#endif
+
             Submesh& submesh = mesh.submeshes[submeshIdx];
             renderPrimitive.indexCount = submesh.indexCount;
             renderPrimitive.indexOffset = submesh.indexOffset;
 
             renderPrimitive.instanceCount = 0;
-            renderPrimitive.instancingOffset = instancingBuffer.head;
+            renderPrimitive.instancingOffset = instancingBase + primIdx * instanceStride;
 
             forwardRenderData.renderPrimitives[forwardRenderData.renderPrimitiveCount++] = renderPrimitive;
 
@@ -139,17 +587,12 @@ void ForwardShading_Update(Device& device, const Scene& scene, const Embedded& e
         }
 
         RenderPrimitive& renderPrimitive = forwardRenderData.renderPrimitives[forwardRenderData.renderPrimitiveCount - 1];
-
-        const mat4&   world  = entity.worldMatrix;
-        const mat4    worldViewProjection = scene.mainCamera.viewProjectionMatrix * world;
-        BufferPushMat4(instancingBuffer, world);
-        BufferPushMat4(instancingBuffer, worldViewProjection);
         renderPrimitive.instanceCount++;
     }
 
     UnmapBuffer(instancingBuffer);
 
-#else
+#elif USE_GFX_API_OPENGL
 
     for (u32 entityIdx = 0; entityIdx < scene.entityCount; ++entityIdx)
     {
@@ -165,8 +608,8 @@ void ForwardShading_Update(Device& device, const Scene& scene, const Embedded& e
         Buffer& constantBuffer = GetMappedConstantBufferForRange( device, forwardRenderData.localParamsBlockSize );
         renderPrimitive.localParamsBufferIdx = device.currentConstantBufferIdx;
         renderPrimitive.localParamsOffset = constantBuffer.head;
-        BufferPushMat4(constantBuffer, world);
-        BufferPushMat4(constantBuffer, worldViewProjection);
+        const LocalParams localParams = { world, worldViewProjection };
+        PushAlignedData(constantBuffer, &localParams, sizeof(localParams), sizeof(vec4));
         renderPrimitive.localParamsSize = constantBuffer.head - renderPrimitive.localParamsOffset;
 
         switch (entity.type)
@@ -215,82 +658,144 @@ void ForwardShading_Update(Device& device, const Scene& scene, const Embedded& e
 #endif
 }
 
-void ForwardShading_Render(Device& device, const Embedded& embedded, const ForwardRenderData& forwardRender, const BufferRange& globalParamsRange)
-{
 #if USE_GFX_API_OPENGL
-    // TODO: Create PSO objects
-    if (g_CullFace)
-    {
-    glEnable(GL_CULL_FACE);
-    glCullFace(GL_BACK);
-    glFrontFace(GL_CCW);
-    }
-    else
-    {
-        glDisable(GL_CULL_FACE);
-    }
+// Shared by the forward and G-Buffer passes, records the render primitives [begin, end)
+static void RecordShadedPrimitives(u32 pipelineStateIdx, u32 instancingBufferIdx, const BufferRange& globalParamsRange,
+                                   const RenderPrimitive* renderPrimitives, u32 begin, u32 end, CommandRecorder& recorder)
+{
+    Cmd_BindPipelineState(recorder, pipelineStateIdx);
 
-    const Program& program = device.programs[forwardRender.programIdx];
-    glUseProgram(program.handle);
+    // Bind GlobalParams uniform block
+    Cmd_BindUniformBuffer(recorder, BINDING(0), globalParamsRange);
 
-    if (device.glVersion < MAKE_GLVERSION(4, 2))
-    {
-        // TODO: Investigate if this only needs to be done once when loading the shader
-        const GLuint globalParamsIdx = glGetUniformBlockIndex(program.handle, "GlobalParams");
-        const GLuint localParamsIdx = glGetUniformBlockIndex(program.handle, "LocalParams");
-        glUniformBlockBinding(program.handle, globalParamsIdx, BINDING(0));
-#if !defined(USE_INSTANCING)
-        glUniformBlockBinding(program.handle, localParamsIdx, BINDING(1));
+#if defined(USE_INSTANCING)
+    Cmd_BindVertexBuffer(recorder, instancingBufferIdx);
 #endif
-    }
 
-    // Bind GlobalParams uniform block
-    glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), device.constantBuffers[globalParamsRange.bufferIdx].handle, globalParamsRange.offset, globalParamsRange.size);
+    for (u32 i = begin; i < end; ++i)
+    {
+        const RenderPrimitive& renderPrimitive = renderPrimitives[i];
+
+        Cmd_BindTexture(recorder, 0, GL_TEXTURE_2D, renderPrimitive.albedoTextureHandle);
+        Cmd_BindVertexArray(recorder, renderPrimitive.vaoHandle);
 
 #if defined(USE_INSTANCING)
-    Buffer& instancingBuffer = device.vertexBuffers[forwardRender.instancingBufferIdx];
-    BindBuffer(instancingBuffer);
+        Cmd_BindInstances(recorder, renderPrimitive.instancingOffset);
+        Cmd_DrawIndexed(recorder, renderPrimitive.indexCount, renderPrimitive.indexOffset, renderPrimitive.instanceCount);
+#else
+        // Bind LocalParams uniform block
+        const BufferRange localParamsRange = { renderPrimitive.localParamsBufferIdx, renderPrimitive.localParamsOffset, renderPrimitive.localParamsSize };
+        Cmd_BindUniformBuffer(recorder, BINDING(1), localParamsRange);
+        Cmd_DrawIndexed(recorder, renderPrimitive.indexCount, renderPrimitive.indexOffset, 1);
 #endif
+    }
+}
 
-    // Render code
-    for (u32 i = 0; i < forwardRender.renderPrimitiveCount; ++i)
-    {
-        const RenderPrimitive& renderPrimitive = forwardRender.renderPrimitives[i];
+void ForwardShading_Record(const ForwardRenderData& forwardRender, const BufferRange& globalParamsRange, u32 begin, u32 end, CommandRecorder& recorder)
+{
+    RecordShadedPrimitives(forwardRender.pipelineStateIdx, forwardRender.instancingBufferIdx, globalParamsRange,
+                           forwardRender.renderPrimitives, begin, end, recorder);
+}
+#endif
 
-        // Bind texture
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, renderPrimitive.albedoTextureHandle);
-        glUniform1i(forwardRender.uniLoc_Albedo, 0);
+void ForwardShading_Render(Device& device, const CommandLists& commandLists, const ForwardRenderData& forwardRender)
+{
+#if USE_GFX_API_OPENGL
+    STATS_ADD(renderPrimitives, forwardRender.renderPrimitiveCount);
+    CommandLists_Replay(device, commandLists, CommandQueue_Forward);
+#endif
+}
 
-        // Bind geometry
-        glBindVertexArray(renderPrimitive.vaoHandle);
+#if USE_GFX_API_VULKAN && defined(USE_INSTANCING)
+struct ForwardShadingJobs
+{
+    const Device*            device;
+    const ForwardRenderData* forwardRender;
+    const VkPipeline*        pipelines; // Of each render primitive, VK_NULL_HANDLE if not drawn
+    VkDescriptorSet          globalParamsSet;
+    ivec2                    viewportSize;
+    u32                      jobCount;
+};
+
+// Records the render primitives of a slice of the pass
+static void ForwardShading_RecordJob(VkCommandBuffer commandBuffer, void* data, u32 jobIdx)
+{
+    const ForwardShadingJobs& jobs = *(const ForwardShadingJobs*)data;
+    const Device& device = *jobs.device;
+    const ForwardRenderData& forwardRender = *jobs.forwardRender;
+    const u32 begin = forwardRender.renderPrimitiveCount * jobIdx / jobs.jobCount;
+    const u32 end = forwardRender.renderPrimitiveCount * (jobIdx + 1) / jobs.jobCount;
+    if (begin == end)
+        return;
+
+    // Flipped so that the same projections and winding as OpenGL apply
+    const VkViewport viewport = { 0.0f, (f32)jobs.viewportSize.y, (f32)jobs.viewportSize.x, -(f32)jobs.viewportSize.y, 0.0f, 1.0f };
+    const VkRect2D scissor = { { 0, 0 }, { (u32)jobs.viewportSize.x, (u32)jobs.viewportSize.y } };
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+    const VkPipelineLayout pipelineLayout = Vulkan_GetPipelineLayout(device);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &jobs.globalParamsSet, 0, NULL);
+
+    const Buffer& instancingBuffer = device.vertexBuffers[forwardRender.instancingBufferIdx];
+    VkPipeline boundPipeline = VK_NULL_HANDLE;
+
+    for (u32 i = begin; i < end; ++i)
+    {
+        const VkPipeline pipeline = jobs.pipelines[i];
+        if (pipeline == VK_NULL_HANDLE)
+            continue;
 
-#if defined(USE_INSTANCING)
-        // Bind instancing buffer
-        const u32 VertexStream_FirstInstancingStream = 6;
-        const GLsizei stride = sizeof(mat4) * 2;
-        u64 offset = renderPrimitive.instancingOffset;
-        for (u32 location = VertexStream_FirstInstancingStream; location < 14; ++location)
+        if (pipeline != boundPipeline)
         {
-            glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, stride, (void*)(u64)offset);
-            glVertexAttribDivisor(location, 1);
-            glEnableVertexAttribArray(location);
-            offset += sizeof(vec4);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+            boundPipeline = pipeline;
         }
 
-        // Draw
-        glDrawElementsInstanced(GL_TRIANGLES, renderPrimitive.indexCount, GL_UNSIGNED_INT, (void*)(u64)renderPrimitive.indexOffset, renderPrimitive.instanceCount);
-#else
-        // Bind LocalParams uniform block
-        GLuint bufferHandle = device.constantBuffers[renderPrimitive.localParamsBufferIdx].handle;
-        glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), bufferHandle, renderPrimitive.localParamsOffset, renderPrimitive.localParamsSize);
+        const RenderPrimitive& renderPrimitive = forwardRender.renderPrimitives[i];
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 1, 1, &renderPrimitive.albedoDescriptorSet, 0, NULL);
+
+        // Vertices are bound at the submesh offset, as the attributes of the OpenGL VAOs
+        const Mesh& mesh = device.meshes[HIGH_WORD(renderPrimitive.meshSubmeshIdx)];
+        const Submesh& submesh = mesh.submeshes[LOW_WORD(renderPrimitive.meshSubmeshIdx)];
+        const VkBuffer vertexBuffers[] = { device.vertexBuffers[mesh.vertexBufferIdx].handle, instancingBuffer.handle };
+        const VkDeviceSize vertexOffsets[] = { submesh.vertexOffset, renderPrimitive.instancingOffset };
+        vkCmdBindVertexBuffers(commandBuffer, 0, ARRAY_COUNT(vertexBuffers), vertexBuffers, vertexOffsets);
+        vkCmdBindIndexBuffer(commandBuffer, device.indexBuffers[mesh.indexBufferIdx].handle, 0, VK_INDEX_TYPE_UINT32);
+
+        vkCmdDrawIndexed(commandBuffer, renderPrimitive.indexCount, renderPrimitive.instanceCount, renderPrimitive.indexOffset / sizeof(u32), 0, 0);
+    }
+}
 
-        // Draw
-        glDrawElements(GL_TRIANGLES, renderPrimitive.indexCount, GL_UNSIGNED_INT, (void*)(u64)renderPrimitive.indexOffset);
-#endif
+// Records the forward pass on the job threads, inside the current render pass
+void ForwardShading_Render(Device& device, JobSystem* jobSystem, const ForwardRenderData& forwardRender, const BufferRange& globalParamsRange, ivec2 viewportSize)
+{
+    STATS_ADD(renderPrimitives, forwardRender.renderPrimitiveCount);
+
+    // Pipelines are created on the main thread, the first time a vertex layout is drawn
+    VkPipeline* pipelines = PUSH_ARRAY(GetGlobalFrameArena(), VkPipeline, forwardRender.renderPrimitiveCount);
+    for (u32 i = 0; i < forwardRender.renderPrimitiveCount; ++i)
+    {
+        const RenderPrimitive& renderPrimitive = forwardRender.renderPrimitives[i];
+        const Mesh& mesh = device.meshes[HIGH_WORD(renderPrimitive.meshSubmeshIdx)];
+        const Submesh& submesh = mesh.submeshes[LOW_WORD(renderPrimitive.meshSubmeshIdx)];
+        pipelines[i] = Vulkan_FindPipeline(device, forwardRender.pipelineStateIdx, submesh.vertexBufferLayout);
+        if (pipelines[i] != VK_NULL_HANDLE)
+            Stats_CountDraw(renderPrimitive.indexCount, renderPrimitive.instanceCount);
     }
-#endif
+
+    ForwardShadingJobs jobs = {};
+    jobs.device = &device;
+    jobs.forwardRender = &forwardRender;
+    jobs.pipelines = pipelines;
+    // The whole block is bound, its tail of unused lights included, as GetMappedConstantBufferForRange reserved it
+    const u32 globalParamsBlockSize = GetUniformBlockSize(device, forwardRender.pipelineStateIdx, BINDING(0));
+    jobs.globalParamsSet = Vulkan_CreateUniformSet(device, device.constantBuffers[globalParamsRange.bufferIdx], globalParamsRange.offset, max(globalParamsRange.size, globalParamsBlockSize));
+    jobs.viewportSize = viewportSize;
+    jobs.jobCount = Jobs_GetThreadCount(jobSystem);
+    Vulkan_RecordSecondary(device, jobSystem, jobs.jobCount, ForwardShading_RecordJob, &jobs);
 }
+#endif
 
 
 
@@ -302,18 +807,38 @@ void DeferredShading_Init(Device& device, DeferredRenderData& renderPathData)
 {
 #if USE_GFX_API_OPENGL
     renderPathData.gbufferProgramIdx = LoadProgram(device, CString("shaders.glsl"), CString("GBUFFER"));
-    Program& gbufferProgram = device.programs[renderPathData.gbufferProgramIdx];
-    renderPathData.uniLoc_Albedo = glGetUniformLocation(gbufferProgram.handle, "uAlbedo");
-    renderPathData.localParamsBlockSize = KB(1); // TODO: Get the size from the shader?
     renderPathData.instancingBufferIdx = CreateDynamicVertexBuffer(device, MB(1));
 
+    PipelineStateDesc gbufferDesc = {};
+    gbufferDesc.programIdx = renderPathData.gbufferProgramIdx;
+#if defined(USE_INSTANCING)
+    gbufferDesc.instanceAttributeCount = 8;
+    gbufferDesc.instanceStride = sizeof(mat4) * 2;
+#endif
+    gbufferDesc.cullMode = CullMode_Back;
+    gbufferDesc.depthTest = true;
+    gbufferDesc.depthWrite = true;
+    gbufferDesc.samplers[gbufferDesc.samplerCount++] = { "uAlbedo", 0 };
+    renderPathData.gbufferPipelineStateIdx = CreatePipelineState(device, gbufferDesc);
+    renderPathData.localParamsBlockSize = GetUniformBlockSize(device, renderPathData.gbufferPipelineStateIdx, BINDING(1));
+
     renderPathData.shadingProgramIdx = LoadProgram(device, CString("shaders.glsl"), CString("DEFERRED_SHADING"));
-    Program& shadingProgram = device.programs[renderPathData.shadingProgramIdx];
+
+    // Full-screen pass, the depth buffer is left for the debug draw that follows
+    PipelineStateDesc shadingDesc = {};
+    shadingDesc.programIdx = renderPathData.shadingProgramIdx;
+    shadingDesc.samplers[shadingDesc.samplerCount++] = { "uAlbedo", 0 };
+    shadingDesc.samplers[shadingDesc.samplerCount++] = { "uNormal", 1 };
+    shadingDesc.samplers[shadingDesc.samplerCount++] = { "uPosition", 2 };
+    renderPathData.shadingPipelineStateIdx = CreatePipelineState(device, shadingDesc);
 #endif
 }
 
-void DeferredShading_Update(Device& device, const Scene& scene, const Embedded& embedded, DeferredRenderData& renderPathData)
+void DeferredShading_Update(Device& device, const Scene& scene, const RenderQueue& queue, const Embedded& embedded, DeferredRenderData& renderPathData)
 {
+    CPU_PROFILE_FUNCTION();
+    STATS_ADD(entitiesProcessed, scene.entityCount);
+
 #if USE_GFX_API_OPENGL
     Program& program = device.programs[renderPathData.gbufferProgramIdx];
 
@@ -323,51 +848,20 @@ void DeferredShading_Update(Device& device, const Scene& scene, const Embedded&
     Buffer& instancingBuffer = device.vertexBuffers[renderPathData.instancingBufferIdx];
     MapBuffer(instancingBuffer, Access_Write);
 
-    static u64* renderPrimitivesToSort = new u64[MAX_RENDER_PRIMITIVES]; // TODO: this is a mem leak, put this in another place
-    u32 renderPrimitivesToSortCount = 0;
-
-    for (u32 entityIdx = 0; entityIdx < scene.entityCount; ++entityIdx)
-    {
-        const Entity& entity = scene.entities[entityIdx];
-        const u32 meshIdx = HIGH_WORD(entity.meshSubmeshIdx);
-        const u32 submeshIdx = LOW_WORD(entity.meshSubmeshIdx);
-
-        switch (entity.type)
-        {
-            case EntityType_Mesh:
-                {
-                    u64 rp = ((u64)meshIdx << 48) | ((u64)submeshIdx << 32) | (entityIdx);
-                    renderPrimitivesToSort[renderPrimitivesToSortCount++] = rp;
-                }
-                break;
-
-            case EntityType_Model:
-                {
-                    Mesh& mesh = device.meshes[meshIdx];
-
-                    for (u32 submeshIdx = 0; submeshIdx < mesh.submeshes.size(); ++submeshIdx)
-                    {
-                        u64 rp = ((u64)meshIdx << 48) | ((u64)submeshIdx << 32) | (entityIdx);
-                        renderPrimitivesToSort[renderPrimitivesToSortCount++] = rp;
-                    }
-                }
-                break;
-        }
-    }
-
-    QSort((u64*)renderPrimitivesToSort, (u64*)renderPrimitivesToSort + renderPrimitivesToSortCount - 1);
+    // The simulation culled and sorted the instances and laid out their matrices
+    ASSERT(queue.renderPath == RenderPath_DeferredShading, "The render queue was built for another render path");
+    const u32 instancingBase = instancingBuffer.head;
+    const u32 instanceStride = sizeof(mat4) * 2;
+    BufferPushData(instancingBuffer, queue.instanceData, queue.instanceDataSize);
 
     u16 prevMeshIdx = 0xffff;
     u16 prevSubmeshIdx = 0xffff;
 
-    for (u32 primIdx = 0; primIdx < renderPrimitivesToSortCount; ++primIdx)
+    for (u32 primIdx = 0; primIdx < queue.keyCount; ++primIdx)
     {
-        u64 rp = renderPrimitivesToSort[primIdx];
+        u64 rp = queue.keys[primIdx];
         u32 meshIdx    = (rp >> 48) & 0xffff;
         u32 submeshIdx = (rp >> 32) & 0xffff;
-        u32 entityIdx  = (rp >>  0) & 0xffffffff;
-
-        const Entity& entity = scene.entities[entityIdx];
 
         if (meshIdx != prevMeshIdx || submeshIdx != prevSubmeshIdx)
         {
@@ -393,7 +887,7 @@ void DeferredShading_Update(Device& device, const Scene& scene, const Embedded&
             renderPrimitive.indexOffset = submesh.indexOffset;
 
             renderPrimitive.instanceCount = 0;
-            renderPrimitive.instancingOffset = instancingBuffer.head;
+            renderPrimitive.instancingOffset = instancingBase + primIdx * instanceStride;
 
             renderPathData.renderPrimitives[renderPathData.renderPrimitiveCount++] = renderPrimitive;
 
@@ -402,11 +896,6 @@ void DeferredShading_Update(Device& device, const Scene& scene, const Embedded&
         }
 
         RenderPrimitive& renderPrimitive = renderPathData.renderPrimitives[renderPathData.renderPrimitiveCount - 1];
-
-        const mat4&   world  = entity.worldMatrix;
-        const mat4    worldViewProjection = scene.mainCamera.viewProjectionMatrix * world;
-        BufferPushMat4(instancingBuffer, world);
-        BufferPushMat4(instancingBuffer, worldViewProjection);
         renderPrimitive.instanceCount++;
     }
 
@@ -428,8 +917,8 @@ void DeferredShading_Update(Device& device, const Scene& scene, const Embedded&
         Buffer& constantBuffer = GetMappedConstantBufferForRange( device, renderPathData.localParamsBlockSize );
         renderPrimitive.localParamsBufferIdx = device.currentConstantBufferIdx;
         renderPrimitive.localParamsOffset = constantBuffer.head;
-        BufferPushMat4(constantBuffer, world);
-        BufferPushMat4(constantBuffer, worldViewProjection);
+        const LocalParams localParams = { world, worldViewProjection };
+        PushAlignedData(constantBuffer, &localParams, sizeof(localParams), sizeof(vec4));
         renderPrimitive.localParamsSize = constantBuffer.head - renderPrimitive.localParamsOffset;
 
         switch (entity.type)
@@ -478,73 +967,628 @@ void DeferredShading_Update(Device& device, const Scene& scene, const Embedded&
 #endif
 }
 
-void DeferredShading_RenderOpaques(Device& device, const Embedded& embedded, const DeferredRenderData& renderPathData, const BufferRange& globalParamsRange)
+#if USE_GFX_API_OPENGL
+void DeferredShading_RecordOpaques(const DeferredRenderData& renderPathData, const BufferRange& globalParamsRange, u32 begin, u32 end, CommandRecorder& recorder)
+{
+    RecordShadedPrimitives(renderPathData.gbufferPipelineStateIdx, renderPathData.instancingBufferIdx, globalParamsRange,
+                           renderPathData.renderPrimitives, begin, end, recorder);
+}
+#endif
+
+void DeferredShading_RenderOpaques(Device& device, const CommandLists& commandLists, const DeferredRenderData& renderPathData)
 {
 #if USE_GFX_API_OPENGL
-    const Program& program = device.programs[renderPathData.gbufferProgramIdx];
-    glUseProgram(program.handle);
+    STATS_ADD(renderPrimitives, renderPathData.renderPrimitiveCount);
+    CommandLists_Replay(device, commandLists, CommandQueue_GBuffer);
+#endif
+}
+
+#if USE_GFX_API_OPENGL
+// Shades every G-Buffer pixel with all the lights in a single full-screen pass
+void DeferredShading_RenderLights(Device& device, const Embedded& embedded, const DeferredRenderData& renderPathData, const BufferRange& globalParamsRange, const GLuint gbufferTextureHandles[3])
+{
+    ApplyPipelineState(device, renderPathData.shadingPipelineStateIdx);
 
-    if (device.glVersion < MAKE_GLVERSION(4, 2))
+    glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), device.constantBuffers[globalParamsRange.bufferIdx].handle, globalParamsRange.offset, globalParamsRange.size);
+
+    const Program& program = device.programs[renderPathData.shadingProgramIdx];
+    GLuint vaoHandle = FindVAO(device, embedded.meshIdx, embedded.blitSubmeshIdx, program);
+    glBindVertexArray(vaoHandle);
+    STATS_INC(vaoBinds);
+
+    for (u32 i = 0; i < 3; ++i)
     {
-        // TODO: Investigate if this only needs to be done once when loading the shader
-        const GLuint globalParamsIdx = glGetUniformBlockIndex(program.handle, "GlobalParams");
-        const GLuint localParamsIdx = glGetUniformBlockIndex(program.handle, "LocalParams");
-        glUniformBlockBinding(program.handle, globalParamsIdx, BINDING(0));
-#if !defined(USE_INSTANCING)
-        glUniformBlockBinding(program.handle, localParamsIdx, BINDING(1));
-#endif
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, gbufferTextureHandles[i]);
     }
+    STATS_ADD(textureBinds, 3);
 
-    // Bind GlobalParams uniform block
-    glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), device.constantBuffers[globalParamsRange.bufferIdx].handle, globalParamsRange.offset, globalParamsRange.size);
+    glDrawElements(GL_TRIANGLES, 3, GL_UNSIGNED_INT, 0);
+    Stats_CountDraw(3, 1);
 
-#if defined(USE_INSTANCING)
-    Buffer& instancingBuffer = device.vertexBuffers[renderPathData.instancingBufferIdx];
-    BindBuffer(instancingBuffer);
+    glActiveTexture(GL_TEXTURE0);
+    glBindVertexArray(0);
+}
 #endif
 
-    // Render code
-    for (u32 i = 0; i < renderPathData.renderPrimitiveCount; ++i)
+
+
+
+
+// VISIBILITY BUFFER RENDERER
+
+#if USE_GFX_API_OPENGL
+GLuint CreateBufferTexture(GLuint bufferHandle, GLenum internalFormat)
+{
+    GLuint textureHandle;
+    glGenTextures(1, &textureHandle);
+    glBindTexture(GL_TEXTURE_BUFFER, textureHandle);
+    glTexBuffer(GL_TEXTURE_BUFFER, internalFormat, bufferHandle);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    return textureHandle;
+}
+
+i32 FindVertexAttributeOffset(const VertexBufferLayout& layout, u8 location)
+{
+    for (u32 i = 0; i < layout.attributeCount; ++i)
+        if (layout.attributes[i].location == location)
+            return layout.attributes[i].offset;
+    return -1;
+}
+
+// Packs the vertex and index buffers used by the meshes into one buffer each. Buffers are
+// only ever added, so their count tells whether the packed copies are up to date.
+void VisibilityBuffer_UpdateGeometry(Device& device, VisibilityBufferRenderData& renderPathData)
+{
+    const u32 bufferCount = device.vertexBufferCount + device.indexBufferCount;
+    if (renderPathData.geometryMeshCount == device.meshCount && renderPathData.geometryBufferCount == bufferCount)
+        return;
+
+    CPU_PROFILE_FUNCTION();
+
+    renderPathData.geometryMeshCount = device.meshCount;
+    renderPathData.geometryBufferCount = bufferCount;
+
+    bool isVertexBufferUsed[ARRAY_COUNT(device.vertexBuffers)] = {};
+    bool isIndexBufferUsed[ARRAY_COUNT(device.indexBuffers)] = {};
+    for (u32 meshIdx = 0; meshIdx < device.meshCount; ++meshIdx)
     {
-        const RenderPrimitive& renderPrimitive = renderPathData.renderPrimitives[i];
+        isVertexBufferUsed[device.meshes[meshIdx].vertexBufferIdx] = true;
+        isIndexBufferUsed[device.meshes[meshIdx].indexBufferIdx] = true;
+    }
+
+    u32 vertexBufferSize = 0;
+    for (u32 i = 0; i < device.vertexBufferCount; ++i)
+    {
+        renderPathData.geometryVertexBases[i] = vertexBufferSize / sizeof(f32);
+        if (isVertexBufferUsed[i])
+            vertexBufferSize += device.vertexBuffers[i].size;
+    }
+    u32 indexBufferSize = 0;
+    for (u32 i = 0; i < device.indexBufferCount; ++i)
+    {
+        renderPathData.geometryIndexBases[i] = indexBufferSize / sizeof(u32);
+        if (isIndexBufferUsed[i])
+            indexBufferSize += device.indexBuffers[i].size;
+    }
+
+    glDeleteTextures(1, &renderPathData.geometryVertexTexture);
+    glDeleteTextures(1, &renderPathData.geometryIndexTexture);
+    glDeleteBuffers(1, &renderPathData.geometryVertexBufferHandle);
+    glDeleteBuffers(1, &renderPathData.geometryIndexBufferHandle);
+
+    // The copies stay on the GPU
+    glGenBuffers(1, &renderPathData.geometryVertexBufferHandle);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, renderPathData.geometryVertexBufferHandle);
+    glBufferData(GL_COPY_WRITE_BUFFER, vertexBufferSize, NULL, GL_STATIC_DRAW);
+    for (u32 i = 0; i < device.vertexBufferCount; ++i)
+    {
+        if (!isVertexBufferUsed[i])
+            continue;
+        glBindBuffer(GL_COPY_READ_BUFFER, device.vertexBuffers[i].handle);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, renderPathData.geometryVertexBases[i] * sizeof(f32), device.vertexBuffers[i].size);
+    }
+
+    glGenBuffers(1, &renderPathData.geometryIndexBufferHandle);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, renderPathData.geometryIndexBufferHandle);
+    glBufferData(GL_COPY_WRITE_BUFFER, indexBufferSize, NULL, GL_STATIC_DRAW);
+    for (u32 i = 0; i < device.indexBufferCount; ++i)
+    {
+        if (!isIndexBufferUsed[i])
+            continue;
+        glBindBuffer(GL_COPY_READ_BUFFER, device.indexBuffers[i].handle);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, renderPathData.geometryIndexBases[i] * sizeof(u32), device.indexBuffers[i].size);
+    }
+
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    renderPathData.geometryVertexTexture = CreateBufferTexture(renderPathData.geometryVertexBufferHandle, GL_R32F);
+    renderPathData.geometryIndexTexture = CreateBufferTexture(renderPathData.geometryIndexBufferHandle, GL_R32UI);
+}
+
+u32 VisibilityBuffer_FindAlbedoSlot(VisibilityBufferRenderData& renderPathData, u32 texIdx)
+{
+    for (u32 i = 0; i < renderPathData.albedoSlotCount; ++i)
+        if (renderPathData.albedoTextureIndices[i] == texIdx)
+            return i;
+
+    if (renderPathData.albedoSlotCount == VISIBILITY_MAX_ALBEDO_SLOTS)
+        return VISIBILITY_NO_ALBEDO_SLOT;
+
+    const u32 slot = renderPathData.albedoSlotCount++;
+    renderPathData.albedoTextureIndices[slot] = texIdx;
+    renderPathData.albedoSlotSources[slot] = 0;
+    renderPathData.albedoSlotEntries[slot] = VISIBILITY_NO_ALBEDO_ENTRY;
+    return slot;
+}
+
+// The null texture has no size, it is copied as 1x1 and samples black like on the other paths
+static ivec2 VisibilityBuffer_GetAlbedoSize(const Device& device, const VisibilityBufferRenderData& renderPathData, u32 slot)
+{
+    return max(device.textures[renderPathData.albedoTextureIndices[slot]].size, ivec2(1));
+}
+
+// Array the texture of a size goes to: the one of its size, else the smallest one it fits in
+// without downsampling, else the largest one
+static u32 VisibilityBuffer_ChooseAlbedoArray(const VisibilityBufferRenderData& renderPathData, ivec2 size)
+{
+    u32 fitIdx = VISIBILITY_MAX_ALBEDO_ARRAYS;
+    u32 largestIdx = 0;
+    for (u32 i = 0; i < VISIBILITY_MAX_ALBEDO_ARRAYS; ++i)
+    {
+        const ivec2 arraySize = renderPathData.albedoArrays[i].size;
+        if (arraySize == size)
+            return i;
+        const i32 area = arraySize.x * arraySize.y;
+        if (arraySize.x >= size.x && arraySize.y >= size.y && (fitIdx == VISIBILITY_MAX_ALBEDO_ARRAYS || area < renderPathData.albedoArrays[fitIdx].size.x * renderPathData.albedoArrays[fitIdx].size.y))
+            fitIdx = i;
+        if (area > renderPathData.albedoArrays[largestIdx].size.x * renderPathData.albedoArrays[largestIdx].size.y)
+            largestIdx = i;
+    }
+    return fitIdx != VISIBILITY_MAX_ALBEDO_ARRAYS ? fitIdx : largestIdx;
+}
+
+// Sizes the arrays after the textures of the slots: the largest sizes get an array of their
+// own, arrays keep theirs as long as it is one of them
+static void VisibilityBuffer_SizeAlbedoArrays(const Device& device, VisibilityBufferRenderData& renderPathData)
+{
+    ivec2 sizes[VISIBILITY_MAX_ALBEDO_SLOTS];
+    u32 sizeCount = 0;
+    for (u32 slot = 0; slot < renderPathData.albedoSlotCount; ++slot)
+    {
+        const ivec2 size = VisibilityBuffer_GetAlbedoSize(device, renderPathData, slot);
+        u32 i = 0;
+        while (i < sizeCount && sizes[i] != size && sizes[i].x * sizes[i].y >= size.x * size.y)
+            ++i;
+        if (i < sizeCount && sizes[i] == size)
+            continue;
+        for (u32 j = sizeCount++; j > i; --j)
+            sizes[j] = sizes[j - 1];
+        sizes[i] = size;
+    }
+    sizeCount = min(sizeCount, (u32)VISIBILITY_MAX_ALBEDO_ARRAYS);
+
+    bool isSizeTaken[VISIBILITY_MAX_ALBEDO_ARRAYS] = {};
+    bool isArrayKept[VISIBILITY_MAX_ALBEDO_ARRAYS] = {};
+    for (u32 arrayIdx = 0; arrayIdx < VISIBILITY_MAX_ALBEDO_ARRAYS; ++arrayIdx)
+    {
+        for (u32 i = 0; i < sizeCount; ++i)
+        {
+            if (!isSizeTaken[i] && renderPathData.albedoArrays[arrayIdx].size == sizes[i])
+            {
+                isSizeTaken[i] = true;
+                isArrayKept[arrayIdx] = true;
+                break;
+            }
+        }
+    }
+
+    u32 arrayIdx = 0;
+    for (u32 i = 0; i < sizeCount; ++i)
+    {
+        if (isSizeTaken[i])
+            continue;
+        while (isArrayKept[arrayIdx])
+            ++arrayIdx;
+        isArrayKept[arrayIdx] = true;
+
+        // Allocated with the layers it needs in VisibilityBuffer_UpdateAlbedoArrays
+        VisibilityAlbedoArray& albedoArray = renderPathData.albedoArrays[arrayIdx];
+        albedoArray.size = sizes[i];
+        albedoArray.levelCount = 1;
+        while (albedoArray.size.x >> albedoArray.levelCount || albedoArray.size.y >> albedoArray.levelCount)
+            albedoArray.levelCount++;
+        albedoArray.layerCapacity = 0;
+    }
+
+    for (u32 i = 0; i < VISIBILITY_MAX_ALBEDO_ARRAYS; ++i)
+    {
+        if (!isArrayKept[i] && renderPathData.albedoArrays[i].handle)
+        {
+            glDeleteTextures(1, &renderPathData.albedoArrays[i].handle);
+            renderPathData.albedoArrays[i] = {};
+        }
+    }
+}
+
+// Copies the albedo textures that are new, were streamed in or moved to another array into
+// their layers, every level from the same level of the texture
+void VisibilityBuffer_UpdateAlbedoArrays(Device& device, const Embedded& embedded, VisibilityBufferRenderData& renderPathData)
+{
+    bool hasNewSources = false;
+    for (u32 slot = 0; slot < renderPathData.albedoSlotCount; ++slot)
+        hasNewSources |= device.textures[renderPathData.albedoTextureIndices[slot]].handle != renderPathData.albedoSlotSources[slot];
+    if (!hasNewSources)
+        return;
+
+    CPU_PROFILE_FUNCTION();
+
+    VisibilityBuffer_SizeAlbedoArrays(device, renderPathData);
+
+    // Slots moving to another array free their layer before any is taken
+    u32 slotArrays[VISIBILITY_MAX_ALBEDO_SLOTS];
+    u32 layerCounts[VISIBILITY_MAX_ALBEDO_ARRAYS] = {};
+    for (u32 slot = 0; slot < renderPathData.albedoSlotCount; ++slot)
+    {
+        slotArrays[slot] = VisibilityBuffer_ChooseAlbedoArray(renderPathData, VisibilityBuffer_GetAlbedoSize(device, renderPathData, slot));
+        layerCounts[slotArrays[slot]]++;
+
+        u32& entry = renderPathData.albedoSlotEntries[slot];
+        if (entry != VISIBILITY_NO_ALBEDO_ENTRY && entry >> VISIBILITY_ALBEDO_LAYER_BITS != slotArrays[slot])
+        {
+            renderPathData.albedoArrays[entry >> VISIBILITY_ALBEDO_LAYER_BITS].usedLayers &= ~(1ull << (entry & VISIBILITY_ALBEDO_LAYER_MASK));
+            entry = VISIBILITY_NO_ALBEDO_ENTRY;
+        }
+    }
+
+    for (u32 arrayIdx = 0; arrayIdx < VISIBILITY_MAX_ALBEDO_ARRAYS; ++arrayIdx)
+    {
+        VisibilityAlbedoArray& albedoArray = renderPathData.albedoArrays[arrayIdx];
+        if (layerCounts[arrayIdx] <= albedoArray.layerCapacity)
+            continue;
+
+        // Grows in steps, all its layers are copied again
+        albedoArray.layerCapacity = (layerCounts[arrayIdx] + 7) / 8 * 8;
+        albedoArray.usedLayers = 0;
+        for (u32 slot = 0; slot < renderPathData.albedoSlotCount; ++slot)
+            if (renderPathData.albedoSlotEntries[slot] >> VISIBILITY_ALBEDO_LAYER_BITS == arrayIdx)
+                renderPathData.albedoSlotEntries[slot] = VISIBILITY_NO_ALBEDO_ENTRY;
+
+        glDeleteTextures(1, &albedoArray.handle);
+        glGenTextures(1, &albedoArray.handle);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, albedoArray.handle);
+        for (u32 level = 0; level < albedoArray.levelCount; ++level)
+        {
+            const ivec2 levelSize = TextureCooker_LevelSize(albedoArray.size, level);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGBA8, levelSize.x, levelSize.y, albedoArray.layerCapacity, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        }
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, albedoArray.levelCount - 1);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
+
+    if (!renderPathData.albedoFramebufferHandle)
+        glGenFramebuffers(1, &renderPathData.albedoFramebufferHandle);
+    glBindFramebuffer(GL_FRAMEBUFFER, renderPathData.albedoFramebufferHandle);
+
+    ApplyPipelineState(device, embedded.texturedQuadPipelineStateIdx);
+    const Program& program = device.programs[embedded.texturedGeometryProgramIdx];
+    glBindVertexArray(FindVAO(device, embedded.meshIdx, embedded.blitSubmeshIdx, program));
+    glUniform2f(embedded.texturedGeometryProgram_TexCoordScaleLoc, 1.0f, 1.0f);
+    glActiveTexture(GL_TEXTURE0);
+
+    for (u32 slot = 0; slot < renderPathData.albedoSlotCount; ++slot)
+    {
+        const GLuint sourceHandle = device.textures[renderPathData.albedoTextureIndices[slot]].handle;
+        u32& entry = renderPathData.albedoSlotEntries[slot];
+        if (sourceHandle == renderPathData.albedoSlotSources[slot] && entry != VISIBILITY_NO_ALBEDO_ENTRY)
+            continue;
+
+        const u32 arrayIdx = slotArrays[slot];
+        VisibilityAlbedoArray& albedoArray = renderPathData.albedoArrays[arrayIdx];
+        if (entry == VISIBILITY_NO_ALBEDO_ENTRY)
+        {
+            u32 layer = 0;
+            while (albedoArray.usedLayers & (1ull << layer))
+                ++layer;
+            ASSERT(layer < albedoArray.layerCapacity, "Albedo array layers were miscounted");
+            albedoArray.usedLayers |= 1ull << layer;
+            entry = arrayIdx << VISIBILITY_ALBEDO_LAYER_BITS | layer;
+        }
+
+        // Drawn level by level, each one samples the level of the texture of the same size
+        glBindTexture(GL_TEXTURE_2D, sourceHandle);
+        STATS_INC(textureBinds);
+        for (u32 level = 0; level < albedoArray.levelCount; ++level)
+        {
+            const ivec2 levelSize = TextureCooker_LevelSize(albedoArray.size, level);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, albedoArray.handle, level, entry & VISIBILITY_ALBEDO_LAYER_MASK);
+            glViewport(0, 0, levelSize.x, levelSize.y);
+            glDrawElements(GL_TRIANGLES, 3, GL_UNSIGNED_INT, 0);
+            Stats_CountDraw(3, 1);
+        }
+
+        renderPathData.albedoSlotSources[slot] = sourceHandle;
+    }
+
+    glBindVertexArray(0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+#endif
+
+void VisibilityBuffer_Init(Device& device, VisibilityBufferRenderData& renderPathData)
+{
+#if USE_GFX_API_OPENGL
+    renderPathData.visibilityProgramIdx = LoadProgram(device, CString("shaders.glsl"), CString("VISIBILITY_BUFFER"));
+    Program& visibilityProgram = device.programs[renderPathData.visibilityProgramIdx];
+    renderPathData.uniLoc_BaseInstance = glGetUniformLocation(visibilityProgram.handle, "uBaseInstance");
+
+    // Only the matrices of the instances are vertex attributes
+    PipelineStateDesc visibilityDesc = {};
+    visibilityDesc.programIdx = renderPathData.visibilityProgramIdx;
+    visibilityDesc.instanceAttributeCount = 8;
+    visibilityDesc.instanceStride = VISIBILITY_INSTANCE_STRIDE;
+    visibilityDesc.cullMode = CullMode_Back;
+    visibilityDesc.depthTest = true;
+    visibilityDesc.depthWrite = true;
+    renderPathData.visibilityPipelineStateIdx = CreatePipelineState(device, visibilityDesc);
+
+    renderPathData.resolveProgramIdx = LoadProgram(device, CString("shaders.glsl"), CString("VISIBILITY_RESOLVE"), "USE_SHADOWS");
+    Program& resolveProgram = device.programs[renderPathData.resolveProgramIdx];
+    renderPathData.uniLoc_ViewportSize = glGetUniformLocation(resolveProgram.handle, "uViewportSize");
+    renderPathData.uniLoc_AlbedoSlots = glGetUniformLocation(resolveProgram.handle, "uAlbedoSlots");
+
+    // Full-screen pass, the depth buffer is left for the debug draw that follows
+    PipelineStateDesc resolveDesc = {};
+    resolveDesc.programIdx = renderPathData.resolveProgramIdx;
+    resolveDesc.samplers[resolveDesc.samplerCount++] = { "uVisibility", 0 };
+    resolveDesc.samplers[resolveDesc.samplerCount++] = { "uVertices", 1 };
+    resolveDesc.samplers[resolveDesc.samplerCount++] = { "uIndices", 2 };
+    resolveDesc.samplers[resolveDesc.samplerCount++] = { "uInstances", 3 };
+    resolveDesc.samplers[resolveDesc.samplerCount++] = { "uAlbedo[0]", 4 };
+    resolveDesc.samplers[resolveDesc.samplerCount++] = { "uAlbedo[1]", 5 };
+    resolveDesc.samplers[resolveDesc.samplerCount++] = { "uAlbedo[2]", 6 };
+    resolveDesc.samplers[resolveDesc.samplerCount++] = { "uAlbedo[3]", 7 };
+    CASSERT(VISIBILITY_MAX_ALBEDO_ARRAYS == 4 && SHADOW_MAP_TEXTURE_UNIT >= 4 + VISIBILITY_MAX_ALBEDO_ARRAYS, "One sampler per albedo array");
+    resolveDesc.samplers[resolveDesc.samplerCount++] = { "uShadowMap", SHADOW_MAP_TEXTURE_UNIT };
+    renderPathData.resolvePipelineStateIdx = CreatePipelineState(device, resolveDesc);
 
-        // Bind texture
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, renderPrimitive.albedoTextureHandle);
-        glUniform1i(renderPathData.uniLoc_Albedo, 0);
+    renderPathData.instancingBufferIdx = CreateDynamicVertexBuffer(device, MB(1));
+    Buffer& instancingBuffer = device.vertexBuffers[renderPathData.instancingBufferIdx];
+    renderPathData.instancingBufferTexture = CreateBufferTexture(instancingBuffer.handle, GL_RGBA32UI);
+#endif
+}
 
-        // Bind geometry
-        glBindVertexArray(renderPrimitive.vaoHandle);
+void VisibilityBuffer_Update(Device& device, const Scene& scene, const RenderQueue& queue, const Embedded& embedded, VisibilityBufferRenderData& renderPathData)
+{
+    CPU_PROFILE_FUNCTION();
+    STATS_ADD(entitiesProcessed, scene.entityCount);
 
+#if USE_GFX_API_OPENGL
 #if defined(USE_INSTANCING)
-        // Bind instancing buffer
-        const u32 VertexStream_FirstInstancingStream = 6;
-        const GLsizei stride = sizeof(mat4) * 2;
-        u64 offset = renderPrimitive.instancingOffset;
-        for (u32 location = VertexStream_FirstInstancingStream; location < 14; ++location)
+    Program& program = device.programs[renderPathData.visibilityProgramIdx];
+
+    renderPathData.renderPrimitiveCount = 0;
+
+    Buffer& instancingBuffer = device.vertexBuffers[renderPathData.instancingBufferIdx];
+    MapBuffer(instancingBuffer, Access_Write);
+
+    // The simulation culled and sorted the instances and laid out their matrices and draw data.
+    // Instances are tightly packed so that the instance index stored in the visibility buffer
+    // is the instancing buffer offset divided by the instance stride.
+    ASSERT(queue.renderPath == RenderPath_VisibilityBuffer, "The render queue was built for another render path");
+    ASSERT(instancingBuffer.head == 0, "The instance table must start the instancing buffer");
+    ASSERT(queue.keyCount <= (1 << VISIBILITY_INSTANCE_BITS), "Too many instances to encode in the visibility buffer");
+    BufferPushData(instancingBuffer, queue.instanceData, queue.instanceDataSize);
+
+    u16 prevMeshIdx = 0xffff;
+    u16 prevSubmeshIdx = 0xffff;
+
+    for (u32 primIdx = 0; primIdx < queue.keyCount; ++primIdx)
+    {
+        u64 rp = queue.keys[primIdx];
+        u32 meshIdx    = (rp >> 48) & 0xffff;
+        u32 submeshIdx = (rp >> 32) & 0xffff;
+
+        if (meshIdx != prevMeshIdx || submeshIdx != prevSubmeshIdx)
         {
-            glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, stride, (void*)(u64)offset);
-            glVertexAttribDivisor(location, 1);
-            glEnableVertexAttribArray(location);
-            offset += sizeof(vec4);
+            Mesh& mesh = device.meshes[meshIdx];
+
+            RenderPrimitive renderPrimitive = {};
+            renderPrimitive.meshSubmeshIdx = MAKE_DWORD(meshIdx, submeshIdx);
+            renderPrimitive.vaoHandle = FindVAO(device, meshIdx, submeshIdx, program);
+
+            Submesh& submesh = mesh.submeshes[submeshIdx];
+            ASSERT(submesh.indexCount / 3 < (1 << VISIBILITY_TRIANGLE_BITS), "Too many triangles to encode in the visibility buffer");
+            renderPrimitive.indexCount = submesh.indexCount;
+            renderPrimitive.indexOffset = submesh.indexOffset;
+
+            renderPrimitive.instanceCount = 0;
+            renderPrimitive.instancingOffset = primIdx * VISIBILITY_INSTANCE_STRIDE;
+
+            ASSERT(renderPathData.renderPrimitiveCount < ARRAY_COUNT(renderPathData.renderPrimitives), "Max number of render primitives reached");
+            renderPathData.renderPrimitives[renderPathData.renderPrimitiveCount++] = renderPrimitive;
+
+            prevMeshIdx = meshIdx;
+            prevSubmeshIdx = submeshIdx;
         }
 
-        // Draw
-        glDrawElementsInstanced(GL_TRIANGLES, renderPrimitive.indexCount, GL_UNSIGNED_INT, (void*)(u64)renderPrimitive.indexOffset, renderPrimitive.instanceCount);
-#else
-        // Bind LocalParams uniform block
-        GLuint bufferHandle = device.constantBuffers[renderPrimitive.localParamsBufferIdx].handle;
-        glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), bufferHandle, renderPrimitive.localParamsOffset, renderPrimitive.localParamsSize);
+        RenderPrimitive& renderPrimitive = renderPathData.renderPrimitives[renderPathData.renderPrimitiveCount - 1];
+        renderPrimitive.instanceCount++;
+    }
+
+    UnmapBuffer(instancingBuffer);
 
-        // Draw
-        glDrawElements(GL_TRIANGLES, renderPrimitive.indexCount, GL_UNSIGNED_INT, (void*)(u64)renderPrimitive.indexOffset);
+    VisibilityBuffer_UpdateAlbedoArrays(device, embedded, renderPathData);
+#else
+    INVALID_CODE_PATH("The visibility buffer render path requires USE_INSTANCING");
 #endif
+#endif
+}
+
+#if USE_GFX_API_OPENGL
+void VisibilityBuffer_RecordVisibility(const VisibilityBufferRenderData& renderPathData, u32 begin, u32 end, CommandRecorder& recorder)
+{
+#if defined(USE_INSTANCING)
+    Cmd_BindPipelineState(recorder, renderPathData.visibilityPipelineStateIdx);
+    Cmd_BindVertexBuffer(recorder, renderPathData.instancingBufferIdx);
+
+    for (u32 i = begin; i < end; ++i)
+    {
+        const RenderPrimitive& renderPrimitive = renderPathData.renderPrimitives[i];
+
+        // Only the world-view-projection matrix is needed to rasterize ids
+        Cmd_BindVertexArray(recorder, renderPrimitive.vaoHandle);
+        Cmd_BindInstances(recorder, renderPrimitive.instancingOffset);
+        Cmd_SetUniformUInt(recorder, renderPathData.uniLoc_BaseInstance, renderPrimitive.instancingOffset / VISIBILITY_INSTANCE_STRIDE);
+        Cmd_DrawIndexed(recorder, renderPrimitive.indexCount, renderPrimitive.indexOffset, renderPrimitive.instanceCount);
     }
 #endif
 }
+#endif
+
+void VisibilityBuffer_RenderVisibility(Device& device, const CommandLists& commandLists, const VisibilityBufferRenderData& renderPathData)
+{
+#if USE_GFX_API_OPENGL && defined(USE_INSTANCING)
+    STATS_ADD(renderPrimitives, renderPathData.renderPrimitiveCount);
+    CommandLists_Replay(device, commandLists, CommandQueue_Visibility);
+#endif
+}
 
-void DeferredShading_RenderLights(Device& device, const Embedded& embedded, const DeferredRenderData& renderPathData, const BufferRange& globalParamsRange)
+#if USE_GFX_API_OPENGL
+// A single full-screen pass: every pixel decodes its instance and triangle from the visibility
+// buffer and looks the transforms, geometry and albedo slot up in the instance table
+void VisibilityBuffer_Resolve(Device& device, const Embedded& embedded, VisibilityBufferRenderData& renderPathData, const BufferRange& globalParamsRange, GLuint visibilityTextureHandle, ivec2 viewportSize)
 {
+#if defined(USE_INSTANCING)
+    ApplyPipelineState(device, renderPathData.resolvePipelineStateIdx);
+
+    glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), device.constantBuffers[globalParamsRange.bufferIdx].handle, globalParamsRange.offset, globalParamsRange.size);
+
+    const Program& program = device.programs[renderPathData.resolveProgramIdx];
+    GLuint vaoHandle = FindVAO(device, embedded.meshIdx, embedded.blitSubmeshIdx, program);
+    glBindVertexArray(vaoHandle);
+    STATS_INC(vaoBinds);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, visibilityTextureHandle);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_BUFFER, renderPathData.geometryVertexTexture);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_BUFFER, renderPathData.geometryIndexTexture);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_BUFFER, renderPathData.instancingBufferTexture);
+    for (u32 i = 0; i < VISIBILITY_MAX_ALBEDO_ARRAYS; ++i)
+    {
+        glActiveTexture(GL_TEXTURE4 + i);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, renderPathData.albedoArrays[i].handle);
+    }
+    STATS_ADD(textureBinds, 4 + VISIBILITY_MAX_ALBEDO_ARRAYS);
 
+    glUniform2f(renderPathData.uniLoc_ViewportSize, (f32)viewportSize.x, (f32)viewportSize.y);
+    glUniform1uiv(renderPathData.uniLoc_AlbedoSlots, renderPathData.albedoSlotCount, renderPathData.albedoSlotEntries);
+
+    glDrawElements(GL_TRIANGLES, 3, GL_UNSIGNED_INT, 0);
+    Stats_CountDraw(3, 1);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindVertexArray(0);
+#endif
 }
+#endif
 
+
+
+// RENDER SCENE
+
+// Snapshots the submesh instances of the scene for the simulation to cull and sort. On the
+// visibility buffer path it also packs the geometry and assigns the albedo slots, since the
+// draw data of every instance points into them, and checks that the scene fits its encoding.
+// Returns whether a new snapshot was taken.
+bool RenderScene_Update(Device& device, const Scene& scene, const Embedded& embedded, RenderPath renderPath, VisibilityBufferRenderData& visibilityData, RenderScene& renderScene)
+{
+    const u32 geometryBufferCount = device.vertexBufferCount + device.indexBufferCount;
+    if (renderScene.version != 0 &&
+        renderScene.renderPath == renderPath &&
+        renderScene.staticGeometryVersion == scene.staticGeometryVersion &&
+        renderScene.entityCount == scene.entityCount &&
+        renderScene.meshCount == device.meshCount &&
+        renderScene.materialCount == device.materialCount &&
+        renderScene.geometryBufferCount == geometryBufferCount &&
+        scene.dynamicEntityCount == 0)
+        return false;
+
+    CPU_PROFILE_FUNCTION();
+
+#if USE_GFX_API_OPENGL && defined(USE_INSTANCING)
+    const bool hasDrawData = renderPath == RenderPath_VisibilityBuffer;
+    if (hasDrawData)
+        VisibilityBuffer_UpdateGeometry(device, visibilityData);
+    visibilityData.isSceneSupported = true;
+#endif
+
+    // Keys are built in entity order, so the items keep it as well
+    ScratchArena scratchArena;
+    u64* keys = PUSH_ARRAY(scratchArena, u64, MAX_RENDER_PRIMITIVES);
+    renderScene.itemCount = BuildRenderPrimitiveSortKeys(device, scene, keys);
+
+    for (u32 itemIdx = 0; itemIdx < renderScene.itemCount; ++itemIdx)
+    {
+        const u32 meshIdx    = (keys[itemIdx] >> 48) & 0xffff;
+        const u32 submeshIdx = (keys[itemIdx] >> 32) & 0xffff;
+        const u32 entityIdx  = (keys[itemIdx] >>  0) & 0xffffffff;
+        const Mesh& mesh = device.meshes[meshIdx];
+        const Submesh& submesh = mesh.submeshes[submeshIdx];
+
+        RenderSceneItem& item = renderScene.items[itemIdx];
+        item.meshSubmeshIdx = MAKE_DWORD(meshIdx, submeshIdx);
+        item.worldMatrix = scene.entities[entityIdx].worldMatrix;
+        item.boundsMin = submesh.boundsMin;
+        item.boundsMax = submesh.boundsMax;
+        item.visibilityDrawData[0] = uvec4(0);
+        item.visibilityDrawData[1] = uvec4(0);
+
+#if USE_GFX_API_OPENGL && defined(USE_INSTANCING)
+        if (hasDrawData)
+        {
+            // Where the resolve finds the submesh in the packed geometry, offsets and strides
+            // in 32-bit elements, and the slot of its albedo
+            const u32 materialIdx = submeshIdx < mesh.materialIndices.size() ? mesh.materialIndices[submeshIdx] : embedded.defaultMaterialIdx;
+            const u32 albedoSlot = VisibilityBuffer_FindAlbedoSlot(visibilityData, device.materials[materialIdx].albedoTextureIdx);
+            if (albedoSlot == VISIBILITY_NO_ALBEDO_SLOT || submesh.indexCount / 3 >= (1 << VISIBILITY_TRIANGLE_BITS))
+                visibilityData.isSceneSupported = false;
+
+            const VertexBufferLayout& layout = submesh.vertexBufferLayout;
+            const i32 normalOffset = FindVertexAttributeOffset(layout, 1);
+            const i32 texCoordOffset = FindVertexAttributeOffset(layout, 2);
+            item.visibilityDrawData[0] = uvec4(visibilityData.geometryIndexBases[mesh.indexBufferIdx] + submesh.indexOffset / sizeof(u32),
+                                               visibilityData.geometryVertexBases[mesh.vertexBufferIdx] + submesh.vertexOffset / sizeof(f32),
+                                               layout.stride / sizeof(f32),
+                                               albedoSlot);
+            item.visibilityDrawData[1] = uvec4(normalOffset < 0 ? VISIBILITY_NO_ATTRIBUTE : normalOffset / sizeof(f32),
+                                               texCoordOffset < 0 ? VISIBILITY_NO_ATTRIBUTE : texCoordOffset / sizeof(f32),
+                                               0, 0);
+        }
+#endif
+    }
+
+#if USE_GFX_API_OPENGL && defined(USE_INSTANCING)
+    // Instances are encoded by their index in the render queue, which at most holds them all
+    if (hasDrawData && renderScene.itemCount > (1 << VISIBILITY_INSTANCE_BITS))
+        visibilityData.isSceneSupported = false;
+#endif
+
+    renderScene.version++;
+    renderScene.renderPath = renderPath;
+    renderScene.staticGeometryVersion = scene.staticGeometryVersion;
+    renderScene.entityCount = scene.entityCount;
+    renderScene.dynamicEntityCount = scene.dynamicEntityCount;
+    renderScene.meshCount = device.meshCount;
+    renderScene.materialCount = device.materialCount;
+    renderScene.geometryBufferCount = geometryBufferCount;
+    return true;
+}
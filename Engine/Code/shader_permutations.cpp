@@ -0,0 +1,429 @@
+//
+// shader_permutations.cpp : Assembles the source of a program permutation (a program name
+// plus its feature switches) from the shader files. It resolves #include "file" directives
+// and blanks the sections that can not be active for the permutation, so that the source
+// hash and the dependencies of a permutation only change when its own code does.
+//
+// Conditions are evaluated conservatively: only #ifdef/#ifndef/#if [!]defined(NAME) are
+// understood, and NAME is known to be undefined only if no define seen so far sets it.
+// Anything else (and VERTEX/FRAGMENT, since both stages share the source) may be active.
+//
+
+#define SHADER_MAX_INCLUDE_DEPTH 8
+#define SHADER_MAX_CONDITION_DEPTH 32
+#define SHADER_MAX_KNOWN_DEFINES 64
+
+enum ShaderCondition
+{
+    ShaderCondition_False,
+    ShaderCondition_True,
+    ShaderCondition_Maybe,
+};
+
+struct ShaderConditionScope
+{
+    ShaderCondition current;   // Of the branch being parsed
+    ShaderCondition anyTaken;  // Whether a previous branch was taken
+    bool            wasActive; // Whether the enclosing region was active
+};
+
+struct ShaderPreprocessor
+{
+    String          defineNames[SHADER_MAX_KNOWN_DEFINES];
+    ShaderCondition defineValues[SHADER_MAX_KNOWN_DEFINES];
+    u32             defineCount;
+
+    ShaderConditionScope scopes[SHADER_MAX_CONDITION_DEPTH];
+    u32                  scopeCount;
+    bool                 isActive;
+
+    Program* program;
+    Arena*   arena;
+    bool     hasErrors;
+};
+
+// FNV-1a
+u64 HashBytes(const void* data, u32 size, u64 hash = 0xcbf29ce484222325ull)
+{
+    const u8* bytes = (const u8*)data;
+    for (u32 i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Name of the permutation, e.g. FORWARD_RENDER+USE_SHADOWS, also used to name its cached binary
+String MakePermutationName(Arena& arena, String programName, String defines)
+{
+    String name = {};
+    name.str = (const char*)PushData(arena, programName.str, programName.len);
+    name.len = programName.len;
+
+    const char* c = defines.str;
+    const char* end = defines.str + defines.len;
+    while (c && c < end)
+    {
+        if (*c == ' ')
+        {
+            ++c;
+            continue;
+        }
+        PushChar(arena, '+');
+        name.len++;
+        while (c < end && *c != ' ')
+        {
+            PushChar(arena, *c++);
+            name.len++;
+        }
+    }
+    PushChar(arena, 0);
+    return name;
+}
+
+// A #define line for each feature switch of the permutation
+String MakePermutationDefines(Arena& arena, String defines)
+{
+    String lines = {};
+    lines.str = (const char*)(arena.data + arena.head);
+
+    const char* c = defines.str;
+    const char* end = defines.str + defines.len;
+    while (c && c < end)
+    {
+        if (*c == ' ')
+        {
+            ++c;
+            continue;
+        }
+        const char* nameBegin = c;
+        while (c < end && *c != ' ') ++c;
+        String line = FormatString(arena, "#define %.*s\n", (int)(c - nameBegin), nameBegin);
+        lines.len += line.len;
+        arena.head--; // Drop the terminator so that the lines stay contiguous
+    }
+    PushChar(arena, 0);
+    return lines;
+}
+
+u32 RegisterShaderFile(Device& device, const char* filepath)
+{
+    for (u32 i = 0; i < device.shaderFileCount; ++i)
+        if (SameString(device.shaderFiles[i].filepath.str, filepath))
+            return i;
+
+    ASSERT(device.shaderFileCount < ARRAY_COUNT(device.shaderFiles), "Max number of shader files reached");
+    ShaderFile& shaderFile = device.shaderFiles[device.shaderFileCount];
+    shaderFile.filepath = InternString(StrArena, filepath);
+    shaderFile.lastWriteTimestamp = GetFileLastWriteTimestamp(filepath);
+    shaderFile.hasChanged = false;
+    return device.shaderFileCount++;
+}
+
+static ShaderCondition ShaderCondition_Not(ShaderCondition c)
+{
+    return c == ShaderCondition_Maybe ? c : (c == ShaderCondition_True ? ShaderCondition_False : ShaderCondition_True);
+}
+
+static ShaderCondition ShaderCondition_Or(ShaderCondition a, ShaderCondition b)
+{
+    if (a == ShaderCondition_True || b == ShaderCondition_True) return ShaderCondition_True;
+    if (a == ShaderCondition_False && b == ShaderCondition_False) return ShaderCondition_False;
+    return ShaderCondition_Maybe;
+}
+
+static void ShaderPreprocessor_SetDefine(ShaderPreprocessor& pp, String name, ShaderCondition value)
+{
+    for (u32 i = 0; i < pp.defineCount; ++i)
+    {
+        if (SameString(pp.defineNames[i], name))
+        {
+            pp.defineValues[i] = (pp.defineValues[i] == value) ? value : ShaderCondition_Maybe;
+            return;
+        }
+    }
+
+    ASSERT(pp.defineCount < ARRAY_COUNT(pp.defineNames), "Max number of known shader defines reached");
+    pp.defineNames[pp.defineCount] = name;
+    pp.defineValues[pp.defineCount] = value;
+    pp.defineCount++;
+}
+
+static ShaderCondition ShaderPreprocessor_IsDefined(const ShaderPreprocessor& pp, String name)
+{
+    for (u32 i = 0; i < pp.defineCount; ++i)
+        if (SameString(pp.defineNames[i], name))
+            return pp.defineValues[i];
+    return ShaderCondition_False;
+}
+
+static bool IsIdentifierChar(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static const char* SkipSpaces(const char* c, const char* end)
+{
+    while (c < end && (*c == ' ' || *c == '\t' || *c == '\r')) ++c;
+    return c;
+}
+
+static String ParseIdentifier(const char*& c, const char* end)
+{
+    String identifier = {};
+    identifier.str = c;
+    while (c < end && IsIdentifierChar(*c)) ++c;
+    identifier.len = (u32)(c - identifier.str);
+    return identifier;
+}
+
+// Evaluates [!]defined(NAME) and [!]defined NAME, anything else is Maybe
+static ShaderCondition ShaderPreprocessor_Evaluate(const ShaderPreprocessor& pp, const char* c, const char* end)
+{
+    c = SkipSpaces(c, end);
+    bool negate = false;
+    if (c < end && *c == '!')
+    {
+        negate = true;
+        c = SkipSpaces(c + 1, end);
+    }
+
+    String keyword = ParseIdentifier(c, end);
+    if (!SameString(keyword, CString("defined")))
+        return ShaderCondition_Maybe;
+
+    c = SkipSpaces(c, end);
+    const bool hasParenthesis = c < end && *c == '(';
+    if (hasParenthesis)
+        c = SkipSpaces(c + 1, end);
+
+    String name = ParseIdentifier(c, end);
+    c = SkipSpaces(c, end);
+    if (hasParenthesis)
+    {
+        if (c == end || *c != ')')
+            return ShaderCondition_Maybe;
+        c = SkipSpaces(c + 1, end);
+    }
+
+    // Trailing comments are fine, other operators (&&, ||) are not understood
+    if (name.len == 0 || (c < end && !(c + 1 < end && c[0] == '/' && (c[1] == '/' || c[1] == '*'))))
+        return ShaderCondition_Maybe;
+
+    ShaderCondition result = ShaderPreprocessor_IsDefined(pp, name);
+    return negate ? ShaderCondition_Not(result) : result;
+}
+
+static void ShaderPreprocessor_UpdateActive(ShaderPreprocessor& pp)
+{
+    pp.isActive = true;
+    if (pp.scopeCount > 0)
+    {
+        const ShaderConditionScope& scope = pp.scopes[pp.scopeCount - 1];
+        pp.isActive = scope.wasActive && scope.current != ShaderCondition_False;
+    }
+}
+
+static void ShaderPreprocessor_AddDependency(Program& program, u32 shaderFileIdx)
+{
+    for (u32 i = 0; i < program.dependencyCount; ++i)
+        if (program.dependencies[i] == shaderFileIdx)
+            return;
+
+    ASSERT(program.dependencyCount < ARRAY_COUNT(program.dependencies), "Max number of program dependencies reached");
+    program.dependencies[program.dependencyCount++] = shaderFileIdx;
+}
+
+static void ShaderPreprocessor_Push(ShaderPreprocessor& pp, const char* text, u32 len)
+{
+    PushData(*pp.arena, text, len);
+}
+
+static void ShaderPreprocessor_ExpandFile(Device& device, ShaderPreprocessor& pp, const char* filepath, u32 depth)
+{
+    if (depth > SHADER_MAX_INCLUDE_DEPTH)
+    {
+        ELOG("Shader include depth exceeded in %s (recursive #include?)", filepath);
+        pp.hasErrors = true;
+        return;
+    }
+
+    const u32 shaderFileIdx = RegisterShaderFile(device, filepath);
+    ShaderPreprocessor_AddDependency(*pp.program, shaderFileIdx);
+
+    String source = ReadTextFile(filepath);
+    if (!source.str)
+    {
+        pp.hasErrors = true;
+        return;
+    }
+
+    // Source string numbers in compiler messages are shader file indices
+    char lineDirective[64];
+    u32 lineDirectiveLen = snprintf(lineDirective, sizeof(lineDirective), "#line 1 %u\n", shaderFileIdx);
+    ShaderPreprocessor_Push(pp, lineDirective, lineDirectiveLen);
+
+    const char* end = source.str + source.len;
+    const char* lineBegin = source.str;
+    u32 lineNumber = 1;
+
+    while (lineBegin < end)
+    {
+        const char* lineEnd = lineBegin;
+        while (lineEnd < end && *lineEnd != '\n') ++lineEnd;
+        const u32 lineLen = (u32)(lineEnd - lineBegin);
+
+        bool keepLine = pp.isActive;
+
+        const char* c = SkipSpaces(lineBegin, lineEnd);
+        if (c < lineEnd && *c == '#')
+        {
+            c = SkipSpaces(c + 1, lineEnd);
+            String directive = ParseIdentifier(c, lineEnd);
+            c = SkipSpaces(c, lineEnd);
+
+            if (SameString(directive, CString("ifdef")) || SameString(directive, CString("ifndef")) || SameString(directive, CString("if")))
+            {
+                ShaderCondition condition = ShaderCondition_Maybe;
+                if (SameString(directive, CString("if")))
+                {
+                    condition = ShaderPreprocessor_Evaluate(pp, c, lineEnd);
+                }
+                else
+                {
+                    String name = ParseIdentifier(c, lineEnd);
+                    condition = ShaderPreprocessor_IsDefined(pp, name);
+                    if (SameString(directive, CString("ifndef")))
+                        condition = ShaderCondition_Not(condition);
+                }
+
+                ASSERT(pp.scopeCount < ARRAY_COUNT(pp.scopes), "Max shader condition depth reached");
+                ShaderConditionScope& scope = pp.scopes[pp.scopeCount++];
+                scope.current = condition;
+                scope.anyTaken = condition;
+                scope.wasActive = pp.isActive;
+                ShaderPreprocessor_UpdateActive(pp);
+                keepLine = scope.wasActive;
+            }
+            else if ((SameString(directive, CString("elif")) || SameString(directive, CString("else"))) && pp.scopeCount > 0)
+            {
+                ShaderConditionScope& scope = pp.scopes[pp.scopeCount - 1];
+                ShaderCondition condition = SameString(directive, CString("elif")) ?
+                    ShaderPreprocessor_Evaluate(pp, c, lineEnd) : ShaderCondition_True;
+
+                if (scope.anyTaken == ShaderCondition_True)
+                    scope.current = ShaderCondition_False;
+                else if (scope.anyTaken == ShaderCondition_False)
+                    scope.current = condition;
+                else
+                    scope.current = (condition == ShaderCondition_False) ? ShaderCondition_False : ShaderCondition_Maybe;
+
+                scope.anyTaken = ShaderCondition_Or(scope.anyTaken, condition);
+                ShaderPreprocessor_UpdateActive(pp);
+                keepLine = scope.wasActive;
+            }
+            else if (SameString(directive, CString("endif")) && pp.scopeCount > 0)
+            {
+                keepLine = pp.scopes[pp.scopeCount - 1].wasActive;
+                pp.scopeCount--;
+                ShaderPreprocessor_UpdateActive(pp);
+            }
+            else if (SameString(directive, CString("define")) && pp.isActive)
+            {
+                bool isCertain = true;
+                for (u32 i = 0; i < pp.scopeCount; ++i)
+                    isCertain = isCertain && pp.scopes[i].current == ShaderCondition_True;
+                String name = ParseIdentifier(c, lineEnd);
+                ShaderPreprocessor_SetDefine(pp, name, isCertain ? ShaderCondition_True : ShaderCondition_Maybe);
+            }
+            else if (SameString(directive, CString("undef")) && pp.isActive)
+            {
+                String name = ParseIdentifier(c, lineEnd);
+                ShaderPreprocessor_SetDefine(pp, name, ShaderCondition_Maybe);
+            }
+            else if (SameString(directive, CString("include")) && pp.isActive)
+            {
+                const char* nameBegin = (c < lineEnd && *c == '"') ? c + 1 : NULL;
+                const char* nameEnd = nameBegin;
+                while (nameEnd && nameEnd < lineEnd && *nameEnd != '"') ++nameEnd;
+
+                if (!nameBegin || nameEnd == lineEnd)
+                {
+                    ELOG("%s:%u: malformed #include", filepath, lineNumber);
+                    pp.hasErrors = true;
+                }
+                else
+                {
+                    // Relative to the including file
+                    i32 dirLen = (i32)strlen(filepath);
+                    while (dirLen > 0 && filepath[dirLen - 1] != '/' && filepath[dirLen - 1] != '\\') --dirLen;
+                    String includePath = FormatString(GetGlobalFrameArena(), "%.*s%.*s", dirLen, filepath, (int)(nameEnd - nameBegin), nameBegin);
+
+                    ShaderPreprocessor_ExpandFile(device, pp, includePath.str, depth + 1);
+
+                    lineDirectiveLen = snprintf(lineDirective, sizeof(lineDirective), "\n#line %u %u", lineNumber + 1, shaderFileIdx);
+                    ShaderPreprocessor_Push(pp, lineDirective, lineDirectiveLen);
+                }
+                keepLine = false;
+            }
+        }
+
+        // Inactive lines are blanked, which keeps the line numbers
+        if (keepLine)
+            ShaderPreprocessor_Push(pp, lineBegin, lineLen);
+        if (lineEnd < end)
+            PushChar(*pp.arena, '\n');
+
+        lineBegin = lineEnd + 1;
+        lineNumber++;
+    }
+}
+
+// Expands the program file of a permutation and records the files it depends on
+String ExpandProgramSource(Device& device, Program& program, Arena& arena)
+{
+    CPU_PROFILE_FUNCTION();
+
+    ShaderPreprocessor pp = {};
+    pp.program = &program;
+    pp.arena = &arena;
+    pp.isActive = true;
+
+    // What the source is compiled with, see CreateProgramFromSource
+    ShaderPreprocessor_SetDefine(pp, CString("VERSION"), ShaderCondition_True);
+    ShaderPreprocessor_SetDefine(pp, program.programName, ShaderCondition_True);
+    ShaderPreprocessor_SetDefine(pp, CString("VERTEX"), ShaderCondition_Maybe);
+    ShaderPreprocessor_SetDefine(pp, CString("FRAGMENT"), ShaderCondition_Maybe);
+#if defined(USE_INSTANCING)
+    ShaderPreprocessor_SetDefine(pp, CString("USE_INSTANCING"), ShaderCondition_Maybe); // Vertex shaders only
+#endif
+
+    const char* c = program.defines.str;
+    const char* definesEnd = program.defines.str + program.defines.len;
+    while (c && c < definesEnd)
+    {
+        c = SkipSpaces(c, definesEnd);
+        String name = ParseIdentifier(c, definesEnd);
+        if (name.len > 0)
+            ShaderPreprocessor_SetDefine(pp, name, ShaderCondition_True);
+        else if (c < definesEnd)
+            ++c;
+    }
+
+    program.dependencyCount = 0;
+
+    String source = {};
+    source.str = (const char*)(arena.data + arena.head);
+    ShaderPreprocessor_ExpandFile(device, pp, program.filepath.str, 0);
+    source.len = (u32)((const char*)(arena.data + arena.head) - source.str);
+    PushChar(arena, 0);
+
+    if (pp.scopeCount > 0)
+        ELOG("Unterminated #if in the source of %s", program.permutationName.str);
+
+    if (pp.hasErrors)
+        source = {};
+
+    return source;
+}
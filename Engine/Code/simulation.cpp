@@ -0,0 +1,272 @@
+//
+// simulation.cpp : Simulation of the frame (camera controls) and the thread that runs it ahead
+// of rendering in pipelined runs. Every frame the render thread submits the input of frame N+1
+// and takes the packet of frame N, which the simulation finished while frame N-1 was being
+// rendered. Packets are copied in and out under the lock, so each side only ever works on
+// its own copy. The simulation also culls and sorts the render scene and lays out the
+// instance data into the render queue of the packet slot, which the render thread only
+// copies into the instancing buffers.
+//
+
+void QSort(u64* begin, u64* end);
+
+struct Simulation
+{
+    std::thread             thread;
+    std::mutex              mutex;
+    std::condition_variable condition;
+    bool                    quit;
+
+    FramePacket packets[FRAME_PACKET_COUNT];
+    u32         submittedCount; // Packets with input, handed to the simulation thread
+    u32         simulatedCount; // Packets ready to render
+    u32         renderedCount;  // Packets taken by the render thread, their slots are free
+
+    RenderQueue renderQueues[FRAME_PACKET_COUNT]; // Owned by the packet slots
+
+    // Latest render scene snapshot of the render thread, guarded by the lock
+    RenderScene pendingScene;
+    bool        hasPendingScene;
+
+    // Simulation state, only touched by the simulation thread
+    Camera      camera;
+    RenderScene scene;
+};
+
+void UpdateCamera(Camera& camera, const Input& input, f32 deltaTime, ivec2 displaySize)
+{
+    const float rotationSpeed = 0.1f * PI;
+    if (input.mouseButtons[RIGHT] == BUTTON_PRESSED)
+    {
+        camera.yaw += input.mouseDelta.x * rotationSpeed * deltaTime;
+        camera.pitch -= input.mouseDelta.y * rotationSpeed * deltaTime;
+    }
+    camera.yaw = mod(camera.yaw, TAU);
+    camera.pitch = clamp(camera.pitch, -PI/2.1f, PI/2.1f);
+    camera.forward = vec3(cosf(camera.pitch)*sinf(camera.yaw),
+                               sinf(camera.pitch),
+                               -cosf(camera.pitch)*cosf(camera.yaw));
+    camera.right = vec3(cosf(camera.yaw), 0.0f, sinf(camera.yaw));
+    vec3 upVector = vec3(0.0f, 1.0f, 0.0f);
+
+    vec3 newDirection = vec3(0.0);
+    if (input.keys[K_W] == BUTTON_PRESSED) { newDirection += camera.forward; }
+    if (input.keys[K_S] == BUTTON_PRESSED) { newDirection -= camera.forward; }
+    if (input.keys[K_D] == BUTTON_PRESSED) { newDirection += camera.right;   }
+    if (input.keys[K_A] == BUTTON_PRESSED) { newDirection -= camera.right;   }
+
+    const float newdirMagnitude = length(newDirection);
+    newDirection = (newdirMagnitude > 0.0f) ? newDirection / newdirMagnitude : vec3(0.0f);
+
+    float speedMagnitude = length(camera.speed);
+    vec3 speedDirection = (speedMagnitude > 0.0f) ? camera.speed / speedMagnitude : vec3(0.0f);
+
+    const float MAX_SPEED = 100.0f;
+    if (newdirMagnitude > 0.0f) {
+        speedDirection = 0.5f * (speedDirection + newDirection);
+        speedMagnitude = min(speedMagnitude + 1.0f, MAX_SPEED);
+    } else {
+        speedMagnitude *= 0.8f;
+        if (speedMagnitude < 0.01f)
+            speedMagnitude = 0.0f;
+    }
+
+    camera.speed = speedMagnitude * speedDirection;
+
+    camera.position += camera.speed * deltaTime;
+
+    float aspectRatio = (float)displaySize.x/(float)displaySize.y;
+    camera.viewMatrix = lookAt(camera.position, camera.position + camera.forward, upVector);
+    camera.projectionMatrix = perspective(radians(CAMERA_FOV_Y_DEGREES), aspectRatio, CAMERA_Z_NEAR, CAMERA_Z_FAR);
+    camera.viewProjectionMatrix = camera.projectionMatrix * camera.viewMatrix;
+}
+
+// Whether the local bounds are completely outside one of the clip planes
+bool IsOutsideFrustum(const mat4& worldViewProjection, const vec3& boundsMin, const vec3& boundsMax)
+{
+    u32 outsideMask = 0x3f;
+    for (u32 i = 0; i < 8; ++i)
+    {
+        const vec3 corner = vec3(i & 1 ? boundsMax.x : boundsMin.x,
+                                 i & 2 ? boundsMax.y : boundsMin.y,
+                                 i & 4 ? boundsMax.z : boundsMin.z);
+        const vec4 clip = worldViewProjection * vec4(corner, 1.0f);
+        const u32 cornerMask = (clip.x < -clip.w ? 0x01 : 0) | (clip.x > clip.w ? 0x02 : 0) |
+                               (clip.y < -clip.w ? 0x04 : 0) | (clip.y > clip.w ? 0x08 : 0) |
+                               (clip.z < -clip.w ? 0x10 : 0) | (clip.z > clip.w ? 0x20 : 0);
+        outsideMask &= cornerMask;
+    }
+    return outsideMask != 0;
+}
+
+// Culls the render scene against the camera, sorts the visible items by mesh/submesh and writes
+// their instance data in the layout of the render path: world and world-view-projection
+// matrices, followed by the draw data of the visibility buffer resolve on that path
+void RenderQueue_Build(const RenderScene& scene, const Camera& camera, RenderPath renderPath, RenderQueue& queue)
+{
+    CPU_PROFILE_FUNCTION();
+
+    queue.renderPath = renderPath;
+    queue.sceneVersion = scene.version;
+    queue.keyCount = 0;
+    queue.culledCount = 0;
+    queue.instanceDataSize = 0;
+
+    for (u32 itemIdx = 0; itemIdx < scene.itemCount; ++itemIdx)
+    {
+        const RenderSceneItem& item = scene.items[itemIdx];
+        const mat4 worldViewProjection = camera.viewProjectionMatrix * item.worldMatrix;
+        if (IsOutsideFrustum(worldViewProjection, item.boundsMin, item.boundsMax))
+        {
+            queue.culledCount++;
+            continue;
+        }
+
+        const u32 meshIdx = HIGH_WORD(item.meshSubmeshIdx);
+        const u32 submeshIdx = LOW_WORD(item.meshSubmeshIdx);
+        queue.keys[queue.keyCount++] = ((u64)meshIdx << 48) | ((u64)submeshIdx << 32) | itemIdx;
+    }
+
+    QSort(queue.keys, queue.keys + queue.keyCount - 1);
+
+    const bool hasDrawData = renderPath == RenderPath_VisibilityBuffer;
+    const u32 instanceStride = hasDrawData ? VISIBILITY_INSTANCE_STRIDE : 2 * sizeof(mat4);
+
+    for (u32 keyIdx = 0; keyIdx < queue.keyCount; ++keyIdx)
+    {
+        const RenderSceneItem& item = scene.items[queue.keys[keyIdx] & 0xffffffff];
+        const mat4 worldViewProjection = camera.viewProjectionMatrix * item.worldMatrix;
+
+        u8* instance = queue.instanceData + keyIdx * instanceStride;
+        MemCopy(instance, &item.worldMatrix, sizeof(mat4));
+        MemCopy(instance + sizeof(mat4), &worldViewProjection, sizeof(mat4));
+        if (hasDrawData)
+            MemCopy(instance + 2 * sizeof(mat4), item.visibilityDrawData, sizeof(item.visibilityDrawData));
+    }
+
+    queue.instanceDataSize = queue.keyCount * instanceStride;
+}
+
+// Advances the simulation state by the input of packet and stores the result in packet
+void Simulation_Step(Camera& camera, const RenderScene& scene, FramePacket& packet)
+{
+    CPU_PROFILE_FUNCTION();
+    const u64 beginNs = GetProfileTimeNs();
+
+    UpdateCamera(camera, packet.input, packet.deltaTime, packet.displaySize);
+    packet.camera = camera;
+
+    RenderQueue_Build(scene, camera, packet.renderPath, *packet.renderQueue);
+
+    packet.simulationTimeMs = (GetProfileTimeNs() - beginNs) / 1000000.0f;
+}
+
+static void Simulation_Run(Simulation* simulation)
+{
+#if USE_CPU_PROFILER
+    CpuProfile_SetThreadName("Simulation");
+#endif
+
+    for (;;)
+    {
+        FramePacket packet;
+        {
+            std::unique_lock<std::mutex> lock(simulation->mutex);
+            simulation->condition.wait(lock, [simulation]() { return simulation->simulatedCount != simulation->submittedCount || simulation->quit; });
+            if (simulation->quit)
+                break;
+            packet = simulation->packets[simulation->simulatedCount % FRAME_PACKET_COUNT];
+
+            if (simulation->hasPendingScene)
+            {
+                simulation->scene = simulation->pendingScene;
+                simulation->hasPendingScene = false;
+            }
+        }
+
+        Simulation_Step(simulation->camera, simulation->scene, packet);
+
+        {
+            std::lock_guard<std::mutex> lock(simulation->mutex);
+            simulation->packets[simulation->simulatedCount % FRAME_PACKET_COUNT] = packet;
+            simulation->simulatedCount++;
+        }
+        simulation->condition.notify_all();
+    }
+}
+
+// Hands the input of a frame to the simulation thread, waits if all the packets are in use
+void Simulation_Submit(Simulation* simulation, const FramePacket& packet)
+{
+    {
+        std::unique_lock<std::mutex> lock(simulation->mutex);
+        simulation->condition.wait(lock, [simulation]() { return simulation->submittedCount - simulation->renderedCount < FRAME_PACKET_COUNT; });
+        const u32 slot = simulation->submittedCount % FRAME_PACKET_COUNT;
+        simulation->packets[slot] = packet;
+        simulation->packets[slot].renderQueue = &simulation->renderQueues[slot];
+        simulation->submittedCount++;
+    }
+    simulation->condition.notify_all();
+}
+
+// Hands a new render scene snapshot to the simulation, used from the next packet it simulates
+void Simulation_SetScene(Simulation* simulation, const RenderScene& scene)
+{
+    CPU_PROFILE_FUNCTION();
+    std::lock_guard<std::mutex> lock(simulation->mutex);
+    simulation->pendingScene = scene;
+    simulation->hasPendingScene = true;
+}
+
+// Copies out the oldest packet once it is simulated, returns the time spent waiting for it
+f32 Simulation_TakePacket(Simulation* simulation, FramePacket& packet)
+{
+    CPU_PROFILE_FUNCTION();
+    const u64 beginNs = GetProfileTimeNs();
+
+    {
+        std::unique_lock<std::mutex> lock(simulation->mutex);
+        ASSERT(simulation->renderedCount != simulation->submittedCount, "No frame packet was submitted");
+        simulation->condition.wait(lock, [simulation]() { return simulation->simulatedCount != simulation->renderedCount; });
+        packet = simulation->packets[simulation->renderedCount % FRAME_PACKET_COUNT];
+        simulation->renderedCount++;
+    }
+    simulation->condition.notify_all();
+
+    return (GetProfileTimeNs() - beginNs) / 1000000.0f;
+}
+
+// The pipeline starts full: the first FRAME_PACKET_COUNT - 1 packets are simulated without input
+Simulation* Simulation_Create(const Camera& camera, ivec2 displaySize, f32 deltaTime)
+{
+    Simulation* simulation = new Simulation();
+    simulation->camera = camera;
+    simulation->thread = std::thread(Simulation_Run, simulation);
+
+    FramePacket packet = {};
+    packet.displaySize = displaySize;
+    packet.deltaTime = deltaTime;
+    for (u32 i = 0; i + 1 < FRAME_PACKET_COUNT; ++i)
+    {
+        packet.inputTimeNs = GetProfileTimeNs();
+        Simulation_Submit(simulation, packet);
+    }
+
+    ILOG("Simulation thread: %u frame packets", FRAME_PACKET_COUNT);
+    return simulation;
+}
+
+void Simulation_Destroy(Simulation* simulation)
+{
+    if (!simulation)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(simulation->mutex);
+        simulation->quit = true;
+    }
+    simulation->condition.notify_all();
+    simulation->thread.join();
+
+    delete simulation;
+}
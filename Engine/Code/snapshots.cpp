@@ -0,0 +1,269 @@
+//
+// snapshots.cpp : Asynchronous framebuffer captures. Frames are read back into a ring of
+// pixel pack buffers and only mapped once their fence has signaled (a few frames later),
+// then a worker thread encodes and writes the PNG files. Sequence captures write every
+// frame: when the ring or the writer queue is full, the render thread waits instead of
+// dropping frames.
+//
+
+struct SnapshotImage
+{
+    u8*   pixels; // Top-down RGB rows, owned by the writer once queued
+    ivec2 size;
+    char  filepath[256];
+};
+
+struct SnapshotWriter
+{
+    std::thread             thread;
+    std::mutex              mutex;
+    std::condition_variable condition; // Signals both new images and free queue slots
+    SnapshotImage           queue[SNAPSHOT_MAX_QUEUED_IMAGES];
+    u32                     queueHead;
+    u32                     queueCount;
+    bool                    quit;
+    std::atomic<u32>        writtenCount;
+    std::atomic<u32>        failedCount;
+};
+
+static void SnapshotWriter_Run(SnapshotWriter* writer)
+{
+#if USE_CPU_PROFILER
+    CpuProfile_SetThreadName("Snapshot writer");
+#endif
+
+    for (;;)
+    {
+        SnapshotImage image;
+        {
+            std::unique_lock<std::mutex> lock(writer->mutex);
+            writer->condition.wait(lock, [writer]() { return writer->queueCount > 0 || writer->quit; });
+            if (writer->queueCount == 0)
+                break;
+
+            image = writer->queue[writer->queueHead];
+            writer->queueHead = (writer->queueHead + 1) % SNAPSHOT_MAX_QUEUED_IMAGES;
+            writer->queueCount--;
+        }
+        writer->condition.notify_all();
+
+        {
+            CPU_PROFILE_SCOPE("Write PNG");
+            const int stride = image.size.x * 3;
+            if (stbi_write_png(image.filepath, image.size.x, image.size.y, 3, image.pixels, stride))
+                writer->writtenCount++;
+            else
+            {
+                ELOG("Could not write snapshot %s\n", image.filepath);
+                writer->failedCount++;
+            }
+        }
+
+        free(image.pixels);
+    }
+}
+
+static void SnapshotWriter_Push(Snapshots& snapshots, const SnapshotImage& image)
+{
+    if (!snapshots.writer)
+    {
+        snapshots.writer = new SnapshotWriter();
+        snapshots.writer->thread = std::thread(SnapshotWriter_Run, snapshots.writer);
+    }
+
+    SnapshotWriter* writer = snapshots.writer;
+    {
+        std::unique_lock<std::mutex> lock(writer->mutex);
+        if (writer->queueCount == SNAPSHOT_MAX_QUEUED_IMAGES)
+        {
+            CPU_PROFILE_SCOPE("Wait snapshot writer");
+            snapshots.queueStallCount++;
+            writer->condition.wait(lock, [writer]() { return writer->queueCount < SNAPSHOT_MAX_QUEUED_IMAGES; });
+        }
+
+        const u32 tail = (writer->queueHead + writer->queueCount) % SNAPSHOT_MAX_QUEUED_IMAGES;
+        writer->queue[tail] = image;
+        writer->queueCount++;
+    }
+    writer->condition.notify_all();
+}
+
+static void SnapshotWriter_Destroy(Snapshots& snapshots)
+{
+    SnapshotWriter* writer = snapshots.writer;
+    if (writer)
+    {
+        {
+            std::lock_guard<std::mutex> lock(writer->mutex);
+            writer->quit = true;
+        }
+        writer->condition.notify_all();
+        writer->thread.join(); // Writes every queued image before returning
+
+        delete writer;
+        snapshots.writer = NULL;
+    }
+}
+
+#if USE_GFX_API_OPENGL
+static bool Snapshots_IsReadbackReady(const SnapshotReadback& readback)
+{
+    GLint status = GL_UNSIGNALED;
+    glGetSynciv(readback.fence, GL_SYNC_STATUS, sizeof(status), NULL, &status);
+    return status == GL_SIGNALED;
+}
+
+static void Snapshots_ResolveReadback(Snapshots& snapshots, SnapshotReadback& readback)
+{
+    CPU_PROFILE_FUNCTION();
+
+    // Only blocks if the fence has not signaled yet (the ring is full)
+    glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+    glDeleteSync(readback.fence);
+    readback.fence = 0;
+
+    const u32 rowSize = readback.size.x * 3;
+    const u32 imageSize = rowSize * readback.size.y;
+
+    SnapshotImage image = {};
+    image.pixels = (u8*)malloc(imageSize);
+    image.size = readback.size;
+    MemCopy(image.filepath, readback.filepath, sizeof(image.filepath));
+
+    // GL rows go bottom-up, flip them while copying out of the mapped buffer
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+    const u8* mappedPixels = (const u8*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, imageSize, GL_MAP_READ_BIT);
+    if (mappedPixels)
+    {
+        for (i32 y = 0; y < readback.size.y; ++y)
+            MemCopy(image.pixels + y * rowSize, mappedPixels + (readback.size.y - 1 - y) * rowSize, rowSize);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    readback.isPending = false;
+
+    if (mappedPixels)
+        SnapshotWriter_Push(snapshots, image);
+    else
+    {
+        ELOG("Could not map the readback buffer of %s\n", readback.filepath);
+        free(image.pixels);
+    }
+}
+
+static void Snapshots_BeginReadback(Snapshots& snapshots, SnapshotReadback& readback, ivec2 size, const char* filepath)
+{
+    CPU_PROFILE_FUNCTION();
+
+    const u32 imageSize = size.x * size.y * 3;
+
+    if (!readback.pbo)
+        glGenBuffers(1, &readback.pbo);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+    if (readback.pboSize < imageSize)
+    {
+        glBufferData(GL_PIXEL_PACK_BUFFER, imageSize, NULL, GL_STREAM_READ);
+        readback.pboSize = imageSize;
+    }
+
+    // Returns right away, the copy happens on the GPU timeline
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, size.x, size.y, GL_RGB, GL_UNSIGNED_BYTE, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback.size = size;
+    snprintf(readback.filepath, sizeof(readback.filepath), "%s", filepath);
+    readback.isPending = true;
+
+    snapshots.readbackCount++;
+}
+
+// Hands finished readbacks over to the writer and starts the readback of this frame if requested
+void Snapshots_Update(App* app)
+{
+    CPU_PROFILE_FUNCTION();
+
+    Snapshots& snapshots = app->snapshots;
+
+    // Oldest first, so sequence images are queued in order
+    for (u32 i = 0; i < SNAPSHOT_READBACK_SLOTS; ++i)
+    {
+        SnapshotReadback& readback = snapshots.readbacks[(snapshots.readbackHead + i) % SNAPSHOT_READBACK_SLOTS];
+        if (!readback.isPending)
+            continue;
+        if (!Snapshots_IsReadbackReady(readback))
+            break;
+        Snapshots_ResolveReadback(snapshots, readback);
+    }
+
+    if (!snapshots.takeSnapshot && !snapshots.isCapturingSequence)
+        return;
+
+    SnapshotReadback& readback = snapshots.readbacks[snapshots.readbackHead];
+    snapshots.readbackHead = (snapshots.readbackHead + 1) % SNAPSHOT_READBACK_SLOTS;
+
+    if (readback.isPending)
+    {
+        // The GPU is more than SNAPSHOT_READBACK_SLOTS frames behind
+        snapshots.readbackStallCount++;
+        Snapshots_ResolveReadback(snapshots, readback);
+    }
+
+    char filepath[256];
+    if (snapshots.isCapturingSequence)
+    {
+        const char* prefix = snapshots.sequencePrefix ? snapshots.sequencePrefix : "capture";
+        snprintf(filepath, sizeof(filepath), "%s_%05u.png", prefix, snapshots.sequenceIndex++);
+    }
+    else
+    {
+        snprintf(filepath, sizeof(filepath), "snapshot.png");
+    }
+
+    Snapshots_BeginReadback(snapshots, readback, app->displaySize, filepath);
+
+    snapshots.takeSnapshot = false;
+}
+
+void Snapshots_Shutdown(App* app)
+{
+    Snapshots& snapshots = app->snapshots;
+
+    for (u32 i = 0; i < SNAPSHOT_READBACK_SLOTS; ++i)
+    {
+        SnapshotReadback& readback = snapshots.readbacks[(snapshots.readbackHead + i) % SNAPSHOT_READBACK_SLOTS];
+        if (readback.isPending)
+            Snapshots_ResolveReadback(snapshots, readback);
+        if (readback.pbo)
+            glDeleteBuffers(1, &readback.pbo);
+        readback = {};
+    }
+
+    SnapshotWriter_Destroy(snapshots);
+}
+#endif
+
+void Snapshots_Gui(App* app)
+{
+    Snapshots& snapshots = app->snapshots;
+
+    if (ImGui::Button("Take snapshot"))
+    {
+        snapshots.takeSnapshot = true;
+    }
+    ImGui::SameLine();
+    if (ImGui::Button(snapshots.isCapturingSequence ? "Stop capture" : "Start capture"))
+    {
+        snapshots.isCapturingSequence = !snapshots.isCapturingSequence;
+    }
+
+    const u32 writtenCount = snapshots.writer ? snapshots.writer->writtenCount.load() : 0;
+    const u32 failedCount = snapshots.writer ? snapshots.writer->failedCount.load() : 0;
+    ImGui::Text("Snapshots: %u read back, %u written, %u failed", snapshots.readbackCount, writtenCount, failedCount);
+    ImGui::Text("Stalls: %u GPU, %u writer", snapshots.readbackStallCount, snapshots.queueStallCount);
+}
@@ -0,0 +1,845 @@
+//
+// software_engine.cpp : Software rendering backend of USE_GFX_API_SOFTWARE builds. The OpenGL
+// code paths of the engine run on the null driver, and every frame the scene is rasterized on
+// the CPU with the material model of the forward shading path, into the image glReadPixels
+// returns. Snapshots, image sequences and benchmarks work as usual without a GPU.
+//
+// Geometry jobs run the vertex stage of each draw, clip its triangles and bin them into screen
+// tiles. Tile jobs then rasterize their bins in draw order with fixed point half-space edge
+// functions, shading 8 pixels of a row at a time, and skip whole tiles and 8x8 blocks the
+// triangle is behind of with a two-level max depth buffer. Shadow maps are not rasterized,
+// lights are never occluded.
+//
+
+#include "software_engine.h"
+#include "null_engine.h"
+
+#if USE_GFX_API_SOFTWARE
+
+#include <string.h>
+#include <math.h>
+#include <utility>
+
+#define SOFTWARE_TILE_SIZE         64
+#define SOFTWARE_BLOCK_SIZE        8 // Of the hierarchical depth, a block row is one 8-wide step
+#define SOFTWARE_LANES             SOFTWARE_BLOCK_SIZE
+#define SOFTWARE_SUBPIXEL_BITS     4
+#define SOFTWARE_SUBPIXEL_ONE      (1 << SOFTWARE_SUBPIXEL_BITS)
+#define SOFTWARE_GUARD_BAND        2.0f // Clip space extent triangles are clipped to, fits the fixed point range
+#define SOFTWARE_CLIP_PLANES       6
+#define SOFTWARE_MAX_CLIP_VERTICES (3 + SOFTWARE_CLIP_PLANES)
+
+// The pixel stage works on all the lanes of a row at once with the vector extensions of GCC and
+// Clang, the compilers the SOFTWARE build supports. Vectors are passed by reference, by value
+// they would change the calling convention depending on the enabled instruction sets.
+typedef f32 f32x8 __attribute__((vector_size(SOFTWARE_LANES * sizeof(f32))));
+typedef i32 i32x8 __attribute__((vector_size(SOFTWARE_LANES * sizeof(i32))));
+typedef i64 i64x8 __attribute__((vector_size(SOFTWARE_LANES * sizeof(i64))));
+CASSERT(SOFTWARE_LANES == 8, "Lane vectors are initialized with 8 elements");
+
+static const f32 SoftwareClearColor[3] = { 0.1f, 0.1f, 0.1f }; // As the render graph targets
+static const f32 SoftwareClearDepth    = 1.0f;
+
+struct SoftwareTexture
+{
+    const u8* data; // Samples white if NULL
+    ivec2     size;
+    u32       channelCount;
+};
+
+// Output of the vertex stage, as in the forward vertex shader
+struct SoftwareVertex
+{
+    vec4 clipPosition;
+    vec3 position; // In worldspace
+    vec3 normal;   // In worldspace
+    vec2 texCoord;
+};
+
+// Counter-clockwise (positive area) triangle ready to rasterize, its attributes are divided by w
+// for perspective-correct interpolation
+struct SoftwareTriangle
+{
+    i32  x[3];
+    i32  y[3];         // Window coordinates in fixed point, rows go bottom-up
+    i64  area;         // Twice the area, in fixed point
+    i32  minX, minY;   // Covered pixels, inclusive and within the viewport
+    i32  maxX, maxY;
+    f32  z[3];         // Window depth
+    f32  minZ;
+    f32  invW[3];
+    vec3 position[3];
+    vec3 normal[3];
+    vec2 texCoord[3];
+};
+
+struct SoftwareBinEntry
+{
+    u32 tileIdx;
+    u32 triangleIdx;
+};
+
+// One submesh of an entity
+struct SoftwareDraw
+{
+    mat4            worldMatrix;
+    const Submesh*  submesh;
+    const u8*       vertexData;
+    const u32*      indices;
+    SoftwareTexture albedo;
+
+    // Output of its geometry job, capacity is kept across frames
+    std::vector<SoftwareTriangle> triangles;
+    std::vector<SoftwareBinEntry> binEntries;
+};
+
+struct SoftwareTileEntry
+{
+    u32 drawIdx;
+    u32 triangleIdx;
+};
+
+struct SoftwareRenderer
+{
+    // Targets
+    ivec2            size;
+    ivec2            tileCount;
+    i32              depthPitch;    // Depth rows are padded to whole blocks
+    i32              blockPitch;
+    std::vector<u8>  colorBuffer;   // RGBA8, rows bottom-up
+    std::vector<f32> depthBuffer;
+    std::vector<f32> blockMaxDepth; // Farthest depth of each 8x8 block
+    std::vector<f32> tileMaxDepth;
+
+    // Frame
+    mat4                      viewProjectionMatrix;
+    vec3                      cameraPosition;
+    Light                     lights[MAX_LIGHTS];
+    u32                       lightCount;
+    bool                      cullBackFaces;
+    std::vector<SoftwareDraw> draws;
+    u32                       drawCount;
+
+    // Triangles of every tile in draw order, the ones of tile i start at tileOffsets[i]
+    std::vector<u32>               tileOffsets;
+    std::vector<SoftwareTileEntry> tileEntries;
+
+    // Per job thread
+    std::vector<SoftwareVertex> threadVertices[MAX_JOB_THREADS];
+    u64                         threadPixels[MAX_JOB_THREADS];
+};
+
+//
+// Geometry
+//
+
+static SoftwareVertex Software_LerpVertex(const SoftwareVertex& a, const SoftwareVertex& b, f32 t)
+{
+    SoftwareVertex vertex;
+    vertex.clipPosition = mix(a.clipPosition, b.clipPosition, t);
+    vertex.position = mix(a.position, b.position, t);
+    vertex.normal = mix(a.normal, b.normal, t);
+    vertex.texCoord = mix(a.texCoord, b.texCoord, t);
+    return vertex;
+}
+
+// Signed distance to the near, far and guard band planes, inside if positive
+static f32 Software_ClipDistance(const vec4& p, u32 planeIdx)
+{
+    switch (planeIdx)
+    {
+        case 0:  return p.w + p.z;
+        case 1:  return p.w - p.z;
+        case 2:  return SOFTWARE_GUARD_BAND * p.w + p.x;
+        case 3:  return SOFTWARE_GUARD_BAND * p.w - p.x;
+        case 4:  return SOFTWARE_GUARD_BAND * p.w + p.y;
+        default: return SOFTWARE_GUARD_BAND * p.w - p.y;
+    }
+}
+
+// Sutherland-Hodgman in clip space, returns the vertex count of the clipped polygon
+static u32 Software_ClipPolygon(SoftwareVertex* polygon, u32 vertexCount)
+{
+    SoftwareVertex clipped[SOFTWARE_MAX_CLIP_VERTICES];
+
+    for (u32 planeIdx = 0; planeIdx < SOFTWARE_CLIP_PLANES && vertexCount > 0; ++planeIdx)
+    {
+        u32 clippedCount = 0;
+        for (u32 i = 0; i < vertexCount; ++i)
+        {
+            const SoftwareVertex& a = polygon[i];
+            const SoftwareVertex& b = polygon[(i + 1) % vertexCount];
+            const f32 distanceA = Software_ClipDistance(a.clipPosition, planeIdx);
+            const f32 distanceB = Software_ClipDistance(b.clipPosition, planeIdx);
+
+            if (distanceA >= 0.0f)
+                clipped[clippedCount++] = a;
+            if ((distanceA >= 0.0f) != (distanceB >= 0.0f))
+                clipped[clippedCount++] = Software_LerpVertex(a, b, distanceA / (distanceA - distanceB));
+        }
+
+        vertexCount = clippedCount;
+        for (u32 i = 0; i < vertexCount; ++i)
+            polygon[i] = clipped[i];
+    }
+
+    return vertexCount;
+}
+
+static i64 Software_Orient2D(i32 ax, i32 ay, i32 bx, i32 by, i32 cx, i32 cy)
+{
+    return (i64)(bx - ax) * (cy - ay) - (i64)(by - ay) * (cx - ax);
+}
+
+// Edge functions of a triangle at the pixel centers, edge k is the one opposite to vertex k.
+// Pixels on an edge are only covered by the triangle the edge is a top or left edge of.
+struct SoftwareEdges
+{
+    i64 value[3]; // At the center of pixel (x, y) given to Software_SetupEdges
+    i64 stepX[3]; // Per pixel
+    i64 stepY[3];
+};
+
+static void Software_SetupEdges(const SoftwareTriangle& triangle, i32 x, i32 y, SoftwareEdges& edges)
+{
+    const i32 px = (x << SOFTWARE_SUBPIXEL_BITS) + SOFTWARE_SUBPIXEL_ONE / 2;
+    const i32 py = (y << SOFTWARE_SUBPIXEL_BITS) + SOFTWARE_SUBPIXEL_ONE / 2;
+
+    for (u32 k = 0; k < 3; ++k)
+    {
+        const u32 a = (k + 1) % 3;
+        const u32 b = (k + 2) % 3;
+        const i32 dx = triangle.x[b] - triangle.x[a];
+        const i32 dy = triangle.y[b] - triangle.y[a];
+
+        // Counter-clockwise with rows going up: left edges go down, top edges go left
+        const bool isTopLeft = dy < 0 || (dy == 0 && dx < 0);
+
+        edges.value[k] = Software_Orient2D(triangle.x[a], triangle.y[a], triangle.x[b], triangle.y[b], px, py) - (isTopLeft ? 0 : 1);
+        edges.stepX[k] = -(i64)dy * SOFTWARE_SUBPIXEL_ONE;
+        edges.stepY[k] = (i64)dx * SOFTWARE_SUBPIXEL_ONE;
+    }
+}
+
+// True if the pixel rectangle [x0, x1] x [y0, y1] is entirely outside of an edge
+static bool Software_IsRectOutside(const SoftwareTriangle& triangle, i32 x0, i32 y0, i32 x1, i32 y1)
+{
+    SoftwareEdges edges;
+    Software_SetupEdges(triangle, x0, y0, edges);
+    for (u32 k = 0; k < 3; ++k)
+    {
+        // Corner where the edge function is the largest
+        const i64 maxValue = edges.value[k] + (edges.stepX[k] > 0 ? edges.stepX[k] * (x1 - x0) : 0)
+                                            + (edges.stepY[k] > 0 ? edges.stepY[k] * (y1 - y0) : 0);
+        if (maxValue < 0)
+            return true;
+    }
+    return false;
+}
+
+static void Software_SetupTriangle(SoftwareRenderer* renderer, SoftwareDraw& draw, const SoftwareVertex& v0, const SoftwareVertex& v1, const SoftwareVertex& v2)
+{
+    const ivec2 size = renderer->size;
+    const SoftwareVertex* vertices[3] = { &v0, &v1, &v2 };
+
+    SoftwareTriangle triangle;
+    for (u32 i = 0; i < 3; ++i)
+    {
+        const vec4& clipPosition = vertices[i]->clipPosition;
+        const f32 invW = 1.0f / clipPosition.w;
+        const f32 windowX = (clipPosition.x * invW * 0.5f + 0.5f) * size.x;
+        const f32 windowY = (clipPosition.y * invW * 0.5f + 0.5f) * size.y;
+        triangle.x[i] = (i32)floorf(windowX * SOFTWARE_SUBPIXEL_ONE + 0.5f);
+        triangle.y[i] = (i32)floorf(windowY * SOFTWARE_SUBPIXEL_ONE + 0.5f);
+        triangle.z[i] = clipPosition.z * invW * 0.5f + 0.5f;
+        triangle.invW[i] = invW;
+        triangle.position[i] = vertices[i]->position * invW;
+        triangle.normal[i] = vertices[i]->normal * invW;
+        triangle.texCoord[i] = vertices[i]->texCoord * invW;
+    }
+
+    triangle.area = Software_Orient2D(triangle.x[0], triangle.y[0], triangle.x[1], triangle.y[1], triangle.x[2], triangle.y[2]);
+    if (triangle.area == 0)
+        return;
+    if (triangle.area < 0)
+    {
+        if (renderer->cullBackFaces)
+            return;
+
+        // Two-sided, rasterize it counter-clockwise
+        triangle.area = -triangle.area;
+        std::swap(triangle.x[1], triangle.x[2]);
+        std::swap(triangle.y[1], triangle.y[2]);
+        std::swap(triangle.z[1], triangle.z[2]);
+        std::swap(triangle.invW[1], triangle.invW[2]);
+        std::swap(triangle.position[1], triangle.position[2]);
+        std::swap(triangle.normal[1], triangle.normal[2]);
+        std::swap(triangle.texCoord[1], triangle.texCoord[2]);
+    }
+
+    // Pixels whose center is inside of the fixed point bounding box
+    const i32 half = SOFTWARE_SUBPIXEL_ONE / 2;
+    const i32 minX = min(triangle.x[0], min(triangle.x[1], triangle.x[2]));
+    const i32 minY = min(triangle.y[0], min(triangle.y[1], triangle.y[2]));
+    const i32 maxX = max(triangle.x[0], max(triangle.x[1], triangle.x[2]));
+    const i32 maxY = max(triangle.y[0], max(triangle.y[1], triangle.y[2]));
+    triangle.minX = max((minX - half + SOFTWARE_SUBPIXEL_ONE - 1) >> SOFTWARE_SUBPIXEL_BITS, 0);
+    triangle.minY = max((minY - half + SOFTWARE_SUBPIXEL_ONE - 1) >> SOFTWARE_SUBPIXEL_BITS, 0);
+    triangle.maxX = min((maxX - half) >> SOFTWARE_SUBPIXEL_BITS, size.x - 1);
+    triangle.maxY = min((maxY - half) >> SOFTWARE_SUBPIXEL_BITS, size.y - 1);
+    if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY)
+        return;
+
+    triangle.minZ = min(triangle.z[0], min(triangle.z[1], triangle.z[2]));
+
+    const u32 triangleIdx = draw.triangles.size();
+    draw.triangles.push_back(triangle);
+
+    const i32 tileX0 = triangle.minX / SOFTWARE_TILE_SIZE;
+    const i32 tileY0 = triangle.minY / SOFTWARE_TILE_SIZE;
+    const i32 tileX1 = triangle.maxX / SOFTWARE_TILE_SIZE;
+    const i32 tileY1 = triangle.maxY / SOFTWARE_TILE_SIZE;
+    for (i32 tileY = tileY0; tileY <= tileY1; ++tileY)
+    {
+        for (i32 tileX = tileX0; tileX <= tileX1; ++tileX)
+        {
+            // Large triangles only overlap some of the tiles of their bounds
+            const bool isSingleTile = tileX0 == tileX1 && tileY0 == tileY1;
+            if (!isSingleTile)
+            {
+                const i32 x0 = max(tileX * SOFTWARE_TILE_SIZE, triangle.minX);
+                const i32 y0 = max(tileY * SOFTWARE_TILE_SIZE, triangle.minY);
+                const i32 x1 = min(tileX * SOFTWARE_TILE_SIZE + SOFTWARE_TILE_SIZE - 1, triangle.maxX);
+                const i32 y1 = min(tileY * SOFTWARE_TILE_SIZE + SOFTWARE_TILE_SIZE - 1, triangle.maxY);
+                if (Software_IsRectOutside(triangle, x0, y0, x1, y1))
+                    continue;
+            }
+
+            draw.binEntries.push_back(SoftwareBinEntry{ (u32)(tileY * renderer->tileCount.x + tileX), triangleIdx });
+        }
+    }
+}
+
+// Geometry job: vertex stage, clipping, triangle setup and binning of one draw
+static void Software_ProcessDraw(void* data, u32 drawIdx, u32 threadIdx)
+{
+    SoftwareRenderer* renderer = (SoftwareRenderer*)data;
+    SoftwareDraw& draw = renderer->draws[drawIdx];
+    const Submesh& submesh = *draw.submesh;
+    const VertexBufferLayout& layout = submesh.vertexBufferLayout;
+
+    draw.triangles.clear();
+    draw.binEntries.clear();
+
+    std::vector<SoftwareVertex>& vertices = renderer->threadVertices[threadIdx];
+    vertices.resize(submesh.vertexCount);
+
+    const mat4 worldViewProjection = renderer->viewProjectionMatrix * draw.worldMatrix;
+    for (u32 vertexIdx = 0; vertexIdx < submesh.vertexCount; ++vertexIdx)
+    {
+        const u8* vertexData = draw.vertexData + submesh.vertexOffset + vertexIdx * layout.stride;
+
+        vec3 position = vec3(0.0f);
+        vec3 normal = vec3(0.0f);
+        vec2 texCoord = vec2(0.0f);
+        for (u32 i = 0; i < layout.attributeCount; ++i)
+        {
+            const VertexBufferAttribute& attribute = layout.attributes[i];
+            const f32* components = (const f32*)(vertexData + attribute.offset);
+            switch (attribute.location)
+            {
+                case 0: position = vec3(components[0], components[1], components[2]); break;
+                case 1: normal   = vec3(components[0], components[1], components[2]); break;
+                case 2: texCoord = vec2(components[0], components[1]); break;
+            }
+        }
+
+        SoftwareVertex& vertex = vertices[vertexIdx];
+        vertex.clipPosition = worldViewProjection * vec4(position, 1.0f);
+        vertex.position = vec3(draw.worldMatrix * vec4(position, 1.0f));
+        vertex.normal = vec3(draw.worldMatrix * vec4(normal, 0.0f));
+        vertex.texCoord = texCoord;
+    }
+
+    for (u32 i = 0; i + 2 < submesh.indexCount; i += 3)
+    {
+        const SoftwareVertex& v0 = vertices[draw.indices[i + 0]];
+        const SoftwareVertex& v1 = vertices[draw.indices[i + 1]];
+        const SoftwareVertex& v2 = vertices[draw.indices[i + 2]];
+
+        // Outside of one of the frustum planes
+        bool isOutside = false;
+        bool isInside = true;
+        for (u32 planeIdx = 0; planeIdx < SOFTWARE_CLIP_PLANES; ++planeIdx)
+        {
+            const f32 d0 = Software_ClipDistance(v0.clipPosition, planeIdx);
+            const f32 d1 = Software_ClipDistance(v1.clipPosition, planeIdx);
+            const f32 d2 = Software_ClipDistance(v2.clipPosition, planeIdx);
+            isOutside = isOutside || (d0 < 0.0f && d1 < 0.0f && d2 < 0.0f);
+            isInside = isInside && d0 >= 0.0f && d1 >= 0.0f && d2 >= 0.0f;
+        }
+        if (isOutside)
+            continue;
+
+        if (isInside)
+        {
+            Software_SetupTriangle(renderer, draw, v0, v1, v2);
+            continue;
+        }
+
+        SoftwareVertex polygon[SOFTWARE_MAX_CLIP_VERTICES] = { v0, v1, v2 };
+        const u32 polygonVertexCount = Software_ClipPolygon(polygon, 3);
+        for (u32 j = 1; j + 1 < polygonVertexCount; ++j)
+            Software_SetupTriangle(renderer, draw, polygon[0], polygon[j], polygon[j + 1]);
+    }
+}
+
+//
+// Pixels
+//
+
+// Bilinear and clamped to the edges, like the engine textures without mipmaps
+static vec3 Software_SampleTexture(const SoftwareTexture& texture, f32 u, f32 v)
+{
+    if (!texture.data)
+        return vec3(1.0f);
+
+    const ivec2 size = texture.size;
+    f32 tx = u * size.x - 0.5f;
+    f32 ty = v * size.y - 0.5f;
+    tx = tx >= 0.0f ? min(tx, (f32)(size.x - 1)) : 0.0f; // Also catches NaNs
+    ty = ty >= 0.0f ? min(ty, (f32)(size.y - 1)) : 0.0f;
+
+    const i32 x0 = (i32)tx;
+    const i32 y0 = (i32)ty;
+    const i32 x1 = min(x0 + 1, size.x - 1);
+    const i32 y1 = min(y0 + 1, size.y - 1);
+    const f32 fx = tx - x0;
+    const f32 fy = ty - y0;
+
+    const u32 channelCount = texture.channelCount;
+    const u8* t00 = texture.data + ((u64)y0 * size.x + x0) * channelCount;
+    const u8* t10 = texture.data + ((u64)y0 * size.x + x1) * channelCount;
+    const u8* t01 = texture.data + ((u64)y1 * size.x + x0) * channelCount;
+    const u8* t11 = texture.data + ((u64)y1 * size.x + x1) * channelCount;
+
+    vec3 texel;
+    for (u32 c = 0; c < 3; ++c)
+    {
+        const f32 top = t00[c] + (t10[c] - t00[c]) * fx;
+        const f32 bottom = t01[c] + (t11[c] - t01[c]) * fx;
+        texel[c] = (top + (bottom - top) * fy) * (1.0f / 255.0f);
+    }
+    return texel;
+}
+
+static u8 Software_PackChannel(f32 value)
+{
+    return (u8)(clamp(value, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+// Lengths of the vectors of 8 lanes, clamped away from zero as in the shaders
+static void Software_Length(const f32x8& x, const f32x8& y, const f32x8& z, f32x8& length)
+{
+    const f32x8 lengthSquared = x * x + y * y + z * z;
+    for (u32 i = 0; i < SOFTWARE_LANES; ++i)
+        length[i] = max(sqrtf(lengthSquared[i]), 1e-20f);
+}
+
+static void Software_Normalize(f32x8& x, f32x8& y, f32x8& z)
+{
+    f32x8 length;
+    Software_Length(x, y, z, length);
+    const f32x8 invLength = 1.0f / length;
+    x *= invLength;
+    y *= invLength;
+    z *= invLength;
+}
+
+// Depth tests and shades 8 pixels of a row starting at x, the lanes in [laneBegin, laneEnd) are
+// within the triangle bounds. Returns the number of pixels written.
+static u32 Software_ShadeRow(SoftwareRenderer* renderer, const SoftwareDraw& draw, const SoftwareTriangle& triangle,
+                             const SoftwareEdges& edges, i32 x, i32 y, u32 laneBegin, u32 laneEnd)
+{
+    const i64x8 lane = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    f32* depth = &renderer->depthBuffer[y * renderer->depthPitch + x];
+    const f32 invArea = 1.0f / (f32)triangle.area;
+
+    // Coverage and depth test
+    const i64x8 e0 = edges.value[0] + edges.stepX[0] * lane;
+    const i64x8 e1 = edges.value[1] + edges.stepX[1] * lane;
+    const i64x8 e2 = edges.value[2] + edges.stepX[2] * lane;
+    const i64x8 isInside = ((e0 | e1 | e2) >= 0) & (lane >= (i64)laneBegin) & (lane < (i64)laneEnd);
+
+    const f32x8 w0 = __builtin_convertvector(e0, f32x8) * invArea;
+    const f32x8 w1 = __builtin_convertvector(e1, f32x8) * invArea;
+    const f32x8 w2 = __builtin_convertvector(e2, f32x8) * invArea;
+    const f32x8 z = w0 * triangle.z[0] + w1 * triangle.z[1] + w2 * triangle.z[2];
+
+    f32x8 depthRow;
+    memcpy(&depthRow, depth, sizeof(depthRow));
+    const i32x8 isWritten = __builtin_convertvector(isInside, i32x8) & (z < depthRow);
+
+    u32 writtenCount = 0;
+    for (u32 i = 0; i < SOFTWARE_LANES; ++i)
+        writtenCount += isWritten[i] != 0;
+    if (writtenCount == 0)
+        return 0;
+
+    // Perspective-correct attributes
+    const f32x8 w = 1.0f / (w0 * triangle.invW[0] + w1 * triangle.invW[1] + w2 * triangle.invW[2]);
+    const f32x8 b0 = w0 * w, b1 = w1 * w, b2 = w2 * w;
+    const f32x8 px = b0 * triangle.position[0].x + b1 * triangle.position[1].x + b2 * triangle.position[2].x;
+    const f32x8 py = b0 * triangle.position[0].y + b1 * triangle.position[1].y + b2 * triangle.position[2].y;
+    const f32x8 pz = b0 * triangle.position[0].z + b1 * triangle.position[1].z + b2 * triangle.position[2].z;
+    f32x8 nx = b0 * triangle.normal[0].x + b1 * triangle.normal[1].x + b2 * triangle.normal[2].x;
+    f32x8 ny = b0 * triangle.normal[0].y + b1 * triangle.normal[1].y + b2 * triangle.normal[2].y;
+    f32x8 nz = b0 * triangle.normal[0].z + b1 * triangle.normal[1].z + b2 * triangle.normal[2].z;
+    const f32x8 u = b0 * triangle.texCoord[0].x + b1 * triangle.texCoord[1].x + b2 * triangle.texCoord[2].x;
+    const f32x8 v = b0 * triangle.texCoord[0].y + b1 * triangle.texCoord[1].y + b2 * triangle.texCoord[2].y;
+
+    // Albedo, one texture fetch per lane
+    f32x8 ar = {}, ag = {}, ab = {};
+    for (u32 i = 0; i < SOFTWARE_LANES; ++i)
+    {
+        if (!isWritten[i])
+            continue;
+        const vec3 albedo = Software_SampleTexture(draw.albedo, u[i], v[i]);
+        ar[i] = albedo.r;
+        ag[i] = albedo.g;
+        ab[i] = albedo.b;
+    }
+
+    // N and V
+    const vec3 cameraPosition = renderer->cameraPosition;
+    Software_Normalize(nx, ny, nz);
+    f32x8 vx = cameraPosition.x - px;
+    f32x8 vy = cameraPosition.y - py;
+    f32x8 vz = cameraPosition.z - pz;
+    Software_Normalize(vx, vy, vz);
+
+    // Forward shading material model
+    const f32 ambientFactor = 0.05f;
+    f32x8 cr = ambientFactor * ar;
+    f32x8 cg = ambientFactor * ag;
+    f32x8 cb = ambientFactor * ab;
+
+    for (u32 lightIdx = 0; lightIdx < renderer->lightCount; ++lightIdx)
+    {
+        const Light& light = renderer->lights[lightIdx];
+
+        // Scalars are broadcast by adding them to zero
+        const f32x8 zero = {};
+        f32x8 lx = zero + light.direction.x, ly = zero + light.direction.y, lz = zero + light.direction.z;
+        f32x8 attenuationFactor = zero + 1.0f;
+        if (light.type == LightType_Point)
+        {
+            lx = light.position.x - px;
+            ly = light.position.y - py;
+            lz = light.position.z - pz;
+            f32x8 distance;
+            Software_Length(lx, ly, lz, distance);
+            lx /= distance;
+            ly /= distance;
+            lz /= distance;
+            attenuationFactor = 1.0f / distance;
+        }
+
+        f32x8 hx = vx + lx, hy = vy + ly, hz = vz + lz;
+        Software_Normalize(hx, hy, hz);
+
+        const f32x8 nDotL = lx * nx + ly * ny + lz * nz;
+        const f32x8 nDotH = hx * nx + hy * ny + hz * nz;
+        f32x8 diffuseFactor, specularFactor;
+        for (u32 i = 0; i < SOFTWARE_LANES; ++i)
+        {
+            diffuseFactor[i] = max(0.0f, nDotL[i]);
+            specularFactor[i] = powf(max(0.0f, nDotH[i]), 100.0f);
+        }
+        diffuseFactor = 0.7f * diffuseFactor * attenuationFactor;
+        specularFactor = 0.3f * specularFactor * attenuationFactor;
+        cr += (diffuseFactor * ar + specularFactor) * light.color.r;
+        cg += (diffuseFactor * ag + specularFactor) * light.color.g;
+        cb += (diffuseFactor * ab + specularFactor) * light.color.b;
+    }
+
+    u8* color = &renderer->colorBuffer[((u64)y * renderer->size.x + x) * 4];
+    for (u32 i = 0; i < SOFTWARE_LANES; ++i)
+    {
+        if (!isWritten[i])
+            continue;
+        depth[i] = z[i];
+        color[i * 4 + 0] = Software_PackChannel(cr[i]);
+        color[i * 4 + 1] = Software_PackChannel(cg[i]);
+        color[i * 4 + 2] = Software_PackChannel(cb[i]);
+        color[i * 4 + 3] = 255;
+    }
+
+    return writtenCount;
+}
+
+static f32 Software_UpdateBlockMaxDepth(SoftwareRenderer* renderer, i32 blockX, i32 blockY)
+{
+    const f32* depth = &renderer->depthBuffer[blockY * SOFTWARE_BLOCK_SIZE * renderer->depthPitch + blockX * SOFTWARE_BLOCK_SIZE];
+    f32 maxDepth = 0.0f;
+    for (u32 row = 0; row < SOFTWARE_BLOCK_SIZE; ++row)
+        for (u32 i = 0; i < SOFTWARE_BLOCK_SIZE; ++i)
+            maxDepth = max(maxDepth, depth[row * renderer->depthPitch + i]);
+    renderer->blockMaxDepth[blockY * renderer->blockPitch + blockX] = maxDepth;
+    return maxDepth;
+}
+
+// Tile job: clears the tile and rasterizes the triangles binned to it, in draw order
+static void Software_RasterizeTile(void* data, u32 tileIdx, u32 threadIdx)
+{
+    SoftwareRenderer* renderer = (SoftwareRenderer*)data;
+
+    const i32 tileX = tileIdx % renderer->tileCount.x;
+    const i32 tileY = tileIdx / renderer->tileCount.x;
+    const i32 x0 = tileX * SOFTWARE_TILE_SIZE;
+    const i32 y0 = tileY * SOFTWARE_TILE_SIZE;
+    const i32 x1 = min(x0 + SOFTWARE_TILE_SIZE, renderer->size.x) - 1;
+    const i32 y1 = min(y0 + SOFTWARE_TILE_SIZE, renderer->size.y) - 1;
+    const i32 blockX0 = x0 / SOFTWARE_BLOCK_SIZE;
+    const i32 blockY0 = y0 / SOFTWARE_BLOCK_SIZE;
+    const i32 blockX1 = x1 / SOFTWARE_BLOCK_SIZE;
+    const i32 blockY1 = y1 / SOFTWARE_BLOCK_SIZE;
+
+    // Clear, the depth padding to the nearest depth so the block maxima ignore it. No triangle
+    // covers it.
+    const u8 clearColor[4] = { Software_PackChannel(SoftwareClearColor[0]), Software_PackChannel(SoftwareClearColor[1]), Software_PackChannel(SoftwareClearColor[2]), 255 };
+    for (i32 y = y0; y <= y1; ++y)
+    {
+        u8* color = &renderer->colorBuffer[((u64)y * renderer->size.x + x0) * 4];
+        for (i32 x = x0; x <= x1; ++x, color += 4)
+            memcpy(color, clearColor, 4);
+    }
+    for (i32 y = y0; y < (blockY1 + 1) * SOFTWARE_BLOCK_SIZE; ++y)
+    {
+        f32* depth = &renderer->depthBuffer[y * renderer->depthPitch];
+        for (i32 x = x0; x < (blockX1 + 1) * SOFTWARE_BLOCK_SIZE; ++x)
+            depth[x] = x <= x1 && y <= y1 ? SoftwareClearDepth : 0.0f;
+    }
+    for (i32 blockY = blockY0; blockY <= blockY1; ++blockY)
+        for (i32 blockX = blockX0; blockX <= blockX1; ++blockX)
+            renderer->blockMaxDepth[blockY * renderer->blockPitch + blockX] = SoftwareClearDepth;
+    f32& tileMaxDepth = renderer->tileMaxDepth[tileIdx];
+    tileMaxDepth = SoftwareClearDepth;
+
+    u64 pixelCount = 0;
+    for (u32 entryIdx = renderer->tileOffsets[tileIdx]; entryIdx < renderer->tileOffsets[tileIdx + 1]; ++entryIdx)
+    {
+        const SoftwareTileEntry& entry = renderer->tileEntries[entryIdx];
+        const SoftwareDraw& draw = renderer->draws[entry.drawIdx];
+        const SoftwareTriangle& triangle = draw.triangles[entry.triangleIdx];
+
+        // Behind everything in the tile
+        if (triangle.minZ >= tileMaxDepth)
+            continue;
+
+        const i32 minX = max(triangle.minX, x0);
+        const i32 minY = max(triangle.minY, y0);
+        const i32 maxX = min(triangle.maxX, x1);
+        const i32 maxY = min(triangle.maxY, y1);
+
+        bool isTileWritten = false;
+        for (i32 blockY = minY / SOFTWARE_BLOCK_SIZE; blockY <= maxY / SOFTWARE_BLOCK_SIZE; ++blockY)
+        {
+            for (i32 blockX = minX / SOFTWARE_BLOCK_SIZE; blockX <= maxX / SOFTWARE_BLOCK_SIZE; ++blockX)
+            {
+                if (triangle.minZ >= renderer->blockMaxDepth[blockY * renderer->blockPitch + blockX])
+                    continue;
+
+                const i32 bx = blockX * SOFTWARE_BLOCK_SIZE;
+                const i32 by = blockY * SOFTWARE_BLOCK_SIZE;
+                const i32 rowBegin = max(by, minY);
+                const i32 rowEnd = min(by + SOFTWARE_BLOCK_SIZE - 1, maxY);
+                const u32 laneBegin = max(bx, minX) - bx;
+                const u32 laneEnd = min(bx + SOFTWARE_BLOCK_SIZE - 1, maxX) - bx + 1;
+                if (Software_IsRectOutside(triangle, bx + laneBegin, rowBegin, bx + laneEnd - 1, rowEnd))
+                    continue;
+
+                SoftwareEdges edges;
+                Software_SetupEdges(triangle, bx, rowBegin, edges);
+
+                u32 blockPixelCount = 0;
+                for (i32 y = rowBegin; y <= rowEnd; ++y)
+                {
+                    blockPixelCount += Software_ShadeRow(renderer, draw, triangle, edges, bx, y, laneBegin, laneEnd);
+                    for (u32 k = 0; k < 3; ++k)
+                        edges.value[k] += edges.stepY[k];
+                }
+
+                if (blockPixelCount > 0)
+                {
+                    Software_UpdateBlockMaxDepth(renderer, blockX, blockY);
+                    pixelCount += blockPixelCount;
+                    isTileWritten = true;
+                }
+            }
+        }
+
+        if (isTileWritten)
+        {
+            f32 maxDepth = 0.0f;
+            for (i32 blockY = blockY0; blockY <= blockY1; ++blockY)
+                for (i32 blockX = blockX0; blockX <= blockX1; ++blockX)
+                    maxDepth = max(maxDepth, renderer->blockMaxDepth[blockY * renderer->blockPitch + blockX]);
+            tileMaxDepth = maxDepth;
+        }
+    }
+
+    renderer->threadPixels[threadIdx] += pixelCount;
+}
+
+//
+// Frame
+//
+
+static void Software_ResizeTargets(SoftwareRenderer* renderer, ivec2 size)
+{
+    const ivec2 blockCount = (size + SOFTWARE_BLOCK_SIZE - 1) / SOFTWARE_BLOCK_SIZE;
+
+    renderer->size = size;
+    renderer->tileCount = (size + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+    renderer->depthPitch = blockCount.x * SOFTWARE_BLOCK_SIZE;
+    renderer->blockPitch = blockCount.x;
+    renderer->colorBuffer.resize((u64)size.x * size.y * 4);
+    renderer->depthBuffer.resize((u64)renderer->depthPitch * blockCount.y * SOFTWARE_BLOCK_SIZE);
+    renderer->blockMaxDepth.resize((u64)blockCount.x * blockCount.y);
+    renderer->tileMaxDepth.resize((u64)renderer->tileCount.x * renderer->tileCount.y);
+    renderer->tileOffsets.resize(renderer->tileMaxDepth.size() + 1);
+}
+
+static SoftwareTexture Software_GetTexture(const Device& device, u32 textureIdx)
+{
+    SoftwareTexture texture = {};
+    texture.data = Null_GetTextureData(device.textures[textureIdx].handle, &texture.size, &texture.channelCount);
+    return texture;
+}
+
+static u64 Software_AddDraw(SoftwareRenderer* renderer, const Device& device, const Entity& entity, u32 meshIdx, u32 submeshIdx, u32 materialIdx)
+{
+    const Mesh& mesh = device.meshes[meshIdx];
+    const Submesh& submesh = mesh.submeshes[submeshIdx];
+
+    u64 vertexBufferSize, indexBufferSize;
+    const u8* vertexData = Null_GetBufferData(device.vertexBuffers[mesh.vertexBufferIdx].handle, &vertexBufferSize);
+    const u8* indexData = Null_GetBufferData(device.indexBuffers[mesh.indexBufferIdx].handle, &indexBufferSize);
+    ASSERT(vertexData && submesh.vertexOffset + (u64)submesh.vertexCount * submesh.vertexBufferLayout.stride <= vertexBufferSize, "Submesh vertices out of the vertex buffer");
+    ASSERT(indexData && submesh.indexOffset + (u64)submesh.indexCount * sizeof(u32) <= indexBufferSize, "Submesh indices out of the index buffer");
+
+    if (renderer->drawCount == renderer->draws.size())
+        renderer->draws.resize(renderer->drawCount + 1);
+
+    SoftwareDraw& draw = renderer->draws[renderer->drawCount++];
+    draw.worldMatrix = entity.worldMatrix;
+    draw.submesh = &submesh;
+    draw.vertexData = vertexData;
+    draw.indices = (const u32*)(indexData + submesh.indexOffset);
+    draw.albedo = Software_GetTexture(device, device.materials[materialIdx].albedoTextureIdx);
+
+    return submesh.indexCount / 3;
+}
+
+// Concatenates the bin entries of all the draws per tile, keeping the draw order
+static void Software_SortBins(SoftwareRenderer* renderer)
+{
+    CPU_PROFILE_FUNCTION();
+
+    std::vector<u32>& tileOffsets = renderer->tileOffsets;
+    const u32 tileCount = tileOffsets.size() - 1;
+
+    for (u32 i = 0; i <= tileCount; ++i)
+        tileOffsets[i] = 0;
+    for (u32 drawIdx = 0; drawIdx < renderer->drawCount; ++drawIdx)
+        for (const SoftwareBinEntry& binEntry : renderer->draws[drawIdx].binEntries)
+            tileOffsets[binEntry.tileIdx + 1]++;
+    for (u32 i = 0; i < tileCount; ++i)
+        tileOffsets[i + 1] += tileOffsets[i];
+
+    // tileOffsets[i + 1] is the next free entry of tile i while filling, and ends as its end
+    renderer->tileEntries.resize(tileOffsets[tileCount]);
+    for (u32 i = tileCount; i > 0; --i)
+        tileOffsets[i] = tileOffsets[i - 1];
+    for (u32 drawIdx = 0; drawIdx < renderer->drawCount; ++drawIdx)
+        for (const SoftwareBinEntry& binEntry : renderer->draws[drawIdx].binEntries)
+            renderer->tileEntries[tileOffsets[binEntry.tileIdx + 1]++] = SoftwareTileEntry{ drawIdx, binEntry.triangleIdx };
+}
+
+SoftwareRenderer* Software_Create()
+{
+    SoftwareRenderer* renderer = new SoftwareRenderer();
+    ILOG("Software rasterizer: %ux%u tiles, %u-wide rows", SOFTWARE_TILE_SIZE, SOFTWARE_TILE_SIZE, SOFTWARE_LANES);
+    return renderer;
+}
+
+void Software_Destroy(SoftwareRenderer* renderer)
+{
+    Null_SetFramebufferImage(NULL, ivec2(0));
+    delete renderer;
+}
+
+SoftwareFrameStats Software_Render(SoftwareRenderer* renderer, App* app, bool cullBackFaces)
+{
+    CPU_PROFILE_FUNCTION();
+    const u64 beginNs = GetProfileTimeNs();
+
+    SoftwareFrameStats stats = {};
+
+    const ivec2 size = app->displaySize;
+    if (size.x <= 0 || size.y <= 0)
+        return stats;
+    if (size != renderer->size)
+        Software_ResizeTargets(renderer, size);
+
+    const Device& device = app->device;
+    const Scene& scene = app->scene;
+
+    renderer->viewProjectionMatrix = scene.mainCamera.viewProjectionMatrix;
+    renderer->cameraPosition = scene.mainCamera.position;
+    renderer->lightCount = scene.lightCount;
+    for (u32 i = 0; i < scene.lightCount; ++i)
+        renderer->lights[i] = scene.lights[i];
+    renderer->cullBackFaces = cullBackFaces;
+
+    // Same draws and materials as the forward shading path
+    renderer->drawCount = 0;
+    for (u32 entityIdx = 0; entityIdx < scene.entityCount; ++entityIdx)
+    {
+        const Entity& entity = scene.entities[entityIdx];
+        const u32 meshIdx = HIGH_WORD(entity.meshSubmeshIdx);
+
+        switch (entity.type)
+        {
+            case EntityType_Mesh:
+                stats.triangles += Software_AddDraw(renderer, device, entity, meshIdx, LOW_WORD(entity.meshSubmeshIdx), app->embedded.defaultMaterialIdx);
+                break;
+
+            case EntityType_Model:
+                {
+                    const Mesh& mesh = device.meshes[meshIdx];
+                    for (u32 submeshIdx = 0; submeshIdx < mesh.submeshes.size(); ++submeshIdx)
+                        stats.triangles += Software_AddDraw(renderer, device, entity, meshIdx, submeshIdx, mesh.materialIndices[submeshIdx]);
+                }
+                break;
+        }
+    }
+
+    Jobs_ParallelFor(app->jobs, renderer->drawCount, Software_ProcessDraw, renderer);
+
+    Software_SortBins(renderer);
+
+    for (u32 i = 0; i < MAX_JOB_THREADS; ++i)
+        renderer->threadPixels[i] = 0;
+    Jobs_ParallelFor(app->jobs, renderer->tileMaxDepth.size(), Software_RasterizeTile, renderer);
+    for (u32 i = 0; i < MAX_JOB_THREADS; ++i)
+        stats.pixels += renderer->threadPixels[i];
+
+    Null_SetFramebufferImage(renderer->colorBuffer.data(), size);
+
+    stats.timeMs = (GetProfileTimeNs() - beginNs) / 1000000.0f;
+    return stats;
+}
+
+#endif // USE_GFX_API_SOFTWARE
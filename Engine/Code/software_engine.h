@@ -0,0 +1,18 @@
+#pragma once
+
+#include "engine.h"
+
+struct SoftwareFrameStats
+{
+    u64 triangles; // Fetched from the index buffers, before culling and clipping
+    u64 pixels;    // Shaded, after the depth test
+    f32 timeMs;
+};
+
+SoftwareRenderer* Software_Create();
+
+void Software_Destroy(SoftwareRenderer* renderer);
+
+// Rasterizes the scene with the forward shading material model into the image glReadPixels
+// returns from the default framebuffer, spreading the work across the jobs of the app
+SoftwareFrameStats Software_Render(SoftwareRenderer* renderer, App* app, bool cullBackFaces);
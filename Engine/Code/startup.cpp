@@ -0,0 +1,427 @@
+//
+// startup.cpp : Startup task graph. Init first runs the tasks that only read and decode files
+// (images, and model imports with their geometry) on the job threads, in waves of the tasks whose
+// dependencies are done, and then the steps that create GL objects one after the other on the
+// main thread. Those steps find the decoded files here instead of loading them again. Every task
+// is timed and Startup_End reports the timeline with its critical path.
+//
+
+#define MAX_STARTUP_IMAGES 64
+#define MAX_STARTUP_MODELS 4
+
+struct StartupImage
+{
+    char          filepath[256];
+    TextureRole   role;
+    CookedTexture cooked; // Read instead of decoding the image if the texture is cooked
+    Image         image;  // No pixels if the decode failed, LoadTexture2D then loads it again and logs why
+};
+
+struct StartupModel
+{
+    char           filepath[256];
+    const aiScene* scene;    // Kept for the materials, LoadModel creates their textures
+    Mesh           mesh;     // Submeshes extracted and optimized, material indices start at 0
+    Arena          vertices;
+    Arena          indices;
+    u32            taskIdx;  // Of the import, the texture decodes depend on it
+};
+
+// Decoded by the worker tasks, released by Startup_End
+struct StartupFiles
+{
+    StartupImage images[MAX_STARTUP_IMAGES];
+    u32          imageCount;
+    StartupModel models[MAX_STARTUP_MODELS];
+    u32          modelCount;
+};
+
+static StartupFiles gStartupFiles = {};
+static std::mutex   gStartupMutex; // Worker tasks add tasks and files as well
+
+// Texture types loaded by ProcessAssimpMaterial, and their roles
+static const aiTextureType AssimpTextureTypes[] = {
+    aiTextureType_DIFFUSE,
+    aiTextureType_EMISSIVE,
+    aiTextureType_SPECULAR,
+    aiTextureType_NORMALS,
+    aiTextureType_HEIGHT,
+};
+
+static const TextureRole AssimpTextureRoles[] = {
+    TextureRole_Albedo,
+    TextureRole_Emissive,
+    TextureRole_Mask,
+    TextureRole_Normal,
+    TextureRole_Mask,
+};
+CASSERT(ARRAY_COUNT(AssimpTextureRoles) == ARRAY_COUNT(AssimpTextureTypes), "");
+
+// Defined with the rest of the model loading, in engine.cpp
+void ProcessAssimpNode(const aiScene* scene, aiNode *node, Mesh *myMesh, u32 baseMeshMaterialIdx, std::vector<u32>& submeshMaterialIndices, Arena& vertexArena, Arena& indexArena);
+
+static void CountAssimpGeometry(const aiScene* scene, const aiNode* node, u32& vertexCount, u32& indexCount)
+{
+    for (unsigned int i = 0; i < node->mNumMeshes; ++i)
+    {
+        const aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
+        vertexCount += mesh->mNumVertices;
+        indexCount += mesh->mNumFaces * 3;
+    }
+    for (unsigned int i = 0; i < node->mNumChildren; ++i)
+        CountAssimpGeometry(scene, node->mChildren[i], vertexCount, indexCount);
+}
+
+// Path of a file referenced by a model, built like ProcessAssimpMaterial does with MakePath
+// but without the frame arena, so that loader threads can use it too
+static void MakeModelRelativePath(char* path, u32 pathSize, const char* modelFilepath, const char* filename)
+{
+    i32 directoryLen = (i32)strlen(modelFilepath);
+    while (directoryLen > 0 && modelFilepath[directoryLen - 1] != '/' && modelFilepath[directoryLen - 1] != '\\')
+        directoryLen--;
+
+    if (directoryLen > 0)
+        snprintf(path, pathSize, "%.*s/%s", directoryLen - 1, modelFilepath, filename);
+    else
+        snprintf(path, pathSize, "%s", filename);
+}
+
+static u32 Startup_AddTask(Startup& startup, const char* name, StartupTaskQueue queue, StartupTaskFunc func, void* data,
+                           u32 dependencyIdx = UINT32_MAX)
+{
+    std::lock_guard<std::mutex> lock(gStartupMutex);
+    ASSERT(startup.taskCount < MAX_STARTUP_TASKS, "Max number of startup tasks reached");
+
+    const u32 taskIdx = startup.taskCount++;
+    StartupTask& task = startup.tasks[taskIdx];
+    task = {};
+    snprintf(task.name, sizeof(task.name), "%s", name);
+    task.queue = queue;
+    task.func = func;
+    task.data = data;
+    if (dependencyIdx != UINT32_MAX)
+        task.dependencies[task.dependencyCount++] = dependencyIdx;
+    return taskIdx;
+}
+
+static void Startup_DecodeImageTask(Startup& startup, void* data)
+{
+    StartupImage& file = *(StartupImage*)data;
+
+    if (startup.useCookedTextures && TextureCooker_LoadCooked(file.filepath, file.role, file.cooked))
+        return;
+
+    // Rows bottom-up, as LoadImage returns them
+    stbi_set_flip_vertically_on_load_thread(true);
+
+    Image& image = file.image;
+    image.pixels = stbi_load(file.filepath, &image.size.x, &image.size.y, &image.nchannels, 0);
+    if (image.pixels)
+        image.stride = image.size.x * image.nchannels;
+}
+
+// Queues the decode of an image, after dependencyIdx if given. Images past the limit are
+// simply loaded by LoadTexture2D later on.
+void Startup_DecodeImage(Startup& startup, const char* filepath, TextureRole role, u32 dependencyIdx = UINT32_MAX)
+{
+    StartupImage* file = NULL;
+    {
+        std::lock_guard<std::mutex> lock(gStartupMutex);
+        for (u32 i = 0; i < gStartupFiles.imageCount; ++i)
+            if (gStartupFiles.images[i].role == role && SameString(gStartupFiles.images[i].filepath, filepath))
+                return;
+        if (gStartupFiles.imageCount == MAX_STARTUP_IMAGES)
+            return;
+
+        file = &gStartupFiles.images[gStartupFiles.imageCount++];
+        snprintf(file->filepath, sizeof(file->filepath), "%s", filepath);
+        file->role = role;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "Decode %s", filepath);
+    Startup_AddTask(startup, name, StartupTaskQueue_Worker, Startup_DecodeImageTask, file, dependencyIdx);
+}
+
+static void Startup_ImportModelTask(Startup& startup, void* data)
+{
+    StartupModel& file = *(StartupModel*)data;
+
+    file.scene = aiImportFile(file.filepath, AssimpImportFlags);
+    if (!file.scene)
+        return;
+
+    // The textures of the materials are decoded in the next waves
+    for (unsigned int i = 0; i < file.scene->mNumMaterials; ++i)
+    {
+        const aiMaterial* material = file.scene->mMaterials[i];
+        for (u32 j = 0; j < ARRAY_COUNT(AssimpTextureTypes); ++j)
+        {
+            aiString filename;
+            if (material->GetTextureCount(AssimpTextureTypes[j]) > 0 &&
+                material->GetTexture(AssimpTextureTypes[j], 0, &filename) == aiReturn_SUCCESS)
+            {
+                char filepath[256];
+                MakeModelRelativePath(filepath, sizeof(filepath), file.filepath, filename.C_Str());
+                Startup_DecodeImage(startup, filepath, AssimpTextureRoles[j], file.taskIdx);
+            }
+        }
+    }
+
+    // While those run, the vertices and indices are extracted and optimized here. Only
+    // creating the buffers and materials is left to LoadModel.
+    u32 vertexCount = 0;
+    u32 indexCount = 0;
+    CountAssimpGeometry(file.scene, file.scene->mRootNode, vertexCount, indexCount);
+
+    // Position, normal, texture coordinates, tangent and bitangent at most, see ProcessAssimpMesh
+    file.vertices = CreateArena(vertexCount * 14 * sizeof(float));
+    file.indices = CreateArena(indexCount * sizeof(u32));
+    ProcessAssimpNode(file.scene, file.scene->mRootNode, &file.mesh, 0, file.mesh.materialIndices, file.vertices, file.indices);
+}
+
+// Queues the import of a model, its geometry extraction, and the decode of its textures once imported
+void Startup_ImportModel(Startup& startup, const char* filepath)
+{
+    StartupModel* file = NULL;
+    {
+        std::lock_guard<std::mutex> lock(gStartupMutex);
+        for (u32 i = 0; i < gStartupFiles.modelCount; ++i)
+            if (SameString(gStartupFiles.models[i].filepath, filepath))
+                return;
+        if (gStartupFiles.modelCount == MAX_STARTUP_MODELS)
+            return;
+
+        file = &gStartupFiles.models[gStartupFiles.modelCount++];
+        snprintf(file->filepath, sizeof(file->filepath), "%s", filepath);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "Import %s", filepath);
+    file->taskIdx = Startup_AddTask(startup, name, StartupTaskQueue_Worker, Startup_ImportModelTask, file);
+}
+
+// Only called once all the worker tasks are done, so no locking. Images are keyed by path and
+// role, the same file is cooked differently for another role.
+static const StartupImage* Startup_FindImageFile(const char* filepath, TextureRole role)
+{
+    for (u32 i = 0; i < gStartupFiles.imageCount; ++i)
+        if (gStartupFiles.images[i].role == role && SameString(gStartupFiles.images[i].filepath, filepath))
+            return &gStartupFiles.images[i];
+    return NULL;
+}
+
+const Image* Startup_FindImage(const char* filepath, TextureRole role)
+{
+    const StartupImage* file = Startup_FindImageFile(filepath, role);
+    return file && file->image.pixels ? &file->image : NULL;
+}
+
+const CookedTexture* Startup_FindCookedTexture(const char* filepath, TextureRole role)
+{
+    const StartupImage* file = Startup_FindImageFile(filepath, role);
+    return file && file->cooked.data ? &file->cooked : NULL;
+}
+
+const StartupModel* Startup_FindModel(const char* filepath)
+{
+    for (u32 i = 0; i < gStartupFiles.modelCount; ++i)
+        if (gStartupFiles.models[i].scene && SameString(gStartupFiles.models[i].filepath, filepath))
+            return &gStartupFiles.models[i];
+    return NULL;
+}
+
+struct StartupWave
+{
+    Startup* startup;
+    u32      taskIndices[MAX_STARTUP_TASKS];
+};
+
+static void Startup_RunWorkerTaskJob(void* data, u32 jobIdx, u32 threadIdx)
+{
+    StartupWave& wave = *(StartupWave*)data;
+    StartupTask& task = wave.startup->tasks[wave.taskIndices[jobIdx]];
+
+    CPU_PROFILE_SCOPE(task.name);
+    task.threadIdx = threadIdx;
+    task.beginNs = GetProfileTimeNs();
+    task.func(*wave.startup, task.data);
+    task.endNs = GetProfileTimeNs();
+}
+
+void Startup_Begin(Startup& startup)
+{
+    startup = {};
+    startup.beginNs = GetProfileTimeNs();
+}
+
+// Runs the queued worker tasks on the job threads, waves of ready tasks until none is left
+void Startup_RunWorkers(Startup& startup, JobSystem* jobs)
+{
+    CPU_PROFILE_FUNCTION();
+
+    startup.threadCount = Jobs_GetThreadCount(jobs);
+
+    StartupWave wave = {};
+    wave.startup = &startup;
+
+    for (;;)
+    {
+        u32 readyCount = 0;
+        for (u32 i = 0; i < startup.taskCount; ++i)
+        {
+            const StartupTask& task = startup.tasks[i];
+            if (task.queue != StartupTaskQueue_Worker || task.isDone)
+                continue;
+
+            bool isReady = true;
+            for (u32 j = 0; j < task.dependencyCount; ++j)
+                isReady = isReady && startup.tasks[task.dependencies[j]].isDone;
+            if (isReady)
+                wave.taskIndices[readyCount++] = i;
+        }
+        if (readyCount == 0)
+            break;
+
+        Jobs_ParallelFor(jobs, readyCount, Startup_RunWorkerTaskJob, &wave);
+
+        for (u32 i = 0; i < readyCount; ++i)
+            startup.tasks[wave.taskIndices[i]].isDone = true;
+    }
+}
+
+// Times a step of Init on the main thread
+struct StartupScope
+{
+    Startup& startup;
+    u32      taskIdx;
+
+    StartupScope(Startup& startup, const char* name) : startup(startup)
+    {
+        taskIdx = Startup_AddTask(startup, name, StartupTaskQueue_Main, NULL, NULL);
+        startup.tasks[taskIdx].beginNs = GetProfileTimeNs();
+    }
+
+    ~StartupScope()
+    {
+        startup.tasks[taskIdx].endNs = GetProfileTimeNs();
+        startup.tasks[taskIdx].isDone = true;
+    }
+};
+
+#define STARTUP_SCOPE(startup, name) const StartupScope startupScope(startup, name); CPU_PROFILE_SCOPE(name)
+
+// Walks back from the task that finished last. A task waited for its dependency that finished
+// last or, without dependencies, for the last task that finished before it began.
+static void Startup_FindCriticalPath(Startup& startup)
+{
+    u32 path[MAX_STARTUP_TASKS];
+    u32 pathCount = 0;
+
+    u32 taskIdx = UINT32_MAX;
+    for (u32 i = 0; i < startup.taskCount; ++i)
+        if (taskIdx == UINT32_MAX || startup.tasks[i].endNs > startup.tasks[taskIdx].endNs)
+            taskIdx = i;
+
+    while (taskIdx != UINT32_MAX && pathCount < MAX_STARTUP_TASKS)
+    {
+        path[pathCount++] = taskIdx;
+        const StartupTask& task = startup.tasks[taskIdx];
+
+        u32 predecessorIdx = UINT32_MAX;
+        for (u32 i = 0; i < task.dependencyCount; ++i)
+        {
+            const u32 dependencyIdx = task.dependencies[i];
+            if (predecessorIdx == UINT32_MAX || startup.tasks[dependencyIdx].endNs > startup.tasks[predecessorIdx].endNs)
+                predecessorIdx = dependencyIdx;
+        }
+        if (task.dependencyCount == 0)
+        {
+            for (u32 i = 0; i < startup.taskCount; ++i)
+            {
+                const StartupTask& other = startup.tasks[i];
+                if (i == taskIdx || other.endNs > task.beginNs)
+                    continue;
+                if (predecessorIdx == UINT32_MAX || other.endNs > startup.tasks[predecessorIdx].endNs)
+                    predecessorIdx = i;
+            }
+        }
+        taskIdx = predecessorIdx;
+    }
+
+    startup.criticalPathCount = pathCount;
+    for (u32 i = 0; i < pathCount; ++i)
+        startup.criticalPath[i] = path[pathCount - 1 - i];
+}
+
+static f32 Startup_Ms(const Startup& startup, u64 timeNs)
+{
+    return (timeNs - startup.beginNs) / 1000000.0f;
+}
+
+// Releases the decoded files and logs the timeline
+void Startup_End(Startup& startup)
+{
+    startup.endNs = GetProfileTimeNs();
+
+    for (u32 i = 0; i < gStartupFiles.imageCount; ++i)
+    {
+        if (gStartupFiles.images[i].image.pixels)
+            stbi_image_free(gStartupFiles.images[i].image.pixels);
+        FreeCookedTexture(gStartupFiles.images[i].cooked);
+    }
+    for (u32 i = 0; i < gStartupFiles.modelCount; ++i)
+    {
+        if (gStartupFiles.models[i].scene)
+            aiReleaseImport(gStartupFiles.models[i].scene);
+        if (gStartupFiles.models[i].vertices.data)
+            DestroyArena(gStartupFiles.models[i].vertices);
+        if (gStartupFiles.models[i].indices.data)
+            DestroyArena(gStartupFiles.models[i].indices);
+    }
+    gStartupFiles = {};
+
+    Startup_FindCriticalPath(startup);
+
+    ILOG("Startup: %.2f ms, %u tasks on %u threads", Startup_Ms(startup, startup.endNs), startup.taskCount, startup.threadCount);
+    for (u32 i = 0; i < startup.taskCount; ++i)
+    {
+        const StartupTask& task = startup.tasks[i];
+
+        bool isCritical = false;
+        for (u32 j = 0; j < startup.criticalPathCount; ++j)
+            isCritical = isCritical || startup.criticalPath[j] == i;
+
+        char thread[16];
+        if (task.queue == StartupTaskQueue_Main)
+            snprintf(thread, sizeof(thread), "main");
+        else
+            snprintf(thread, sizeof(thread), "worker %u", task.threadIdx);
+
+        ILOG("  %c %8.2f %8.2f %8.2f ms  %-9s %s", isCritical ? '*' : ' ',
+             Startup_Ms(startup, task.beginNs), Startup_Ms(startup, task.endNs),
+             (task.endNs - task.beginNs) / 1000000.0f, thread, task.name);
+    }
+
+    f32 criticalTimeMs = 0.0f;
+    for (u32 i = 0; i < startup.criticalPathCount; ++i)
+    {
+        const StartupTask& task = startup.tasks[startup.criticalPath[i]];
+        criticalTimeMs += (task.endNs - task.beginNs) / 1000000.0f;
+    }
+    ILOG("Startup critical path (*): %u tasks, %.2f ms", startup.criticalPathCount, criticalTimeMs);
+}
+
+void Startup_Gui(App* app)
+{
+    const Startup& startup = app->startup;
+
+    ImGui::Text("Init: %.2f ms, first frame after %.2f ms", Startup_Ms(startup, startup.endNs),
+                startup.firstFrameNs ? Startup_Ms(startup, startup.firstFrameNs) : 0.0f);
+    ImGui::Text("Critical path:");
+    for (u32 i = 0; i < startup.criticalPathCount; ++i)
+    {
+        const StartupTask& task = startup.tasks[startup.criticalPath[i]];
+        ImGui::BulletText("%s: %.2f ms", task.name, (task.endNs - task.beginNs) / 1000000.0f);
+    }
+}
@@ -0,0 +1,169 @@
+//
+// texcook.cpp : Offline texture cooker. It builds the platform layer and the engine into its own
+// executable, like microbench.cpp, imports the given models to find their textures and the role
+// of each one in its material, and cooks them on the job threads into the texture cache that the
+// engine reads (see texture_cooker.cpp), together with the embedded textures. Textures cooked
+// already are skipped unless --force is given. Usage: texcook [--force] [model...]
+//
+
+#define PLATFORM_NO_MAIN
+#include "platform.cpp"
+#include "engine.cpp"
+
+#define TEXCOOK_MAX_TEXTURES 1024
+
+struct TexcookTexture
+{
+    char              filepath[256];
+    TextureRole       role;
+    TextureCookResult result;
+    bool              success;
+    u64               timeNs;
+};
+
+struct Texcook
+{
+    TexcookTexture textures[TEXCOOK_MAX_TEXTURES];
+    u32            textureCount;
+    bool           force;
+};
+
+static void Texcook_Add(Texcook& texcook, const char* filepath, TextureRole role)
+{
+    for (u32 i = 0; i < texcook.textureCount; ++i)
+        if (SameString(texcook.textures[i].filepath, filepath) && texcook.textures[i].role == role)
+            return;
+
+    if (texcook.textureCount == TEXCOOK_MAX_TEXTURES)
+    {
+        fprintf(stderr, "texcook: more than %d textures, %s skipped\n", TEXCOOK_MAX_TEXTURES, filepath);
+        return;
+    }
+
+    TexcookTexture& texture = texcook.textures[texcook.textureCount++];
+    snprintf(texture.filepath, sizeof(texture.filepath), "%s", filepath);
+    texture.role = role;
+}
+
+static bool Texcook_AddModel(Texcook& texcook, const char* modelFilepath)
+{
+    const aiScene* scene = aiImportFile(modelFilepath, AssimpImportFlags);
+    if (!scene)
+    {
+        fprintf(stderr, "texcook: could not import %s: %s\n", modelFilepath, aiGetErrorString());
+        return false;
+    }
+
+    for (unsigned int i = 0; i < scene->mNumMaterials; ++i)
+    {
+        const aiMaterial* material = scene->mMaterials[i];
+        for (u32 j = 0; j < ARRAY_COUNT(AssimpTextureTypes); ++j)
+        {
+            aiString filename;
+            if (material->GetTextureCount(AssimpTextureTypes[j]) > 0 &&
+                material->GetTexture(AssimpTextureTypes[j], 0, &filename) == aiReturn_SUCCESS)
+            {
+                char filepath[256];
+                MakeModelRelativePath(filepath, sizeof(filepath), modelFilepath, filename.C_Str());
+                Texcook_Add(texcook, filepath, AssimpTextureRoles[j]);
+            }
+        }
+    }
+
+    aiReleaseImport(scene);
+    return true;
+}
+
+static void Texcook_CookJob(void* data, u32 jobIdx, u32 threadIdx)
+{
+    TexcookTexture& texture = ((Texcook*)data)->textures[jobIdx];
+
+    const u64 beginNs = GetProfileTimeNs();
+    texture.success = TextureCooker_Cook(texture.filepath, texture.role, ((Texcook*)data)->force, texture.result);
+    texture.timeNs = GetProfileTimeNs() - beginNs;
+}
+
+int main(int argc, char** argv)
+{
+    GlobalFrameArena = CreateArena(GLOBAL_FRAME_ARENA_SIZE);
+    GlobalScratchArena = CreateArena(GLOBAL_SCRATCH_ARENA_SIZE);
+
+    Texcook* texcook = new Texcook();
+
+    for (u32 i = 0; i < ARRAY_COUNT(EmbeddedTextures); ++i)
+        Texcook_Add(*texcook, EmbeddedTextures[i].filepath, EmbeddedTextures[i].role);
+
+    bool success = true;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (SameString(argv[i], "--force"))
+        {
+            texcook->force = true;
+        }
+        else if (argv[i][0] != '-')
+        {
+            success = Texcook_AddModel(*texcook, argv[i]) && success;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: texcook [--force] [model...]\n");
+            delete texcook;
+            return EXIT_CODE_BAD_ARGUMENTS;
+        }
+    }
+
+    if (!MakeDirectory(TEXTURE_CACHE_DIRECTORY))
+    {
+        fprintf(stderr, "texcook: could not create the directory %s\n", TEXTURE_CACHE_DIRECTORY);
+        delete texcook;
+        return EXIT_CODE_INIT_FAILED;
+    }
+
+    const u64 beginNs = GetProfileTimeNs();
+    JobSystem* jobs = Jobs_Create(0);
+    Jobs_ParallelFor(jobs, texcook->textureCount, Texcook_CookJob, texcook);
+    Jobs_Destroy(jobs);
+    const u64 timeNs = GetProfileTimeNs() - beginNs;
+
+    // Uncompressed size as the engine would upload the source images, RGBA8 plus a third for mips
+    u64 uncompressedSize = 0;
+    u64 cookedSize = 0;
+    u32 cookedCount = 0;
+    u32 cachedCount = 0;
+
+    printf("%-48s %-8s %-6s %11s %5s %10s %10s %8s %10s\n",
+           "texture", "role", "format", "size", "mips", "source", "cooked", "PSNR", "time");
+    for (u32 i = 0; i < texcook->textureCount; ++i)
+    {
+        const TexcookTexture& texture = texcook->textures[i];
+        const TextureCookResult& result = texture.result;
+        if (!texture.success)
+        {
+            printf("%-48s %-8s failed: %s\n", texture.filepath, TextureRoles[texture.role].name, result.error);
+            success = false;
+            continue;
+        }
+
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", result.size.x, result.size.y);
+        char psnr[32];
+        snprintf(psnr, sizeof(psnr), result.isCached ? "cached" : "%.2f dB", result.psnr);
+        printf("%-48s %-8s %-6s %11s %5u %7.1f KB %7.1f KB %8s %7.1f ms\n",
+               texture.filepath, TextureRoles[texture.role].name, CookedFormats[result.format].name, size,
+               result.levelCount, result.sourceSize / 1024.0f, result.cookedSize / 1024.0f, psnr, texture.timeNs * 1.0e-6);
+
+        uncompressedSize += (u64)result.size.x * result.size.y * 4 * 4 / 3;
+        cookedSize += result.cookedSize;
+        cookedCount += !result.isCached;
+        cachedCount += result.isCached;
+    }
+
+    printf("%u textures (%u cooked, %u cached) in %.1f ms, GPU memory %.2f MB -> %.2f MB\n",
+           texcook->textureCount, cookedCount, cachedCount, timeNs * 1.0e-6,
+           uncompressedSize / (f64)MB(1), cookedSize / (f64)MB(1));
+
+    delete texcook;
+    DestroyArena(GlobalScratchArena);
+    DestroyArena(GlobalFrameArena);
+    return success ? EXIT_CODE_SUCCESS : EXIT_CODE_INIT_FAILED;
+}
@@ -0,0 +1,1097 @@
+//
+// texture_cooker.cpp : Offline cooking of textures into KTX2 files with their whole mip chain
+// block compressed. Mips are box filtered on the CPU in linear space (color textures are
+// decoded from sRGB first, normals are renormalized), and each level is encoded as BC1, BC3,
+// BC5 or BC7 depending on the role of the texture in its material. Cooked files live in
+// TEXTURE_CACHE_DIRECTORY, named after a hash of the source file and the role, so editing a
+// source image simply misses the cache until it is cooked again (texcook.cpp). None of the
+// functions here log nor touch the frame arena, loader threads call them too.
+//
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define TEXTURE_COOKER_SSE2 1
+#endif
+
+#define TEXTURE_CACHE_DIRECTORY "texture_cache"
+#define TEXTURE_COOKER_VERSION  1 // Part of the cache key, bump it whenever the cooked output changes
+
+struct TextureRoleInfo
+{
+    const char* name;
+    bool        isSrgb; // Filtered in linear space and stored sRGB encoded, like the source
+};
+
+static const TextureRoleInfo TextureRoles[] = {
+    { "albedo",   true  },
+    { "emissive", true  },
+    { "normal",   false },
+    { "mask",     false },
+};
+CASSERT(ARRAY_COUNT(TextureRoles) == TextureRole_Count, "");
+
+struct CookedFormatInfo
+{
+    const char* name;
+    u32         blockSize; // Bytes of a 4x4 block
+    u32         vkFormat;
+    u32         vkFormatSrgb;
+    u32         dfdColorModel;
+};
+
+static const CookedFormatInfo CookedFormats[] = {
+    { "BC1",  8, 131, 132, 128 }, // VK_FORMAT_BC1_RGB_UNORM_BLOCK, KHR_DF_MODEL_BC1A
+    { "BC3", 16, 137, 138, 130 }, // VK_FORMAT_BC3_UNORM_BLOCK, KHR_DF_MODEL_BC3
+    { "BC5", 16, 141, 141, 132 }, // VK_FORMAT_BC5_UNORM_BLOCK (no sRGB variant), KHR_DF_MODEL_BC5
+    { "BC7", 16, 145, 146, 134 }, // VK_FORMAT_BC7_UNORM_BLOCK, KHR_DF_MODEL_BC7
+};
+CASSERT(ARRAY_COUNT(CookedFormats) == CookedFormat_Count, "");
+
+static CookedFormat TextureCooker_ChooseFormat(TextureRole role, bool hasAlpha)
+{
+    switch (role)
+    {
+        case TextureRole_Albedo:   return CookedFormat_BC7;
+        case TextureRole_Emissive: return CookedFormat_BC1;
+        case TextureRole_Normal:   return CookedFormat_BC5;
+        default:                   return hasAlpha ? CookedFormat_BC3 : CookedFormat_BC1;
+    }
+}
+
+static ivec2 TextureCooker_LevelSize(ivec2 size, u32 level)
+{
+    return ivec2(max(size.x >> level, 1), max(size.y >> level, 1));
+}
+
+static u32 TextureCooker_LevelByteSize(CookedFormat format, ivec2 levelSize)
+{
+    return ((levelSize.x + 3) / 4) * ((levelSize.y + 3) / 4) * CookedFormats[format].blockSize;
+}
+
+void FreeCookedTexture(CookedTexture& cooked)
+{
+    free(cooked.data);
+    cooked = {};
+}
+
+
+// FILES ///////////////////////////////////////////////////////////////
+
+static u8* TextureCooker_ReadFile(const char* filepath, u32* size)
+{
+    FILE* file = fopen(filepath, "rb");
+    if (!file)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+    const long fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    u8* bytes = fileSize > 0 ? (u8*)malloc(fileSize) : NULL;
+    if (bytes && fread(bytes, fileSize, 1, file) != 1)
+    {
+        free(bytes);
+        bytes = NULL;
+    }
+    fclose(file);
+
+    *size = bytes ? (u32)fileSize : 0;
+    return bytes;
+}
+
+static u64 TextureCooker_Key(const u8* source, u32 sourceSize, TextureRole role)
+{
+    const u32 params[] = { TEXTURE_COOKER_VERSION, (u32)role };
+    const u64 hash = HashBytes(params, sizeof(params));
+    return HashBytes(source, sourceSize, hash);
+}
+
+static void TextureCooker_CachePath(char* path, u32 pathSize, u64 key)
+{
+    snprintf(path, pathSize, TEXTURE_CACHE_DIRECTORY "/%016llx.ktx2", (unsigned long long)key);
+}
+
+
+// KTX2 ////////////////////////////////////////////////////////////////
+
+static const u8 Ktx2Identifier[12] = { 0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+
+struct Ktx2Header
+{
+    u8  identifier[12];
+    u32 vkFormat;
+    u32 typeSize;
+    u32 pixelWidth;
+    u32 pixelHeight;
+    u32 pixelDepth;
+    u32 layerCount;
+    u32 faceCount;
+    u32 levelCount;
+    u32 supercompressionScheme;
+    u32 dfdByteOffset;
+    u32 dfdByteLength;
+    u32 kvdByteOffset;
+    u32 kvdByteLength;
+    u64 sgdByteOffset;
+    u64 sgdByteLength;
+};
+CASSERT(sizeof(Ktx2Header) == 80, "");
+
+struct Ktx2Level
+{
+    u64 byteOffset;
+    u64 byteLength;
+    u64 uncompressedByteLength;
+};
+
+// Basic data format descriptor of the block compressed formats, one sample per 64-bit half of
+// the block
+static u32 Ktx2_WriteDfd(u32* words, const CookedFormatInfo& info, bool isSrgb)
+{
+    u32 sampleChannels[2] = {};
+    u32 sampleCount = 1;
+    if (info.dfdColorModel == 130) // BC3, alpha block then color block
+    {
+        sampleChannels[0] = 15;
+        sampleChannels[1] = 0;
+        sampleCount = 2;
+    }
+    else if (info.dfdColorModel == 132) // BC5, red block then green block
+    {
+        sampleChannels[0] = 0;
+        sampleChannels[1] = 1;
+        sampleCount = 2;
+    }
+    const u32 sampleBits = info.blockSize * 8 / sampleCount;
+    const u32 blockSize = 24 + 16 * sampleCount;
+
+    u32 count = 0;
+    words[count++] = 4 + blockSize;                     // dfdTotalSize
+    words[count++] = 0;                                 // vendorId, descriptorType
+    words[count++] = 2 | (blockSize << 16);             // versionNumber, descriptorBlockSize
+    words[count++] = info.dfdColorModel | (1 << 8) | ((isSrgb ? 2 : 1) << 16); // BT709 primaries
+    words[count++] = 3 | (3 << 8);                      // 4x4 texel blocks
+    words[count++] = info.blockSize;                    // bytesPlane0
+    words[count++] = 0;
+    for (u32 i = 0; i < sampleCount; ++i)
+    {
+        words[count++] = (i * sampleBits) | ((sampleBits - 1) << 16) | (sampleChannels[i] << 24);
+        words[count++] = 0;                             // samplePosition
+        words[count++] = 0;                             // sampleLower
+        words[count++] = UINT32_MAX;                    // sampleUpper
+    }
+    return count * sizeof(u32);
+}
+
+static u32 Ktx2_WriteKeyValue(u8* bytes, const char* key, const char* value)
+{
+    const u32 keyLength = (u32)strlen(key) + 1;
+    const u32 valueLength = (u32)strlen(value) + 1;
+    const u32 length = keyLength + valueLength;
+    memcpy(bytes, &length, sizeof(length));
+    memcpy(bytes + 4, key, keyLength);
+    memcpy(bytes + 4 + keyLength, value, valueLength);
+    const u32 size = Align(4 + length, 4);
+    memset(bytes + 4 + length, 0, size - 4 - length);
+    return size;
+}
+
+// Levels are stored smallest first as the format requires, rows bottom-up as LoadImage returns them
+static bool Ktx2_Write(const char* filepath, const CookedTexture& cooked)
+{
+    const CookedFormatInfo& info = CookedFormats[cooked.format];
+
+    u32 dfd[32];
+    const u32 dfdSize = Ktx2_WriteDfd(dfd, info, cooked.isSrgb);
+
+    u8 kvd[128];
+    u32 kvdSize = 0;
+    kvdSize += Ktx2_WriteKeyValue(kvd + kvdSize, "KTXorientation", "ru");
+    kvdSize += Ktx2_WriteKeyValue(kvd + kvdSize, "KTXwriter", "AGP texture cooker");
+
+    Ktx2Header header = {};
+    memcpy(header.identifier, Ktx2Identifier, sizeof(Ktx2Identifier));
+    header.vkFormat = cooked.isSrgb ? info.vkFormatSrgb : info.vkFormat;
+    header.typeSize = 1;
+    header.pixelWidth = cooked.size.x;
+    header.pixelHeight = cooked.size.y;
+    header.faceCount = 1;
+    header.levelCount = cooked.levelCount;
+    header.dfdByteOffset = sizeof(Ktx2Header) + cooked.levelCount * sizeof(Ktx2Level);
+    header.dfdByteLength = dfdSize;
+    header.kvdByteOffset = header.dfdByteOffset + dfdSize;
+    header.kvdByteLength = kvdSize;
+
+    Ktx2Level levels[TEXTURE_MAX_LEVELS] = {};
+    u64 offset = Align(header.kvdByteOffset + kvdSize, info.blockSize);
+    const u64 levelsOffset = offset;
+    for (i32 level = (i32)cooked.levelCount - 1; level >= 0; --level)
+    {
+        levels[level].byteOffset = offset;
+        levels[level].byteLength = cooked.levelSizes[level];
+        levels[level].uncompressedByteLength = cooked.levelSizes[level];
+        offset += cooked.levelSizes[level];
+    }
+
+    FILE* file = fopen(filepath, "wb");
+    if (!file)
+        return false;
+
+    const u8 padding[16] = {};
+    bool success =
+        fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(levels, sizeof(Ktx2Level), cooked.levelCount, file) == cooked.levelCount &&
+        fwrite(dfd, dfdSize, 1, file) == 1 &&
+        fwrite(kvd, kvdSize, 1, file) == 1 &&
+        fwrite(padding, levelsOffset - (header.kvdByteOffset + kvdSize), 1, file) <= 1;
+    for (i32 level = (i32)cooked.levelCount - 1; level >= 0 && success; --level)
+        success = fwrite(cooked.data + cooked.levelOffsets[level], cooked.levelSizes[level], 1, file) == 1;
+
+    return fclose(file) == 0 && success;
+}
+
+// Parses a KTX2 file written by Ktx2_Write into cooked, with its levels packed level 0 first
+static bool Ktx2_Read(const u8* bytes, u32 size, CookedTexture& cooked)
+{
+    if (size < sizeof(Ktx2Header))
+        return false;
+
+    Ktx2Header header;
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.identifier, Ktx2Identifier, sizeof(Ktx2Identifier)) != 0 ||
+        header.pixelWidth == 0 || header.pixelHeight == 0 || header.pixelDepth != 0 ||
+        header.layerCount != 0 || header.faceCount != 1 || header.supercompressionScheme != 0 ||
+        header.levelCount == 0 || header.levelCount > TEXTURE_MAX_LEVELS ||
+        size < sizeof(Ktx2Header) + header.levelCount * sizeof(Ktx2Level))
+        return false;
+
+    cooked = {};
+    cooked.format = CookedFormat_Count;
+    for (u32 i = 0; i < CookedFormat_Count; ++i)
+    {
+        if (header.vkFormat == CookedFormats[i].vkFormat || header.vkFormat == CookedFormats[i].vkFormatSrgb)
+        {
+            cooked.format = (CookedFormat)i;
+            cooked.isSrgb = header.vkFormat != CookedFormats[i].vkFormat;
+        }
+    }
+    if (cooked.format == CookedFormat_Count)
+        return false;
+
+    cooked.size = ivec2(header.pixelWidth, header.pixelHeight);
+    cooked.levelCount = header.levelCount;
+
+    Ktx2Level levels[TEXTURE_MAX_LEVELS];
+    memcpy(levels, bytes + sizeof(Ktx2Header), header.levelCount * sizeof(Ktx2Level));
+    for (u32 level = 0; level < cooked.levelCount; ++level)
+    {
+        const u32 levelSize = TextureCooker_LevelByteSize(cooked.format, TextureCooker_LevelSize(cooked.size, level));
+        if (levels[level].byteLength != levelSize || levelSize > size || levels[level].byteOffset > size - levelSize)
+            return false;
+        cooked.levelOffsets[level] = cooked.dataSize;
+        cooked.levelSizes[level] = levelSize;
+        cooked.dataSize += levelSize;
+    }
+
+    cooked.data = (u8*)malloc(cooked.dataSize);
+    for (u32 level = 0; level < cooked.levelCount; ++level)
+        memcpy(cooked.data + cooked.levelOffsets[level], bytes + levels[level].byteOffset, cooked.levelSizes[level]);
+    return true;
+}
+
+// Looks for the cooked version of the image at sourcePath, only found if the source did not
+// change since it was cooked with the same role
+bool TextureCooker_LoadCooked(const char* sourcePath, TextureRole role, CookedTexture& cooked)
+{
+    u32 sourceSize = 0;
+    u8* source = TextureCooker_ReadFile(sourcePath, &sourceSize);
+    if (!source)
+        return false;
+
+    char cachePath[256];
+    TextureCooker_CachePath(cachePath, sizeof(cachePath), TextureCooker_Key(source, sourceSize, role));
+    free(source);
+
+    u32 fileSize = 0;
+    u8* file = TextureCooker_ReadFile(cachePath, &fileSize);
+    if (!file)
+        return false;
+
+    const bool success = Ktx2_Read(file, fileSize, cooked);
+    free(file);
+    return success;
+}
+
+
+// MIP CHAIN ///////////////////////////////////////////////////////////
+
+static f32 SrgbToLinear(f32 c)
+{
+    return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static f32 LinearToSrgb(f32 c)
+{
+    return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+}
+
+// Level 0 as 4 floats per texel: linear color, or the normal in [-1, 1]
+static void TextureCooker_ToFloat(const u8* pixels, u32 texelCount, TextureRole role, f32* texels)
+{
+    f32 srgbToLinear[256];
+    for (u32 i = 0; i < 256; ++i)
+        srgbToLinear[i] = SrgbToLinear(i / 255.0f);
+
+    for (u32 i = 0; i < texelCount; ++i)
+    {
+        const u8* p = pixels + i * 4;
+        f32* t = texels + i * 4;
+        for (u32 c = 0; c < 3; ++c)
+        {
+            if (TextureRoles[role].isSrgb)
+                t[c] = srgbToLinear[p[c]];
+            else if (role == TextureRole_Normal)
+                t[c] = p[c] / 127.5f - 1.0f;
+            else
+                t[c] = p[c] / 255.0f;
+        }
+        t[3] = p[3] / 255.0f;
+    }
+}
+
+// 2x2 box filter, the last row and column are repeated for odd sizes
+static void TextureCooker_Downsample(const f32* src, ivec2 srcSize, f32* dst, ivec2 dstSize)
+{
+    for (i32 y = 0; y < dstSize.y; ++y)
+    {
+        const f32* row0 = src + min(2 * y, srcSize.y - 1) * srcSize.x * 4;
+        const f32* row1 = src + min(2 * y + 1, srcSize.y - 1) * srcSize.x * 4;
+        f32* dstRow = dst + y * dstSize.x * 4;
+        for (i32 x = 0; x < dstSize.x; ++x)
+        {
+            const i32 x0 = min(2 * x, srcSize.x - 1) * 4;
+            const i32 x1 = min(2 * x + 1, srcSize.x - 1) * 4;
+#if TEXTURE_COOKER_SSE2
+            const __m128 sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(row0 + x0), _mm_loadu_ps(row0 + x1)),
+                                          _mm_add_ps(_mm_loadu_ps(row1 + x0), _mm_loadu_ps(row1 + x1)));
+            _mm_storeu_ps(dstRow + x * 4, _mm_mul_ps(sum, _mm_set1_ps(0.25f)));
+#else
+            for (u32 c = 0; c < 4; ++c)
+                dstRow[x * 4 + c] = (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c]) * 0.25f;
+#endif
+        }
+    }
+}
+
+static u8 UnitToU8(f32 value)
+{
+    return (u8)(clamp(value, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+// Back to 8 bits per channel, as the encoders take them
+static void TextureCooker_ToU8(const f32* texels, u32 texelCount, TextureRole role, u8* pixels)
+{
+    for (u32 i = 0; i < texelCount; ++i)
+    {
+        const f32* t = texels + i * 4;
+        u8* p = pixels + i * 4;
+        if (role == TextureRole_Normal)
+        {
+            // Averaged normals are shorter than one
+            const f32 length = sqrtf(t[0] * t[0] + t[1] * t[1] + t[2] * t[2]);
+            const f32 scale = length > 0.0f ? 1.0f / length : 0.0f;
+            for (u32 c = 0; c < 3; ++c)
+                p[c] = UnitToU8(t[c] * scale * 0.5f + 0.5f);
+        }
+        else
+        {
+            for (u32 c = 0; c < 3; ++c)
+                p[c] = UnitToU8(TextureRoles[role].isSrgb ? LinearToSrgb(t[c]) : t[c]);
+        }
+        p[3] = UnitToU8(t[3]);
+    }
+}
+
+
+// BLOCK ENCODERS //////////////////////////////////////////////////////
+
+// Principal axis of the first channelCount channels of the block, by power iteration on its
+// covariance matrix
+static void TextureCooker_PrincipalAxis(const u8 block[16][4], u32 channelCount, f32 mean[4], f32 axis[4])
+{
+    for (u32 c = 0; c < 4; ++c)
+    {
+        mean[c] = 0.0f;
+        for (u32 i = 0; i < 16; ++i)
+            mean[c] += block[i][c];
+        mean[c] /= 16.0f;
+    }
+
+    f32 covariance[4][4] = {};
+    for (u32 i = 0; i < 16; ++i)
+        for (u32 a = 0; a < channelCount; ++a)
+            for (u32 b = 0; b < channelCount; ++b)
+                covariance[a][b] += (block[i][a] - mean[a]) * (block[i][b] - mean[b]);
+
+    for (u32 c = 0; c < 4; ++c)
+        axis[c] = c < channelCount ? 1.0f : 0.0f;
+
+    for (u32 iteration = 0; iteration < 8; ++iteration)
+    {
+        f32 next[4] = {};
+        f32 length = 0.0f;
+        for (u32 a = 0; a < channelCount; ++a)
+        {
+            for (u32 b = 0; b < channelCount; ++b)
+                next[a] += covariance[a][b] * axis[b];
+            length = max(length, fabsf(next[a]));
+        }
+        if (length == 0.0f)
+            break; // Flat block, any axis will do
+        for (u32 a = 0; a < channelCount; ++a)
+            axis[a] = next[a] / length;
+    }
+}
+
+// Endpoints at the extremes of the projections on the principal axis, inset by 1/16 of the range
+// so that the outliers do not waste the interpolated values
+static void TextureCooker_AxisEndpoints(const u8 block[16][4], u32 channelCount, f32 e0[4], f32 e1[4])
+{
+    f32 mean[4], axis[4];
+    TextureCooker_PrincipalAxis(block, channelCount, mean, axis);
+
+    f32 axisLength2 = 0.0f;
+    for (u32 c = 0; c < channelCount; ++c)
+        axisLength2 += axis[c] * axis[c];
+
+    f32 tMin = 0.0f, tMax = 0.0f;
+    for (u32 i = 0; i < 16; ++i)
+    {
+        f32 t = 0.0f;
+        for (u32 c = 0; c < channelCount; ++c)
+            t += (block[i][c] - mean[c]) * axis[c];
+        tMin = min(tMin, t);
+        tMax = max(tMax, t);
+    }
+    if (axisLength2 > 0.0f)
+    {
+        tMin /= axisLength2;
+        tMax /= axisLength2;
+    }
+
+    const f32 inset = (tMax - tMin) / 16.0f;
+    for (u32 c = 0; c < 4; ++c)
+    {
+        e0[c] = clamp(mean[c] + axis[c] * (tMin + inset), 0.0f, 255.0f);
+        e1[c] = clamp(mean[c] + axis[c] * (tMax - inset), 0.0f, 255.0f);
+    }
+}
+
+// Endpoints that minimize the squared error for the given interpolation weights of e1 (least
+// squares), left untouched if the weights do not determine them
+static void TextureCooker_FitEndpoints(const u8 block[16][4], const f32 weights[16], u32 channelCount, f32 e0[4], f32 e1[4])
+{
+    f32 aa = 0.0f, ab = 0.0f, bb = 0.0f;
+    f32 ax[4] = {}, bx[4] = {};
+    for (u32 i = 0; i < 16; ++i)
+    {
+        const f32 b = weights[i];
+        const f32 a = 1.0f - b;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (u32 c = 0; c < channelCount; ++c)
+        {
+            ax[c] += a * block[i][c];
+            bx[c] += b * block[i][c];
+        }
+    }
+
+    const f32 determinant = aa * bb - ab * ab;
+    if (fabsf(determinant) < 1e-6f)
+        return;
+
+    for (u32 c = 0; c < channelCount; ++c)
+    {
+        e0[c] = clamp((ax[c] * bb - bx[c] * ab) / determinant, 0.0f, 255.0f);
+        e1[c] = clamp((bx[c] * aa - ax[c] * ab) / determinant, 0.0f, 255.0f);
+    }
+}
+
+static u16 PackRgb565(const f32 color[4])
+{
+    const u32 r = (u32)(color[0] * 31.0f / 255.0f + 0.5f);
+    const u32 g = (u32)(color[1] * 63.0f / 255.0f + 0.5f);
+    const u32 b = (u32)(color[2] * 31.0f / 255.0f + 0.5f);
+    return (u16)((r << 11) | (g << 5) | b);
+}
+
+static void UnpackRgb565(u16 packed, i32 color[3])
+{
+    const i32 r = (packed >> 11) & 31;
+    const i32 g = (packed >> 5) & 63;
+    const i32 b = packed & 31;
+    color[0] = (r << 3) | (r >> 2);
+    color[1] = (g << 2) | (g >> 4);
+    color[2] = (b << 3) | (b >> 2);
+}
+
+// Four color palette of a BC1 block, c0 > c1 is assumed
+static void Bc1_Palette(u16 c0, u16 c1, i32 palette[4][3])
+{
+    UnpackRgb565(c0, palette[0]);
+    UnpackRgb565(c1, palette[1]);
+    for (u32 c = 0; c < 3; ++c)
+    {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+}
+
+static u32 Bc1_ChooseIndices(const u8 block[16][4], u16 c0, u16 c1, u32* indices)
+{
+    i32 palette[4][3];
+    Bc1_Palette(c0, c1, palette);
+
+    u32 totalError = 0;
+    *indices = 0;
+    for (u32 i = 0; i < 16; ++i)
+    {
+        u32 bestIdx = 0;
+        u32 bestError = UINT32_MAX;
+        for (u32 p = 0; p < 4; ++p)
+        {
+            const i32 dr = block[i][0] - palette[p][0];
+            const i32 dg = block[i][1] - palette[p][1];
+            const i32 db = block[i][2] - palette[p][2];
+            const u32 error = dr * dr + dg * dg + db * db;
+            if (error < bestError)
+            {
+                bestError = error;
+                bestIdx = p;
+            }
+        }
+        *indices |= bestIdx << (2 * i);
+        totalError += bestError;
+    }
+    return totalError;
+}
+
+// Color block of BC1 and BC3, always in four color mode
+static void TextureCooker_EncodeBc1Color(const u8 block[16][4], u8* out)
+{
+    f32 e0[4], e1[4];
+    TextureCooker_AxisEndpoints(block, 3, e0, e1);
+
+    u16 c0 = PackRgb565(e1);
+    u16 c1 = PackRgb565(e0);
+    if (c0 < c1)
+        std::swap(c0, c1);
+    u32 indices = 0;
+    u32 error = c0 == c1 ? 0 : Bc1_ChooseIndices(block, c0, c1, &indices);
+
+    // One refinement of the endpoints with the indices chosen
+    if (c0 != c1)
+    {
+        static const f32 IndexWeights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f }; // Of c1
+        f32 weights[16];
+        for (u32 i = 0; i < 16; ++i)
+            weights[i] = IndexWeights[(indices >> (2 * i)) & 3];
+        TextureCooker_FitEndpoints(block, weights, 3, e1, e0);
+
+        u16 refined0 = PackRgb565(e1);
+        u16 refined1 = PackRgb565(e0);
+        if (refined0 < refined1)
+            std::swap(refined0, refined1);
+        if (refined0 != refined1)
+        {
+            u32 refinedIndices = 0;
+            const u32 refinedError = Bc1_ChooseIndices(block, refined0, refined1, &refinedIndices);
+            if (refinedError < error)
+            {
+                c0 = refined0;
+                c1 = refined1;
+                indices = refinedIndices;
+                error = refinedError;
+            }
+        }
+    }
+
+    memcpy(out, &c0, 2);
+    memcpy(out + 2, &c1, 2);
+    memcpy(out + 4, &indices, 4);
+}
+
+// Single channel block of BC3 (alpha) and BC5, in the mode with six interpolated values
+static void TextureCooker_EncodeBc4(const u8 block[16][4], u32 channel, u8* out)
+{
+    u8 a0 = 0, a1 = 255;
+    for (u32 i = 0; i < 16; ++i)
+    {
+        a0 = max(a0, block[i][channel]);
+        a1 = min(a1, block[i][channel]);
+    }
+
+    u64 bits = 0;
+    if (a0 != a1)
+    {
+        i32 palette[8] = { a0, a1 };
+        for (i32 p = 2; p < 8; ++p)
+            palette[p] = ((8 - p) * a0 + (p - 1) * a1 + 3) / 7;
+
+        for (u32 i = 0; i < 16; ++i)
+        {
+            u64 bestIdx = 0;
+            i32 bestError = INT32_MAX;
+            for (u32 p = 0; p < 8; ++p)
+            {
+                const i32 error = abs(block[i][channel] - palette[p]);
+                if (error < bestError)
+                {
+                    bestError = error;
+                    bestIdx = p;
+                }
+            }
+            bits |= bestIdx << (3 * i);
+        }
+    }
+
+    out[0] = a0;
+    out[1] = a1;
+    for (u32 i = 0; i < 6; ++i)
+        out[2 + i] = (u8)(bits >> (8 * i));
+}
+
+struct Bc7Endpoints
+{
+    u8 values[2][4]; // With the p-bit as their lowest bit
+};
+
+// Mode 6 stores 7 bits per channel plus a p-bit per endpoint shared by its four channels
+static void Bc7_QuantizeEndpoint(const f32 endpoint[4], u8 values[4])
+{
+    f32 bestError = FLT_MAX;
+    for (u32 p = 0; p < 2; ++p)
+    {
+        u8 candidate[4];
+        f32 error = 0.0f;
+        for (u32 c = 0; c < 4; ++c)
+        {
+            const i32 q = clamp((i32)((endpoint[c] - p) * 0.5f + 0.5f), 0, 127);
+            candidate[c] = (u8)((q << 1) | p);
+            error += (candidate[c] - endpoint[c]) * (candidate[c] - endpoint[c]);
+        }
+        if (error < bestError)
+        {
+            bestError = error;
+            memcpy(values, candidate, 4);
+        }
+    }
+}
+
+static const u32 Bc7Weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+static u32 Bc7_ChooseIndices(const u8 block[16][4], const Bc7Endpoints& endpoints, u8 indices[16])
+{
+    i32 palette[16][4];
+    for (u32 p = 0; p < 16; ++p)
+        for (u32 c = 0; c < 4; ++c)
+            palette[p][c] = ((64 - Bc7Weights4[p]) * endpoints.values[0][c] + Bc7Weights4[p] * endpoints.values[1][c] + 32) >> 6;
+
+    u32 totalError = 0;
+    for (u32 i = 0; i < 16; ++i)
+    {
+        u32 bestError = UINT32_MAX;
+        for (u32 p = 0; p < 16; ++p)
+        {
+            u32 error = 0;
+            for (u32 c = 0; c < 4; ++c)
+                error += (block[i][c] - palette[p][c]) * (block[i][c] - palette[p][c]);
+            if (error < bestError)
+            {
+                bestError = error;
+                indices[i] = (u8)p;
+            }
+        }
+        totalError += bestError;
+    }
+    return totalError;
+}
+
+struct BitWriter
+{
+    u8* bytes;
+    u32 position;
+};
+
+static void WriteBits(BitWriter& writer, u32 value, u32 count)
+{
+    for (u32 i = 0; i < count; ++i, ++writer.position)
+        if ((value >> i) & 1)
+            writer.bytes[writer.position >> 3] |= 1 << (writer.position & 7);
+}
+
+// Mode 6 only: a single subset of RGBA endpoints with 16 interpolated values, which handles
+// both opaque and translucent blocks without partition searches
+static void TextureCooker_EncodeBc7(const u8 block[16][4], u8* out)
+{
+    f32 e0[4], e1[4];
+    TextureCooker_AxisEndpoints(block, 4, e0, e1);
+
+    Bc7Endpoints endpoints;
+    Bc7_QuantizeEndpoint(e0, endpoints.values[0]);
+    Bc7_QuantizeEndpoint(e1, endpoints.values[1]);
+    u8 indices[16];
+    u32 error = Bc7_ChooseIndices(block, endpoints, indices);
+
+    // One refinement of the endpoints with the indices chosen
+    f32 weights[16];
+    for (u32 i = 0; i < 16; ++i)
+        weights[i] = Bc7Weights4[indices[i]] / 64.0f;
+    TextureCooker_FitEndpoints(block, weights, 4, e0, e1);
+
+    Bc7Endpoints refined;
+    Bc7_QuantizeEndpoint(e0, refined.values[0]);
+    Bc7_QuantizeEndpoint(e1, refined.values[1]);
+    u8 refinedIndices[16];
+    const u32 refinedError = Bc7_ChooseIndices(block, refined, refinedIndices);
+    if (refinedError < error)
+    {
+        endpoints = refined;
+        memcpy(indices, refinedIndices, sizeof(indices));
+        error = refinedError;
+    }
+
+    // The most significant bit of the first index is implicitly zero
+    if (indices[0] & 8)
+    {
+        std::swap(endpoints.values[0], endpoints.values[1]);
+        for (u32 i = 0; i < 16; ++i)
+            indices[i] = 15 - indices[i];
+    }
+
+    memset(out, 0, 16);
+    BitWriter writer = { out, 0 };
+    WriteBits(writer, 1 << 6, 7);
+    for (u32 c = 0; c < 4; ++c)
+    {
+        WriteBits(writer, endpoints.values[0][c] >> 1, 7);
+        WriteBits(writer, endpoints.values[1][c] >> 1, 7);
+    }
+    WriteBits(writer, endpoints.values[0][0] & 1, 1);
+    WriteBits(writer, endpoints.values[1][0] & 1, 1);
+    for (u32 i = 0; i < 16; ++i)
+        WriteBits(writer, indices[i], i == 0 ? 3 : 4);
+}
+
+static void TextureCooker_EncodeBlock(CookedFormat format, const u8 block[16][4], u8* out)
+{
+    switch (format)
+    {
+        case CookedFormat_BC1: TextureCooker_EncodeBc1Color(block, out); break;
+        case CookedFormat_BC3: TextureCooker_EncodeBc4(block, 3, out); TextureCooker_EncodeBc1Color(block, out + 8); break;
+        case CookedFormat_BC5: TextureCooker_EncodeBc4(block, 0, out); TextureCooker_EncodeBc4(block, 1, out + 8); break;
+        case CookedFormat_BC7: TextureCooker_EncodeBc7(block, out); break;
+        default: INVALID_CODE_PATH("Unknown cooked format");
+    }
+}
+
+// 4x4 block at texel (x, y), edge texels are repeated past the borders
+static void TextureCooker_FetchBlock(const u8* pixels, ivec2 size, i32 x, i32 y, u8 block[16][4])
+{
+    for (i32 by = 0; by < 4; ++by)
+        for (i32 bx = 0; bx < 4; ++bx)
+            memcpy(block[by * 4 + bx], pixels + (min(y + by, size.y - 1) * size.x + min(x + bx, size.x - 1)) * 4, 4);
+}
+
+static void TextureCooker_EncodeLevel(CookedFormat format, const u8* pixels, ivec2 size, u8* out)
+{
+    const u32 blockSize = CookedFormats[format].blockSize;
+    u8 block[16][4];
+    for (i32 y = 0; y < size.y; y += 4)
+    {
+        for (i32 x = 0; x < size.x; x += 4)
+        {
+            TextureCooker_FetchBlock(pixels, size, x, y, block);
+            TextureCooker_EncodeBlock(format, block, out);
+            out += blockSize;
+        }
+    }
+}
+
+
+// BLOCK DECODERS //////////////////////////////////////////////////////
+
+// Only used to measure the error of the encoders above, so BC7 handles mode 6 alone
+
+static void Bc1_DecodeColor(const u8* in, u8 block[16][4], bool isFourColorMode)
+{
+    u16 c0, c1;
+    u32 indices;
+    memcpy(&c0, in, 2);
+    memcpy(&c1, in + 2, 2);
+    memcpy(&indices, in + 4, 4);
+
+    i32 palette[4][3];
+    Bc1_Palette(c0, c1, palette);
+    if (!isFourColorMode && c0 <= c1)
+    {
+        for (u32 c = 0; c < 3; ++c)
+        {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = 0;
+        }
+    }
+
+    for (u32 i = 0; i < 16; ++i)
+        for (u32 c = 0; c < 3; ++c)
+            block[i][c] = (u8)palette[(indices >> (2 * i)) & 3][c];
+}
+
+static void Bc4_Decode(const u8* in, u8 block[16][4], u32 channel)
+{
+    const i32 a0 = in[0];
+    const i32 a1 = in[1];
+    i32 palette[8] = { a0, a1 };
+    if (a0 > a1)
+    {
+        for (i32 p = 2; p < 8; ++p)
+            palette[p] = ((8 - p) * a0 + (p - 1) * a1 + 3) / 7;
+    }
+    else
+    {
+        for (i32 p = 2; p < 6; ++p)
+            palette[p] = ((6 - p) * a0 + (p - 1) * a1 + 2) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+
+    u64 bits = 0;
+    for (u32 i = 0; i < 6; ++i)
+        bits |= (u64)in[2 + i] << (8 * i);
+    for (u32 i = 0; i < 16; ++i)
+        block[i][channel] = (u8)palette[(bits >> (3 * i)) & 7];
+}
+
+static u32 ReadBits(const u8* bytes, u32& position, u32 count)
+{
+    u32 value = 0;
+    for (u32 i = 0; i < count; ++i, ++position)
+        value |= ((bytes[position >> 3] >> (position & 7)) & 1) << i;
+    return value;
+}
+
+static void Bc7_DecodeMode6(const u8* in, u8 block[16][4])
+{
+    u32 position = 0;
+    if (ReadBits(in, position, 7) != (1 << 6))
+    {
+        // Magenta, as missing textures
+        for (u32 i = 0; i < 16; ++i)
+        {
+            block[i][0] = 255;
+            block[i][1] = 0;
+            block[i][2] = 255;
+        }
+        return;
+    }
+
+    u8 endpoints[2][4];
+    for (u32 c = 0; c < 4; ++c)
+    {
+        endpoints[0][c] = (u8)(ReadBits(in, position, 7) << 1);
+        endpoints[1][c] = (u8)(ReadBits(in, position, 7) << 1);
+    }
+    const u32 p0 = ReadBits(in, position, 1);
+    const u32 p1 = ReadBits(in, position, 1);
+    for (u32 c = 0; c < 4; ++c)
+    {
+        endpoints[0][c] |= p0;
+        endpoints[1][c] |= p1;
+    }
+
+    for (u32 i = 0; i < 16; ++i)
+    {
+        const u32 weight = Bc7Weights4[ReadBits(in, position, i == 0 ? 3 : 4)];
+        for (u32 c = 0; c < 4; ++c)
+            block[i][c] = (u8)(((64 - weight) * endpoints[0][c] + weight * endpoints[1][c] + 32) >> 6);
+    }
+}
+
+static void TextureCooker_DecodeBlock(CookedFormat format, const u8* in, u8 block[16][4])
+{
+    memset(block, 255, 16 * 4);
+    switch (format)
+    {
+        case CookedFormat_BC1: Bc1_DecodeColor(in, block, false); break;
+        case CookedFormat_BC3: Bc4_Decode(in, block, 3); Bc1_DecodeColor(in + 8, block, true); break;
+        case CookedFormat_BC5: Bc4_Decode(in, block, 0); Bc4_Decode(in + 8, block, 1); break;
+        case CookedFormat_BC7: Bc7_DecodeMode6(in, block); break;
+        default: INVALID_CODE_PATH("Unknown cooked format");
+    }
+}
+
+// Peak signal to noise ratio of a compressed level against its pixels, over the channels the
+// format keeps
+static f32 TextureCooker_Psnr(CookedFormat format, const u8* encoded, const u8* pixels, ivec2 size)
+{
+    const u32 channelCount = format == CookedFormat_BC1 ? 3 : format == CookedFormat_BC5 ? 2 : 4;
+    const u32 blockSize = CookedFormats[format].blockSize;
+
+    u64 squaredError = 0;
+    u8 decoded[16][4];
+    for (i32 y = 0; y < size.y; y += 4)
+    {
+        for (i32 x = 0; x < size.x; x += 4)
+        {
+            TextureCooker_DecodeBlock(format, encoded, decoded);
+            encoded += blockSize;
+
+            for (i32 by = 0; by < 4 && y + by < size.y; ++by)
+            {
+                for (i32 bx = 0; bx < 4 && x + bx < size.x; ++bx)
+                {
+                    const u8* pixel = pixels + ((y + by) * size.x + x + bx) * 4;
+                    for (u32 c = 0; c < channelCount; ++c)
+                    {
+                        const i32 difference = decoded[by * 4 + bx][c] - pixel[c];
+                        squaredError += difference * difference;
+                    }
+                }
+            }
+        }
+    }
+
+    if (squaredError == 0)
+        return 99.0f;
+    const f64 meanSquaredError = (f64)squaredError / ((f64)size.x * size.y * channelCount);
+    return (f32)(10.0 * log10(255.0 * 255.0 / meanSquaredError));
+}
+
+
+// COOKING /////////////////////////////////////////////////////////////
+
+struct TextureCookResult
+{
+    CookedFormat format;
+    ivec2        size;
+    u32          levelCount;
+    u32          sourceSize; // Of the source file
+    u32          cookedSize; // Of all the levels
+    f32          psnr;       // Of level 0, in dB, not measured for cached textures
+    bool         isCached;
+    char         error[128];
+};
+
+// Cooks the image at sourcePath into the texture cache, unless it is cached already and force
+// is not set. Returns false with result.error set if it fails.
+bool TextureCooker_Cook(const char* sourcePath, TextureRole role, bool force, TextureCookResult& result)
+{
+    result = {};
+
+    u32 sourceSize = 0;
+    u8* source = TextureCooker_ReadFile(sourcePath, &sourceSize);
+    if (!source)
+    {
+        snprintf(result.error, sizeof(result.error), "could not read the file");
+        return false;
+    }
+    result.sourceSize = sourceSize;
+
+    char cachePath[256];
+    TextureCooker_CachePath(cachePath, sizeof(cachePath), TextureCooker_Key(source, sourceSize, role));
+
+    CookedTexture cooked = {};
+    if (!force && TextureCooker_LoadCooked(sourcePath, role, cooked))
+    {
+        result.isCached = true;
+        result.format = cooked.format;
+        result.size = cooked.size;
+        result.levelCount = cooked.levelCount;
+        result.cookedSize = cooked.dataSize;
+        FreeCookedTexture(cooked);
+        free(source);
+        return true;
+    }
+
+    // Rows bottom-up, as LoadImage returns them
+    stbi_set_flip_vertically_on_load_thread(true);
+
+    ivec2 size;
+    i32 channelCount = 0;
+    u8* pixels = stbi_load_from_memory(source, (int)sourceSize, &size.x, &size.y, &channelCount, 4);
+    free(source);
+    if (!pixels)
+    {
+        snprintf(result.error, sizeof(result.error), "%s", stbi_failure_reason());
+        return false;
+    }
+
+    bool hasAlpha = false;
+    if (channelCount == 2 || channelCount == 4)
+        for (i32 i = 0; i < size.x * size.y && !hasAlpha; ++i)
+            hasAlpha = pixels[i * 4 + 3] != 255;
+
+    cooked.format = TextureCooker_ChooseFormat(role, hasAlpha);
+    cooked.isSrgb = TextureRoles[role].isSrgb && cooked.format != CookedFormat_BC5;
+    cooked.size = size;
+    cooked.levelCount = 1;
+    while (cooked.levelCount < TEXTURE_MAX_LEVELS && (size.x >> cooked.levelCount || size.y >> cooked.levelCount))
+        cooked.levelCount++;
+
+    for (u32 level = 0; level < cooked.levelCount; ++level)
+    {
+        cooked.levelOffsets[level] = cooked.dataSize;
+        cooked.levelSizes[level] = TextureCooker_LevelByteSize(cooked.format, TextureCooker_LevelSize(size, level));
+        cooked.dataSize += cooked.levelSizes[level];
+    }
+    cooked.data = (u8*)malloc(cooked.dataSize);
+
+    // Each level is filtered from the float texels of the previous one, never from 8 bits
+    const u32 texelCount = size.x * size.y;
+    f32* texels = (f32*)malloc(texelCount * 4 * sizeof(f32));
+    const ivec2 level1Size = TextureCooker_LevelSize(size, 1);
+    f32* nextTexels = (f32*)malloc(level1Size.x * level1Size.y * 4 * sizeof(f32));
+    TextureCooker_ToFloat(pixels, texelCount, role, texels);
+
+    for (u32 level = 0; level < cooked.levelCount; ++level)
+    {
+        const ivec2 levelSize = TextureCooker_LevelSize(size, level);
+        if (level > 0)
+        {
+            TextureCooker_Downsample(texels, TextureCooker_LevelSize(size, level - 1), nextTexels, levelSize);
+            std::swap(texels, nextTexels);
+        }
+
+        TextureCooker_ToU8(texels, levelSize.x * levelSize.y, role, pixels);
+        TextureCooker_EncodeLevel(cooked.format, pixels, levelSize, cooked.data + cooked.levelOffsets[level]);
+        if (level == 0)
+            result.psnr = TextureCooker_Psnr(cooked.format, cooked.data, pixels, levelSize);
+    }
+
+    free(nextTexels);
+    free(texels);
+    stbi_image_free(pixels);
+
+    // Written aside and renamed, so the engine never finds a partial file
+    char tmpPath[272];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", cachePath);
+    bool success = Ktx2_Write(tmpPath, cooked);
+    if (success)
+    {
+        remove(cachePath);
+        success = rename(tmpPath, cachePath) == 0;
+    }
+    if (!success)
+    {
+        remove(tmpPath);
+        snprintf(result.error, sizeof(result.error), "could not write %s", cachePath);
+    }
+
+    result.format = cooked.format;
+    result.size = cooked.size;
+    result.levelCount = cooked.levelCount;
+    result.cookedSize = cooked.dataSize;
+    FreeCookedTexture(cooked);
+    return success;
+}
@@ -0,0 +1,1778 @@
+//
+// vulkan_engine.cpp : Vulkan 1.3 backend. Render passes map to dynamic rendering, so framebuffers
+// need no Vulkan objects and the load/store ops of the passes go straight into the attachment
+// infos. Each frame in flight owns a command buffer, a fence and a persistently mapped upload
+// ring: mapped buffers are written in the ring and copied to their device local memory when
+// unmapped. The contents of the passes are recorded in secondary command buffers on the job
+// threads, each thread allocating from its own command pool of the frame. Programs are loaded
+// from SPIR-V precompiled into WorkingDir/spirv (see the spirv target of the Makefile) and
+// reflected like the OpenGL ones, and the VkPipelines of a pipeline state are created on first
+// use for each vertex layout and attachment formats it is drawn with. All of them share one
+// pipeline layout: set 0 holds the global params uniform buffer and set 1 the albedo texture.
+// Any Vulkan 1.3 device works, Mesa lavapipe included (see the vulkan-lavapipe target of the
+// Makefile), and the validation layer is enabled whenever it is installed.
+//
+
+#include "vulkan_engine.h"
+#include "imgui_gfx.h"
+
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>
+#include <imgui.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <vector>
+
+GLFWwindow* GetGlfwWindow();
+
+#define VULKAN_FRAME_COUNT       2
+#define VULKAN_UPLOAD_RING_SIZE  MB(16)
+#define VULKAN_UPLOAD_ALIGNMENT  16
+#define VULKAN_VALIDATION_LAYER  "VK_LAYER_KHRONOS_validation"
+#define VULKAN_FRAME_UNIFORM_SETS 64
+#define VULKAN_SPIRV_DIRECTORY   "spirv"
+
+#define VK_CHECK(call) do { const VkResult vkResult = (call); ASSERT(vkResult == VK_SUCCESS, #call " failed"); (void)vkResult; } while (0)
+
+struct VulkanFrame
+{
+    VkCommandPool   commandPool;
+    VkCommandBuffer commandBuffer;
+    VkFence         fence;
+    VkSemaphore     acquireSemaphore;
+    bool            isRecording;
+
+    // Upload ring, reset when the frame is recorded again
+    VkBuffer        uploadBuffer;
+    VkDeviceMemory  uploadMemory;
+    u8*             uploadData;
+    u32             uploadHead;
+
+    // Staging buffers of uploads that did not fit in the ring, freed when the frame retires
+    std::vector<VkBuffer>       stagingBuffers;
+    std::vector<VkDeviceMemory> stagingMemories;
+
+    // Uniform sets of the frame, reset with the ring
+    VkDescriptorPool descriptorPool;
+
+    // Secondary command buffers, reused every time the frame is recorded
+    VkCommandPool                threadCommandPools[MAX_JOB_THREADS];
+    std::vector<VkCommandBuffer> threadCommandBuffers[MAX_JOB_THREADS];
+    u32                          threadCommandBufferCount[MAX_JOB_THREADS];
+};
+
+// Pipeline of a pipeline state for a vertex layout and the attachment formats of a pass
+struct VulkanPipeline
+{
+    u32                pipelineStateIdx;
+    VertexBufferLayout vertexBufferLayout;
+    VkFormat           colorFormats[MAX_FRAMEBUFFER_ATTACHMENTS];
+    u32                colorFormatCount;
+    VkFormat           depthFormat;
+    VkPipeline         handle;
+};
+
+struct VulkanDeviceWrapper
+{
+    VkInstance               instance;
+    VkDebugUtilsMessengerEXT messenger;
+    VkPhysicalDevice         physicalDevice;
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    VkDevice                 device;
+    u32                      queueFamilyIdx;
+    VkQueue                  queue;
+
+    // Swapchain, headless runs have none
+    VkSurfaceKHR             surface;
+    VkSwapchainKHR           swapchain;
+    VkFormat                 swapchainFormat;
+    VkExtent2D               swapchainExtent;
+    std::vector<VkImage>     swapchainImages;
+    std::vector<VkSemaphore> presentSemaphores; // One per image, presentation may hold them past the frame fence
+    u32                      swapchainImageIdx;
+    bool                     isSwapchainImageAcquired;
+
+    VulkanFrame frames[VULKAN_FRAME_COUNT];
+    u32         frameIdx;
+
+    // Current pass, inherited by its secondary command buffers
+    bool     isInRenderPass;
+    VkFormat colorFormats[MAX_FRAMEBUFFER_ATTACHMENTS];
+    u32      colorFormatCount;
+    VkFormat depthFormat;
+    std::vector<VkCommandBuffer> secondaryCommandBuffers;
+
+    // Shared by all the pipelines, see the comment at the top
+    VkDescriptorSetLayout uniformSetLayout;
+    VkDescriptorSetLayout textureSetLayout;
+    VkPipelineLayout      pipelineLayout;
+    VkSampler             sampler;
+    VkDescriptorPool      textureDescriptorPool; // A set per texture, never freed
+    std::vector<VulkanPipeline> pipelines;
+};
+
+static VulkanDeviceWrapper s_vulkanDeviceWrapper;
+static std::atomic<u32> s_vulkanValidationErrorCount(0);
+
+static VulkanDeviceWrapper& GetVulkanDeviceWrapper(const Device& device)
+{
+    VulkanDeviceWrapper* devWrapper = (VulkanDeviceWrapper*)device.internal;
+    ASSERT(devWrapper, "Vulkan device was not initialized.");
+    return *devWrapper;
+}
+
+static VKAPI_ATTR VkBool32 VKAPI_CALL OnVulkanDebugMessage(VkDebugUtilsMessageSeverityFlagBitsEXT severity,
+                                                          VkDebugUtilsMessageTypeFlagsEXT type,
+                                                          const VkDebugUtilsMessengerCallbackDataEXT* callbackData,
+                                                          void* userData)
+{
+    if (severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT)
+    {
+        s_vulkanValidationErrorCount++;
+        ELOG("Vulkan error: %s", callbackData->pMessage);
+    }
+    else
+    {
+        ILOG("Vulkan warning: %s", callbackData->pMessage);
+    }
+    return VK_FALSE;
+}
+
+static u32 Vulkan_FindMemoryType(const VulkanDeviceWrapper& vk, u32 typeBits, VkMemoryPropertyFlags properties)
+{
+    for (u32 i = 0; i < vk.memoryProperties.memoryTypeCount; ++i)
+        if ((typeBits & (1u << i)) && (vk.memoryProperties.memoryTypes[i].propertyFlags & properties) == properties)
+            return i;
+    return UINT32_MAX;
+}
+
+static bool Vulkan_CreateBufferMemory(const VulkanDeviceWrapper& vk, u32 size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& memory)
+{
+    VkBufferCreateInfo bufferInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+    bufferInfo.size = size;
+    bufferInfo.usage = usage;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (vkCreateBuffer(vk.device, &bufferInfo, NULL, &buffer) != VK_SUCCESS)
+    {
+        ELOG("vkCreateBuffer() failed (%u bytes)", size);
+        return false;
+    }
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(vk.device, buffer, &requirements);
+
+    VkMemoryAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
+    allocateInfo.allocationSize = requirements.size;
+    allocateInfo.memoryTypeIndex = Vulkan_FindMemoryType(vk, requirements.memoryTypeBits, properties);
+    if (allocateInfo.memoryTypeIndex == UINT32_MAX || vkAllocateMemory(vk.device, &allocateInfo, NULL, &memory) != VK_SUCCESS)
+    {
+        ELOG("vkAllocateMemory() failed (%u bytes)", size);
+        vkDestroyBuffer(vk.device, buffer, NULL);
+        buffer = VK_NULL_HANDLE;
+        return false;
+    }
+
+    VK_CHECK(vkBindBufferMemory(vk.device, buffer, memory, 0));
+    return true;
+}
+
+// Coarse barrier, every pass waits for all the previous work on the image
+static void Vulkan_TransitionImageLevels(VkCommandBuffer commandBuffer, VkImage image, VkImageAspectFlags aspect, u32 baseLevel, u32 levelCount, VkImageLayout oldLayout, VkImageLayout newLayout)
+{
+    VkImageMemoryBarrier2 barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+    barrier.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange = { aspect, baseLevel, levelCount, 0, 1 };
+
+    VkDependencyInfo dependencyInfo = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+    dependencyInfo.imageMemoryBarrierCount = 1;
+    dependencyInfo.pImageMemoryBarriers = &barrier;
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+}
+
+static void Vulkan_TransitionImage(VkCommandBuffer commandBuffer, VkImage image, VkImageAspectFlags aspect, VkImageLayout oldLayout, VkImageLayout newLayout)
+{
+    Vulkan_TransitionImageLevels(commandBuffer, image, aspect, 0, 1, oldLayout, newLayout);
+}
+
+static void Vulkan_MemoryBarrier(VkCommandBuffer commandBuffer, VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 srcAccessMask, VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask)
+{
+    VkMemoryBarrier2 barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+    barrier.srcStageMask = srcStageMask;
+    barrier.srcAccessMask = srcAccessMask;
+    barrier.dstStageMask = dstStageMask;
+    barrier.dstAccessMask = dstAccessMask;
+
+    VkDependencyInfo dependencyInfo = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+    dependencyInfo.memoryBarrierCount = 1;
+    dependencyInfo.pMemoryBarriers = &barrier;
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+}
+
+static VulkanFrame& Vulkan_GetFrame(VulkanDeviceWrapper& vk)
+{
+    return vk.frames[vk.frameIdx];
+}
+
+// Buffer uploads may come before the first BeginFrame (e.g. the embedded geometry), so the
+// command buffer of a frame starts recording on first use
+static VkCommandBuffer Vulkan_GetCommandBuffer(VulkanDeviceWrapper& vk)
+{
+    VulkanFrame& frame = Vulkan_GetFrame(vk);
+    if (!frame.isRecording)
+    {
+        VK_CHECK(vkWaitForFences(vk.device, 1, &frame.fence, VK_TRUE, UINT64_MAX));
+        VK_CHECK(vkResetFences(vk.device, 1, &frame.fence));
+
+        for (u32 i = 0; i < frame.stagingBuffers.size(); ++i)
+        {
+            vkDestroyBuffer(vk.device, frame.stagingBuffers[i], NULL);
+            vkFreeMemory(vk.device, frame.stagingMemories[i], NULL);
+        }
+        frame.stagingBuffers.clear();
+        frame.stagingMemories.clear();
+        frame.uploadHead = 0;
+        VK_CHECK(vkResetDescriptorPool(vk.device, frame.descriptorPool, 0));
+
+        VK_CHECK(vkResetCommandPool(vk.device, frame.commandPool, 0));
+        for (u32 i = 0; i < MAX_JOB_THREADS; ++i)
+        {
+            VK_CHECK(vkResetCommandPool(vk.device, frame.threadCommandPools[i], 0));
+            frame.threadCommandBufferCount[i] = 0;
+        }
+
+        VkCommandBufferBeginInfo beginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        VK_CHECK(vkBeginCommandBuffer(frame.commandBuffer, &beginInfo));
+        frame.isRecording = true;
+    }
+    return frame.commandBuffer;
+}
+
+static void Vulkan_DestroySwapchain(VulkanDeviceWrapper& vk, VkSwapchainKHR swapchain)
+{
+    for (u32 i = 0; i < vk.presentSemaphores.size(); ++i)
+        vkDestroySemaphore(vk.device, vk.presentSemaphores[i], NULL);
+    vk.presentSemaphores.clear();
+    vk.swapchainImages.clear();
+    if (swapchain)
+        vkDestroySwapchainKHR(vk.device, swapchain, NULL);
+}
+
+static bool Vulkan_CreateSwapchain(VulkanDeviceWrapper& vk)
+{
+    VkSurfaceCapabilitiesKHR capabilities;
+    VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(vk.physicalDevice, vk.surface, &capabilities));
+
+    VkExtent2D extent = capabilities.currentExtent;
+    if (extent.width == UINT32_MAX)
+    {
+        int width, height;
+        glfwGetFramebufferSize(GetGlfwWindow(), &width, &height);
+        extent.width = clamp((u32)width, capabilities.minImageExtent.width, capabilities.maxImageExtent.width);
+        extent.height = clamp((u32)height, capabilities.minImageExtent.height, capabilities.maxImageExtent.height);
+    }
+
+    // Minimized windows keep the old swapchain until they get an area again
+    if (extent.width == 0 || extent.height == 0)
+        return false;
+
+    u32 formatCount = 0;
+    VK_CHECK(vkGetPhysicalDeviceSurfaceFormatsKHR(vk.physicalDevice, vk.surface, &formatCount, NULL));
+    std::vector<VkSurfaceFormatKHR> formats(formatCount);
+    VK_CHECK(vkGetPhysicalDeviceSurfaceFormatsKHR(vk.physicalDevice, vk.surface, &formatCount, formats.data()));
+    if (formatCount == 0)
+    {
+        ELOG("The Vulkan surface has no formats");
+        return false;
+    }
+
+    VkSurfaceFormatKHR surfaceFormat = formats[0];
+    for (u32 i = 0; i < formatCount; ++i)
+        if (formats[i].format == VK_FORMAT_B8G8R8A8_UNORM || formats[i].format == VK_FORMAT_R8G8B8A8_UNORM)
+            surfaceFormat = formats[i];
+
+    if (!(capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT))
+    {
+        ELOG("The Vulkan swapchain images cannot be blitted to");
+        return false;
+    }
+
+    u32 imageCount = capabilities.minImageCount + 1;
+    if (capabilities.maxImageCount > 0)
+        imageCount = min(imageCount, capabilities.maxImageCount);
+
+    const VkSwapchainKHR oldSwapchain = vk.swapchain;
+
+    VkSwapchainCreateInfoKHR swapchainInfo = { VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR };
+    swapchainInfo.surface = vk.surface;
+    swapchainInfo.minImageCount = imageCount;
+    swapchainInfo.imageFormat = surfaceFormat.format;
+    swapchainInfo.imageColorSpace = surfaceFormat.colorSpace;
+    swapchainInfo.imageExtent = extent;
+    swapchainInfo.imageArrayLayers = 1;
+    swapchainInfo.imageUsage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    swapchainInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    swapchainInfo.preTransform = capabilities.currentTransform;
+    swapchainInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+    swapchainInfo.presentMode = VK_PRESENT_MODE_FIFO_KHR; // Always supported
+    swapchainInfo.clipped = VK_TRUE;
+    swapchainInfo.oldSwapchain = oldSwapchain;
+
+    VkSwapchainKHR swapchain;
+    if (vkCreateSwapchainKHR(vk.device, &swapchainInfo, NULL, &swapchain) != VK_SUCCESS)
+    {
+        ELOG("vkCreateSwapchainKHR() failed");
+        return false;
+    }
+
+    VK_CHECK(vkDeviceWaitIdle(vk.device));
+    Vulkan_DestroySwapchain(vk, oldSwapchain);
+
+    vk.swapchain = swapchain;
+    vk.swapchainFormat = surfaceFormat.format;
+    vk.swapchainExtent = extent;
+
+    VK_CHECK(vkGetSwapchainImagesKHR(vk.device, swapchain, &imageCount, NULL));
+    vk.swapchainImages.resize(imageCount);
+    VK_CHECK(vkGetSwapchainImagesKHR(vk.device, swapchain, &imageCount, vk.swapchainImages.data()));
+
+    VkSemaphoreCreateInfo semaphoreInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+    vk.presentSemaphores.resize(imageCount);
+    for (u32 i = 0; i < imageCount; ++i)
+        VK_CHECK(vkCreateSemaphore(vk.device, &semaphoreInfo, NULL, &vk.presentSemaphores[i]));
+
+    ILOG("Vulkan swapchain: %ux%u, %u images", extent.width, extent.height, imageCount);
+    return true;
+}
+
+static bool Vulkan_HasLayer(const char* layerName)
+{
+    u32 layerCount = 0;
+    vkEnumerateInstanceLayerProperties(&layerCount, NULL);
+    std::vector<VkLayerProperties> layers(layerCount);
+    vkEnumerateInstanceLayerProperties(&layerCount, layers.data());
+    for (u32 i = 0; i < layerCount; ++i)
+        if (strcmp(layers[i].layerName, layerName) == 0)
+            return true;
+    return false;
+}
+
+static bool Vulkan_CreateInstance(VulkanDeviceWrapper& vk, GLFWwindow* window)
+{
+    // AGP_VULKAN_VALIDATION=0 turns the layer off, e.g. to measure
+    const char* validationEnv = getenv("AGP_VULKAN_VALIDATION");
+    const bool wantsValidation = !validationEnv || strcmp(validationEnv, "0") != 0;
+    const bool hasValidation = wantsValidation && Vulkan_HasLayer(VULKAN_VALIDATION_LAYER);
+    if (wantsValidation && !hasValidation)
+        ILOG("Vulkan validation layer not found, running without it");
+
+    std::vector<const char*> extensions;
+    if (window)
+    {
+        u32 glfwExtensionCount = 0;
+        const char** glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+        extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    }
+    if (hasValidation)
+        extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+
+    const char* layers[] = { VULKAN_VALIDATION_LAYER };
+
+    VkApplicationInfo applicationInfo = { VK_STRUCTURE_TYPE_APPLICATION_INFO };
+    applicationInfo.pApplicationName = "AGP";
+    applicationInfo.pEngineName = "AGP";
+    applicationInfo.apiVersion = VK_API_VERSION_1_3;
+
+    VkInstanceCreateInfo instanceInfo = { VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO };
+    instanceInfo.pApplicationInfo = &applicationInfo;
+    instanceInfo.enabledExtensionCount = (u32)extensions.size();
+    instanceInfo.ppEnabledExtensionNames = extensions.data();
+    instanceInfo.enabledLayerCount = hasValidation ? 1 : 0;
+    instanceInfo.ppEnabledLayerNames = layers;
+
+    if (vkCreateInstance(&instanceInfo, NULL, &vk.instance) != VK_SUCCESS)
+    {
+        ELOG("vkCreateInstance() failed");
+        return false;
+    }
+
+    if (hasValidation)
+    {
+        VkDebugUtilsMessengerCreateInfoEXT messengerInfo = { VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT };
+        messengerInfo.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+        messengerInfo.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+        messengerInfo.pfnUserCallback = OnVulkanDebugMessage;
+
+        PFN_vkCreateDebugUtilsMessengerEXT createMessenger = (PFN_vkCreateDebugUtilsMessengerEXT)vkGetInstanceProcAddr(vk.instance, "vkCreateDebugUtilsMessengerEXT");
+        if (createMessenger)
+            createMessenger(vk.instance, &messengerInfo, NULL, &vk.messenger);
+        ILOG("Vulkan validation layer enabled");
+    }
+
+    return true;
+}
+
+// AGP_VULKAN_DEVICE selects the first device whose name contains it (e.g. "llvmpipe" for
+// lavapipe), otherwise discrete GPUs go first
+static bool Vulkan_SelectPhysicalDevice(VulkanDeviceWrapper& vk)
+{
+    u32 physicalDeviceCount = 0;
+    VK_CHECK(vkEnumeratePhysicalDevices(vk.instance, &physicalDeviceCount, NULL));
+    std::vector<VkPhysicalDevice> physicalDevices(physicalDeviceCount);
+    VK_CHECK(vkEnumeratePhysicalDevices(vk.instance, &physicalDeviceCount, physicalDevices.data()));
+
+    const char* nameFilter = getenv("AGP_VULKAN_DEVICE");
+    i32 bestScore = -1;
+
+    for (u32 i = 0; i < physicalDeviceCount; ++i)
+    {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevices[i], &properties);
+        ILOG("Vulkan device %u: %s (Vulkan %u.%u)", i, properties.deviceName,
+             VK_API_VERSION_MAJOR(properties.apiVersion), VK_API_VERSION_MINOR(properties.apiVersion));
+
+        if (properties.apiVersion < VK_API_VERSION_1_3)
+            continue;
+        if (nameFilter && !strstr(properties.deviceName, nameFilter))
+            continue;
+
+        u32 queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevices[i], &queueFamilyCount, NULL);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevices[i], &queueFamilyCount, queueFamilies.data());
+
+        u32 queueFamilyIdx = UINT32_MAX;
+        for (u32 j = 0; j < queueFamilyCount && queueFamilyIdx == UINT32_MAX; ++j)
+        {
+            VkBool32 canPresent = VK_TRUE;
+            if (vk.surface)
+                vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevices[i], j, vk.surface, &canPresent);
+            if ((queueFamilies[j].queueFlags & VK_QUEUE_GRAPHICS_BIT) && canPresent)
+                queueFamilyIdx = j;
+        }
+        if (queueFamilyIdx == UINT32_MAX)
+            continue;
+
+        const i32 score = properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU ? 2 :
+                          properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU ? 1 : 0;
+        if (score > bestScore)
+        {
+            bestScore = score;
+            vk.physicalDevice = physicalDevices[i];
+            vk.queueFamilyIdx = queueFamilyIdx;
+        }
+    }
+
+    if (!vk.physicalDevice)
+    {
+        ELOG("No Vulkan 1.3 device found%s%s", nameFilter ? " matching " : "", nameFilter ? nameFilter : "");
+        return false;
+    }
+
+    vkGetPhysicalDeviceMemoryProperties(vk.physicalDevice, &vk.memoryProperties);
+    return true;
+}
+
+static bool Vulkan_CreateFrames(VulkanDeviceWrapper& vk)
+{
+    for (u32 i = 0; i < VULKAN_FRAME_COUNT; ++i)
+    {
+        VulkanFrame& frame = vk.frames[i];
+
+        VkCommandPoolCreateInfo poolInfo = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        poolInfo.queueFamilyIndex = vk.queueFamilyIdx;
+        VK_CHECK(vkCreateCommandPool(vk.device, &poolInfo, NULL, &frame.commandPool));
+        for (u32 j = 0; j < MAX_JOB_THREADS; ++j)
+            VK_CHECK(vkCreateCommandPool(vk.device, &poolInfo, NULL, &frame.threadCommandPools[j]));
+
+        VkCommandBufferAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+        allocateInfo.commandPool = frame.commandPool;
+        allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocateInfo.commandBufferCount = 1;
+        VK_CHECK(vkAllocateCommandBuffers(vk.device, &allocateInfo, &frame.commandBuffer));
+
+        // Signaled, the first use of the frame must not wait
+        VkFenceCreateInfo fenceInfo = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+        VK_CHECK(vkCreateFence(vk.device, &fenceInfo, NULL, &frame.fence));
+
+        VkSemaphoreCreateInfo semaphoreInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+        VK_CHECK(vkCreateSemaphore(vk.device, &semaphoreInfo, NULL, &frame.acquireSemaphore));
+
+        if (!Vulkan_CreateBufferMemory(vk, VULKAN_UPLOAD_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                       frame.uploadBuffer, frame.uploadMemory))
+        {
+            return false;
+        }
+        VK_CHECK(vkMapMemory(vk.device, frame.uploadMemory, 0, VK_WHOLE_SIZE, 0, (void**)&frame.uploadData));
+
+        VkDescriptorPoolSize poolSize = { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VULKAN_FRAME_UNIFORM_SETS };
+        VkDescriptorPoolCreateInfo descriptorPoolInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+        descriptorPoolInfo.maxSets = VULKAN_FRAME_UNIFORM_SETS;
+        descriptorPoolInfo.poolSizeCount = 1;
+        descriptorPoolInfo.pPoolSizes = &poolSize;
+        VK_CHECK(vkCreateDescriptorPool(vk.device, &descriptorPoolInfo, NULL, &frame.descriptorPool));
+    }
+    return true;
+}
+
+static void Vulkan_CreatePipelineLayout(VulkanDeviceWrapper& vk, u32 maxTextureCount)
+{
+    VkDescriptorSetLayoutBinding uniformBinding = {};
+    uniformBinding.binding = 0;
+    uniformBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    uniformBinding.descriptorCount = 1;
+    uniformBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    VkDescriptorSetLayoutCreateInfo setLayoutInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+    setLayoutInfo.bindingCount = 1;
+    setLayoutInfo.pBindings = &uniformBinding;
+    VK_CHECK(vkCreateDescriptorSetLayout(vk.device, &setLayoutInfo, NULL, &vk.uniformSetLayout));
+
+    VkDescriptorSetLayoutBinding textureBinding = {};
+    textureBinding.binding = 0;
+    textureBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    textureBinding.descriptorCount = 1;
+    textureBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    setLayoutInfo.pBindings = &textureBinding;
+    VK_CHECK(vkCreateDescriptorSetLayout(vk.device, &setLayoutInfo, NULL, &vk.textureSetLayout));
+
+    const VkDescriptorSetLayout setLayouts[] = { vk.uniformSetLayout, vk.textureSetLayout };
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+    pipelineLayoutInfo.setLayoutCount = ARRAY_COUNT(setLayouts);
+    pipelineLayoutInfo.pSetLayouts = setLayouts;
+    VK_CHECK(vkCreatePipelineLayout(vk.device, &pipelineLayoutInfo, NULL, &vk.pipelineLayout));
+
+    // Same filtering and wrapping as the OpenGL textures
+    VkSamplerCreateInfo samplerInfo = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+    samplerInfo.magFilter = VK_FILTER_LINEAR;
+    samplerInfo.minFilter = VK_FILTER_LINEAR;
+    samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+    VK_CHECK(vkCreateSampler(vk.device, &samplerInfo, NULL, &vk.sampler));
+
+    VkDescriptorPoolSize poolSize = { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, maxTextureCount };
+    VkDescriptorPoolCreateInfo descriptorPoolInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+    descriptorPoolInfo.maxSets = maxTextureCount;
+    descriptorPoolInfo.poolSizeCount = 1;
+    descriptorPoolInfo.pPoolSizes = &poolSize;
+    VK_CHECK(vkCreateDescriptorPool(vk.device, &descriptorPoolInfo, NULL, &vk.textureDescriptorPool));
+}
+
+bool Vulkan_InitDevice(Device& device)
+{
+    ASSERT(device.internal == NULL, "Vulkan device was already initialized");
+    VulkanDeviceWrapper& vk = s_vulkanDeviceWrapper;
+
+    GLFWwindow* window = GetGlfwWindow();
+
+    if (!Vulkan_CreateInstance(vk, window))
+        return false;
+
+    if (window && glfwCreateWindowSurface(vk.instance, window, NULL, &vk.surface) != VK_SUCCESS)
+    {
+        ELOG("glfwCreateWindowSurface() failed");
+        return false;
+    }
+
+    if (!Vulkan_SelectPhysicalDevice(vk))
+        return false;
+
+    const f32 queuePriority = 1.0f;
+    VkDeviceQueueCreateInfo queueInfo = { VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO };
+    queueInfo.queueFamilyIndex = vk.queueFamilyIdx;
+    queueInfo.queueCount = 1;
+    queueInfo.pQueuePriorities = &queuePriority;
+
+    VkPhysicalDeviceVulkan13Features features13 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES };
+    features13.dynamicRendering = VK_TRUE;
+    features13.synchronization2 = VK_TRUE;
+
+    const char* swapchainExtension = VK_KHR_SWAPCHAIN_EXTENSION_NAME;
+
+    VkDeviceCreateInfo deviceInfo = { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO };
+    deviceInfo.pNext = &features13;
+    deviceInfo.queueCreateInfoCount = 1;
+    deviceInfo.pQueueCreateInfos = &queueInfo;
+    deviceInfo.enabledExtensionCount = vk.surface ? 1 : 0;
+    deviceInfo.ppEnabledExtensionNames = &swapchainExtension;
+
+    if (vkCreateDevice(vk.physicalDevice, &deviceInfo, NULL, &vk.device) != VK_SUCCESS)
+    {
+        ELOG("vkCreateDevice() failed");
+        return false;
+    }
+    vkGetDeviceQueue(vk.device, vk.queueFamilyIdx, 0, &vk.queue);
+
+    if (!Vulkan_CreateFrames(vk))
+        return false;
+
+    if (vk.surface && !Vulkan_CreateSwapchain(vk))
+        return false;
+
+    Vulkan_CreatePipelineLayout(vk, ARRAY_COUNT(device.textures));
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(vk.physicalDevice, &properties);
+    snprintf(device.name, sizeof(device.name), "%s", properties.deviceName);
+    snprintf(device.glVersionString, sizeof(device.glVersionString), "Vulkan %u.%u.%u",
+             VK_API_VERSION_MAJOR(properties.apiVersion), VK_API_VERSION_MINOR(properties.apiVersion), VK_API_VERSION_PATCH(properties.apiVersion));
+    device.uniformBufferAlignment = (i32)properties.limits.minUniformBufferOffsetAlignment;
+    // Constant buffers are allocated with this size, some drivers report ranges of gigabytes
+    device.uniformBufferMaxSize = (i32)min(properties.limits.maxUniformBufferRange, (u32)KB(64));
+
+    ILOG("Vulkan device: %s (%s)", device.name, device.glVersionString);
+
+    device.internal = &vk;
+    return true;
+}
+
+void Vulkan_ShutdownDevice(Device& device)
+{
+    VulkanDeviceWrapper& vk = GetVulkanDeviceWrapper(device);
+    VK_CHECK(vkDeviceWaitIdle(vk.device));
+
+    // The engine never destroys buffers, render targets, textures and programs, they all go away here
+    Buffer* bufferArrays[] = { device.vertexBuffers, device.indexBuffers, device.constantBuffers };
+    const u32 bufferCounts[] = { device.vertexBufferCount, device.indexBufferCount, device.constantBufferCount };
+    for (u32 i = 0; i < ARRAY_COUNT(bufferArrays); ++i)
+    {
+        for (u32 j = 0; j < bufferCounts[i]; ++j)
+        {
+            vkDestroyBuffer(vk.device, bufferArrays[i][j].handle, NULL);
+            vkFreeMemory(vk.device, bufferArrays[i][j].memory, NULL);
+        }
+    }
+    for (u32 i = 0; i < device.renderTargetCount; ++i)
+        Vulkan_DestroyRenderTarget(device.renderTargets[i]);
+    for (u32 i = 0; i < device.textureCount; ++i)
+    {
+        const Texture& texture = device.textures[i];
+        vkDestroyImageView(vk.device, texture.view, NULL);
+        vkDestroyImage(vk.device, texture.handle, NULL);
+        vkFreeMemory(vk.device, texture.memory, NULL);
+    }
+    for (u32 i = 0; i < device.programCount; ++i)
+    {
+        vkDestroyShaderModule(vk.device, device.programs[i].vertexModule, NULL);
+        vkDestroyShaderModule(vk.device, device.programs[i].fragmentModule, NULL);
+    }
+    for (u32 i = 0; i < vk.pipelines.size(); ++i)
+        vkDestroyPipeline(vk.device, vk.pipelines[i].handle, NULL);
+    vk.pipelines.clear();
+
+    vkDestroyDescriptorPool(vk.device, vk.textureDescriptorPool, NULL);
+    vkDestroySampler(vk.device, vk.sampler, NULL);
+    vkDestroyPipelineLayout(vk.device, vk.pipelineLayout, NULL);
+    vkDestroyDescriptorSetLayout(vk.device, vk.textureSetLayout, NULL);
+    vkDestroyDescriptorSetLayout(vk.device, vk.uniformSetLayout, NULL);
+
+    for (u32 i = 0; i < VULKAN_FRAME_COUNT; ++i)
+    {
+        VulkanFrame& frame = vk.frames[i];
+        for (u32 j = 0; j < frame.stagingBuffers.size(); ++j)
+        {
+            vkDestroyBuffer(vk.device, frame.stagingBuffers[j], NULL);
+            vkFreeMemory(vk.device, frame.stagingMemories[j], NULL);
+        }
+        vkDestroyBuffer(vk.device, frame.uploadBuffer, NULL);
+        vkFreeMemory(vk.device, frame.uploadMemory, NULL);
+        vkDestroyDescriptorPool(vk.device, frame.descriptorPool, NULL);
+        vkDestroySemaphore(vk.device, frame.acquireSemaphore, NULL);
+        vkDestroyFence(vk.device, frame.fence, NULL);
+        for (u32 j = 0; j < MAX_JOB_THREADS; ++j)
+            vkDestroyCommandPool(vk.device, frame.threadCommandPools[j], NULL);
+        vkDestroyCommandPool(vk.device, frame.commandPool, NULL);
+    }
+
+    Vulkan_DestroySwapchain(vk, vk.swapchain);
+    vkDestroyDevice(vk.device, NULL);
+    if (vk.surface)
+        vkDestroySurfaceKHR(vk.instance, vk.surface, NULL);
+    if (vk.messenger)
+    {
+        PFN_vkDestroyDebugUtilsMessengerEXT destroyMessenger = (PFN_vkDestroyDebugUtilsMessengerEXT)vkGetInstanceProcAddr(vk.instance, "vkDestroyDebugUtilsMessengerEXT");
+        if (destroyMessenger)
+            destroyMessenger(vk.instance, vk.messenger, NULL);
+    }
+    vkDestroyInstance(vk.instance, NULL);
+
+    device.internal = NULL;
+}
+
+void Vulkan_BeginFrame(Device& device)
+{
+    VulkanDeviceWrapper& vk = GetVulkanDeviceWrapper(device);
+    Vulkan_GetCommandBuffer(vk);
+
+    vk.isSwapchainImageAcquired = false;
+    if (!vk.swapchain)
+        return;
+
+    VkResult result = vkAcquireNextImageKHR(vk.device, vk.swapchain, UINT64_MAX, Vulkan_GetFrame(vk).acquireSemaphore, VK_NULL_HANDLE, &vk.swapchainImageIdx);
+    if (result == VK_ERROR_OUT_OF_DATE_KHR)
+    {
+        // Nothing waits on the semaphore after a failed acquire, it can be reused right away
+        if (!Vulkan_CreateSwapchain(vk))
+            return;
+        result = vkAcquireNextImageKHR(vk.device, vk.swapchain, UINT64_MAX, Vulkan_GetFrame(vk).acquireSemaphore, VK_NULL_HANDLE, &vk.swapchainImageIdx);
+    }
+    vk.isSwapchainImageAcquired = (result == VK_SUCCESS || result == VK_SUBOPTIMAL_KHR);
+}
+
+void Vulkan_EndFrame(Device& device, const RenderTarget* presentTarget, ivec2 size)
+{
+    VulkanDeviceWrapper& vk = GetVulkanDeviceWrapper(device);
+    VulkanFrame& frame = Vulkan_GetFrame(vk);
+    VkCommandBuffer commandBuffer = Vulkan_GetCommandBuffer(vk);
+    ASSERT(!vk.isInRenderPass, "The frame ended inside a render pass");
+
+    if (vk.isSwapchainImageAcquired)
+    {
+        VkImage swapchainImage = vk.swapchainImages[vk.swapchainImageIdx];
+        Vulkan_TransitionImage(commandBuffer, swapchainImage, VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+        if (presentTarget)
+        {
+            Vulkan_TransitionImage(commandBuffer, presentTarget->handle, VK_IMAGE_ASPECT_COLOR_BIT, presentTarget->layout, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+            presentTarget->layout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+
+            const i32 width = min(size.x, (i32)vk.swapchainExtent.width);
+            const i32 height = min(size.y, (i32)vk.swapchainExtent.height);
+            VkImageBlit region = {};
+            region.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+            region.srcOffsets[0] = { 0, 0, 0 };
+            region.srcOffsets[1] = { width, height, 1 };
+            region.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+            region.dstOffsets[0] = { 0, 0, 0 };
+            region.dstOffsets[1] = { width, height, 1 };
+            vkCmdBlitImage(commandBuffer, presentTarget->handle, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           swapchainImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region, VK_FILTER_NEAREST);
+        }
+
+        Vulkan_TransitionImage(commandBuffer, swapchainImage, VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+    }
+
+    VK_CHECK(vkEndCommandBuffer(commandBuffer));
+    frame.isRecording = false;
+
+    VkCommandBufferSubmitInfo commandBufferInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO };
+    commandBufferInfo.commandBuffer = commandBuffer;
+
+    VkSemaphoreSubmitInfo waitInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO };
+    waitInfo.semaphore = frame.acquireSemaphore;
+    waitInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+
+    VkSemaphoreSubmitInfo signalInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO };
+    signalInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+
+    VkSubmitInfo2 submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO_2 };
+    submitInfo.commandBufferInfoCount = 1;
+    submitInfo.pCommandBufferInfos = &commandBufferInfo;
+    if (vk.isSwapchainImageAcquired)
+    {
+        signalInfo.semaphore = vk.presentSemaphores[vk.swapchainImageIdx];
+        submitInfo.waitSemaphoreInfoCount = 1;
+        submitInfo.pWaitSemaphoreInfos = &waitInfo;
+        submitInfo.signalSemaphoreInfoCount = 1;
+        submitInfo.pSignalSemaphoreInfos = &signalInfo;
+    }
+    VK_CHECK(vkQueueSubmit2(vk.queue, 1, &submitInfo, frame.fence));
+
+    if (vk.isSwapchainImageAcquired)
+    {
+        VkPresentInfoKHR presentInfo = { VK_STRUCTURE_TYPE_PRESENT_INFO_KHR };
+        presentInfo.waitSemaphoreCount = 1;
+        presentInfo.pWaitSemaphores = &signalInfo.semaphore;
+        presentInfo.swapchainCount = 1;
+        presentInfo.pSwapchains = &vk.swapchain;
+        presentInfo.pImageIndices = &vk.swapchainImageIdx;
+        const VkResult result = vkQueuePresentKHR(vk.queue, &presentInfo);
+        if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
+            Vulkan_CreateSwapchain(vk);
+        vk.isSwapchainImageAcquired = false;
+    }
+
+    vk.frameIdx = (vk.frameIdx + 1) % VULKAN_FRAME_COUNT;
+}
+
+static const VkBufferUsageFlags VkBufferUsageFromBufferType[] = {
+    VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+    VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+    VK_BUFFER_USAGE_INDEX_BUFFER_BIT
+};
+CASSERT(ARRAY_COUNT(VkBufferUsageFromBufferType) == BufferType_Count, "");
+
+// Buffers live in device local memory whatever their usage, mapping them hands out staging
+// memory of the frame and unmapping records the copy
+Buffer Vulkan_CreateBuffer(Device& device, u32 size, BufferType type, BufferUsage usage)
+{
+    VulkanDeviceWrapper& vk = GetVulkanDeviceWrapper(device);
+
+    Buffer buffer = {};
+    buffer.size = size;
+    buffer.type = type;
+    Vulkan_CreateBufferMemory(vk, size, VkBufferUsageFromBufferType[type] | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer.handle, buffer.memory);
+    return buffer;
+}
+
+void Vulkan_BindBuffer(const Buffer& buffer)
+{
+    // Vertex and index buffers are bound by the draws that use them
+}
+
+// Hands out size bytes of staging memory of the frame, copied by the command buffer of the frame
+static void Vulkan_AllocateUpload(VulkanDeviceWrapper& vk, u32 size, VkBuffer& uploadBuffer, u32& uploadOffset, void*& uploadData)
+{
+    VulkanFrame& frame = Vulkan_GetFrame(vk);
+    Vulkan_GetCommandBuffer(vk); // Resets the ring if the frame starts recording
+
+    const u32 offset = (frame.uploadHead + VULKAN_UPLOAD_ALIGNMENT - 1) & ~(VULKAN_UPLOAD_ALIGNMENT - 1);
+    if (offset + size <= VULKAN_UPLOAD_RING_SIZE)
+    {
+        frame.uploadHead = offset + size;
+        uploadBuffer = frame.uploadBuffer;
+        uploadOffset = offset;
+        uploadData = frame.uploadData + offset;
+        return;
+    }
+
+    // Does not fit in what is left of the ring (e.g. the geometry of a large model)
+    VkBuffer stagingBuffer;
+    VkDeviceMemory stagingMemory;
+    if (!Vulkan_CreateBufferMemory(vk, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                   stagingBuffer, stagingMemory))
+    {
+        INVALID_CODE_PATH("Could not allocate staging memory");
+        return;
+    }
+    frame.stagingBuffers.push_back(stagingBuffer);
+    frame.stagingMemories.push_back(stagingMemory);
+
+    uploadBuffer = stagingBuffer;
+    uploadOffset = 0;
+    VK_CHECK(vkMapMemory(vk.device, stagingMemory, 0, VK_WHOLE_SIZE, 0, &uploadData));
+}
+
+void Vulkan_MapBuffer(const Buffer& buffer, Access access)
+{
+    ASSERT(access == Access_Write, "Vulkan buffers can only be mapped for writing");
+    Vulkan_AllocateUpload(s_vulkanDeviceWrapper, buffer.size, buffer.uploadBuffer, buffer.uploadOffset, buffer.data);
+}
+
+void Vulkan_UnmapBuffer(const Buffer& buffer)
+{
+    VulkanDeviceWrapper& vk = s_vulkanDeviceWrapper;
+    ASSERT(!vk.isInRenderPass, "Buffers cannot be uploaded inside a render pass");
+    VkCommandBuffer commandBuffer = Vulkan_GetCommandBuffer(vk);
+
+    // Buffers rewritten every frame (constants, instancing) may still be read by the previous one
+    Vulkan_MemoryBarrier(commandBuffer, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_READ_BIT,
+                         VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+
+    // Writers that do not advance the head filled the whole buffer
+    VkBufferCopy region = {};
+    region.srcOffset = buffer.uploadOffset;
+    region.size = buffer.head > 0 ? buffer.head : buffer.size;
+    vkCmdCopyBuffer(commandBuffer, buffer.uploadBuffer, buffer.handle, 1, &region);
+
+    Vulkan_MemoryBarrier(commandBuffer, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                         VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_READ_BIT);
+
+    buffer.uploadBuffer = VK_NULL_HANDLE;
+}
+
+static const VkFormat VkFormatFromRenderTargetType[] = {
+    VK_FORMAT_R8G8B8A8_UNORM,
+    VK_FORMAT_R32G32B32A32_SFLOAT,
+    VK_FORMAT_D32_SFLOAT, // Unlike D24 it is supported everywhere as a depth attachment
+    VK_FORMAT_R32_UINT,
+};
+CASSERT(ARRAY_COUNT(VkFormatFromRenderTargetType) == RenderTargetType_Count, "");
+
+static bool IsDepthRenderTarget(const RenderTarget& renderTarget)
+{
+    return renderTarget.type == RenderTargetType_Depth;
+}
+
+bool Vulkan_CreateRenderTarget(RenderTarget& renderTarget, ivec2 size, RenderTargetType type)
+{
+    VulkanDeviceWrapper& vk = s_vulkanDeviceWrapper;
+    const bool isDepth = type == RenderTargetType_Depth;
+    const VkFormat format = VkFormatFromRenderTargetType[type];
+
+    VkImageCreateInfo imageInfo = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = format;
+    imageInfo.extent = { (u32)size.x, (u32)size.y, 1 };
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+                      (isDepth ? VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT : VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    if (vkCreateImage(vk.device, &imageInfo, NULL, &renderTarget.handle) != VK_SUCCESS)
+    {
+        ELOG("vkCreateImage() failed (%dx%d)", size.x, size.y);
+        return false;
+    }
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(vk.device, renderTarget.handle, &requirements);
+
+    VkMemoryAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
+    allocateInfo.allocationSize = requirements.size;
+    allocateInfo.memoryTypeIndex = Vulkan_FindMemoryType(vk, requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    VK_CHECK(vkAllocateMemory(vk.device, &allocateInfo, NULL, &renderTarget.memory));
+    VK_CHECK(vkBindImageMemory(vk.device, renderTarget.handle, renderTarget.memory, 0));
+
+    VkImageViewCreateInfo viewInfo = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
+    viewInfo.image = renderTarget.handle;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = format;
+    viewInfo.subresourceRange = { (VkImageAspectFlags)(isDepth ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT), 0, 1, 0, 1 };
+    VK_CHECK(vkCreateImageView(vk.device, &viewInfo, NULL, &renderTarget.view));
+
+    renderTarget.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    return true;
+}
+
+void Vulkan_DestroyRenderTarget(const RenderTarget& renderTarget)
+{
+    if (!renderTarget.handle)
+        return;
+
+    // Frames in flight may still use it, render targets only go away on resizes and shutdown
+    VulkanDeviceWrapper& vk = s_vulkanDeviceWrapper;
+    VK_CHECK(vkDeviceWaitIdle(vk.device));
+    vkDestroyImageView(vk.device, renderTarget.view, NULL);
+    vkDestroyImage(vk.device, renderTarget.handle, NULL);
+    vkFreeMemory(vk.device, renderTarget.memory, NULL);
+}
+
+// Sampled from set 1 by the draws, with mips blitted down from the image like glGenerateMipmap
+void Vulkan_CreateTexture2D(const Device& device, Texture& texture, const Image& image)
+{
+    VulkanDeviceWrapper& vk = GetVulkanDeviceWrapper(device);
+    ASSERT(!vk.isInRenderPass, "Textures cannot be uploaded inside a render pass");
+
+    if (image.nchannels != 3 && image.nchannels != 4)
+    {
+        ELOG("Vulkan_CreateTexture2D() - Unsupported number of channels");
+        return;
+    }
+
+    const u32 width = image.size.x;
+    const u32 height = image.size.y;
+    u32 levelCount = 1;
+    while ((width | height) >> levelCount)
+        levelCount++;
+
+    const VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
+
+    VkImageCreateInfo imageInfo = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = format;
+    imageInfo.extent = { width, height, 1 };
+    imageInfo.mipLevels = levelCount;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    if (vkCreateImage(vk.device, &imageInfo, NULL, &texture.handle) != VK_SUCCESS)
+    {
+        ELOG("vkCreateImage() failed (%ux%u)", width, height);
+        texture.handle = VK_NULL_HANDLE;
+        return;
+    }
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(vk.device, texture.handle, &requirements);
+
+    VkMemoryAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
+    allocateInfo.allocationSize = requirements.size;
+    allocateInfo.memoryTypeIndex = Vulkan_FindMemoryType(vk, requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    VK_CHECK(vkAllocateMemory(vk.device, &allocateInfo, NULL, &texture.memory));
+    VK_CHECK(vkBindImageMemory(vk.device, texture.handle, texture.memory, 0));
+
+    // RGB images are expanded to RGBA, few devices sample three channel formats
+    VkBuffer uploadBuffer;
+    u32 uploadOffset;
+    void* uploadData;
+    Vulkan_AllocateUpload(vk, width * height * 4, uploadBuffer, uploadOffset, uploadData);
+    for (u32 y = 0; y < height; ++y)
+    {
+        const u8* src = (const u8*)image.pixels + y * image.stride;
+        u8* dst = (u8*)uploadData + y * width * 4;
+        for (u32 x = 0; x < width; ++x, src += image.nchannels, dst += 4)
+        {
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
+            dst[3] = image.nchannels == 4 ? src[3] : 255;
+        }
+    }
+
+    VkCommandBuffer commandBuffer = Vulkan_GetCommandBuffer(vk);
+    Vulkan_TransitionImageLevels(commandBuffer, texture.handle, VK_IMAGE_ASPECT_COLOR_BIT, 0, levelCount, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+    VkBufferImageCopy region = {};
+    region.bufferOffset = uploadOffset;
+    region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    region.imageExtent = { width, height, 1 };
+    vkCmdCopyBufferToImage(commandBuffer, uploadBuffer, texture.handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    for (u32 level = 1; level < levelCount; ++level)
+    {
+        Vulkan_TransitionImageLevels(commandBuffer, texture.handle, VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 1, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+
+        VkImageBlit blit = {};
+        blit.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 0, 1 };
+        blit.srcOffsets[1] = { (i32)max(width >> (level - 1), 1u), (i32)max(height >> (level - 1), 1u), 1 };
+        blit.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1 };
+        blit.dstOffsets[1] = { (i32)max(width >> level, 1u), (i32)max(height >> level, 1u), 1 };
+        vkCmdBlitImage(commandBuffer, texture.handle, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                       texture.handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+    }
+
+    // Every level but the last was the source of a blit
+    if (levelCount > 1)
+        Vulkan_TransitionImageLevels(commandBuffer, texture.handle, VK_IMAGE_ASPECT_COLOR_BIT, 0, levelCount - 1, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    Vulkan_TransitionImageLevels(commandBuffer, texture.handle, VK_IMAGE_ASPECT_COLOR_BIT, levelCount - 1, 1, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    VkImageViewCreateInfo viewInfo = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
+    viewInfo.image = texture.handle;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = format;
+    viewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, levelCount, 0, 1 };
+    VK_CHECK(vkCreateImageView(vk.device, &viewInfo, NULL, &texture.view));
+
+    VkDescriptorSetAllocateInfo setInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+    setInfo.descriptorPool = vk.textureDescriptorPool;
+    setInfo.descriptorSetCount = 1;
+    setInfo.pSetLayouts = &vk.textureSetLayout;
+    VK_CHECK(vkAllocateDescriptorSets(vk.device, &setInfo, &texture.descriptorSet));
+
+    VkDescriptorImageInfo descriptorImageInfo = {};
+    descriptorImageInfo.sampler = vk.sampler;
+    descriptorImageInfo.imageView = texture.view;
+    descriptorImageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    VkWriteDescriptorSet write = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+    write.dstSet = texture.descriptorSet;
+    write.dstBinding = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write.pImageInfo = &descriptorImageInfo;
+    vkUpdateDescriptorSets(vk.device, 1, &write, 0, NULL);
+}
+
+static const VkAttachmentLoadOp VkLoadOpFromLoadOp[] = {
+    VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+    VK_ATTACHMENT_LOAD_OP_CLEAR,
+    VK_ATTACHMENT_LOAD_OP_LOAD,
+};
+CASSERT(ARRAY_COUNT(VkLoadOpFromLoadOp) == LoadOp_Load + 1, "");
+
+static const VkAttachmentStoreOp VkStoreOpFromStoreOp[] = {
+    VK_ATTACHMENT_STORE_OP_DONT_CARE,
+    VK_ATTACHMENT_STORE_OP_STORE,
+};
+CASSERT(ARRAY_COUNT(VkStoreOpFromStoreOp) == StoreOp_Store + 1, "");
+
+void Vulkan_BeginRenderPass(const Device& device, const RenderPass& renderPass, const Framebuffer& framebuffer)
+{
+    VulkanDeviceWrapper& vk = GetVulkanDeviceWrapper(device);
+    ASSERT(!vk.isInRenderPass, "Render passes cannot be nested");
+    VkCommandBuffer commandBuffer = Vulkan_GetCommandBuffer(vk);
+
+    VkRenderingAttachmentInfo colorAttachments[MAX_FRAMEBUFFER_ATTACHMENTS];
+    VkRenderingAttachmentInfo depthAttachment = { VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO };
+    bool hasDepthAttachment = false;
+    vk.colorFormatCount = 0;
+    vk.depthFormat = VK_FORMAT_UNDEFINED;
+    VkExtent2D extent = { UINT32_MAX, UINT32_MAX };
+
+    for (u32 i = 0; i < framebuffer.attachmentCount; ++i)
+    {
+        const Attachment& attachment = framebuffer.attachments[i];
+        const RenderTarget& renderTarget = device.renderTargets[attachment.renderTargetIdx];
+        const bool isDepth = IsDepthRenderTarget(renderTarget);
+
+        // Attachments without an action keep their contents, as in OpenGL
+        LoadOp loadOp = LoadOp_Load;
+        StoreOp storeOp = StoreOp_Store;
+        ClearValue clearValue = {};
+        for (u32 j = 0; j < renderPass.attachmentActionCount; ++j)
+        {
+            const AttachmentAction& action = renderPass.attachmentActions[j];
+            if (action.attachmentIdx == i)
+            {
+                loadOp = action.loadOp;
+                storeOp = action.storeOp;
+                clearValue = action.clearValue;
+            }
+        }
+
+        const VkImageLayout layout = isDepth ? VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        if (renderTarget.layout != layout)
+        {
+            // Contents that are not loaded need not survive the transition
+            const VkImageLayout oldLayout = loadOp == LoadOp_Load ? renderTarget.layout : VK_IMAGE_LAYOUT_UNDEFINED;
+            Vulkan_TransitionImage(commandBuffer, renderTarget.handle, isDepth ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT, oldLayout, layout);
+            renderTarget.layout = layout;
+        }
+
+        VkRenderingAttachmentInfo attachmentInfo = { VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO };
+        attachmentInfo.imageView = renderTarget.view;
+        attachmentInfo.imageLayout = layout;
+        attachmentInfo.loadOp = VkLoadOpFromLoadOp[loadOp];
+        attachmentInfo.storeOp = VkStoreOpFromStoreOp[storeOp];
+        if (isDepth)
+        {
+            attachmentInfo.clearValue.depthStencil.depth = clearValue.depth;
+            depthAttachment = attachmentInfo;
+            hasDepthAttachment = true;
+            vk.depthFormat = VkFormatFromRenderTargetType[renderTarget.type];
+        }
+        else
+        {
+            if (renderTarget.type == RenderTargetType_UInt)
+                attachmentInfo.clearValue.color.uint32[0] = clearValue.colorUInt;
+            else
+                MemCopy(attachmentInfo.clearValue.color.float32, &clearValue.color, sizeof(f32) * 4);
+            vk.colorFormats[vk.colorFormatCount] = VkFormatFromRenderTargetType[renderTarget.type];
+            colorAttachments[vk.colorFormatCount++] = attachmentInfo;
+        }
+
+        extent.width = min(extent.width, (u32)renderTarget.size.x);
+        extent.height = min(extent.height, (u32)renderTarget.size.y);
+    }
+
+    VkRenderingInfo renderingInfo = { VK_STRUCTURE_TYPE_RENDERING_INFO };
+    renderingInfo.flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT;
+    renderingInfo.renderArea.extent = extent;
+    renderingInfo.layerCount = 1;
+    renderingInfo.colorAttachmentCount = vk.colorFormatCount;
+    renderingInfo.pColorAttachments = colorAttachments;
+    renderingInfo.pDepthAttachment = hasDepthAttachment ? &depthAttachment : NULL;
+    vkCmdBeginRendering(commandBuffer, &renderingInfo);
+
+    vk.isInRenderPass = true;
+}
+
+void Vulkan_EndRenderPass(const Device& device, const RenderPass& renderPass, const Framebuffer& framebuffer)
+{
+    VulkanDeviceWrapper& vk = GetVulkanDeviceWrapper(device);
+    ASSERT(vk.isInRenderPass, "No render pass to end");
+    vkCmdEndRendering(Vulkan_GetCommandBuffer(vk));
+    vk.isInRenderPass = false;
+}
+
+// SPIR-V reflection of just what the engine needs: the per-vertex inputs of the vertex stage and
+// the uniform blocks with their bindings and std140 sizes
+enum SpirvOp
+{
+    SpirvOp_Name           = 5,
+    SpirvOp_TypeInt        = 21,
+    SpirvOp_TypeFloat      = 22,
+    SpirvOp_TypeVector     = 23,
+    SpirvOp_TypeMatrix     = 24,
+    SpirvOp_TypeArray      = 28,
+    SpirvOp_TypeStruct     = 30,
+    SpirvOp_TypePointer    = 32,
+    SpirvOp_Constant       = 43,
+    SpirvOp_Variable       = 59,
+    SpirvOp_Decorate       = 71,
+    SpirvOp_MemberDecorate = 72,
+};
+
+enum SpirvDecoration
+{
+    SpirvDecoration_Block       = 2,
+    SpirvDecoration_ArrayStride = 6,
+    SpirvDecoration_Location    = 30,
+    SpirvDecoration_Binding     = 33,
+    SpirvDecoration_Offset      = 35,
+};
+
+enum SpirvStorageClass
+{
+    SpirvStorageClass_Input   = 1,
+    SpirvStorageClass_Uniform = 2,
+};
+
+#define SPIRV_MAGIC       0x07230203
+#define SPIRV_HEADER_SIZE 5
+
+struct SpirvModule
+{
+    std::vector<const u32*>  definitions; // Instruction of each type, constant and variable id
+    std::vector<const char*> names;
+    std::vector<const u32*>  decorations;
+    std::vector<const u32*>  variables;
+};
+
+static bool Spirv_Parse(const std::vector<u32>& code, SpirvModule& module)
+{
+    if (code.size() < SPIRV_HEADER_SIZE || code[0] != SPIRV_MAGIC)
+        return false;
+
+    const u32 bound = code[3];
+    module.definitions.assign(bound, (const u32*)NULL);
+    module.names.assign(bound, "");
+
+    for (u32 i = SPIRV_HEADER_SIZE; i < code.size(); )
+    {
+        const u32* instruction = &code[i];
+        const u32 opcode = instruction[0] & 0xffff;
+        const u32 wordCount = instruction[0] >> 16;
+        if (wordCount == 0 || i + wordCount > code.size())
+            return false;
+
+        switch (opcode)
+        {
+            case SpirvOp_Name:
+                if (instruction[1] < bound)
+                    module.names[instruction[1]] = (const char*)&instruction[2];
+                break;
+            case SpirvOp_TypeInt:
+            case SpirvOp_TypeFloat:
+            case SpirvOp_TypeVector:
+            case SpirvOp_TypeMatrix:
+            case SpirvOp_TypeArray:
+            case SpirvOp_TypeStruct:
+            case SpirvOp_TypePointer:
+                if (instruction[1] < bound)
+                    module.definitions[instruction[1]] = instruction;
+                break;
+            case SpirvOp_Constant:
+            case SpirvOp_Variable:
+                if (instruction[2] < bound)
+                    module.definitions[instruction[2]] = instruction;
+                if (opcode == SpirvOp_Variable)
+                    module.variables.push_back(instruction);
+                break;
+            case SpirvOp_Decorate:
+            case SpirvOp_MemberDecorate:
+                module.decorations.push_back(instruction);
+                break;
+        }
+        i += wordCount;
+    }
+    return true;
+}
+
+// Value of the decoration of id, UINT32_MAX if it does not have it
+static u32 Spirv_FindDecoration(const SpirvModule& module, u32 id, u32 decoration)
+{
+    for (u32 i = 0; i < module.decorations.size(); ++i)
+    {
+        const u32* instruction = module.decorations[i];
+        if ((instruction[0] & 0xffff) == SpirvOp_Decorate && instruction[1] == id && instruction[2] == decoration)
+            return (instruction[0] >> 16) > 3 ? instruction[3] : 0;
+    }
+    return UINT32_MAX;
+}
+
+static u32 Spirv_FindMemberOffset(const SpirvModule& module, u32 structId, u32 member)
+{
+    for (u32 i = 0; i < module.decorations.size(); ++i)
+    {
+        const u32* instruction = module.decorations[i];
+        if ((instruction[0] & 0xffff) == SpirvOp_MemberDecorate && instruction[1] == structId &&
+            instruction[2] == member && instruction[3] == SpirvDecoration_Offset)
+            return instruction[4];
+    }
+    return 0;
+}
+
+// Size of a type laid out with std140, as GL_UNIFORM_BLOCK_DATA_SIZE reports it
+static u32 Spirv_TypeSize(const SpirvModule& module, u32 typeId)
+{
+    const u32* type = module.definitions[typeId];
+    ASSERT(type, "Undefined SPIR-V type");
+    switch (type[0] & 0xffff)
+    {
+        case SpirvOp_TypeInt:
+        case SpirvOp_TypeFloat:
+            return type[2] / 8;
+        case SpirvOp_TypeVector:
+            return type[3] * Spirv_TypeSize(module, type[2]);
+        case SpirvOp_TypeMatrix:
+            return type[3] * sizeof(vec4); // Columns are vec4 aligned
+        case SpirvOp_TypeArray:
+            return module.definitions[type[3]][3] * Spirv_FindDecoration(module, typeId, SpirvDecoration_ArrayStride);
+        case SpirvOp_TypeStruct:
+        {
+            u32 size = 0;
+            const u32 memberCount = (type[0] >> 16) - 2;
+            for (u32 i = 0; i < memberCount; ++i)
+                size = max(size, Spirv_FindMemberOffset(module, typeId, i) + Spirv_TypeSize(module, type[2 + i]));
+            return (size + sizeof(vec4) - 1) & ~(u32)(sizeof(vec4) - 1);
+        }
+    }
+    INVALID_CODE_PATH("Unsupported SPIR-V type in a uniform block");
+    return 0;
+}
+
+static VertexShaderLayout Spirv_ReflectVertexInputs(const SpirvModule& module)
+{
+    VertexShaderLayout layout = {};
+
+    for (u32 i = 0; i < module.variables.size(); ++i)
+    {
+        const u32* variable = module.variables[i];
+        if (variable[3] != SpirvStorageClass_Input)
+            continue;
+
+        // Built-ins have no location, and the instancing stream is not part of the layout
+        const u32 location = Spirv_FindDecoration(module, variable[2], SpirvDecoration_Location);
+        const u32 VertexStream_FirstInstancingStream = 6;
+        if (location == UINT32_MAX || location >= VertexStream_FirstInstancingStream)
+            continue;
+
+        const u32* pointer = module.definitions[variable[1]];
+        const u32* type = module.definitions[pointer[3]];
+        u8 componentCount = 0;
+        switch (type[0] & 0xffff)
+        {
+            case SpirvOp_TypeFloat:  componentCount = 1; break;
+            case SpirvOp_TypeVector: componentCount = (u8)type[3]; break;
+            default: INVALID_CODE_PATH("Unsupported attribute type");
+        }
+
+        ASSERT(layout.attributeCount < ARRAY_COUNT(layout.attributes), "Max number of attributes reached.");
+        layout.attributes[layout.attributeCount++] = { (u8)location, componentCount };
+    }
+
+    return layout;
+}
+
+static void Spirv_ReflectUniformBlocks(const SpirvModule& module, PipelineState& pipelineState)
+{
+    for (u32 i = 0; i < module.variables.size(); ++i)
+    {
+        const u32* variable = module.variables[i];
+        if (variable[3] != SpirvStorageClass_Uniform)
+            continue;
+
+        const u32 blockTypeId = module.definitions[variable[1]][3];
+        const u32 binding = Spirv_FindDecoration(module, variable[2], SpirvDecoration_Binding);
+        if (Spirv_FindDecoration(module, blockTypeId, SpirvDecoration_Block) == UINT32_MAX || binding == UINT32_MAX)
+            continue;
+
+        // Blocks used by both stages are reflected once
+        bool isReflected = false;
+        for (u32 j = 0; j < pipelineState.uniformBlockCount; ++j)
+            isReflected |= pipelineState.uniformBlocks[j].binding == binding;
+        if (isReflected)
+            continue;
+
+        ASSERT(pipelineState.uniformBlockCount < ARRAY_COUNT(pipelineState.uniformBlocks), "Max number of uniform blocks per pipeline reached");
+        PipelineUniformBlock& block = pipelineState.uniformBlocks[pipelineState.uniformBlockCount++];
+        snprintf(block.name, sizeof(block.name), "%s", module.names[blockTypeId]);
+        block.binding = binding;
+        block.size = Spirv_TypeSize(module, blockTypeId);
+    }
+}
+
+// Loads spirv/<permutationName>.<stage>.spv, false if it was not precompiled
+static bool Vulkan_LoadSpirv(const Program& program, const char* stage, std::vector<u32>& code)
+{
+    char filepath[256];
+    snprintf(filepath, sizeof(filepath), VULKAN_SPIRV_DIRECTORY "/%s.%s.spv", program.permutationName.str, stage);
+
+    FILE* file = fopen(filepath, "rb");
+    if (!file)
+        return false;
+
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    code.resize(size > 0 ? size / sizeof(u32) : 0);
+    const bool isRead = size > 0 && size % sizeof(u32) == 0 && fread(code.data(), size, 1, file) == 1;
+    fclose(file);
+
+    if (!isRead)
+        ELOG("Could not read %s", filepath);
+    return isRead;
+}
+
+static VkShaderModule Vulkan_CreateShaderModule(const VulkanDeviceWrapper& vk, const std::vector<u32>& code)
+{
+    VkShaderModuleCreateInfo moduleInfo = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+    moduleInfo.codeSize = code.size() * sizeof(u32);
+    moduleInfo.pCode = code.data();
+
+    VkShaderModule shaderModule = VK_NULL_HANDLE;
+    if (vkCreateShaderModule(vk.device, &moduleInfo, NULL, &shaderModule) != VK_SUCCESS)
+        ELOG("vkCreateShaderModule() failed");
+    return shaderModule;
+}
+
+bool Vulkan_CreateProgram(const Device& device, Program& program)
+{
+    VulkanDeviceWrapper& vk = GetVulkanDeviceWrapper(device);
+
+    std::vector<u32> vertexCode, fragmentCode;
+    if (!Vulkan_LoadSpirv(program, "vert", vertexCode) || !Vulkan_LoadSpirv(program, "frag", fragmentCode))
+    {
+        // Not every program is ported, their passes are skipped on Vulkan
+        ILOG("No SPIR-V for program %s, it is not drawn on Vulkan", program.permutationName.str);
+        return false;
+    }
+
+    SpirvModule vertexModule;
+    if (!Spirv_Parse(vertexCode, vertexModule))
+    {
+        ELOG("Invalid SPIR-V for the vertex stage of program %s", program.permutationName.str);
+        return false;
+    }
+
+    program.vertexModule = Vulkan_CreateShaderModule(vk, vertexCode);
+    program.fragmentModule = Vulkan_CreateShaderModule(vk, fragmentCode);
+    program.vertexInputLayout = Spirv_ReflectVertexInputs(vertexModule);
+    return program.vertexModule && program.fragmentModule;
+}
+
+void Vulkan_CreatePipelineState(const Device& device, PipelineState& pipelineState)
+{
+    const Program& program = device.programs[pipelineState.desc.programIdx];
+    pipelineState.uniformBlockCount = 0;
+
+    const char* stages[] = { "vert", "frag" };
+    for (u32 i = 0; i < ARRAY_COUNT(stages); ++i)
+    {
+        std::vector<u32> code;
+        SpirvModule module;
+        if (Vulkan_LoadSpirv(program, stages[i], code) && Spirv_Parse(code, module))
+            Spirv_ReflectUniformBlocks(module, pipelineState);
+    }
+}
+
+static bool IsSameVertexBufferLayout(const VertexBufferLayout& a, const VertexBufferLayout& b)
+{
+    if (a.stride != b.stride || a.attributeCount != b.attributeCount)
+        return false;
+    for (u32 i = 0; i < a.attributeCount; ++i)
+        if (a.attributes[i].location != b.attributes[i].location ||
+            a.attributes[i].componentCount != b.attributes[i].componentCount ||
+            a.attributes[i].offset != b.attributes[i].offset)
+            return false;
+    return true;
+}
+
+static const VkFormat VkFormatFromComponentCount[] = {
+    VK_FORMAT_UNDEFINED,
+    VK_FORMAT_R32_SFLOAT,
+    VK_FORMAT_R32G32_SFLOAT,
+    VK_FORMAT_R32G32B32_SFLOAT,
+    VK_FORMAT_R32G32B32A32_SFLOAT,
+};
+
+static VkPipeline Vulkan_CreatePipeline(const Device& device, const VulkanDeviceWrapper& vk, const PipelineStateDesc& desc, const VertexBufferLayout& vertexBufferLayout)
+{
+    const Program& program = device.programs[desc.programIdx];
+    ASSERT(!desc.depthClamp, "Depth clamp is not enabled on the Vulkan device");
+
+    VkPipelineShaderStageCreateInfo stages[2] = {};
+    stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    stages[0].module = program.vertexModule;
+    stages[0].pName = "main";
+    stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    stages[1].module = program.fragmentModule;
+    stages[1].pName = "main";
+
+    // Binding 0 streams the vertices of the submesh and binding 1 the instancing data, with
+    // the same vertex inputs linking as the OpenGL VAOs
+    VkVertexInputBindingDescription bindings[2] = {};
+    bindings[0] = { 0, vertexBufferLayout.stride, VK_VERTEX_INPUT_RATE_VERTEX };
+    bindings[1] = { 1, desc.instanceStride, VK_VERTEX_INPUT_RATE_INSTANCE };
+
+    VkVertexInputAttributeDescription attributes[MAX_ATTRIBUTE_COUNT + 8];
+    u32 attributeCount = 0;
+    const VertexShaderLayout& shaderLayout = program.vertexInputLayout;
+    for (u32 i = 0; i < shaderLayout.attributeCount; ++i)
+    {
+        bool attributeWasLinked = false;
+        for (u32 j = 0; j < vertexBufferLayout.attributeCount; ++j)
+        {
+            const VertexBufferAttribute& attribute = vertexBufferLayout.attributes[j];
+            if (shaderLayout.attributes[i].location == attribute.location)
+            {
+                attributes[attributeCount++] = { attribute.location, 0, VkFormatFromComponentCount[attribute.componentCount], attribute.offset };
+                attributeWasLinked = true;
+                break;
+            }
+        }
+        ASSERT(attributeWasLinked, "The submesh should provide an attribute for each vertex input");
+    }
+
+    const u32 VertexStream_FirstInstancingStream = 6;
+    ASSERT(attributeCount + desc.instanceAttributeCount <= ARRAY_COUNT(attributes), "Max number of instance attributes reached");
+    for (u32 i = 0; i < desc.instanceAttributeCount; ++i)
+        attributes[attributeCount++] = { VertexStream_FirstInstancingStream + i, 1, VK_FORMAT_R32G32B32A32_SFLOAT, (u32)(i * sizeof(vec4)) };
+
+    VkPipelineVertexInputStateCreateInfo vertexInputState = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
+    vertexInputState.vertexBindingDescriptionCount = desc.instanceAttributeCount > 0 ? 2 : 1;
+    vertexInputState.pVertexBindingDescriptions = bindings;
+    vertexInputState.vertexAttributeDescriptionCount = attributeCount;
+    vertexInputState.pVertexAttributeDescriptions = attributes;
+
+    VkPipelineInputAssemblyStateCreateInfo inputAssemblyState = { VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
+    inputAssemblyState.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+    VkPipelineViewportStateCreateInfo viewportState = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
+    viewportState.viewportCount = 1;
+    viewportState.scissorCount = 1;
+
+    // Draws flip the viewport like OpenGL, so counter-clockwise triangles keep facing front
+    VkPipelineRasterizationStateCreateInfo rasterizationState = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
+    rasterizationState.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterizationState.cullMode = desc.cullMode == CullMode_Back ? VK_CULL_MODE_BACK_BIT : VK_CULL_MODE_NONE;
+    rasterizationState.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+    rasterizationState.depthBiasEnable = desc.polygonOffset;
+    rasterizationState.depthBiasConstantFactor = desc.polygonOffsetUnits;
+    rasterizationState.depthBiasSlopeFactor = desc.polygonOffsetFactor;
+    rasterizationState.lineWidth = 1.0f;
+
+    VkPipelineMultisampleStateCreateInfo multisampleState = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
+    multisampleState.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+    VkPipelineDepthStencilStateCreateInfo depthStencilState = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
+    depthStencilState.depthTestEnable = desc.depthTest;
+    depthStencilState.depthWriteEnable = desc.depthWrite;
+    depthStencilState.depthCompareOp = VK_COMPARE_OP_LESS;
+
+    VkPipelineColorBlendAttachmentState blendAttachments[MAX_FRAMEBUFFER_ATTACHMENTS] = {};
+    for (u32 i = 0; i < vk.colorFormatCount; ++i)
+    {
+        VkPipelineColorBlendAttachmentState& blendAttachment = blendAttachments[i];
+        blendAttachment.blendEnable = desc.blendMode == BlendMode_Alpha;
+        blendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+        blendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+        blendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+        blendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+        blendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+        blendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+        blendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    }
+
+    VkPipelineColorBlendStateCreateInfo colorBlendState = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
+    colorBlendState.attachmentCount = vk.colorFormatCount;
+    colorBlendState.pAttachments = blendAttachments;
+
+    const VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+    VkPipelineDynamicStateCreateInfo dynamicState = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
+    dynamicState.dynamicStateCount = ARRAY_COUNT(dynamicStates);
+    dynamicState.pDynamicStates = dynamicStates;
+
+    VkPipelineRenderingCreateInfo renderingInfo = { VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO };
+    renderingInfo.colorAttachmentCount = vk.colorFormatCount;
+    renderingInfo.pColorAttachmentFormats = vk.colorFormats;
+    renderingInfo.depthAttachmentFormat = vk.depthFormat;
+
+    VkGraphicsPipelineCreateInfo pipelineInfo = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
+    pipelineInfo.pNext = &renderingInfo;
+    pipelineInfo.stageCount = ARRAY_COUNT(stages);
+    pipelineInfo.pStages = stages;
+    pipelineInfo.pVertexInputState = &vertexInputState;
+    pipelineInfo.pInputAssemblyState = &inputAssemblyState;
+    pipelineInfo.pViewportState = &viewportState;
+    pipelineInfo.pRasterizationState = &rasterizationState;
+    pipelineInfo.pMultisampleState = &multisampleState;
+    pipelineInfo.pDepthStencilState = &depthStencilState;
+    pipelineInfo.pColorBlendState = &colorBlendState;
+    pipelineInfo.pDynamicState = &dynamicState;
+    pipelineInfo.layout = vk.pipelineLayout;
+
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    if (vkCreateGraphicsPipelines(vk.device, VK_NULL_HANDLE, 1, &pipelineInfo, NULL, &pipeline) != VK_SUCCESS)
+        ELOG("vkCreateGraphicsPipelines() failed for program %s", program.permutationName.str);
+    return pipeline;
+}
+
+VkPipeline Vulkan_FindPipeline(const Device& device, u32 pipelineStateIdx, const VertexBufferLayout& vertexBufferLayout)
+{
+    VulkanDeviceWrapper& vk = GetVulkanDeviceWrapper(device);
+    ASSERT(vk.isInRenderPass, "Pipelines are found for the attachment formats of the current pass");
+
+    for (u32 i = 0; i < vk.pipelines.size(); ++i)
+    {
+        const VulkanPipeline& pipeline = vk.pipelines[i];
+        if (pipeline.pipelineStateIdx == pipelineStateIdx &&
+            pipeline.colorFormatCount == vk.colorFormatCount &&
+            pipeline.depthFormat == vk.depthFormat &&
+            memcmp(pipeline.colorFormats, vk.colorFormats, vk.colorFormatCount * sizeof(VkFormat)) == 0 &&
+            IsSameVertexBufferLayout(pipeline.vertexBufferLayout, vertexBufferLayout))
+            return pipeline.handle;
+    }
+
+    // Programs without SPIR-V are not drawn
+    const PipelineStateDesc& desc = device.pipelineStates[pipelineStateIdx].desc;
+    const Program& program = device.programs[desc.programIdx];
+    if (!program.vertexModule || !program.fragmentModule)
+        return VK_NULL_HANDLE;
+
+    VulkanPipeline pipeline = {};
+    pipeline.pipelineStateIdx = pipelineStateIdx;
+    pipeline.vertexBufferLayout = vertexBufferLayout;
+    MemCopy(pipeline.colorFormats, vk.colorFormats, sizeof(vk.colorFormats));
+    pipeline.colorFormatCount = vk.colorFormatCount;
+    pipeline.depthFormat = vk.depthFormat;
+    pipeline.handle = Vulkan_CreatePipeline(device, vk, desc, vertexBufferLayout);
+    vk.pipelines.push_back(pipeline);
+    return pipeline.handle;
+}
+
+VkPipelineLayout Vulkan_GetPipelineLayout(const Device& device)
+{
+    return GetVulkanDeviceWrapper(device).pipelineLayout;
+}
+
+VkDescriptorSet Vulkan_CreateUniformSet(const Device& device, const Buffer& buffer, u32 offset, u32 size)
+{
+    VulkanDeviceWrapper& vk = GetVulkanDeviceWrapper(device);
+
+    VkDescriptorSetAllocateInfo setInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+    setInfo.descriptorPool = Vulkan_GetFrame(vk).descriptorPool;
+    setInfo.descriptorSetCount = 1;
+    setInfo.pSetLayouts = &vk.uniformSetLayout;
+    VkDescriptorSet descriptorSet;
+    VK_CHECK(vkAllocateDescriptorSets(vk.device, &setInfo, &descriptorSet));
+
+    VkDescriptorBufferInfo descriptorBufferInfo = {};
+    descriptorBufferInfo.buffer = buffer.handle;
+    descriptorBufferInfo.offset = offset;
+    descriptorBufferInfo.range = size;
+
+    VkWriteDescriptorSet write = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+    write.dstSet = descriptorSet;
+    write.dstBinding = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    write.pBufferInfo = &descriptorBufferInfo;
+    vkUpdateDescriptorSets(vk.device, 1, &write, 0, NULL);
+    return descriptorSet;
+}
+
+struct VulkanRecordJobs
+{
+    VulkanDeviceWrapper* vk;
+    VulkanRecordFunc     func;
+    void*                data;
+};
+
+static void Vulkan_RecordSecondaryJob(void* data, u32 jobIdx, u32 threadIdx)
+{
+    VulkanRecordJobs& jobs = *(VulkanRecordJobs*)data;
+    VulkanDeviceWrapper& vk = *jobs.vk;
+    VulkanFrame& frame = Vulkan_GetFrame(vk);
+
+    // Only this thread allocates from its pool, no locking needed
+    std::vector<VkCommandBuffer>& commandBuffers = frame.threadCommandBuffers[threadIdx];
+    u32& commandBufferCount = frame.threadCommandBufferCount[threadIdx];
+    if (commandBufferCount == commandBuffers.size())
+    {
+        VkCommandBufferAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+        allocateInfo.commandPool = frame.threadCommandPools[threadIdx];
+        allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        allocateInfo.commandBufferCount = 1;
+        VkCommandBuffer commandBuffer;
+        VK_CHECK(vkAllocateCommandBuffers(vk.device, &allocateInfo, &commandBuffer));
+        commandBuffers.push_back(commandBuffer);
+    }
+    VkCommandBuffer commandBuffer = commandBuffers[commandBufferCount++];
+
+    VkCommandBufferInheritanceRenderingInfo renderingInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO };
+    renderingInfo.colorAttachmentCount = vk.colorFormatCount;
+    renderingInfo.pColorAttachmentFormats = vk.colorFormats;
+    renderingInfo.depthAttachmentFormat = vk.depthFormat;
+    renderingInfo.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+    VkCommandBufferInheritanceInfo inheritanceInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO };
+    inheritanceInfo.pNext = &renderingInfo;
+
+    VkCommandBufferBeginInfo beginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    beginInfo.pInheritanceInfo = &inheritanceInfo;
+    VK_CHECK(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+
+    jobs.func(commandBuffer, jobs.data, jobIdx);
+
+    VK_CHECK(vkEndCommandBuffer(commandBuffer));
+    vk.secondaryCommandBuffers[jobIdx] = commandBuffer;
+}
+
+void Vulkan_RecordSecondary(Device& device, JobSystem* jobs, u32 jobCount, VulkanRecordFunc func, void* data)
+{
+    VulkanDeviceWrapper& vk = GetVulkanDeviceWrapper(device);
+    ASSERT(vk.isInRenderPass, "Secondary command buffers are recorded inside render passes");
+    ASSERT(Jobs_GetThreadCount(jobs) <= MAX_JOB_THREADS, "More job threads than command pools");
+    if (jobCount == 0)
+        return;
+
+    vk.secondaryCommandBuffers.resize(jobCount);
+
+    VulkanRecordJobs recordJobs = { &vk, func, data };
+    Jobs_ParallelFor(jobs, jobCount, Vulkan_RecordSecondaryJob, &recordJobs);
+
+    vkCmdExecuteCommands(Vulkan_GetCommandBuffer(vk), jobCount, vk.secondaryCommandBuffers.data());
+}
+
+u32 Vulkan_GetValidationErrorCount()
+{
+    return s_vulkanValidationErrorCount;
+}
+
+// There is no Vulkan renderer for ImGui in ThirdParty, the GUI is built every frame but not drawn
+bool ImGui_Gfx_Init(Device& device)
+{
+    if (!device.internal)
+        return false;
+
+    ImGuiIO& io = ImGui::GetIO();
+    io.BackendRendererName = "agp_vulkan";
+
+    unsigned char* pixels;
+    int width, height;
+    io.Fonts->GetTexDataAsRGBA32(&pixels, &width, &height);
+    return true;
+}
+
+void ImGui_Gfx_NewFrame(Device& device)
+{
+}
+
+void ImGui_Gfx_DrawData(Device& device)
+{
+}
+
+void ImGui_Gfx_Shutdown(Device& device)
+{
+    ImGui::GetIO().BackendRendererName = NULL;
+}
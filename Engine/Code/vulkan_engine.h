@@ -0,0 +1,43 @@
+#pragma once
+
+#include "engine.h"
+
+bool Vulkan_InitDevice(Device& device);
+void Vulkan_ShutdownDevice(Device& device);
+void Vulkan_BeginFrame(Device& device);
+// Blits size texels of presentTarget (if any) to the swapchain image, submits and presents
+void Vulkan_EndFrame(Device& device, const RenderTarget* presentTarget, ivec2 size);
+
+Buffer Vulkan_CreateBuffer(Device& device, u32 size, BufferType type, BufferUsage usage);
+void Vulkan_BindBuffer(const Buffer& buffer);
+void Vulkan_MapBuffer(const Buffer& buffer, Access access);
+void Vulkan_UnmapBuffer(const Buffer& buffer);
+
+bool Vulkan_CreateRenderTarget(RenderTarget& renderTarget, ivec2 size, RenderTargetType type);
+void Vulkan_DestroyRenderTarget(const RenderTarget& renderTarget);
+
+// RGBA8 with a full mip chain and a descriptor set for the albedo slot of the pipeline layout
+void Vulkan_CreateTexture2D(const Device& device, Texture& texture, const Image& image);
+
+// Programs load spirv/<permutationName>.{vert,frag}.spv, false if they were not precompiled
+bool Vulkan_CreateProgram(const Device& device, Program& program);
+// Reflects the uniform blocks of the pipeline state program
+void Vulkan_CreatePipelineState(const Device& device, PipelineState& pipelineState);
+// Pipeline of the state for the vertex layout and the formats of the current pass, created on
+// first use. VK_NULL_HANDLE if its program has no SPIR-V
+VkPipeline Vulkan_FindPipeline(const Device& device, u32 pipelineStateIdx, const VertexBufferLayout& vertexBufferLayout);
+VkPipelineLayout Vulkan_GetPipelineLayout(const Device& device);
+// Set 0 of the pipeline layout for a range of a uniform buffer, valid until the frame is recorded again
+VkDescriptorSet Vulkan_CreateUniformSet(const Device& device, const Buffer& buffer, u32 offset, u32 size);
+
+// Passes are recorded with dynamic rendering and their contents in secondary command buffers
+void Vulkan_BeginRenderPass(const Device& device, const RenderPass& renderPass, const Framebuffer& framebuffer);
+void Vulkan_EndRenderPass(const Device& device, const RenderPass& renderPass, const Framebuffer& framebuffer);
+
+// Records jobCount secondary command buffers of the current pass on the job threads, then
+// executes them in job order
+typedef void (*VulkanRecordFunc)(VkCommandBuffer commandBuffer, void* data, u32 jobIdx);
+void Vulkan_RecordSecondary(Device& device, JobSystem* jobs, u32 jobCount, VulkanRecordFunc func, void* data);
+
+// Messages of the validation layer with error severity since startup
+u32 Vulkan_GetValidationErrorCount();
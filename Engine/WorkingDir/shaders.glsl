@@ -13,6 +13,12 @@ struct Light
 #   define UNIFORM_BLOCK(bindingNumber) layout(std140)
 #endif
 
+#if defined(USE_SHADOWS)
+#if defined(FRAGMENT)
+#include "shadows.glsl"
+#endif
+#endif
+
 ///////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////
@@ -23,11 +29,13 @@ struct Light
 layout(location=0) in vec3 aPosition;
 layout(location=2) in vec2 aTexCoord;
 
+uniform vec2 uTexCoordScale;
+
 out vec2 vTexCoord;
 
 void main()
 {
-    vTexCoord = aTexCoord;
+    vTexCoord = aTexCoord * uTexCoordScale;
     gl_Position = vec4(aPosition, 1.0);
 }
 
@@ -177,6 +185,8 @@ void main()
         float attenuationFactor = 1.0;
         if (uLight[i].type == 1) attenuationFactor = 1.0 / length(uLight[i].position - vPosition);
 
+        attenuationFactor *= ShadowFactor(i, vPosition, N, uCameraPosition);
+
         float diffuseFactor  = 0.7 * max(0.0, dot(L,N));
         oColor.rgb += diffuseFactor * uLight[i].color * attenuationFactor * albedo;
 
@@ -255,7 +265,7 @@ void main()
     vec3 N = normalize(vNormal);
 
     oAlbedo = albedo;
-    oNormal = vec4(N, 1.0);
+    oNormal = vec4(N * 0.5 + 0.5, 1.0); // Unsigned normalized target
     oPosition = vec4(vPosition, 1.0);
 }
 
@@ -273,33 +283,133 @@ void main()
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
-layout(location = 0) in vec3 aPosition;
-layout(location = 2) in vec2 aTexCoord;
+layout(location=0) in vec3 aPosition;
 
-#if defined(USE_INSTANCING)
-layout(location = 6) in mat4 aWorldMatrix;
-layout(location = 10) in mat4 aWorldViewProjectionMatrix;
-#endif
+void main()
+{
+    gl_Position = vec4(aPosition, 1.0);
+}
 
-#if !defined(USE_INSTANCING)
-UNIFORM_BLOCK(1) uniform LocalParams
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+UNIFORM_BLOCK(0) uniform GlobalParams
 {
-    mat4 aWorldMatrix;
-    mat4 aWorldViewProjectionMatrix;
+    mat4  uViewProjectionMatrix;
+    vec3  uCameraPosition;
+    uint  uLightCount;
+    Light uLight[16];
 };
+
+// G-Buffer, fetched by pixel since the pooled targets may be larger than the viewport
+uniform sampler2D uAlbedo;
+uniform sampler2D uNormal;
+uniform sampler2D uPosition;
+
+layout(location = 0) out vec4 oColor;
+
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    vec4 position = texelFetch(uPosition, texel, 0);
+    if (position.w == 0.0) discard; // Nothing drawn here
+
+    // G-Buffer
+    vec3 albedo = texelFetch(uAlbedo, texel, 0).rgb;                          // Scene albedo
+    vec3 N      = normalize(texelFetch(uNormal, texel, 0).rgb * 2.0 - 1.0); // Scene normal world space
+    vec3 P      = position.xyz;                                              // Scene position world space
+
+    vec3 V      = normalize(uCameraPosition - P);
+
+    float ambientFactor = 0.05;
+    oColor = vec4(ambientFactor * albedo, 1.0);
+
+    for (uint i = 0; i < uLightCount; ++i)
+    {
+        vec3 L = uLight[i].direction;
+        if (uLight[i].type == 1) L = normalize(uLight[i].position - P);
+
+        vec3 H = normalize(V + L);
+
+        float attenuationFactor = 1.0;
+        if (uLight[i].type == 1) attenuationFactor = 1.0 / length(uLight[i].position - P);
+
+        float diffuseFactor  = 0.7 * max(0.0, dot(L,N));
+        oColor.rgb += diffuseFactor * uLight[i].color * attenuationFactor * albedo;
+
+        float specularFactor = 0.3 * pow(max(0.0, dot(H,N)), 100.0);
+        oColor.rgb += specularFactor * uLight[i].color * attenuationFactor;
+    }
+}
+
+#endif
 #endif
 
-out vec2 vTexCoord;
+
+
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+#ifdef VISIBILITY_BUFFER
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location = 0) in vec3 aPosition;
+layout(location = 10) in mat4 aWorldViewProjectionMatrix;
+
+uniform uint uBaseInstance;
+
+flat out uint vInstanceIdx;
 
 void main()
 {
-    vTexCoord = aTexCoord;
+    vInstanceIdx = uBaseInstance + uint(gl_InstanceID);
     gl_Position = aWorldViewProjectionMatrix * vec4(aPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
 
-UNIFORM_BLOCK(0) uniform GlobalParams
+flat in uint vInstanceIdx;
+
+layout(location = 0) out uint oVisibility;
+
+void main()
+{
+    // VISIBILITY_TRIANGLE_BITS is defined by the engine, see BeginProgramCompile
+    oVisibility = (vInstanceIdx << VISIBILITY_TRIANGLE_BITS) | uint(gl_PrimitiveID);
+}
+
+#endif
+#endif
+
+
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+#ifdef VISIBILITY_RESOLVE
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location=0) in vec3 aPosition;
+
+void main()
+{
+    gl_Position = vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+uniform usampler2D     uVisibility;
+uniform samplerBuffer  uVertices;  // All the mesh vertices, packed
+uniform usamplerBuffer uIndices;   // All the mesh indices, packed
+uniform usamplerBuffer uInstances; // Instance table, see VisibilityBuffer_Update
+uniform sampler2DArray uAlbedo[VISIBILITY_MAX_ALBEDO_ARRAYS]; // One layer per albedo texture of their size
+uniform uint uAlbedoSlots[VISIBILITY_MAX_ALBEDO_SLOTS];        // Array index and layer of each albedo slot
+
+uniform vec2 uViewportSize;
+
+UNIFORM_BLOCK(0)  uniform GlobalParams
 {
     mat4  uViewProjectionMatrix;
     vec3  uCameraPosition;
@@ -307,50 +417,185 @@ UNIFORM_BLOCK(0) uniform GlobalParams
     Light uLight[16];
 };
 
-// Current light index
-uniform uint uLightIdx;
+layout(location = 0) out vec4 oColor;
 
-// G-Buffer
-uniform sampler2D uAlbedo;
-uniform sampler2D uNormal;
-uniform sampler2D uPosition;
+// Must match engine.h, the sizes of the encoding are defined by the engine
+#define VISIBILITY_EMPTY 0xffffffffu
+#define VISIBILITY_TRIANGLE_MASK ((1u << VISIBILITY_TRIANGLE_BITS) - 1u)
+#define VISIBILITY_ALBEDO_LAYER_MASK ((1u << VISIBILITY_ALBEDO_LAYER_BITS) - 1u)
+#define VISIBILITY_NO_ATTRIBUTE 0xffffffffu
+#define INSTANCE_TEXELS 10
 
-in vec2 vTexCoord;
+vec3 FetchVec3(int base)
+{
+    return vec3(texelFetch(uVertices, base + 0).r,
+                texelFetch(uVertices, base + 1).r,
+                texelFetch(uVertices, base + 2).r);
+}
 
-layout(location = 0) out vec4 oColor;
+vec2 FetchVec2(int base)
+{
+    return vec2(texelFetch(uVertices, base + 0).r,
+                texelFetch(uVertices, base + 1).r);
+}
+
+mat4 FetchInstanceMatrix(uint instanceIdx, int matrixIdx)
+{
+    int base = int(instanceIdx) * INSTANCE_TEXELS + matrixIdx * 4;
+    return mat4(uintBitsToFloat(texelFetch(uInstances, base + 0)),
+                uintBitsToFloat(texelFetch(uInstances, base + 1)),
+                uintBitsToFloat(texelFetch(uInstances, base + 2)),
+                uintBitsToFloat(texelFetch(uInstances, base + 3)));
+}
+
+// Samplers can only be indexed with constants, the gradients are explicit so that branching
+// per pixel does not affect them
+#if VISIBILITY_MAX_ALBEDO_ARRAYS != 4
+#error SampleAlbedo expects 4 albedo arrays
+#endif
+vec3 SampleAlbedo(uint slot, vec2 texCoord, vec2 texCoordDx, vec2 texCoordDy)
+{
+    uint entry = uAlbedoSlots[slot];
+    uint arrayIdx = entry >> VISIBILITY_ALBEDO_LAYER_BITS;
+    vec3 coord = vec3(texCoord, float(entry & VISIBILITY_ALBEDO_LAYER_MASK));
+    if (arrayIdx == 0u) return textureGrad(uAlbedo[0], coord, texCoordDx, texCoordDy).rgb;
+    if (arrayIdx == 1u) return textureGrad(uAlbedo[1], coord, texCoordDx, texCoordDy).rgb;
+    if (arrayIdx == 2u) return textureGrad(uAlbedo[2], coord, texCoordDx, texCoordDy).rgb;
+    return textureGrad(uAlbedo[3], coord, texCoordDx, texCoordDy).rgb;
+}
+
+// Perspective-correct barycentrics of a screen point (in NDC) with respect to
+// a triangle given by its vertices in NDC and their 1/w
+vec3 Barycentrics(vec2 n0, vec2 n1, vec2 n2, vec3 invW, vec2 ndc)
+{
+    float invDet = 1.0 / determinant(mat2(n2 - n1, n0 - n1));
+    vec3 ddx = vec3(n1.y - n2.y, n2.y - n0.y, n0.y - n1.y) * invDet * invW;
+    vec3 ddy = vec3(n2.x - n1.x, n0.x - n2.x, n1.x - n0.x) * invDet * invW;
+
+    vec2 delta = ndc - n0;
+    vec3 lambda = vec3(invW.x, 0.0, 0.0) + delta.x * ddx + delta.y * ddy;
+    return lambda / dot(lambda, vec3(1.0));
+}
 
 void main()
 {
-    oColor = vec4(vTexCoord, vec2(1.0));
-    return;
+    uint visibility = texelFetch(uVisibility, ivec2(gl_FragCoord.xy), 0).r;
+    if (visibility == VISIBILITY_EMPTY) discard;
 
-    // G-Buffer
-    vec3 albedo = texture(uAlbedo, vTexCoord).rgb;   // Scene albedo
-    vec3 N      = texture(uNormal, vTexCoord).rgb;   // Scene normal world space
-    vec3 P      = texture(uPosition, vTexCoord).rgb; // Scene position world space
+    uint instanceIdx = visibility >> VISIBILITY_TRIANGLE_BITS;
+    uint triangleIdx = visibility & VISIBILITY_TRIANGLE_MASK;
 
-    vec3 V      = normalize(uCameraPosition - P);
+    // Index offset, vertex offset and vertex stride in 32-bit elements and albedo slot,
+    // then the normal and texture coordinate offsets within a vertex
+    uvec4 submesh = texelFetch(uInstances, int(instanceIdx) * INSTANCE_TEXELS + 8);
+    uvec4 attributes = texelFetch(uInstances, int(instanceIdx) * INSTANCE_TEXELS + 9);
+
+    int vertexBase[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        uint index = texelFetch(uIndices, int(submesh.x + triangleIdx * 3u) + i).r;
+        vertexBase[i] = int(submesh.y + index * submesh.z);
+    }
+
+    mat4 worldMatrix = FetchInstanceMatrix(instanceIdx, 0);
+    mat4 worldViewProjectionMatrix = FetchInstanceMatrix(instanceIdx, 1);
+
+    vec3 positions[3];
+    vec4 clipPositions[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        positions[i] = FetchVec3(vertexBase[i]);
+        clipPositions[i] = worldViewProjectionMatrix * vec4(positions[i], 1.0);
+    }
+
+    vec3 invW = 1.0 / vec3(clipPositions[0].w, clipPositions[1].w, clipPositions[2].w);
+    vec2 n0 = clipPositions[0].xy * invW.x;
+    vec2 n1 = clipPositions[1].xy * invW.y;
+    vec2 n2 = clipPositions[2].xy * invW.z;
+
+    vec2 pixelSize = 2.0 / uViewportSize;
+    vec2 ndc = gl_FragCoord.xy * pixelSize - 1.0;
+    vec3 lambda   = Barycentrics(n0, n1, n2, invW, ndc);
+    vec3 lambdaDx = Barycentrics(n0, n1, n2, invW, ndc + vec2(pixelSize.x, 0.0));
+    vec3 lambdaDy = Barycentrics(n0, n1, n2, invW, ndc + vec2(0.0, pixelSize.y));
+
+    vec3 position = mat3(positions[0], positions[1], positions[2]) * lambda;
+    vec3 worldPosition = vec3( worldMatrix * vec4(position, 1.0) );
+
+    vec3 normal = vec3(0.0, 1.0, 0.0);
+    if (attributes.x != VISIBILITY_NO_ATTRIBUTE)
+    {
+        int normalOffset = int(attributes.x);
+        mat3 normals = mat3(FetchVec3(vertexBase[0] + normalOffset),
+                            FetchVec3(vertexBase[1] + normalOffset),
+                            FetchVec3(vertexBase[2] + normalOffset));
+        normal = normals * lambda;
+    }
+
+    vec3 albedo = vec3(1.0);
+    if (attributes.y != VISIBILITY_NO_ATTRIBUTE)
+    {
+        int texCoordOffset = int(attributes.y);
+        mat3x2 texCoords = mat3x2(FetchVec2(vertexBase[0] + texCoordOffset),
+                                  FetchVec2(vertexBase[1] + texCoordOffset),
+                                  FetchVec2(vertexBase[2] + texCoordOffset));
+        vec2 texCoord = texCoords * lambda;
+        vec2 texCoordDx = texCoords * lambdaDx - texCoord;
+        vec2 texCoordDy = texCoords * lambdaDy - texCoord;
+        albedo = SampleAlbedo(submesh.w, texCoord, texCoordDx, texCoordDy);
+    }
+
+    vec3 N = normalize(vec3( worldMatrix * vec4(normal, 0.0) ));
+    vec3 V = normalize(uCameraPosition - worldPosition);
 
     float ambientFactor = 0.05;
     oColor = vec4(ambientFactor * albedo, 1.0);
 
-    uint i = uLightIdx;
+    for (uint i = 0; i < uLightCount; ++i)
+    {
+        vec3 L = uLight[i].direction;
+        if (uLight[i].type == 1) L = normalize(uLight[i].position - worldPosition);
 
-    vec3 L = uLight[i].direction;
-    if (uLight[i].type == 1) L = normalize(uLight[i].position - P);
+        vec3 H = normalize(V + L);
 
-    vec3 H = normalize(V + L);
+        float attenuationFactor = 1.0;
+        if (uLight[i].type == 1) attenuationFactor = 1.0 / length(uLight[i].position - worldPosition);
 
-    float attenuationFactor = 1.0;
-    if (uLight[i].type == 1) attenuationFactor = 1.0 / length(uLight[i].position - P);
+        attenuationFactor *= ShadowFactor(i, worldPosition, N, uCameraPosition);
 
-    float diffuseFactor  = 0.7 * max(0.0, dot(L,N));
-    oColor.rgb += diffuseFactor * uLight[i].color * attenuationFactor * albedo;
+        float diffuseFactor  = 0.7 * max(0.0, dot(L,N));
+        oColor.rgb += diffuseFactor * uLight[i].color * attenuationFactor * albedo;
 
-    float specularFactor = 0.3 * pow(max(0.0, dot(H,N)), 100.0);
-    oColor.rgb += specularFactor * uLight[i].color * attenuationFactor;
+        float specularFactor = 0.3 * pow(max(0.0, dot(H,N)), 100.0);
+        oColor.rgb += specularFactor * uLight[i].color * attenuationFactor;
+    }
 }
 
 #endif
 #endif
 
+
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+#ifdef SHADOW_DEPTH
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location = 0) in vec3 aPosition;
+layout(location = 6) in mat4 aLightWorldViewProjectionMatrix;
+
+void main()
+{
+    gl_Position = aLightWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+void main()
+{
+}
+
+#endif
+#endif
@@ -0,0 +1,44 @@
+// Cascaded shadow map sampling, included by the fragment shaders of the
+// programs that declare the USE_SHADOWS feature switch
+
+#define SHADOW_CASCADE_COUNT 4
+#define SHADOW_NO_LIGHT 0xffffffffu
+
+UNIFORM_BLOCK(2) uniform ShadowParams
+{
+    mat4  uShadowViewProjection[SHADOW_CASCADE_COUNT];
+    vec4  uShadowCascadeSplits;     // View depth where each cascade ends
+    vec4  uShadowCascadeTexelSizes; // World units per shadow map texel
+    vec3  uShadowCameraForward;
+    uint  uShadowLightIdx;
+};
+
+uniform sampler2DArrayShadow uShadowMap;
+
+float ShadowFactor(uint lightIdx, vec3 P, vec3 N, vec3 cameraPosition)
+{
+    if (lightIdx != uShadowLightIdx) return 1.0;
+
+    float viewDepth = dot(P - cameraPosition, uShadowCameraForward);
+    int cascade = 0;
+    while (cascade < SHADOW_CASCADE_COUNT && viewDepth > uShadowCascadeSplits[cascade]) ++cascade;
+    if (cascade == SHADOW_CASCADE_COUNT) return 1.0;
+
+    // Normal offset scaled by the texel footprint keeps the bias stable across cascades
+    vec3 offsetP = P + N * (1.5 * uShadowCascadeTexelSizes[cascade]);
+    vec4 shadowCoord = uShadowViewProjection[cascade] * vec4(offsetP, 1.0);
+    shadowCoord.xyz = shadowCoord.xyz * 0.5 + 0.5;
+
+    // 3x3 PCF on top of the hardware 2x2 comparison filter
+    vec2 texelSize = 1.0 / vec2(textureSize(uShadowMap, 0).xy);
+    float shadow = 0.0;
+    for (int y = -1; y <= 1; ++y)
+    {
+        for (int x = -1; x <= 1; ++x)
+        {
+            vec2 uv = shadowCoord.xy + vec2(x, y) * texelSize;
+            shadow += texture(uShadowMap, vec4(uv, float(cascade), shadowCoord.z));
+        }
+    }
+    return shadow / 9.0;
+}
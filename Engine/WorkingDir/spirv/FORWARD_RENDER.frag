@@ -0,0 +1,60 @@
+#version 450
+
+// Vulkan version of the FORWARD_RENDER program of shaders.glsl (instanced, without shadows),
+// compiled to FORWARD_RENDER.frag.spv by the spirv target of the Makefile
+
+struct Light
+{
+    uint type;
+    vec3 color;
+    vec3 direction;
+    vec3 position;
+};
+
+layout(location = 0) in vec2 vTexCoord;
+layout(location = 1) in vec3 vPosition; // In worldspace
+layout(location = 2) in vec3 vNormal;   // In worldspace
+layout(location = 3) in vec3 vViewDir;  // In worldspace
+
+layout(set = 1, binding = 0) uniform sampler2D uAlbedo;
+
+layout(set = 0, binding = 0, std140) uniform GlobalParams
+{
+    mat4  uViewProjectionMatrix;
+    vec3  uCameraPosition;
+    uint  uLightCount;
+    Light uLight[16];
+};
+
+layout(location = 0) out vec4 oColor;
+
+void main()
+{
+    vec3 albedo = texture(uAlbedo, vTexCoord).rgb;
+    vec3 N = normalize(vNormal);
+    vec3 V = normalize(vViewDir);
+
+    float ambientFactor = 0.05;
+    vec3 color = ambientFactor * albedo;
+
+    for (uint i = 0; i < uLightCount; ++i)
+    {
+        vec3 L = uLight[i].direction;
+        float attenuationFactor = 1.0;
+        if (uLight[i].type == 1u)
+        {
+            L = normalize(uLight[i].position - vPosition);
+            attenuationFactor = 1.0 / length(uLight[i].position - vPosition);
+        }
+
+        vec3 H = normalize(V + L);
+
+        float diffuseFactor  = 0.7 * max(0.0, dot(L,N));
+        color += diffuseFactor * uLight[i].color * attenuationFactor * albedo;
+
+        float specularFactor = 0.3 * pow(max(0.0, dot(H,N)), 100.0);
+        color += specularFactor * uLight[i].color * attenuationFactor;
+    }
+
+    oColor = vec4(color, 1.0);
+}
@@ -0,0 +1,43 @@
+#version 450
+
+// Vulkan version of the FORWARD_RENDER program of shaders.glsl (instanced, without shadows),
+// compiled to FORWARD_RENDER.vert.spv by the spirv target of the Makefile
+
+struct Light
+{
+    uint type;
+    vec3 color;
+    vec3 direction;
+    vec3 position;
+};
+
+layout(location = 0) in vec3 aPosition;
+layout(location = 1) in vec3 aNormal;
+layout(location = 2) in vec2 aTexCoord;
+layout(location = 6) in mat4 aWorldMatrix;
+layout(location = 10) in mat4 aWorldViewProjectionMatrix;
+
+layout(set = 0, binding = 0, std140) uniform GlobalParams
+{
+    mat4  uViewProjectionMatrix;
+    vec3  uCameraPosition;
+    uint  uLightCount;
+    Light uLight[16];
+};
+
+layout(location = 0) out vec2 vTexCoord;
+layout(location = 1) out vec3 vPosition; // In worldspace
+layout(location = 2) out vec3 vNormal;   // In worldspace
+layout(location = 3) out vec3 vViewDir;  // In worldspace
+
+void main()
+{
+    vTexCoord = aTexCoord;
+    vPosition = vec3( aWorldMatrix * vec4(aPosition, 1.0) );
+    vNormal = vec3( aWorldMatrix * vec4(aNormal, 0.0) );
+    vViewDir = uCameraPosition - vPosition;
+    gl_Position = aWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+
+    // The projection matrices map depth to [-1, 1] as in OpenGL, Vulkan clips to [0, 1]
+    gl_Position.z = 0.5 * (gl_Position.z + gl_Position.w);
+}